@@ -15,6 +15,7 @@
 
 #include <string>
 #include <iostream>
+#include <grpcpp/alarm.h>
 #include <grpcpp/grpcpp.h>
 #include <grpcpp/server.h>
 #include <grpcpp/server_builder.h>
@@ -22,55 +23,72 @@
 #include <grpcpp/security/server_credentials.h>
 
 #include "proto/usps_api/sfc.grpc.pb.h"
+#include "stats.h"
+#include <algorithm>
 #include <thread>
 #include <chrono>
+#include <pthread.h>
+#include <sched.h>
+
+constexpr std::size_t usps_api_server::Call::kArenaBlockSize;
+
+usps_api_server::Call::Call() : arena_(arena_block_, sizeof(arena_block_)) {}
 
 usps_api_server::CreateSfc::CreateSfc(ghost::SfcService::AsyncService* service,
-                      grpc::ServerCompletionQueue* cq,
-                      std::shared_ptr<Config> config) : service_(service),
-  cq_(cq), responder_(&ctx_), status_(CREATE), config_(config) {
+                      CallQueue* queue,
+                      std::shared_ptr<ConfigStore> store,
+                      std::shared_ptr<Scheduler> scheduler) : service_(service),
+  queue_(queue), responder_(&ctx_), status_(CREATE), store_(store),
+  scheduler_(scheduler),
+  request_(google::protobuf::Arena::CreateMessage<ghost::CreateSfcRequest>(
+      arena())),
+  response_(google::protobuf::Arena::CreateMessage<ghost::CreateSfcResponse>(
+      arena())),
+  timer_(Metrics::CREATE_SFC) {
   Proceed();
 }
 void usps_api_server::CreateSfc::Proceed() {
   if (status_ == CREATE) {
     status_ = PROCESS;
-    service_->RequestCreateSfc(&ctx_, &request_, &responder_, cq_, cq_,
-                               this);
+    service_->RequestCreateSfc(&ctx_, request_, &responder_, queue_->cq(),
+                               queue_->cq(), this);
   } else if (status_ == PROCESS) {
     // Creates another CreateSfc to handle new requests.
-    new CreateSfc(service_, cq_, config_);
-    Config* config = config_.get();
-    grpc::Status s;
+    queue_->Spawn<CreateSfc>(service_, store_, scheduler_);
+    timer_.Restart();
+    ConfigSnapshot snapshot = store_->Load();
+    const Config* config = snapshot.get();
+    grpc::Status s = grpc::Status::OK;
     // If creating is disabled, deny request.
     if (!(config->create_)) {
       s = grpc::Status::CANCELLED;
-    }
-    const ghost::SfcFilter sfc_filter = request_.sfc_filter();
-    // Delay list is active.
-    if (config->FilterActive(&(config->delay_))) {
-      if (config->FilterMatch(&(config->delay_), &sfc_filter)) {
-        int delay_time = config->delay_time_ * 1000;
-        // TODO(sam) use multithreading to avoid blocking main thread
-        std::this_thread::sleep_for(std::chrono::milliseconds(delay_time));
-        s = grpc::Status::OK;
-      }
-    }
-    // Deny list is active.
-    if (config->FilterActive(&(config->deny_))) {
-      if (config->FilterMatch(&(config->deny_), &sfc_filter)) {
-        s = grpc::Status::CANCELLED;
-      }
-      s = grpc::Status::OK;
-    } else if (config->FilterActive(&(config->allow_))) {
-      // Allow list is active.
-      if (config->FilterMatch(&(config->allow_), &sfc_filter)) {
-        s = grpc::Status::OK;
+    } else {
+      switch (config->Evaluate(&(request_->sfc_filter()))) {
+        case Config::DELAY:
+          // Parks the call on the completion queue until the delay expires,
+          // so the polling thread keeps serving other calls.
+          alarm_.Set(queue_->cq(),
+                     std::chrono::system_clock::now() +
+                         std::chrono::seconds(config->delay_time_),
+                     this);
+          status_ = DELAY;
+          return;
+        case Config::DENY:
+          s = grpc::Status::CANCELLED;
+          break;
+        default:
+          s = scheduler_->Create(*request_);
+          break;
       }
-      s = grpc::Status::CANCELLED;
-    } else { // Neither allow or deny is active.
-      s = grpc::Status::OK;
     }
-    responder_.Finish(response_, s, this);
+    timer_.Finish(s.ok());
+    responder_.Finish(*response_, s, this);
+    status_ = FINISH;
+  } else if (status_ == DELAY) {
+    // The delay has expired.
+    grpc::Status s = scheduler_->Create(*request_);
+    timer_.Finish(s.ok());
+    responder_.Finish(*response_, s, this);
     status_ = FINISH;
   } else {
     delete this;
@@ -78,73 +96,319 @@ void usps_api_server::CreateSfc::Proceed() {
 }
 
 usps_api_server::DeleteSfc::DeleteSfc(ghost::SfcService::AsyncService* service,
-                      grpc::ServerCompletionQueue* cq,
-                      std::shared_ptr<Config> config) : service_(service),
-  cq_(cq), responder_(&ctx_), status_(CREATE), config_(config) {
+                      CallQueue* queue,
+                      std::shared_ptr<ConfigStore> store,
+                      std::shared_ptr<Scheduler> scheduler) : service_(service),
+  queue_(queue), responder_(&ctx_), status_(CREATE), store_(store),
+  scheduler_(scheduler),
+  request_(google::protobuf::Arena::CreateMessage<ghost::DeleteSfcRequest>(
+      arena())),
+  response_(google::protobuf::Arena::CreateMessage<ghost::DeleteSfcResponse>(
+      arena())),
+  timer_(Metrics::DELETE_SFC) {
     Proceed();
 }
 
 void usps_api_server::DeleteSfc::Proceed() {
   if (status_ == CREATE) {
     status_ = PROCESS;
-    service_->RequestDeleteSfc(&ctx_, &request_, &responder_, cq_, cq_, this);
+    service_->RequestDeleteSfc(&ctx_, request_, &responder_, queue_->cq(),
+                               queue_->cq(), this);
   } else if (status_ == PROCESS) {
     // Creates another DeleteSfc to handle new requests.
-    new DeleteSfc(service_, cq_, config_);
-    Config* config = config_.get();
+    queue_->Spawn<DeleteSfc>(service_, store_, scheduler_);
+    timer_.Restart();
+    ConfigSnapshot snapshot = store_->Load();
+    const Config* config = snapshot.get();
     grpc::Status s = grpc::Status::OK;
     // If creating is disabled, deny request.
     if (!(config->del_)) {
       s = grpc::Status::CANCELLED;
+    } else {
+      s = scheduler_->Delete(*request_);
     }
-    responder_.Finish(response_, s, this);
+    timer_.Finish(s.ok());
+    responder_.Finish(*response_, s, this);
     status_ = FINISH;
   } else {
     delete this;
   }
 }
 usps_api_server::Query::Query(ghost::SfcService::AsyncService* service,
-                       grpc::ServerCompletionQueue* cq,
-                       std::shared_ptr<Config> config) : service_(service),
-  cq_(cq), responder_(&ctx_), status_(CREATE), config_(config) {
+                       CallQueue* queue,
+                       std::shared_ptr<ConfigStore> store,
+                      std::shared_ptr<Scheduler> scheduler) : service_(service),
+  queue_(queue), responder_(&ctx_), status_(CREATE), store_(store),
+  scheduler_(scheduler),
+  request_(google::protobuf::Arena::CreateMessage<ghost::QueryRequest>(
+      arena())),
+  response_(google::protobuf::Arena::CreateMessage<ghost::QueryResponse>(
+      arena())),
+  timer_(Metrics::QUERY) {
  Proceed();
 }
 
 void usps_api_server::Query::Proceed() {
   if (status_ == CREATE) {
     status_ = PROCESS;
-    service_->RequestQuery(&ctx_, &request_, &responder_, cq_, cq_,
-                              this);
+    service_->RequestQuery(&ctx_, request_, &responder_, queue_->cq(),
+                           queue_->cq(), this);
   } else if (status_ == PROCESS) {
     // Creates another Query to handle new requests.
-    new Query(service_, cq_, config_);
-    Config* config = config_.get();
+    queue_->Spawn<Query>(service_, store_, scheduler_);
+    timer_.Restart();
+    ConfigSnapshot snapshot = store_->Load();
+    const Config* config = snapshot.get();
     grpc::Status s = grpc::Status::OK;
     // If creating is disabled, deny request.
     if (!(config->query_)) {
       s = grpc::Status::CANCELLED;
+    } else if (!scheduler_->Query(*request_, response_)) {
+      s = grpc::Status(grpc::StatusCode::NOT_FOUND, "SFC not installed");
     }
-    responder_.Finish(response_, s, this);
+    timer_.Finish(s.ok());
+    responder_.Finish(*response_, s, this);
     status_ = FINISH;
   } else {
     delete this;
   }
 }
+usps_api_server::QueryStream::QueryStream(
+    ghost::SfcService::AsyncService* service,
+    CallQueue* queue,
+    std::shared_ptr<ConfigStore> store,
+    std::shared_ptr<Scheduler> scheduler) : service_(service),
+  queue_(queue), writer_(&ctx_), status_(CREATE), store_(store),
+  scheduler_(scheduler),
+  request_(google::protobuf::Arena::CreateMessage<ghost::QueryRequest>(
+      arena())),
+  response_(google::protobuf::Arena::CreateMessage<ghost::QueryResponse>(
+      arena())),
+  timer_(Metrics::QUERY_STREAM) {
+  Proceed();
+}
+
+void usps_api_server::QueryStream::Proceed() {
+  if (status_ == CREATE) {
+    status_ = PROCESS;
+    service_->RequestQueryStream(&ctx_, request_, &writer_, queue_->cq(),
+                                 queue_->cq(), this);
+  } else if (status_ == PROCESS) {
+    // Creates another QueryStream to handle new requests.
+    queue_->Spawn<QueryStream>(service_, store_, scheduler_);
+    timer_.Restart();
+    ConfigSnapshot snapshot = store_->Load();
+    // If querying is disabled, deny request.
+    if (!(snapshot->query_)) {
+      timer_.Finish(false);
+      writer_.Finish(grpc::Status::CANCELLED, this);
+      status_ = FINISH;
+      return;
+    }
+    cursor_.reset(new QueryCursor(*scheduler_, *request_));
+    if (!cursor_->found()) {
+      timer_.Finish(false);
+      writer_.Finish(
+          grpc::Status(grpc::StatusCode::NOT_FOUND, "SFC not installed"),
+          this);
+      status_ = FINISH;
+      return;
+    }
+    WriteNext();
+  } else if (status_ == WRITE) {
+    WriteNext();
+  } else {
+    delete this;
+  }
+}
+
+void usps_api_server::QueryStream::WriteNext() {
+  if (cursor_->Next(response_)) {
+    writer_.Write(*response_, this);
+    status_ = WRITE;
+  } else {
+    timer_.Finish(true);
+    writer_.Finish(grpc::Status::OK, this);
+    status_ = FINISH;
+  }
+}
+
+usps_api_server::ProgramSfcs::ProgramSfcs(
+    ghost::SfcService::AsyncService* service,
+    CallQueue* queue,
+    std::shared_ptr<ConfigStore> store,
+    std::shared_ptr<Scheduler> scheduler) : service_(service),
+  queue_(queue), stream_(&ctx_), status_(CREATE), store_(store),
+  scheduler_(scheduler),
+  request_(google::protobuf::Arena::CreateMessage<ghost::ProgramSfcsRequest>(
+      arena())),
+  response_(google::protobuf::Arena::CreateMessage<ghost::ProgramSfcsResponse>(
+      arena())) {
+  Proceed();
+}
+
+void usps_api_server::ProgramSfcs::Proceed() {
+  if (status_ == CREATE) {
+    status_ = PROCESS;
+    service_->RequestProgramSfcs(&ctx_, &stream_, queue_->cq(), queue_->cq(),
+                                 this);
+  } else if (status_ == PROCESS) {
+    // Creates another ProgramSfcs to handle new streams.
+    queue_->Spawn<ProgramSfcs>(service_, store_, scheduler_);
+    stream_.Read(request_, this);
+    status_ = READ;
+  } else if (status_ == READ) {
+    batch_start_ = Metrics::Now();
+    ConfigSnapshot snapshot = store_->Load();
+    if (batch_.Apply(*snapshot, *request_, scheduler_.get(), response_)) {
+      // Parks the stream until the delay expires, as CreateSfc does.
+      alarm_.Set(queue_->cq(),
+                 std::chrono::system_clock::now() +
+                     std::chrono::seconds(batch_.delay_time()),
+                 this);
+      status_ = DELAY;
+      return;
+    }
+    RecordBatch(*response_, Metrics::Now() - batch_start_);
+    stream_.Write(*response_, this);
+    status_ = WRITE;
+  } else if (status_ == DELAY) {
+    batch_.ApplyDelayed(*request_, scheduler_.get(), response_);
+    RecordBatch(*response_, Metrics::Now() - batch_start_);
+    stream_.Write(*response_, this);
+    status_ = WRITE;
+  } else if (status_ == WRITE) {
+    // Frees the last batch before reading the next one.
+    arena()->Reset();
+    request_ =
+        google::protobuf::Arena::CreateMessage<ghost::ProgramSfcsRequest>(
+            arena());
+    response_ =
+        google::protobuf::Arena::CreateMessage<ghost::ProgramSfcsResponse>(
+            arena());
+    stream_.Read(request_, this);
+    status_ = READ;
+  } else {
+    delete this;
+  }
+}
+
+void usps_api_server::ProgramSfcs::Fail() {
+  if (status_ == READ) {
+    stream_.Finish(grpc::Status::OK, this);
+    status_ = FINISH;
+  } else {
+    delete this;
+  }
+}
+
+usps_api_server::Stats::Stats(ghost::SfcService::AsyncService* service,
+                              CallQueue* queue,
+                              std::shared_ptr<ConfigStore> store,
+                              std::shared_ptr<Scheduler> /*scheduler*/)
+    : service_(service), queue_(queue), responder_(&ctx_), status_(CREATE),
+      store_(store),
+      request_(google::protobuf::Arena::CreateMessage<ghost::StatsRequest>(
+          arena())),
+      response_(google::protobuf::Arena::CreateMessage<ghost::StatsResponse>(
+          arena())),
+      timer_(Metrics::STATS) {
+  Proceed();
+}
+
+void usps_api_server::Stats::Proceed() {
+  if (status_ == CREATE) {
+    status_ = PROCESS;
+    service_->RequestStats(&ctx_, request_, &responder_, queue_->cq(),
+                           queue_->cq(), this);
+  } else if (status_ == PROCESS) {
+    // Creates another Stats to handle new requests.
+    queue_->Spawn<Stats>(service_, store_, nullptr);
+    timer_.Restart();
+    FillStats(*store_->Load(), response_);
+    timer_.Finish(true);
+    responder_.Finish(*response_, grpc::Status::OK, this);
+    status_ = FINISH;
+  } else {
+    delete this;
+  }
+}
+
+usps_api_server::CallQueue::CallQueue(
+    std::unique_ptr<grpc::ServerCompletionQueue> cq)
+    : cq_(std::move(cq)), shutdown_(false) {}
+
+void usps_api_server::CallQueue::Shutdown() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  shutdown_ = true;
+  cq_->Shutdown();
+}
+
 // Handles all calls asynchronously.
-void usps_api_server::HandleRpcs(ghost::SfcService::AsyncService& service,
-                                 grpc::ServerCompletionQueue* cq,
-                                 std::shared_ptr<Config> config) {
-  new CreateSfc(&service, cq, config);
-  new DeleteSfc(&service, cq, config);
-  new Query(&service, cq, config);
+void usps_api_server::HandleRpcs(ghost::SfcService::AsyncService* service,
+                                 CallQueue* queue,
+                                 std::shared_ptr<ConfigStore> store,
+                                 std::shared_ptr<Scheduler> scheduler,
+                                 int calls) {
+  for (int i = 0; i < calls; ++i) {
+    queue->Spawn<CreateSfc>(service, store, scheduler);
+    queue->Spawn<DeleteSfc>(service, store, scheduler);
+    queue->Spawn<Query>(service, store, scheduler);
+    queue->Spawn<QueryStream>(service, store, scheduler);
+    queue->Spawn<ProgramSfcs>(service, store, scheduler);
+    queue->Spawn<Stats>(service, store, scheduler);
+  }
   void* tag;
   bool ok;
-  while (true) {
-    // Blocks waiting until next event from completion queue.
-    if (!cq->Next(&tag, &ok)) {
-      std::cout << "Shutting down..." << std::endl;
-      break;
+  // Blocks waiting until next event from completion queue. Next returns
+  // false once the queue is shut down and fully drained.
+  while (queue->cq()->Next(&tag, &ok)) {
+    Call* call = static_cast<Call*>(tag);
+    // Events that fail, such as requests cancelled by server shutdown,
+    // end the call.
+    if (ok) {
+      call->Proceed();
+    } else {
+      call->Fail();
+    }
+  }
+}
+
+usps_api_server::WorkerPool::WorkerPool(
+    ghost::SfcService::AsyncService* service,
+    std::shared_ptr<ConfigStore> store,
+    std::shared_ptr<Scheduler> scheduler)
+    : service_(service), store_(store), scheduler_(scheduler) {}
+
+void usps_api_server::WorkerPool::AddQueues(grpc::ServerBuilder* builder,
+                                            int threads) {
+  for (int i = 0; i < std::max(threads, 1); ++i) {
+    queues_.emplace_back(new CallQueue(builder->AddCompletionQueue()));
+  }
+}
+
+void usps_api_server::WorkerPool::Start(int calls, bool pin_cpus) {
+  unsigned int cpus = std::max(std::thread::hardware_concurrency(), 1u);
+  for (std::size_t i = 0; i < queues_.size(); ++i) {
+    threads_.emplace_back(HandleRpcs, service_, queues_[i].get(), store_,
+                          scheduler_,
+                          std::max(calls, 1));
+    if (pin_cpus) {
+      cpu_set_t cpuset;
+      CPU_ZERO(&cpuset);
+      CPU_SET(i % cpus, &cpuset);
+      pthread_setaffinity_np(threads_.back().native_handle(),
+                             sizeof(cpu_set_t), &cpuset);
     }
-    static_cast<Call*>(tag)->Proceed();
   }
 }
+
+void usps_api_server::WorkerPool::Shutdown() {
+  for (std::unique_ptr<CallQueue>& queue : queues_) {
+    queue->Shutdown();
+  }
+  for (std::thread& thread : threads_) {
+    thread.join();
+  }
+  threads_.clear();
+}
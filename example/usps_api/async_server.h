@@ -12,70 +12,224 @@
 // License for the specific language governing permissions and limitations under
 // the License.
 #include "config/config_parser.h"
+#include "config/config_store.h"
+#include "query_cursor.h"
+#include "scheduler.h"
+#include "sfc_batch.h"
+#include "utils/metrics.h"
 #include <grpc/grpc.h>
+#include <grpcpp/alarm.h>
 #include <grpcpp/server.h>
 #include <grpcpp/server_builder.h>
 #include <grpcpp/server_context.h>
+#include <google/protobuf/arena.h>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #include "proto/usps_api/sfc.grpc.pb.h"
 
 namespace usps_api_server {
+// A call owns a protobuf arena whose first block is inline, so parsing a
+// typical request and building its response allocate nothing on the heap.
 class Call {
   public:
+   Call();
+   virtual ~Call() {}
    virtual void Proceed() = 0;
-   enum CallStatus { CREATE, PROCESS, FINISH };
+   // Called instead of Proceed() when an event fails. Ends the call.
+   virtual void Fail() { delete this; }
+   enum CallStatus { CREATE, PROCESS, READ, DELAY, WRITE, FINISH };
+  protected:
+   static constexpr std::size_t kArenaBlockSize = 2048;
+   google::protobuf::Arena* arena() { return &arena_; }
+  private:
+   alignas(std::max_align_t) char arena_block_[kArenaBlockSize];
+   google::protobuf::Arena arena_;
+};
+
+// A server completion queue polled by a single thread.
+class CallQueue {
+ public:
+  explicit CallQueue(std::unique_ptr<grpc::ServerCompletionQueue> cq);
+  grpc::ServerCompletionQueue* cq() { return cq_.get(); }
+  // Requests a new call of type T on this queue unless it is shutting down.
+  // Posting and Shutdown() are serialized so that no call is ever requested
+  // on a queue that has already been shut down.
+  template <typename T>
+  void Spawn(ghost::SfcService::AsyncService* service,
+             std::shared_ptr<ConfigStore> store,
+             std::shared_ptr<Scheduler> scheduler) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!shutdown_) {
+      new T(service, this, store, scheduler);
+    }
+  }
+  void Shutdown();
+ private:
+  std::unique_ptr<grpc::ServerCompletionQueue> cq_;
+  std::mutex mutex_;
+  bool shutdown_;
 };
 
 class CreateSfc final : public Call {
  public:
    explicit CreateSfc(ghost::SfcService::AsyncService* service,
-                        grpc::ServerCompletionQueue* cq,
-                        std::shared_ptr<Config> config);
+                        CallQueue* queue,
+                        std::shared_ptr<ConfigStore> store,
+                        std::shared_ptr<Scheduler> scheduler);
    void Proceed();
  private:
    ghost::SfcService::AsyncService* service_;
-   grpc::ServerCompletionQueue* cq_;
-   grpc::ServerAsyncResponseWriter<ghost::CreateSfcResponse> responder_;
+   CallQueue* queue_;
    grpc::ServerContext ctx_;
+   grpc::ServerAsyncResponseWriter<ghost::CreateSfcResponse> responder_;
    CallStatus status_;
-   std::shared_ptr<Config> config_;
-   ghost::CreateSfcRequest request_;
-   ghost::CreateSfcResponse response_;
+   std::shared_ptr<ConfigStore> store_;
+   std::shared_ptr<Scheduler> scheduler_;
+   ghost::CreateSfcRequest* request_;
+   ghost::CreateSfcResponse* response_;
+   grpc::Alarm alarm_;
+   RpcTimer timer_;
 };
 class DeleteSfc final : public Call {
  public:
   explicit DeleteSfc(ghost::SfcService::AsyncService* service,
-                     grpc::ServerCompletionQueue* cq,
-                     std::shared_ptr<Config> config);
+                     CallQueue* queue,
+                     std::shared_ptr<ConfigStore> store,
+                     std::shared_ptr<Scheduler> scheduler);
   void Proceed();
  private:
   ghost::SfcService::AsyncService* service_;
-  grpc::ServerCompletionQueue* cq_;
+  CallQueue* queue_;
   grpc::ServerContext ctx_;
   grpc::ServerAsyncResponseWriter<ghost::DeleteSfcResponse> responder_;
   CallStatus status_;
-  std::shared_ptr<Config> config_;
-  ghost::DeleteSfcRequest request_;
-  ghost::DeleteSfcResponse response_;
+  std::shared_ptr<ConfigStore> store_;
+  std::shared_ptr<Scheduler> scheduler_;
+  ghost::DeleteSfcRequest* request_;
+  ghost::DeleteSfcResponse* response_;
+  RpcTimer timer_;
 };
 class Query final : public Call {
  public:
   explicit Query(ghost::SfcService::AsyncService* service,
-                     grpc::ServerCompletionQueue* cq,
-                     std::shared_ptr<Config> config);
+                     CallQueue* queue,
+                     std::shared_ptr<ConfigStore> store,
+                     std::shared_ptr<Scheduler> scheduler);
   void Proceed();
  private:
   ghost::SfcService::AsyncService* service_;
-  grpc::ServerCompletionQueue* cq_;
+  CallQueue* queue_;
   grpc::ServerContext ctx_;
   grpc::ServerAsyncResponseWriter<ghost::QueryResponse> responder_;
   CallStatus status_;
-  std::shared_ptr<Config> config_;
-  ghost::QueryRequest request_;
-  ghost::QueryResponse response_;
+  std::shared_ptr<ConfigStore> store_;
+  std::shared_ptr<Scheduler> scheduler_;
+  ghost::QueryRequest* request_;
+  ghost::QueryResponse* response_;
+  RpcTimer timer_;
+};
+// Serves one QueryStream call, writing a page at a time.
+class QueryStream final : public Call {
+ public:
+  explicit QueryStream(ghost::SfcService::AsyncService* service,
+                       CallQueue* queue,
+                       std::shared_ptr<ConfigStore> store,
+                       std::shared_ptr<Scheduler> scheduler);
+  void Proceed();
+ private:
+  // Writes the next page, or finishes the call if there is none.
+  void WriteNext();
+  ghost::SfcService::AsyncService* service_;
+  CallQueue* queue_;
+  grpc::ServerContext ctx_;
+  grpc::ServerAsyncWriter<ghost::QueryResponse> writer_;
+  CallStatus status_;
+  std::shared_ptr<ConfigStore> store_;
+  std::shared_ptr<Scheduler> scheduler_;
+  ghost::QueryRequest* request_;
+  ghost::QueryResponse* response_;
+  std::unique_ptr<QueryCursor> cursor_;
+  RpcTimer timer_;
+};
+// Serves one ProgramSfcs stream, answering each batch before reading the
+// next.
+class ProgramSfcs final : public Call {
+ public:
+  explicit ProgramSfcs(ghost::SfcService::AsyncService* service,
+                       CallQueue* queue,
+                       std::shared_ptr<ConfigStore> store,
+                       std::shared_ptr<Scheduler> scheduler);
+  void Proceed();
+  // A failed read means the client has finished sending batches.
+  void Fail();
+ private:
+  ghost::SfcService::AsyncService* service_;
+  CallQueue* queue_;
+  grpc::ServerContext ctx_;
+  grpc::ServerAsyncReaderWriter<ghost::ProgramSfcsResponse,
+                                ghost::ProgramSfcsRequest> stream_;
+  CallStatus status_;
+  std::shared_ptr<ConfigStore> store_;
+  std::shared_ptr<Scheduler> scheduler_;
+  ghost::ProgramSfcsRequest* request_;
+  ghost::ProgramSfcsResponse* response_;
+  SfcBatch batch_;
+  grpc::Alarm alarm_;
+  // When the batch being applied was read.
+  std::uint64_t batch_start_;
+};
+class Stats final : public Call {
+ public:
+  explicit Stats(ghost::SfcService::AsyncService* service,
+                 CallQueue* queue,
+                 std::shared_ptr<ConfigStore> store,
+                 std::shared_ptr<Scheduler> scheduler);
+  void Proceed();
+ private:
+  ghost::SfcService::AsyncService* service_;
+  CallQueue* queue_;
+  grpc::ServerContext ctx_;
+  grpc::ServerAsyncResponseWriter<ghost::StatsResponse> responder_;
+  CallStatus status_;
+  std::shared_ptr<ConfigStore> store_;
+  ghost::StatsRequest* request_;
+  ghost::StatsResponse* response_;
+  RpcTimer timer_;
 };
 
-void HandleRpcs(ghost::SfcService::AsyncService& service,
-                grpc::ServerCompletionQueue* cq,
-                std::shared_ptr<Config> config);
+// Requests 'calls' of each RPC on 'queue' and serves them until the queue
+// is shut down and drained.
+void HandleRpcs(ghost::SfcService::AsyncService* service,
+                CallQueue* queue,
+                std::shared_ptr<ConfigStore> store,
+                std::shared_ptr<Scheduler> scheduler,
+                int calls);
+
+// Serves the async service from one completion queue per thread.
+class WorkerPool {
+ public:
+  WorkerPool(ghost::SfcService::AsyncService* service,
+             std::shared_ptr<ConfigStore> store,
+             std::shared_ptr<Scheduler> scheduler);
+  // Adds one completion queue per thread to 'builder'. Must be called before
+  // the server is built.
+  void AddQueues(grpc::ServerBuilder* builder, int threads);
+  // Starts a thread per queue, each keeping 'calls' of every RPC posted.
+  // If 'pin_cpus' is set, thread i is pinned to CPU i modulo the CPU count.
+  void Start(int calls, bool pin_cpus);
+  // Shuts down every queue and waits for the threads to drain them. The
+  // server must be shut down first.
+  void Shutdown();
+ private:
+  ghost::SfcService::AsyncService* service_;
+  std::shared_ptr<ConfigStore> store_;
+  std::shared_ptr<Scheduler> scheduler_;
+  std::vector<std::unique_ptr<CallQueue>> queues_;
+  std::vector<std::thread> threads_;
+};
 } //namespace
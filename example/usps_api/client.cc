@@ -11,10 +11,14 @@
 // WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
 // License for the specific language governing permissions and limitations under
 // the License.
+#include "load_generator.h"
 #include "utils/file_reader.h"
 #include <string>
 #include <iostream>
+#include <algorithm>
 #include <cstdint>
+#include <thread>
+#include <vector>
 #include <grpcpp/grpcpp.h>
 #include <grpcpp/channel.h>
 #include <grpcpp/client_context.h>
@@ -29,6 +33,17 @@ using namespace ghost;
 ABSL_FLAG(std::string, HOST, "localhost", "The host of the ip to listen on");
 // port will be within range due to flag definition
 ABSL_FLAG(std::uint16_t, PORT, 0, "The port of the ip to listen on");
+ABSL_FLAG(bool, LOAD, false, "Drive the server with generated load");
+ABSL_FLAG(int, CHANNELS, 1, "Channels to spread the load over");
+ABSL_FLAG(int, IN_FLIGHT, 64, "Outstanding RPCs per channel");
+ABSL_FLAG(double, QPS, 0, "Target total RPC rate, 0 for a closed loop");
+ABSL_FLAG(double, SECONDS, 10, "How long to generate load");
+ABSL_FLAG(std::string, MIX, "1:0:0", "Create:Delete:Query weights");
+ABSL_FLAG(std::string, LABELS, "",
+          "CSV file of terminal,service labels to send");
+ABSL_FLAG(std::string, DISTRIBUTION, "uniform",
+          "How labels are drawn, uniform or zipf");
+ABSL_FLAG(double, ZIPF_EXPONENT, 1.0, "Exponent of the zipf distribution");
 namespace usps_api_client {
 namespace {
 class GhostClient {
@@ -69,6 +84,42 @@ class GhostClient {
        std::cout << "Successfully queried SFC" << std::endl;
      }
    }
+   // Sends 'batches' on one ProgramSfcs stream. Returns the number of
+   // requests that failed.
+   int ProgramSfcs(const std::vector<ProgramSfcsRequest>& batches) {
+     grpc::ClientContext context;
+     std::unique_ptr<grpc::ClientReaderWriter<ProgramSfcsRequest,
+                                              ProgramSfcsResponse>> stream =
+         stub_->ProgramSfcs(&context);
+     int failed = 0;
+     // Reads results while writing so that neither side stalls on flow
+     // control.
+     std::thread reader([&stream, &failed]() {
+       ProgramSfcsResponse response;
+       while (stream->Read(&response)) {
+         for (const ProgramSfcsResult& result : response.results()) {
+           if (result.code() != grpc::StatusCode::OK) {
+             ++failed;
+           }
+         }
+       }
+     });
+     for (const ProgramSfcsRequest& batch : batches) {
+       if (!stream->Write(batch)) {
+         break;
+       }
+     }
+     stream->WritesDone();
+     reader.join();
+     grpc::Status status = stream->Finish();
+     if (!status.ok()) {
+       std::cout << "Failed to program SFCs" << std::endl;
+     } else {
+       std::cout << "Programmed SFCs with " << failed << " failures"
+                 << std::endl;
+     }
+     return failed;
+   }
   private:
     std::unique_ptr<SfcService::Stub> stub_;
 };
@@ -120,6 +171,42 @@ std::shared_ptr<grpc::ChannelCredentials> GetCreds(std::string key_file,
   ssl_opts.pem_private_key = key;
   return grpc::SslCredentials(ssl_opts);
 }
+// Runs the load generator from the flags. Returns the exit code.
+int RunLoad(const std::string& server_address,
+            std::shared_ptr<grpc::ChannelCredentials> creds) {
+  LoadOptions options;
+  options.in_flight = absl::GetFlag(FLAGS_IN_FLIGHT);
+  options.qps = absl::GetFlag(FLAGS_QPS);
+  options.seconds = absl::GetFlag(FLAGS_SECONDS);
+  options.zipf_exponent = absl::GetFlag(FLAGS_ZIPF_EXPONENT);
+  if (!LoadGenerator::ParseMix(absl::GetFlag(FLAGS_MIX), &options)) {
+    std::cout << "Invalid MIX " << absl::GetFlag(FLAGS_MIX) << std::endl;
+    return 1;
+  }
+  std::string labels = absl::GetFlag(FLAGS_LABELS);
+  if (!labels.empty() && !LoadGenerator::ReadLabels(labels, &options)) {
+    std::cout << "No labels in " << labels << std::endl;
+    return 1;
+  }
+  std::string distribution = absl::GetFlag(FLAGS_DISTRIBUTION);
+  if (distribution == "zipf") {
+    options.distribution = LoadOptions::ZIPF;
+  } else if (distribution != "uniform") {
+    std::cout << "Invalid DISTRIBUTION " << distribution << std::endl;
+    return 1;
+  }
+  // Separate channel arguments keep gRPC from sharing one connection.
+  std::vector<std::shared_ptr<grpc::Channel>> channels;
+  for (int i = 0; i < std::max(absl::GetFlag(FLAGS_CHANNELS), 1); ++i) {
+    grpc::ChannelArguments args;
+    args.SetInt("usps_api.channel", i);
+    channels.push_back(
+        grpc::CreateCustomChannel(server_address, creds, args));
+  }
+  LoadGenerator generator(channels, options);
+  generator.Run().Print(&std::cout);
+  return 0;
+}
 } // anonymous namespace
 } // namespace
 
@@ -128,6 +215,9 @@ int main(int argc, char** argv) {
   std::string server_address = absl::GetFlag(FLAGS_HOST) + ":" +
       std::to_string(absl::GetFlag(FLAGS_PORT));
   std::shared_ptr<grpc::ChannelCredentials> creds = grpc::InsecureChannelCredentials();
+  if (absl::GetFlag(FLAGS_LOAD)) {
+    return usps_api_client::RunLoad(server_address, creds);
+  }
   usps_api_client::GhostClient client(
       grpc::CreateChannel(server_address, creds));
   return 0;
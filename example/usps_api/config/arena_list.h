@@ -0,0 +1,104 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#ifndef ARENA_LIST_H
+#define ARENA_LIST_H
+
+#include <google/protobuf/arena.h>
+#include <google/protobuf/repeated_ptr_field.h>
+#include <cstddef>
+#include <memory>
+
+namespace usps_api_server {
+// A list of protos that lives on its own protobuf arena.
+//
+// Parsed filter lists can hold millions of identifiers. Keeping them on an
+// arena replaces one heap allocation per message and submessage with a few
+// large blocks, and frees them all at once on clear() or destruction.
+// Copies get their own arena.
+template <typename T>
+class ArenaList {
+  public:
+    using iterator = typename google::protobuf::RepeatedPtrField<T>::iterator;
+    using const_iterator =
+        typename google::protobuf::RepeatedPtrField<T>::const_iterator;
+
+    ArenaList() { Reset(); }
+    ArenaList(const ArenaList& other) : ArenaList() { *this = other; }
+    ArenaList& operator=(const ArenaList& other) {
+      if (this != &other) {
+        clear();
+        items_->Reserve(other.items_->size());
+        for (const T& item : *other.items_) {
+          push_back(item);
+        }
+      }
+      return *this;
+    }
+
+    // Appends a new empty message and returns it to be filled in place.
+    T* Add() { return items_->Add(); }
+    // Appends a message created on arena(). Messages may be created on the
+    // arena from several threads at once; appending them may not.
+    void AddAllocated(T* item) { items_->UnsafeArenaAddAllocated(item); }
+    google::protobuf::Arena* arena() const { return arena_.get(); }
+    void push_back(const T& item) { *items_->Add() = item; }
+    void pop_back() { items_->RemoveLast(); }
+    const T& front() const { return items_->Get(0); }
+    const T& back() const { return items_->Get(items_->size() - 1); }
+    std::size_t size() const { return items_->size(); }
+    bool empty() const { return items_->empty(); }
+    void reserve(std::size_t size) { items_->Reserve(size); }
+    // Removes the messages for which 'pred' returns true, keeping the order
+    // of the rest. Removed messages stay on the arena for reuse by Add().
+    template <typename Pred>
+    std::size_t RemoveIf(Pred pred) {
+      int kept = 0;
+      for (int i = 0; i < items_->size(); ++i) {
+        if (!pred(items_->Get(i))) {
+          if (kept != i) {
+            items_->SwapElements(kept, i);
+          }
+          ++kept;
+        }
+      }
+      std::size_t removed = items_->size() - kept;
+      while (items_->size() > kept) {
+        items_->RemoveLast();
+      }
+      return removed;
+    }
+    // Drops every message and releases the arena's blocks.
+    void clear() { Reset(); }
+
+    iterator begin() { return items_->begin(); }
+    iterator end() { return items_->end(); }
+    const_iterator begin() const { return items_->begin(); }
+    const_iterator end() const { return items_->end(); }
+
+  private:
+    void Reset() {
+      google::protobuf::ArenaOptions options;
+      options.start_block_size = 4096;
+      options.max_block_size = 1 << 20;
+      items_ = nullptr;
+      arena_.reset(new google::protobuf::Arena(options));
+      items_ = google::protobuf::Arena::CreateMessage<
+          google::protobuf::RepeatedPtrField<T>>(arena_.get());
+    }
+    std::unique_ptr<google::protobuf::Arena> arena_;
+    google::protobuf::RepeatedPtrField<T>* items_;
+};
+}
+
+#endif
@@ -12,70 +12,66 @@
 // License for the specific language governing permissions and limitations under
 // the License.
 #include "config_parser.h"
-#include "example/usps_api/utils/file_reader.h"
+#include "filter_loader.h"
+#include "filter_snapshot.h"
+#include "example/usps_api/utils/metrics.h"
 #include "proto/usps_api/ghost_label.pb.h"
 #include "json/json.h"
 #include <iostream>
 #include <fstream>
-#include <google/protobuf/util/message_differencer.h>
-#include <unistd.h>
-#include <stdlib.h>
-#include <errno.h>
-#include <thread>
-#include <sys/types.h>
-#include <sys/inotify.h>
 
-#define EVENT_SIZE (sizeof(struct inotify_event))
-#define BUF_LEN ((1024*( EVENT_SIZE + 16 )))
-
-// Runs FileWatch on another thread
-void usps_api_server::Config::MonitorConfig() {
-  std::thread monitor (&usps_api_server::Config::FileWatch, this);
-  monitor.detach();
+// Reads the configuration file or creates one if not present.
+bool usps_api_server::Config::Initialize() {
+  Json::Value root;
+  if (!ReadFile(&root)) {
+    return false;
+  }
+  Config::ParseConfig(root);
+  return true;
 }
 
-// Watches the config file for updates and reloads it.
-void usps_api_server::Config::FileWatch() {
-  while(true) {
-    char buffer[BUF_LEN];
-    int fd = inotify_init();
-    int wd = inotify_add_watch(fd, kFilename.c_str(),
-                               IN_MODIFY | IN_CREATE);
-    int i = 0;
-    int length = read(fd, buffer, BUF_LEN);
-    while(i < length) {
-      struct inotify_event* event = ( struct inotify_event * ) &buffer[ i ];
-      Initialize();
-      i+= EVENT_SIZE + event->len;
-    }
-    inotify_rm_watch(fd, wd);
-    close(fd);
+bool usps_api_server::Config::InitializeFromSnapshot(
+    const std::string& snapshot) {
+  Json::Value root;
+  if (!ReadFile(&root) || !FilterSnapshot::Load(snapshot, this)) {
+    return false;
   }
+  ParseSettings(root);
+  return true;
 }
 
-// Reads the configuration file or creates one if not present.
-bool usps_api_server::Config::Initialize() {
+// Reads and parses the JSON in kFilename into 'root'.
+bool usps_api_server::Config::ReadFile(Json::Value* root) const {
   std::ifstream file(kFilename, std::ifstream::binary);
   if (!file.good()) {
     std::cout << kFilename << " does not exist" << std::endl;
     return false;
   }
   std::cout << "Reading from " << kFilename << std::endl;
-  Json::Value root;
   Json::CharReaderBuilder builder;
   std::string errs;
-  bool valid_json = Json::parseFromStream(builder, file, &root, &errs);
-  if (valid_json) {
-    Config::ParseConfig(root);
-    return true;
+  if (!Json::parseFromStream(builder, file, root, &errs)) {
+    std::cout << "Invalid JSON in " << kFilename  << errs << std::endl;
+    return false;
   }
-  std::cout << "Invalid JSON in " << kFilename  << errs << std::endl;
-  return false;
+  return true;
 }
 
 // A helper function to parse the values in the configuration file.
 // TODO(sam) Implement functionality & gmock tests for this function.
 void usps_api_server::Config::ParseConfig(Json::Value root) {
+  ParseSettings(root);
+  // The three filters and their CSV files are loaded together.
+  const Json::Value sfcfilter = root["sfcfilter"];
+  FilterLoader loader;
+  loader.Add(&deny_, sfcfilter["deny"]);
+  loader.Add(&allow_, sfcfilter["allow"]);
+  loader.Add(&delay_, sfcfilter["delay"]);
+  loader.Load();
+}
+
+// Parses everything but the filter lists.
+void usps_api_server::Config::ParseSettings(const Json::Value& root) {
   const Json::Value address = root["address"];
   host_ = address.get("host", "").asString();
   port_ = address.get("port", 0).asInt();
@@ -85,11 +81,7 @@ void usps_api_server::Config::ParseConfig(Json::Value root) {
   del_ = requests.get("delete", true).asBool();
   query_ = requests.get("query", true).asBool();
 
-  const Json::Value sfcfilter = root["sfcfilter"];
-  ParseIdentifiers(&deny_, sfcfilter["deny"]);
-  ParseIdentifiers(&allow_, sfcfilter["allow"]);
-  ParseIdentifiers(&delay_, sfcfilter["delay"]);
-  delay_time_ = sfcfilter["delay"].get("seconds", 0).asInt();
+  delay_time_ = root["sfcfilter"]["delay"].get("seconds", 0).asInt();
 
   const Json::Value ssl = root["ssl"];
   enable_ssl_ = ssl.get("enable", false).asBool();
@@ -98,78 +90,38 @@ void usps_api_server::Config::ParseConfig(Json::Value root) {
   root_ = ssl.get("root", "").asString();
 
   async_ = root.get("async", false).asBool();
+  const Json::Value workers = root["workers"];
+  worker_threads_ = workers.get("threads", 1).asInt();
+  worker_calls_ = workers.get("calls", 1).asInt();
+  pin_cpus_ = workers.get("pin_cpus", false).asBool();
 }
 
 // Parses the configuration file for TunnelIdentifiers and RoutingIdentifiers.
 void usps_api_server::Config::ParseIdentifiers(Filter* filter,
                                                Json::Value root) {
-  const Json::Value tunnels = root["ghost_tunnel_identifier"]["ghostlabel"];
-  const Json::Value routings = root["ghost_routing_identifier"]["destination_label_prefix"];
-  std::string tunnel_file =
-      root["ghost_tunnel_identifier"].get("file", "").asString();
-  std::string route_file =
-      root["ghost_routing_identifier"].get("file", "").asString();
-  filter->tunnels.clear();
-  filter->routings.clear();
-  ParseTunnelFile(tunnel_file, filter);
-  ParseRouteFile(route_file, filter);
-  // Adds given ghostlabel's in ghost_tunnel_identifier to filter's tunnel list.
-  for (unsigned int index = 0; index < tunnels.size(); ++index) {
-    int terminal_label = tunnels[index].get("terminal_label", 0).asInt();
-    int service_label = tunnels[index].get("service_label", 0).asInt();
-    ghost::GhostTunnelIdentifier tunnel_id =
-        CreateGhostTunnel(terminal_label, service_label); 
-    filter->tunnels.push_back(tunnel_id);
-  }
-  // Adds given destination_label_prefix's in ghost_routing_identifier to
-  // filter's routing list.
-  for (unsigned int index = 0; index < routings.size(); ++index) {
-    int value = routings[index].get("value", 0).asInt();
-    int prefix_len = routings[index].get("prefix_len", 0).asInt();
-    ghost::GhostRoutingIdentifier routing_id =
-        CreateGhostRoute(value, prefix_len);
-    filter->routings.push_back(routing_id);
-  }
+  FilterLoader loader;
+  loader.Add(filter, root);
+  loader.Load();
 }
-// Parses a csv file for TunnnelIdentifier and adds it to filter.
-void usps_api_server::Config::ParseTunnelFile(std::string filename,
-                                              Filter*& filter) {
-  if (filename.empty()) {
-    return;
-  }
-  std::list<std::vector<std::string>> entries = FileReader::ParseCSV(filename);
-  std::list<std::vector<std::string>>::iterator it;
-  for (it = entries.begin(); it != entries.end(); it++) {
-    std::vector<std::string> entry = *it;
-    if (entry.size() < 2) {
-      continue;
-    }
-    ghost::GhostTunnelIdentifier tunnel_id =
-        CreateGhostTunnel(std::stoi(entry[0]), std::stoi(entry[1]));
-    filter->tunnels.push_back(tunnel_id);
-  }
+// Sets the terminal_label and service_label of 'tunnel_id'.
+void usps_api_server::Config::SetGhostTunnel(
+    std::uint64_t term, std::uint64_t service,
+    ghost::GhostTunnelIdentifier* tunnel_id) {
+  tunnel_id->mutable_terminal_label()->set_value(term);
+  tunnel_id->mutable_service_label()->set_value(service);
 }
-// Parses a csv file for RoutingIdentifier and adds it to filter.
-void usps_api_server::Config::ParseRouteFile(std::string filename,
-                                     Filter*& filter) {
-  if (filename.empty()) {
-    return;
-  }
-  std::list<std::vector<std::string>> entries = FileReader::ParseCSV(filename);
-  std::list<std::vector<std::string>>::iterator it;
-  for (it = entries.begin(); it != entries.end(); it++) {
-    std::vector<std::string> entry = *it;
-    if (entry.size() < 2) {
-      continue;
-    }
-    ghost::GhostRoutingIdentifier routing_id =
-        CreateGhostRoute(std::stoi(entry[0]), std::stoi(entry[1]));
-    filter->routings.push_back(routing_id);
-  }
+// Sets the value and prefix_len of 'routing_id'.
+void usps_api_server::Config::SetGhostRoute(
+    std::uint64_t value, std::uint32_t prefix_len,
+    ghost::GhostRoutingIdentifier* routing_id) {
+  ghost::GhostLabelPrefix* dest_label =
+      routing_id->mutable_destination_label_prefix();
+  dest_label->set_value(value);
+  dest_label->set_prefix_len(prefix_len);
 }
 // Creates a GhostTunnelIdentifier from terminal_label and service_label.
-ghost::GhostTunnelIdentifier usps_api_server::Config::CreateGhostTunnel(int term,
-                                                                        int service) {
+ghost::GhostTunnelIdentifier usps_api_server::Config::CreateGhostTunnel(
+    std::uint64_t term, std::uint64_t service) {
     ghost::GhostTunnelIdentifier tunnel_id;
     ghost::GhostLabel* terminal_label = tunnel_id.mutable_terminal_label();
     ghost::GhostLabel* service_label = tunnel_id.mutable_service_label();
@@ -178,8 +130,8 @@ ghost::GhostTunnelIdentifier usps_api_server::Config::CreateGhostTunnel(int term
     return tunnel_id;
 }
 // Creates a GhostRoutingIdentifier from value and prefix_len.
-ghost::GhostRoutingIdentifier usps_api_server::Config::CreateGhostRoute(int value,
-                                                                        int prefix_len) {
+ghost::GhostRoutingIdentifier usps_api_server::Config::CreateGhostRoute(
+    std::uint64_t value, std::uint32_t prefix_len) {
   ghost::GhostRoutingIdentifier routing_id;
   ghost::GhostLabelPrefix* dest_label = routing_id.mutable_destination_label_prefix();
   dest_label->set_value(value);
@@ -187,36 +139,22 @@ ghost::GhostRoutingIdentifier usps_api_server::Config::CreateGhostRoute(int valu
   return routing_id;
 }
 // Will return true if the exact same filters in 'sfc_filter' are in 'filter'
-bool usps_api_server::Config::FilterMatch(Filter* filter,
-                                          const ghost::SfcFilter* sfc_filter) {
+bool usps_api_server::Config::FilterMatch(
+    const Filter* filter, const ghost::SfcFilter* sfc_filter) const {
   // Iterates over all filter layers in sfc_filter.
   for (int i = 0; i < sfc_filter->filter_layers_size(); ++i) {
-    ghost::FilterLayer filter_layer = sfc_filter->filter_layers(i);
-    const ghost::GhostFilter ghost_filter = filter_layer.ghost_filter();
+    const ghost::GhostFilter& ghost_filter =
+        sfc_filter->filter_layers(i).ghost_filter();
     // If layer contains a GhostTunnelIdentifier,
-    // check if tunnels list contains same filters
+    // check if the tunnel index contains the same filter.
     if (ghost_filter.has_tunnel_id()) {
-      std::list<ghost::GhostTunnelIdentifier>::iterator it;
-      std::list<ghost::GhostTunnelIdentifier> tunnels = filter->tunnels;
-      for (it = tunnels.begin(); it != tunnels.end(); ++it) {
-        ghost::GhostTunnelIdentifier filter_id = *it;
-        bool matched = google::protobuf::util::MessageDifferencer::Equals(filter_id, ghost_filter.tunnel_id());
-        // If filter matches, return true
-        if (matched) {
-          return true;
-        }
+      if (filter->index.Contains(ghost_filter.tunnel_id())) {
+        return true;
       }
     } else if (ghost_filter.has_routing_id()) {
-      std::list<ghost::GhostRoutingIdentifier>::iterator it;
-      std::list<ghost::GhostRoutingIdentifier> routings = filter->routings;
-      // If instead we have a GhostRoutingIdentifier, check the routings list.
-      for (it = routings.begin(); it != routings.end(); ++it) {
-        ghost::GhostRoutingIdentifier filter_id = *it;
-        bool matched = google::protobuf::util::MessageDifferencer::Equals(filter_id, ghost_filter.routing_id());
-        // If filter matches, return true
-        if (matched) {
-          return true;
-        }
+      // If instead we have a GhostRoutingIdentifier, check the routing index.
+      if (filter->index.Contains(ghost_filter.routing_id())) {
+        return true;
       }
     }
   }
@@ -224,6 +162,42 @@ bool usps_api_server::Config::FilterMatch(Filter* filter,
 }
 
 // Returns true if a given filter is active.
-bool usps_api_server::Config::FilterActive(Filter* filter) {
-  return (filter->tunnels.size() + filter->routings.size()) > 0;
+bool usps_api_server::Config::FilterActive(const Filter* filter) const {
+  return !filter->index.empty();
+}
+
+// Times MatchFilters by the decision it makes. The decision histograms
+// follow the order of FilterAction.
+usps_api_server::Config::FilterAction usps_api_server::Config::Evaluate(
+    const ghost::SfcFilter* sfc_filter) const {
+  std::uint64_t start = Metrics::Now();
+  FilterAction action = MatchFilters(sfc_filter);
+  Metrics::Record(
+      static_cast<Metrics::Histogram>(Metrics::FILTER_ALLOW + action),
+      Metrics::Now() - start);
+  return action;
+}
+
+// Applies the delay, deny and allow lists to 'sfc_filter'. A delay match
+// takes priority; deny and allow lists are mutually exclusive.
+usps_api_server::Config::FilterAction usps_api_server::Config::MatchFilters(
+    const ghost::SfcFilter* sfc_filter) const {
+  // Delay list is active.
+  if (FilterActive(&delay_) && FilterMatch(&delay_, sfc_filter)) {
+    return DELAY;
+  }
+  // Deny list is active.
+  if (FilterActive(&deny_)) {
+    return FilterMatch(&deny_, sfc_filter) ? DENY : ALLOW;
+  } else if (FilterActive(&allow_)) {
+    // Allow list is active.
+    return FilterMatch(&allow_, sfc_filter) ? ALLOW : DENY;
+  }
+  // Neither allow or deny is active.
+  return ALLOW;
+}
+
+// Rebuilds the lookup index from the tunnel and routing lists.
+void usps_api_server::Config::Filter::Compile() {
+  index.Build(tunnels, routings);
 }
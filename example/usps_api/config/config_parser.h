@@ -14,18 +14,26 @@
 #ifndef CONFIG_PARSER_H
 #define CONFIG_PARSER_H
 
+#include "arena_list.h"
+#include "filter_index.h"
 #include "proto/usps_api/sfc_filter.pb.h"
 #include "json/json.h"
+#include <cstdint>
 #include <string>
-#include <list>
 
 
 namespace usps_api_server {
 class Config {
   public:
+    // The action the sfcfilter lists take on a CreateSfc request.
+    enum FilterAction { ALLOW, DENY, DELAY };
     struct Filter {
-      std::list<ghost::GhostTunnelIdentifier> tunnels;
-      std::list<ghost::GhostRoutingIdentifier> routings;
+      ArenaList<ghost::GhostTunnelIdentifier> tunnels;
+      ArenaList<ghost::GhostRoutingIdentifier> routings;
+      // Compiled lookup index over tunnels and routings. Must be rebuilt with
+      // Compile() whenever the lists above change.
+      FilterIndex index;
+      void Compile();
     };
     const std::string kFilename = "example/usps_api/config/config.json";
     std::string host_;
@@ -39,18 +47,37 @@ class Config {
     bool query_;
     int delay_time_;
     bool async_;
+    int worker_threads_;
+    int worker_calls_;
+    bool pin_cpus_;
     Filter deny_, allow_, delay_;
+    // Set by ConfigStore when the configuration is published.
+    std::uint64_t version_ = 0;
     bool Initialize();
-    void MonitorConfig();
-    void FileWatch();
+    // Reads the settings from kFilename and the filter indexes from the
+    // snapshot at 'snapshot', without parsing any identifiers.
+    bool InitializeFromSnapshot(const std::string& snapshot);
+    bool ReadFile(Json::Value* root) const;
     void ParseConfig(Json::Value root);
+    void ParseSettings(const Json::Value& root);
     void ParseIdentifiers(Filter* filter, Json::Value root);
-    void ParseTunnelFile(std::string filename, Filter*& filter);
-    void ParseRouteFile(std::string filename, Filter*& filter);
-    ghost::GhostTunnelIdentifier CreateGhostTunnel(int terminal_label, int service_label);
-    ghost::GhostRoutingIdentifier CreateGhostRoute(int value, int prefix_len);
-    bool FilterMatch(Filter* filter, const ghost::SfcFilter* sfc_filter);
-    bool FilterActive(Filter* filter);
+    // Fill 'tunnel_id' or 'routing_id' in place, e.g. in an arena-backed
+    // filter list.
+    static void SetGhostTunnel(std::uint64_t terminal_label,
+                               std::uint64_t service_label,
+                               ghost::GhostTunnelIdentifier* tunnel_id);
+    static void SetGhostRoute(std::uint64_t value, std::uint32_t prefix_len,
+                              ghost::GhostRoutingIdentifier* routing_id);
+    ghost::GhostTunnelIdentifier CreateGhostTunnel(std::uint64_t terminal_label,
+                                                   std::uint64_t service_label);
+    ghost::GhostRoutingIdentifier CreateGhostRoute(std::uint64_t value,
+                                                   std::uint32_t prefix_len);
+    bool FilterMatch(const Filter* filter,
+                     const ghost::SfcFilter* sfc_filter) const;
+    bool FilterActive(const Filter* filter) const;
+    // Returns MatchFilters and records how long it took.
+    FilterAction Evaluate(const ghost::SfcFilter* sfc_filter) const;
+    FilterAction MatchFilters(const ghost::SfcFilter* sfc_filter) const;
 };
 }
 
@@ -0,0 +1,354 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#include "config_sources.h"
+#include "filter_loader.h"
+#include "example/usps_api/utils/file_reader.h"
+#include "proto/usps_api/ghost_label.pb.h"
+#include <algorithm>
+#include <cstring>
+#include <thread>
+#include <time.h>
+#include <sys/stat.h>
+
+namespace {
+using Pair = usps_api_server::ConfigSources::Pair;
+
+// Removes one entry of 'list' per identifier in 'removed'. 'key' returns the
+// identifier of an entry.
+template <typename T, typename Key>
+void RemovePairs(std::vector<Pair> removed,
+                 usps_api_server::ArenaList<T>* list, Key key) {
+  if (removed.empty()) {
+    return;
+  }
+  std::sort(removed.begin(), removed.end());
+  std::vector<bool> used(removed.size(), false);
+  list->RemoveIf([&removed, &used, &key](const T& item) {
+    Pair pair = key(item);
+    auto it = std::lower_bound(removed.begin(), removed.end(), pair);
+    for (; it != removed.end() && *it == pair; ++it) {
+      if (!used[it - removed.begin()]) {
+        used[it - removed.begin()] = true;
+        return true;
+      }
+    }
+    return false;
+  });
+}
+
+Pair TunnelKey(const ghost::GhostTunnelIdentifier& tunnel_id) {
+  return Pair(tunnel_id.terminal_label().value(),
+              tunnel_id.service_label().value());
+}
+
+Pair RoutingKey(const ghost::GhostRoutingIdentifier& routing_id) {
+  return Pair(routing_id.destination_label_prefix().value(),
+              routing_id.destination_label_prefix().prefix_len());
+}
+
+std::string Serialize(const Json::Value& value) {
+  Json::StreamWriterBuilder builder;
+  builder["indentation"] = "";
+  return Json::writeString(builder, value);
+}
+} // namespace
+
+bool usps_api_server::ConfigSources::Delta::empty() const {
+  return tunnels_added.empty() && tunnels_removed.empty() &&
+         routings_added.empty() && routings_removed.empty();
+}
+
+void usps_api_server::ConfigSources::Delta::Apply(
+    Config::Filter* filter) const {
+  RemovePairs(tunnels_removed, &filter->tunnels, TunnelKey);
+  ghost::GhostTunnelIdentifier removed_id;
+  for (const Pair& pair : tunnels_removed) {
+    Config::SetGhostTunnel(pair.first, pair.second, &removed_id);
+    filter->index.Erase(removed_id);
+  }
+  for (const Pair& pair : tunnels_added) {
+    ghost::GhostTunnelIdentifier* tunnel_id = filter->tunnels.Add();
+    Config::SetGhostTunnel(pair.first, pair.second, tunnel_id);
+    filter->index.Insert(*tunnel_id);
+  }
+  if (routings_added.empty() && routings_removed.empty()) {
+    return;
+  }
+  RemovePairs(routings_removed, &filter->routings, RoutingKey);
+  for (const Pair& pair : routings_added) {
+    Config::SetGhostRoute(pair.first, static_cast<std::uint32_t>(pair.second),
+                          filter->routings.Add());
+  }
+  // The prefix trie is built in one pass, so routing changes rebuild it.
+  filter->index.BuildRoutings(filter->routings);
+}
+
+void usps_api_server::ConfigSources::Scan(const Json::Value& root,
+                                          const ConfigSources* previous) {
+  static const char* const kNames[kFilters] = {"deny", "allow", "delay"};
+  root_hash_ = FileReader::Hash(Serialize(root));
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  scan_start_ = static_cast<std::int64_t>(now.tv_sec) * 1000000000 +
+                now.tv_nsec;
+  // Files changed this close to the previous scan may have changed again
+  // since, within the same timestamp.
+  std::int64_t racy_after =
+      previous != nullptr ? previous->scan_start_ - kMtimeGranularityNs : 0;
+  // Files whose stat changed, with their source in 'previous'.
+  std::vector<std::pair<Source*, const Source*>> changed;
+  for (int f = 0; f < kFilters; ++f) {
+    const Json::Value filter_root = root["sfcfilter"][kNames[f]];
+    const Json::Value tunnel_root = filter_root["ghost_tunnel_identifier"];
+    const Json::Value routing_root = filter_root["ghost_routing_identifier"];
+    for (int kind = 0; kind < kKinds; ++kind) {
+      Source* source = &sources_[f][kind];
+      const Source* old =
+          previous != nullptr ? &previous->sources_[f][kind] : nullptr;
+      *source = Source();
+      if (kind == TUNNELS || kind == ROUTES) {
+        const Json::Value list = kind == TUNNELS
+                                     ? tunnel_root["ghostlabel"]
+                                     : routing_root["destination_label_prefix"];
+        source->hash = FileReader::Hash(Serialize(list));
+        if (old != nullptr && old->chunks != nullptr &&
+            old->hash == source->hash) {
+          source->chunks = old->chunks;
+          continue;
+        }
+        auto pairs = std::make_shared<std::vector<Pair>>();
+        for (unsigned int index = 0; index < list.size(); ++index) {
+          if (kind == TUNNELS) {
+            pairs->emplace_back(
+                list[index].get("terminal_label", 0).asUInt64(),
+                list[index].get("service_label", 0).asUInt64());
+          } else {
+            pairs->emplace_back(list[index].get("value", 0).asUInt64(),
+                                list[index].get("prefix_len", 0).asUInt());
+          }
+        }
+        source->chunks = std::make_shared<Chunks>(
+            1, Chunk{source->hash, std::move(pairs)});
+        continue;
+      }
+      source->path = (kind == TUNNEL_FILE ? tunnel_root : routing_root)
+                         .get("file", "").asString();
+      if (source->path.empty()) {
+        continue;
+      }
+      struct stat st;
+      if (stat(source->path.c_str(), &st) == 0) {
+        source->mtime = static_cast<std::int64_t>(st.st_mtim.tv_sec) *
+                            1000000000 + st.st_mtim.tv_nsec;
+        source->size = st.st_size;
+      }
+      if (old != nullptr && old->path == source->path &&
+          old->mtime == source->mtime && old->size == source->size &&
+          old->mtime < racy_after) {
+        *source = *old;
+        continue;
+      }
+      changed.emplace_back(source, old);
+    }
+  }
+  RunParallel(changed.size(), std::thread::hardware_concurrency(),
+              [&changed](std::size_t i) {
+    Source* source = changed[i].first;
+    const Source* old = changed[i].second;
+    FileReader::MappedFile file(source->path);
+    if (!file.ok()) {
+      return;
+    }
+    const Chunks* old_chunks =
+        old != nullptr && old->path == source->path ? old->chunks.get()
+                                                    : nullptr;
+    auto chunks = std::make_shared<Chunks>();
+    source->hash = Split(file.data(), old_chunks, chunks.get());
+    // Keeps sharing the old chunks if only the stat changed.
+    if (old_chunks != nullptr && old->hash == source->hash) {
+      source->chunks = old->chunks;
+    } else {
+      source->chunks = std::move(chunks);
+    }
+  });
+}
+
+bool usps_api_server::ConfigSources::Same(const ConfigSources& other) const {
+  if (root_hash_ != other.root_hash_) {
+    return false;
+  }
+  for (int f = 0; f < kFilters; ++f) {
+    for (int kind = 0; kind < kKinds; ++kind) {
+      if (sources_[f][kind].chunks != other.sources_[f][kind].chunks) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void usps_api_server::ConfigSources::Fill(Config* config) const {
+  RunParallel(kFilters, kFilters, [this, config](std::size_t f) {
+    Config::Filter* target = filter(config, f);
+    target->tunnels.clear();
+    target->routings.clear();
+    for (int kind = 0; kind < kKinds; ++kind) {
+      if (sources_[f][kind].chunks == nullptr) {
+        continue;
+      }
+      for (const Chunk& chunk : *sources_[f][kind].chunks) {
+        for (const Pair& pair : *chunk.pairs) {
+          if (IsTunnel(kind)) {
+            Config::SetGhostTunnel(pair.first, pair.second,
+                                   target->tunnels.Add());
+          } else {
+            Config::SetGhostRoute(pair.first,
+                                  static_cast<std::uint32_t>(pair.second),
+                                  target->routings.Add());
+          }
+        }
+      }
+    }
+    target->Compile();
+  });
+}
+
+std::vector<usps_api_server::ConfigSources::Delta>
+usps_api_server::ConfigSources::Diff(const ConfigSources& from) const {
+  std::vector<Delta> deltas(kFilters);
+  for (int f = 0; f < kFilters; ++f) {
+    for (int kind = 0; kind < kKinds; ++kind) {
+      const Chunks* before = from.sources_[f][kind].chunks.get();
+      const Chunks* after = sources_[f][kind].chunks.get();
+      if (before == after) {
+        continue;
+      }
+      if (IsTunnel(kind)) {
+        DiffChunks(before, after, &deltas[f].tunnels_added,
+                   &deltas[f].tunnels_removed);
+      } else {
+        DiffChunks(before, after, &deltas[f].routings_added,
+                   &deltas[f].routings_removed);
+      }
+    }
+  }
+  return deltas;
+}
+
+std::vector<std::string> usps_api_server::ConfigSources::Files(
+    const Json::Value& root) {
+  std::vector<std::string> files;
+  for (const Json::Value& filter_root : root["sfcfilter"]) {
+    for (const char* kind :
+         {"ghost_tunnel_identifier", "ghost_routing_identifier"}) {
+      std::string file = filter_root[kind].get("file", "").asString();
+      if (!file.empty()) {
+        files.push_back(file);
+      }
+    }
+  }
+  return files;
+}
+
+usps_api_server::Config::Filter* usps_api_server::ConfigSources::filter(
+    Config* config, int index) {
+  Config::Filter* filters[kFilters] = {&config->deny_, &config->allow_,
+                                       &config->delay_};
+  return filters[index];
+}
+
+std::uint64_t usps_api_server::ConfigSources::Split(std::string_view text,
+                                                    const Chunks* old,
+                                                    Chunks* chunks) {
+  std::vector<std::pair<std::uint64_t, const Chunk*>> known;
+  if (old != nullptr) {
+    for (const Chunk& chunk : *old) {
+      known.emplace_back(chunk.hash, &chunk);
+    }
+    std::sort(known.begin(), known.end());
+  }
+  std::uint64_t hash = 0;
+  const char* p = text.data();
+  const char* end = p + text.size();
+  const char* chunk_begin = p;
+  auto cut = [&](const char* chunk_end) {
+    std::string_view bytes(chunk_begin, chunk_end - chunk_begin);
+    Chunk chunk{FileReader::Hash(bytes), nullptr};
+    hash = (hash ^ chunk.hash) * 0x9e3779b97f4a7c15ULL;
+    auto it = std::lower_bound(
+        known.begin(), known.end(),
+        std::pair<std::uint64_t, const Chunk*>(chunk.hash, nullptr));
+    if (it != known.end() && it->first == chunk.hash) {
+      chunk.pairs = it->second->pairs;
+    } else {
+      auto pairs = std::make_shared<std::vector<Pair>>();
+      FileReader::ParsePairs(bytes, [&pairs](std::uint64_t first,
+                                             std::uint64_t second) {
+        pairs->emplace_back(first, second);
+      });
+      chunk.pairs = std::move(pairs);
+    }
+    chunks->push_back(std::move(chunk));
+    chunk_begin = chunk_end;
+  };
+  while (p < end) {
+    const char* line_end = FileReader::FindNewline(p, end);
+    // Cuts before lines whose first eight bytes hash to 0 mod kChunkLines.
+    std::uint64_t word = 0;
+    std::memcpy(&word, p, std::min<std::size_t>(line_end - p, 8));
+    word *= 0x9e3779b97f4a7c15ULL;
+    if (p != chunk_begin && ((word >> 40) & (kChunkLines - 1)) == 0) {
+      cut(p);
+    }
+    p = line_end == end ? end : line_end + 1;
+  }
+  if (chunk_begin != end) {
+    cut(end);
+  }
+  return hash;
+}
+
+void usps_api_server::ConfigSources::DiffChunks(const Chunks* from,
+                                                const Chunks* to,
+                                                std::vector<Pair>* added,
+                                                std::vector<Pair>* removed) {
+  using Entry = std::pair<std::uint64_t, const std::vector<Pair>*>;
+  auto sorted = [](const Chunks* chunks) {
+    std::vector<Entry> entries;
+    if (chunks != nullptr) {
+      for (const Chunk& chunk : *chunks) {
+        entries.emplace_back(chunk.hash, chunk.pairs.get());
+      }
+    }
+    std::sort(entries.begin(), entries.end());
+    return entries;
+  };
+  std::vector<Entry> a = sorted(from);
+  std::vector<Entry> b = sorted(to);
+  std::size_t i = 0;
+  std::size_t j = 0;
+  while (i < a.size() || j < b.size()) {
+    if (j == b.size() || (i < a.size() && a[i].first < b[j].first)) {
+      removed->insert(removed->end(), a[i].second->begin(),
+                      a[i].second->end());
+      ++i;
+    } else if (i == a.size() || b[j].first < a[i].first) {
+      added->insert(added->end(), b[j].second->begin(), b[j].second->end());
+      ++j;
+    } else {
+      ++i;
+      ++j;
+    }
+  }
+}
@@ -0,0 +1,107 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#ifndef CONFIG_SOURCES_H
+#define CONFIG_SOURCES_H
+
+#include "config_parser.h"
+#include "json/json.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace usps_api_server {
+// The identifier sources of the deny, allow and delay lists as of one load,
+// kept to tell what changed between reloads.
+//
+// A source is one CSV file or the identifiers given inline in the JSON. Each
+// keeps the stat it was read with and its identifiers, split into chunks
+// with a content hash each. Files are cut before lines whose leading bytes
+// hash to a fixed pattern, so an edit only changes the chunks around it, and
+// chunks with a known hash reuse the parsed identifiers of the previous load.
+// Scanning a configuration whose files did not change only costs a stat per
+// file, and an edit to a large file costs one hashing pass over it plus
+// parsing the chunks that changed. As in git, a file whose mtime was within
+// kMtimeGranularityNs of the previous scan's start may have changed again
+// without its stat changing, so it is hashed again.
+class ConfigSources {
+  public:
+    using Pair = std::pair<std::uint64_t, std::uint64_t>;
+    static constexpr int kFilters = 3;
+    // Identifiers to add to and remove from one filter.
+    struct Delta {
+      std::vector<Pair> tunnels_added, tunnels_removed;
+      std::vector<Pair> routings_added, routings_removed;
+      bool empty() const;
+      // Applies the changes to the lists and index of 'filter' in place.
+      // Removals take one pass over the filter's lists, with a binary search
+      // of the removed identifiers per entry, rather than a per-entry
+      // position map that every load would have to build and keep.
+      void Apply(Config::Filter* filter) const;
+    };
+    // Reads the sources referenced by 'root', reusing the identifiers of the
+    // sources in 'previous' (may be null) that did not change.
+    void Scan(const Json::Value& root, const ConfigSources* previous);
+    // Returns true if 'other' was scanned from the same JSON and files.
+    bool Same(const ConfigSources& other) const;
+    // Refills the filters of 'config' from scratch.
+    void Fill(Config* config) const;
+    // Returns, per filter, the changes that turn filters filled from 'from'
+    // into ones filled from these sources.
+    std::vector<Delta> Diff(const ConfigSources& from) const;
+    // Returns the CSV files referenced by 'root'.
+    static std::vector<std::string> Files(const Json::Value& root);
+    // Returns the filters of 'config' in the order of the sources.
+    static Config::Filter* filter(Config* config, int index);
+
+  private:
+    // The four sources of a filter: its CSV files, then the inline lists.
+    enum Kind { TUNNEL_FILE, ROUTE_FILE, TUNNELS, ROUTES, kKinds };
+    // About kChunkLines lines of a source and their identifiers in order.
+    struct Chunk {
+      std::uint64_t hash;
+      std::shared_ptr<const std::vector<Pair>> pairs;
+    };
+    static constexpr std::uint64_t kChunkLines = 256;
+    // The coarsest file timestamp resolution expected, one second.
+    static constexpr std::int64_t kMtimeGranularityNs = 1000000000;
+    using Chunks = std::vector<Chunk>;
+    struct Source {
+      std::string path;
+      std::int64_t mtime = -1;
+      std::int64_t size = -1;
+      std::uint64_t hash = 0;
+      std::shared_ptr<const Chunks> chunks;
+    };
+    static bool IsTunnel(int kind) { return kind == TUNNEL_FILE ||
+                                            kind == TUNNELS; }
+    // Splits 'text' into chunks, reusing those of 'old' (may be null) with
+    // the same hash. Returns the hash of the whole text.
+    static std::uint64_t Split(std::string_view text, const Chunks* old,
+                               Chunks* chunks);
+    // Adds the identifiers of the chunks only in 'to' to 'added' and of
+    // those only in 'from' to 'removed'.
+    static void DiffChunks(const Chunks* from, const Chunks* to,
+                           std::vector<Pair>* added,
+                           std::vector<Pair>* removed);
+    Source sources_[kFilters][kKinds];
+    std::uint64_t root_hash_ = 0;
+    // The wall clock time, in nanoseconds, at which Scan started.
+    std::int64_t scan_start_ = 0;
+};
+}
+
+#endif
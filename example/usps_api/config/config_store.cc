@@ -0,0 +1,193 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#include "config_store.h"
+#include "example/usps_api/utils/metrics.h"
+#include <algorithm>
+#include <chrono>
+
+usps_api_server::ConfigStore::ConfigStore(
+    std::shared_ptr<Config> config,
+    std::vector<FilterSnapshot::Source> sources)
+    : version_(0) {
+  Publish(config);
+  current_stats_ = std::move(sources);
+}
+
+usps_api_server::ConfigStore::~ConfigStore() {
+  StopMonitor();
+}
+
+usps_api_server::ConfigSnapshot usps_api_server::ConfigStore::Load() const {
+  return std::atomic_load_explicit(&config_, std::memory_order_acquire);
+}
+
+void usps_api_server::ConfigStore::Publish(std::shared_ptr<Config> config) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Swap(config, nullptr);
+}
+
+bool usps_api_server::ConfigStore::Reload() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::uint64_t start = Metrics::Now();
+  // Every file is stat'ed before it is read, so the snapshot goes stale if
+  // one changes while loading.
+  std::vector<FilterSnapshot::Source> config_stat =
+      FilterSnapshot::Stat({current_->kFilename});
+  Json::Value root;
+  if (!current_->ReadFile(&root)) {
+    return false;
+  }
+  watched_ = ConfigSources::Files(root);
+  std::vector<FilterSnapshot::Source> stats = FilterSnapshot::Stat(watched_);
+  stats.push_back(config_stat[0]);
+  watched_.push_back(current_->kFilename);
+  std::shared_ptr<ConfigSources> sources = std::make_shared<ConfigSources>();
+  sources->Scan(root, current_sources_.get());
+  if (current_sources_ != nullptr && sources->Same(*current_sources_)) {
+    current_stats_ = std::move(stats);
+    Metrics::Record(Metrics::CONFIG_RELOAD, Metrics::Now() - start);
+    return true;
+  }
+  std::shared_ptr<Config> config;
+  // The spare is only reused once every handler has dropped it; no new one
+  // can load it since it is no longer published.
+  if (spare_ != nullptr && spare_sources_ != nullptr &&
+      spare_.use_count() == 1) {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    config = std::move(spare_);
+    std::vector<ConfigSources::Delta> deltas = sources->Diff(*spare_sources_);
+    for (int f = 0; f < ConfigSources::kFilters; ++f) {
+      deltas[f].Apply(ConfigSources::filter(config.get(), f));
+    }
+  } else {
+    config = std::make_shared<Config>();
+    sources->Fill(config.get());
+  }
+  config->ParseSettings(root);
+  Swap(config, sources);
+  current_stats_ = std::move(stats);
+  Metrics::Record(Metrics::CONFIG_RELOAD, Metrics::Now() - start);
+  return true;
+}
+
+void usps_api_server::ConfigStore::Swap(
+    std::shared_ptr<Config> config,
+    std::shared_ptr<const ConfigSources> sources) {
+  config->version_ = ++version_;
+  spare_ = std::move(current_);
+  spare_sources_ = std::move(current_sources_);
+  current_ = config;
+  current_sources_ = std::move(sources);
+  current_stats_.clear();
+  std::atomic_store_explicit(&config_, std::shared_ptr<const Config>(config),
+                             std::memory_order_release);
+}
+
+void usps_api_server::ConfigStore::SetSnapshot(const std::string& path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  snapshot_ = path;
+}
+
+bool usps_api_server::ConfigStore::WriteSnapshot() {
+  std::string path;
+  std::shared_ptr<const Config> config;
+  std::vector<FilterSnapshot::Source> stats;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    path = snapshot_;
+    config = current_;
+    stats = current_stats_;
+  }
+  return !path.empty() && !stats.empty() &&
+         FilterSnapshot::Write(*config, stats, path);
+}
+
+std::vector<usps_api_server::FilterSnapshot::Source>
+usps_api_server::ConfigStore::StatFiles(const Config& config) {
+  std::vector<FilterSnapshot::Source> config_stat =
+      FilterSnapshot::Stat({config.kFilename});
+  Json::Value root;
+  if (!config.ReadFile(&root)) {
+    return {};
+  }
+  std::vector<FilterSnapshot::Source> stats =
+      FilterSnapshot::Stat(ConfigSources::Files(root));
+  stats.push_back(config_stat[0]);
+  return stats;
+}
+
+void usps_api_server::ConfigStore::MonitorConfig() {
+  if (!monitor_.joinable()) {
+    // Watches are armed before returning so no later change is missed.
+    watcher_.Watch(WatchedFiles());
+    monitor_ = std::thread(&usps_api_server::ConfigStore::FileWatch, this);
+  }
+}
+
+void usps_api_server::ConfigStore::StopMonitor() {
+  watcher_.Stop();
+  if (monitor_.joinable()) {
+    monitor_.join();
+  }
+}
+
+void usps_api_server::ConfigStore::FileWatch() {
+  // A snapshot loaded at startup is checked here, after the server is up.
+  std::string snapshot;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    snapshot = snapshot_;
+  }
+  if (!snapshot.empty() && !FilterSnapshot::Fresh(snapshot, WatchedFiles()) &&
+      Reload()) {
+    WriteSnapshot();
+  }
+  while (watcher_.Wait(-1) == FileWatcher::CHANGED) {
+    // An editor save usually raises several events. Waits until none
+    // arrive for kDebounceMs, or kMaxDebounceMs in total, and reloads once.
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(kMaxDebounceMs);
+    FileWatcher::Event event = FileWatcher::CHANGED;
+    do {
+      auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+          deadline - std::chrono::steady_clock::now()).count();
+      if (left <= 0) {
+        break;
+      }
+      event = watcher_.Wait(std::min<int>(kDebounceMs, left));
+    } while (event == FileWatcher::CHANGED);
+    if (event == FileWatcher::STOPPED) {
+      return;
+    }
+    std::uint64_t version = Load()->version_;
+    if (Reload() && Load()->version_ != version) {
+      WriteSnapshot();
+    }
+    // Renamed-over files are new inodes, and the config may now reference
+    // other files.
+    watcher_.Watch(WatchedFiles());
+  }
+}
+
+std::vector<std::string> usps_api_server::ConfigStore::WatchedFiles() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (watched_.empty()) {
+    Json::Value root;
+    if (current_->ReadFile(&root)) {
+      watched_ = ConfigSources::Files(root);
+    }
+    watched_.push_back(current_->kFilename);
+  }
+  return watched_;
+}
@@ -0,0 +1,114 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#ifndef CONFIG_STORE_H
+#define CONFIG_STORE_H
+
+#include "config_parser.h"
+#include "config_sources.h"
+#include "filter_snapshot.h"
+#include "example/usps_api/utils/file_watcher.h"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace usps_api_server {
+// A published configuration. Snapshots are never modified after they are
+// published, so request handlers can read them without locks.
+using ConfigSnapshot = std::shared_ptr<const Config>;
+
+// Holds the current configuration snapshot and replaces it on reload.
+//
+// Reloads parse into a Config that no handler can see and publish it with an
+// atomic pointer swap. Handlers that loaded the previous snapshot keep it
+// alive through their shared_ptr until they finish, so a reload never
+// changes the configuration underneath an in-flight RPC.
+//
+// Reloads are incremental. The store keeps the snapshot before the current
+// one as a spare, with the sources it was loaded from. Once no handler holds
+// the spare any more, a reload applies the identifiers added to and removed
+// from each source since then to the spare in place and publishes it. Files
+// whose stat and contents did not change are not parsed again. If the spare
+// is still in use, the reload fills a new Config instead. Applying removals
+// still makes one pass over the filter's identifier list, which is cheap
+// next to parsing; see ConfigSources::Delta::Apply.
+class ConfigStore {
+  public:
+    // Reloads wait this long after a file event for the rest of the events
+    // from the same save, but no longer than kMaxDebounceMs after the first
+    // one, so a file that keeps changing is still reloaded.
+    static constexpr int kDebounceMs = 50;
+    static constexpr int kMaxDebounceMs = 500;
+    // 'sources' are the stats of the files 'config' was loaded from, taken
+    // with StatFiles before reading them. Without them no snapshot is
+    // written until the next reload.
+    explicit ConfigStore(std::shared_ptr<Config> config,
+                         std::vector<FilterSnapshot::Source> sources = {});
+    // Returns the current snapshot.
+    ConfigSnapshot Load() const;
+    // Assigns the next version to 'config' and makes it the current snapshot.
+    void Publish(std::shared_ptr<Config> config);
+    // Parses the configuration file into a new snapshot and publishes it.
+    // The current snapshot is kept if the file fails to parse or nothing
+    // changed.
+    bool Reload();
+    // Keeps a filter snapshot at 'path'. FileWatch reloads the filters from
+    // their sources if the snapshot is stale, and rewrites it after every
+    // reload that publishes a new configuration.
+    void SetSnapshot(const std::string& path);
+    // Writes the current filters to the snapshot, with the stats of the files
+    // they were loaded from.
+    bool WriteSnapshot();
+    // Returns the stats of the config file of 'config' and the CSV files it
+    // references, in the order FilterSnapshot::Fresh expects them. The config
+    // file is stat'ed before it is read.
+    static std::vector<FilterSnapshot::Source> StatFiles(const Config& config);
+    // Runs FileWatch on another thread until StopMonitor is called.
+    void MonitorConfig();
+    // Stops the FileWatch thread and waits for it to exit.
+    void StopMonitor();
+    // Reloads the configuration whenever the config file or a CSV file it
+    // references changes, until StopMonitor is called. The files must be
+    // watched already, as MonitorConfig does.
+    void FileWatch();
+    ~ConfigStore();
+  private:
+    // Returns the config file and the CSV files it references.
+    std::vector<std::string> WatchedFiles();
+    // Publishes 'config', loaded from 'sources' (null if unknown), and keeps
+    // the current snapshot as the spare.
+    void Swap(std::shared_ptr<Config> config,
+              std::shared_ptr<const ConfigSources> sources);
+    std::shared_ptr<const Config> config_;
+    std::atomic<std::uint64_t> version_;
+    // Serializes Publish and Reload.
+    std::mutex mutex_;
+    std::shared_ptr<Config> current_;
+    std::shared_ptr<const ConfigSources> current_sources_;
+    // The stats of the files current_ was loaded from, empty if unknown.
+    std::vector<FilterSnapshot::Source> current_stats_;
+    std::shared_ptr<Config> spare_;
+    std::shared_ptr<const ConfigSources> spare_sources_;
+    // The files referenced by the last configuration read.
+    std::vector<std::string> watched_;
+    std::string snapshot_;
+    FileWatcher watcher_;
+    std::thread monitor_;
+};
+}
+
+#endif
@@ -0,0 +1,173 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#include "filter_index.h"
+#include "proto/usps_api/ghost_label.pb.h"
+#include <utility>
+
+// Rebuilds the tunnel table and the routing trie from the given lists.
+void usps_api_server::FilterIndex::Build(
+    const ArenaList<ghost::GhostTunnelIdentifier>& tunnels,
+    const ArenaList<ghost::GhostRoutingIdentifier>& routings) {
+  tunnels_.Reset(tunnels.size());
+  for (const ghost::GhostTunnelIdentifier& tunnel_id : tunnels) {
+    tunnels_.Insert(PackTunnel(tunnel_id));
+  }
+  BuildRoutings(routings);
+}
+
+void usps_api_server::FilterIndex::BuildRoutings(
+    const ArenaList<ghost::GhostRoutingIdentifier>& routings) {
+  std::vector<PrefixTrie::Prefix> prefixes;
+  prefixes.reserve(routings.size());
+  for (const ghost::GhostRoutingIdentifier& routing_id : routings) {
+    const ghost::GhostLabelPrefix& prefix =
+        routing_id.destination_label_prefix();
+    prefixes.push_back(PrefixTrie::Prefix{prefix.value(), prefix.prefix_len()});
+  }
+  routings_.Build(std::move(prefixes));
+}
+
+void usps_api_server::FilterIndex::Insert(
+    const ghost::GhostTunnelIdentifier& tunnel_id) {
+  tunnels_.Insert(PackTunnel(tunnel_id));
+}
+
+void usps_api_server::FilterIndex::Erase(
+    const ghost::GhostTunnelIdentifier& tunnel_id) {
+  tunnels_.Erase(PackTunnel(tunnel_id));
+}
+
+bool usps_api_server::FilterIndex::Contains(
+    const ghost::GhostTunnelIdentifier& tunnel_id) const {
+  return tunnels_.Contains(PackTunnel(tunnel_id));
+}
+
+bool usps_api_server::FilterIndex::Contains(
+    const ghost::GhostRoutingIdentifier& routing_id) const {
+  const ghost::GhostLabelPrefix& prefix = routing_id.destination_label_prefix();
+  return routings_.Covers(prefix.value(), prefix.prefix_len());
+}
+
+std::size_t usps_api_server::FilterIndex::size() const {
+  return tunnels_.size() + routings_.size();
+}
+
+bool usps_api_server::FilterIndex::empty() const {
+  return size() == 0;
+}
+
+usps_api_server::FilterIndex::Key usps_api_server::FilterIndex::PackTunnel(
+    const ghost::GhostTunnelIdentifier& tunnel_id) {
+  return Key{tunnel_id.terminal_label().value(),
+             tunnel_id.service_label().value(),
+             static_cast<std::uint32_t>(tunnel_id.direction())};
+}
+
+// Clears the table and sizes it to keep the load factor at or below 1/2.
+void usps_api_server::FilterIndex::Table::Reset(std::size_t expected) {
+  std::size_t capacity = 16;
+  while (capacity < expected * 2) {
+    capacity <<= 1;
+  }
+  slots_.Assign(std::vector<Slot>(capacity, Slot{Key{0, 0, 0}, 0}));
+  mask_ = capacity - 1;
+  size_ = 0;
+}
+
+void usps_api_server::FilterIndex::Table::Insert(const Key& key) {
+  if (slots_.empty() || (size_ + 1) * 2 > slots_.size()) {
+    // Grows by rehashing every key with its count.
+    std::vector<Slot> old;
+    old.swap(slots_.Mutable());
+    Reset(old.size());
+    std::vector<Slot>& slots = slots_.Mutable();
+    for (const Slot& slot : old) {
+      if (slot.count != 0) {
+        slots[Find(slot.key)] = slot;
+        ++size_;
+      }
+    }
+  }
+  std::vector<Slot>& slots = slots_.Mutable();
+  std::size_t i = Find(key);
+  if (slots[i].count == 0) {
+    slots[i].key = key;
+    ++size_;
+  }
+  ++slots[i].count;
+}
+
+// Drops one occurrence of 'key'. When the last one goes, the following
+// entries of the probe run are shifted back so lookups need no tombstones.
+void usps_api_server::FilterIndex::Table::Erase(const Key& key) {
+  if (size_ == 0) {
+    return;
+  }
+  std::size_t i = Find(key);
+  if (slots_[i].count == 0) {
+    return;
+  }
+  std::vector<Slot>& slots = slots_.Mutable();
+  if (--slots[i].count != 0) {
+    return;
+  }
+  --size_;
+  std::size_t j = i;
+  while (true) {
+    j = (j + 1) & mask_;
+    if (slots[j].count == 0) {
+      break;
+    }
+    // Moves slot j into the hole unless its home lies cyclically in (i, j].
+    std::size_t home = Hash(slots[j].key) & mask_;
+    if (((j - home) & mask_) >= ((j - i) & mask_)) {
+      slots[i] = slots[j];
+      slots[j].count = 0;
+      i = j;
+    }
+  }
+}
+
+bool usps_api_server::FilterIndex::Table::Contains(const Key& key) const {
+  if (size_ == 0) {
+    return false;
+  }
+  return slots_[Find(key)].count != 0;
+}
+
+std::size_t usps_api_server::FilterIndex::Table::Find(const Key& key) const {
+  const Slot* slots = slots_.data();
+  std::size_t i = Hash(key) & mask_;
+  while (slots[i].count != 0 && !Equal(slots[i].key, key)) {
+    i = (i + 1) & mask_;
+  }
+  return i;
+}
+
+bool usps_api_server::FilterIndex::Table::Equal(const Key& a, const Key& b) {
+  return a.first == b.first && a.second == b.second && a.third == b.third;
+}
+
+// Mixes the key words with the splitmix64 finalizer.
+std::uint64_t usps_api_server::FilterIndex::Table::Hash(const Key& key) {
+  std::uint64_t h = key.first * 0x9e3779b97f4a7c15ULL;
+  h ^= key.second + 0x632be59bd9b4e019ULL + (h << 6) + (h >> 2);
+  h ^= static_cast<std::uint64_t>(key.third) << 32;
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111ebULL;
+  h ^= h >> 31;
+  return h;
+}
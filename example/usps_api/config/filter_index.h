@@ -0,0 +1,89 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#ifndef FILTER_INDEX_H
+#define FILTER_INDEX_H
+
+#include "arena_list.h"
+#include "packed_array.h"
+#include "prefix_trie.h"
+#include "proto/usps_api/sfc_filter.pb.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace usps_api_server {
+// A compiled set of identifiers built once per config load and adjusted in
+// place by delta reloads. Tunnel identifiers are packed into fixed-size keys
+// and stored in an open-addressing hash table. Routing identifiers are stored
+// in a prefix trie so that a filter prefix also matches every longer prefix
+// inside it. Lookups never allocate.
+class FilterIndex {
+  public:
+    // Rebuilds the index from the parsed tunnel and routing lists.
+    void Build(const ArenaList<ghost::GhostTunnelIdentifier>& tunnels,
+               const ArenaList<ghost::GhostRoutingIdentifier>& routings);
+    // Adds or removes one occurrence of a tunnel identifier. An identifier
+    // stays in the index until every occurrence is removed.
+    void Insert(const ghost::GhostTunnelIdentifier& tunnel_id);
+    void Erase(const ghost::GhostTunnelIdentifier& tunnel_id);
+    // Rebuilds only the prefix trie from the routing list.
+    void BuildRoutings(const ArenaList<ghost::GhostRoutingIdentifier>& routings);
+    bool Contains(const ghost::GhostTunnelIdentifier& tunnel_id) const;
+    // Returns true if a stored prefix contains the destination_label_prefix.
+    bool Contains(const ghost::GhostRoutingIdentifier& routing_id) const;
+    std::size_t size() const;
+    bool empty() const;
+
+    // A packed tunnel identifier: terminal_label, service_label and
+    // direction.
+    struct Key {
+      std::uint64_t first;
+      std::uint64_t second;
+      std::uint32_t third;
+    };
+    static Key PackTunnel(const ghost::GhostTunnelIdentifier& tunnel_id);
+
+  private:
+    // Linear probing table with a power of two capacity kept at most half
+    // full, so probe sequences stay within one or two cache lines. Each slot
+    // counts the occurrences of its key; a count of 0 marks an empty slot.
+    class Table {
+      public:
+        void Reset(std::size_t expected);
+        void Insert(const Key& key);
+        void Erase(const Key& key);
+        bool Contains(const Key& key) const;
+        std::size_t size() const { return size_; }
+      private:
+        friend class FilterSnapshot;
+        struct Slot {
+          Key key;
+          std::uint32_t count;
+        };
+        static std::uint64_t Hash(const Key& key);
+        static bool Equal(const Key& a, const Key& b);
+        // Returns the slot holding 'key', or the empty slot ending its probe
+        // sequence.
+        std::size_t Find(const Key& key) const;
+        PackedArray<Slot> slots_;
+        std::size_t mask_ = 0;
+        std::size_t size_ = 0;
+    };
+    friend class FilterSnapshot;
+    Table tunnels_;
+    PrefixTrie routings_;
+};
+}
+
+#endif
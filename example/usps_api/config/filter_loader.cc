@@ -0,0 +1,178 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#include "filter_loader.h"
+#include "example/usps_api/utils/file_reader.h"
+#include "proto/usps_api/ghost_label.pb.h"
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+
+namespace {
+// A CSV file to parse into one filter list.
+struct File {
+  std::unique_ptr<FileReader::MappedFile> mapped;
+  usps_api_server::Config::Filter* filter;
+  bool tunnels;
+};
+
+// A line-aligned byte range of a file and the messages parsed from it.
+struct Shard {
+  const File* file;
+  const char* begin;
+  const char* end;
+  std::vector<ghost::GhostTunnelIdentifier*> tunnels;
+  std::vector<ghost::GhostRoutingIdentifier*> routings;
+};
+
+void ParseShard(Shard* shard) {
+  usps_api_server::Config::Filter* filter = shard->file->filter;
+  std::string_view text(shard->begin, shard->end - shard->begin);
+  if (shard->file->tunnels) {
+    google::protobuf::Arena* arena = filter->tunnels.arena();
+    FileReader::ParsePairs(text, [shard, arena](std::uint64_t term,
+                                                std::uint64_t service) {
+      ghost::GhostTunnelIdentifier* tunnel_id = google::protobuf::Arena::
+          CreateMessage<ghost::GhostTunnelIdentifier>(arena);
+      usps_api_server::Config::SetGhostTunnel(term, service, tunnel_id);
+      shard->tunnels.push_back(tunnel_id);
+    });
+  } else {
+    google::protobuf::Arena* arena = filter->routings.arena();
+    FileReader::ParsePairs(text, [shard, arena](std::uint64_t value,
+                                                std::uint64_t len) {
+      ghost::GhostRoutingIdentifier* routing_id = google::protobuf::Arena::
+          CreateMessage<ghost::GhostRoutingIdentifier>(arena);
+      usps_api_server::Config::SetGhostRoute(
+          value, static_cast<std::uint32_t>(len), routing_id);
+      shard->routings.push_back(routing_id);
+    });
+  }
+}
+} // namespace
+
+void usps_api_server::RunParallel(
+    std::size_t tasks, int threads,
+    const std::function<void(std::size_t)>& fn) {
+  std::size_t workers = std::min<std::size_t>(tasks, std::max(threads, 1));
+  if (workers <= 1) {
+    for (std::size_t i = 0; i < tasks; ++i) {
+      fn(i);
+    }
+    return;
+  }
+  std::atomic<std::size_t> next(0);
+  std::vector<std::thread> pool;
+  pool.reserve(workers - 1);
+  auto work = [&next, tasks, &fn]() {
+    for (std::size_t i = next++; i < tasks; i = next++) {
+      fn(i);
+    }
+  };
+  for (std::size_t i = 1; i < workers; ++i) {
+    pool.emplace_back(work);
+  }
+  work();
+  for (std::thread& thread : pool) {
+    thread.join();
+  }
+}
+
+usps_api_server::FilterLoader::FilterLoader(int threads,
+                                            std::size_t min_shard_bytes)
+    : threads_(threads > 0
+                   ? threads
+                   : std::max<int>(std::thread::hardware_concurrency(), 1)),
+      min_shard_bytes_(std::max<std::size_t>(min_shard_bytes, 1)) {}
+
+void usps_api_server::FilterLoader::Add(Config::Filter* filter,
+                                        const Json::Value& root) {
+  jobs_.push_back(Job{filter, root});
+}
+
+void usps_api_server::FilterLoader::Load() {
+  std::vector<File> files;
+  for (const Job& job : jobs_) {
+    job.filter->tunnels.clear();
+    job.filter->routings.clear();
+    std::string tunnel_file =
+        job.root["ghost_tunnel_identifier"].get("file", "").asString();
+    std::string route_file =
+        job.root["ghost_routing_identifier"].get("file", "").asString();
+    if (!tunnel_file.empty()) {
+      files.push_back(File{std::unique_ptr<FileReader::MappedFile>(
+          new FileReader::MappedFile(tunnel_file)), job.filter, true});
+    }
+    if (!route_file.empty()) {
+      files.push_back(File{std::unique_ptr<FileReader::MappedFile>(
+          new FileReader::MappedFile(route_file)), job.filter, false});
+    }
+  }
+  // Splits each file into shards that start just after a newline.
+  std::vector<Shard> shards;
+  for (const File& file : files) {
+    std::string_view data = file.mapped->data();
+    const char* end = data.data() + data.size();
+    std::size_t count = std::max<std::size_t>(
+        std::min<std::size_t>(data.size() / min_shard_bytes_, threads_ * 4),
+        1);
+    const char* begin = data.data();
+    for (std::size_t i = 1; i <= count; ++i) {
+      const char* split = end;
+      if (i < count) {
+        split = data.data() + data.size() * i / count;
+        split = FileReader::FindNewline(std::max(split - 1, begin), end);
+        split = split == end ? end : split + 1;
+      }
+      if (split > begin) {
+        shards.push_back(Shard{&file, begin, split, {}, {}});
+      }
+      begin = split;
+    }
+  }
+  RunParallel(shards.size(), threads_, [&shards](std::size_t i) {
+    ParseShard(&shards[i]);
+  });
+  for (Shard& shard : shards) {
+    for (ghost::GhostTunnelIdentifier* tunnel_id : shard.tunnels) {
+      shard.file->filter->tunnels.AddAllocated(tunnel_id);
+    }
+    for (ghost::GhostRoutingIdentifier* routing_id : shard.routings) {
+      shard.file->filter->routings.AddAllocated(routing_id);
+    }
+  }
+  // Identifiers given inline follow those from the files.
+  for (const Job& job : jobs_) {
+    const Json::Value tunnels =
+        job.root["ghost_tunnel_identifier"]["ghostlabel"];
+    const Json::Value routings =
+        job.root["ghost_routing_identifier"]["destination_label_prefix"];
+    for (unsigned int index = 0; index < tunnels.size(); ++index) {
+      Config::SetGhostTunnel(
+          tunnels[index].get("terminal_label", 0).asUInt64(),
+          tunnels[index].get("service_label", 0).asUInt64(),
+          job.filter->tunnels.Add());
+    }
+    for (unsigned int index = 0; index < routings.size(); ++index) {
+      Config::SetGhostRoute(routings[index].get("value", 0).asUInt64(),
+                            routings[index].get("prefix_len", 0).asUInt(),
+                            job.filter->routings.Add());
+    }
+  }
+  RunParallel(jobs_.size(), threads_, [this](std::size_t i) {
+    jobs_[i].filter->Compile();
+  });
+  jobs_.clear();
+}
@@ -0,0 +1,59 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#ifndef FILTER_LOADER_H
+#define FILTER_LOADER_H
+
+#include "config_parser.h"
+#include "json/json.h"
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace usps_api_server {
+// Runs fn(0) .. fn(tasks - 1) on up to 'threads' threads and waits for them.
+void RunParallel(std::size_t tasks, int threads,
+                 const std::function<void(std::size_t)>& fn);
+
+// Loads the identifier lists of several filters together.
+//
+// Every CSV file referenced by the queued filters is mapped and split into
+// byte-range shards at line boundaries. The shards of all files are parsed
+// on a shared set of threads, each creating its messages directly on the
+// target list's arena. The parsed messages are then appended in file order,
+// followed by the identifiers given inline in the JSON, and the filters are
+// compiled in parallel.
+class FilterLoader {
+  public:
+    // Uses up to 'threads' threads, or one per CPU if 'threads' is 0. Files
+    // are split into shards of at least 'min_shard_bytes'.
+    explicit FilterLoader(int threads = 0,
+                          std::size_t min_shard_bytes = 1 << 20);
+    // Queues 'filter' to be refilled from the identifiers under 'root'.
+    void Add(Config::Filter* filter, const Json::Value& root);
+    // Loads and compiles every queued filter.
+    void Load();
+
+  private:
+    struct Job {
+      Config::Filter* filter;
+      Json::Value root;
+    };
+    std::vector<Job> jobs_;
+    int threads_;
+    std::size_t min_shard_bytes_;
+};
+}
+
+#endif
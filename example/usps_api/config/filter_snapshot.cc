@@ -0,0 +1,238 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#include "filter_snapshot.h"
+#include "example/usps_api/utils/file_reader.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <sys/stat.h>
+
+namespace {
+const char kMagic[8] = {'G', 'H', 'S', 'T', 'F', 'I', 'L', 'T'};
+const std::uint32_t kByteOrder = 0x01020304;
+
+struct Header {
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t byte_order;
+  std::uint64_t file_count;
+};
+
+// Followed by the path, padded to 8 bytes.
+struct FileStamp {
+  std::int64_t mtime;
+  std::int64_t size;
+  std::uint64_t path_size;
+};
+
+// Followed by the slots, nodes and leaves, each padded to 8 bytes.
+struct IndexHeader {
+  std::uint64_t slot_count;
+  std::uint64_t tunnel_count;
+  std::uint64_t node_count;
+  std::uint64_t leaf_count;
+  std::uint64_t prefix_count;
+};
+
+std::size_t Padded(std::size_t size) {
+  return (size + 7) & ~static_cast<std::size_t>(7);
+}
+
+// Reads consecutive sections of a mapped snapshot, checking every bound.
+class Reader {
+  public:
+    explicit Reader(std::string_view data)
+        : p_(data.data()), end_(data.data() + data.size()) {}
+    // Returns the next 'size' bytes, or nullptr if the snapshot is too short.
+    const char* Take(std::size_t size) {
+      if (static_cast<std::size_t>(end_ - p_) < Padded(size)) {
+        return nullptr;
+      }
+      const char* taken = p_;
+      p_ += Padded(size);
+      return taken;
+    }
+    template <typename T>
+    const T* Take(std::size_t count = 1) {
+      if (count > static_cast<std::size_t>(end_ - p_) / sizeof(T)) {
+        return nullptr;
+      }
+      return reinterpret_cast<const T*>(Take(count * sizeof(T)));
+    }
+  private:
+    const char* p_;
+    const char* end_;
+};
+
+// Reads the header and file stamps, calling 'fn(stamp, path)' for each.
+template <typename Fn>
+bool ReadHeader(Reader* reader, Fn fn) {
+  const Header* header = reader->Take<Header>();
+  if (header == nullptr ||
+      std::memcmp(header->magic, kMagic, sizeof(kMagic)) != 0 ||
+      header->version != usps_api_server::FilterSnapshot::kVersion ||
+      header->byte_order != kByteOrder) {
+    return false;
+  }
+  for (std::uint64_t i = 0; i < header->file_count; ++i) {
+    const FileStamp* stamp = reader->Take<FileStamp>();
+    const char* path =
+        stamp != nullptr ? reader->Take(stamp->path_size) : nullptr;
+    if (path == nullptr) {
+      return false;
+    }
+    fn(*stamp, std::string_view(path, stamp->path_size));
+  }
+  return true;
+}
+
+void WriteBytes(std::ofstream* out, const void* data, std::size_t size) {
+  static const char kZeros[8] = {};
+  out->write(static_cast<const char*>(data), size);
+  out->write(kZeros, Padded(size) - size);
+}
+} // namespace
+
+std::vector<usps_api_server::FilterSnapshot::Source>
+usps_api_server::FilterSnapshot::Stat(const std::vector<std::string>& files) {
+  std::vector<Source> sources(files.size());
+  for (std::size_t i = 0; i < files.size(); ++i) {
+    sources[i].path = files[i];
+    struct stat st;
+    if (stat(files[i].c_str(), &st) == 0) {
+      sources[i].mtime =
+          static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+          st.st_mtim.tv_nsec;
+      sources[i].size = st.st_size;
+    }
+  }
+  return sources;
+}
+
+bool usps_api_server::FilterSnapshot::Write(
+    const Config& config, const std::vector<Source>& sources,
+    const std::string& path) {
+  static_assert(sizeof(FilterIndex::Table::Slot) == 32, "slot layout");
+  static_assert(sizeof(PrefixTrie::Node) == 24, "node layout");
+  static_assert(sizeof(PrefixTrie::Leaf) == 2, "leaf layout");
+  std::string temporary = path + ".tmp";
+  std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+  Header header;
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.byte_order = kByteOrder;
+  header.file_count = sources.size();
+  WriteBytes(&out, &header, sizeof(header));
+  for (const Source& source : sources) {
+    FileStamp stamp = {source.mtime, source.size, source.path.size()};
+    WriteBytes(&out, &stamp, sizeof(stamp));
+    WriteBytes(&out, source.path.data(), source.path.size());
+  }
+  for (const Config::Filter* filter :
+       {&config.deny_, &config.allow_, &config.delay_}) {
+    const FilterIndex::Table& table = filter->index.tunnels_;
+    const PrefixTrie& trie = filter->index.routings_;
+    IndexHeader index = {table.slots_.size(), table.size_,
+                         trie.nodes_.size(), trie.leaves_.size(), trie.size_};
+    WriteBytes(&out, &index, sizeof(index));
+    WriteBytes(&out, table.slots_.data(),
+               table.slots_.size() * sizeof(FilterIndex::Table::Slot));
+    WriteBytes(&out, trie.nodes_.data(),
+               trie.nodes_.size() * sizeof(PrefixTrie::Node));
+    WriteBytes(&out, trie.leaves_.data(),
+               trie.leaves_.size() * sizeof(PrefixTrie::Leaf));
+  }
+  out.close();
+  if (!out.good() || std::rename(temporary.c_str(), path.c_str()) != 0) {
+    std::remove(temporary.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool usps_api_server::FilterSnapshot::Load(const std::string& path,
+                                           Config* config) {
+  auto file = std::make_shared<FileReader::MappedFile>(path);
+  if (!file->ok()) {
+    return false;
+  }
+  Reader reader(file->data());
+  if (!ReadHeader(&reader, [](const FileStamp&, std::string_view) {})) {
+    return false;
+  }
+  // Checks every section before pointing any index into the mapping.
+  struct Sections {
+    const IndexHeader* index;
+    const FilterIndex::Table::Slot* slots;
+    const PrefixTrie::Node* nodes;
+    const PrefixTrie::Leaf* leaves;
+  } sections[3];
+  for (Sections& section : sections) {
+    section.index = reader.Take<IndexHeader>();
+    if (section.index == nullptr) {
+      return false;
+    }
+    std::uint64_t slot_count = section.index->slot_count;
+    section.slots = reader.Take<FilterIndex::Table::Slot>(slot_count);
+    section.nodes = reader.Take<PrefixTrie::Node>(section.index->node_count);
+    section.leaves = reader.Take<PrefixTrie::Leaf>(section.index->leaf_count);
+    // The table's capacity must be a power of two for its mask.
+    if (section.slots == nullptr || section.nodes == nullptr ||
+        section.leaves == nullptr || (slot_count & (slot_count - 1)) != 0 ||
+        section.index->tunnel_count > slot_count) {
+      return false;
+    }
+  }
+  Config::Filter* filters[3] = {&config->deny_, &config->allow_,
+                                &config->delay_};
+  for (int f = 0; f < 3; ++f) {
+    FilterIndex::Table& table = filters[f]->index.tunnels_;
+    PrefixTrie& trie = filters[f]->index.routings_;
+    const Sections& section = sections[f];
+    filters[f]->tunnels.clear();
+    filters[f]->routings.clear();
+    table.slots_.View(section.slots, section.index->slot_count, file);
+    table.mask_ = section.index->slot_count != 0
+                      ? section.index->slot_count - 1 : 0;
+    table.size_ = section.index->tunnel_count;
+    trie.nodes_.View(section.nodes, section.index->node_count, file);
+    trie.leaves_.View(section.leaves, section.index->leaf_count, file);
+    trie.size_ = section.index->prefix_count;
+  }
+  return true;
+}
+
+bool usps_api_server::FilterSnapshot::Fresh(
+    const std::string& path, const std::vector<std::string>& files) {
+  FileReader::MappedFile file(path);
+  if (!file.ok()) {
+    return false;
+  }
+  Reader reader(file.data());
+  std::vector<Source> current = Stat(files);
+  std::size_t i = 0;
+  bool fresh = true;
+  bool valid = ReadHeader(&reader, [&](const FileStamp& stamp,
+                                       std::string_view stamp_path) {
+    if (i >= files.size() || stamp_path != files[i]) {
+      fresh = false;
+    } else {
+      fresh = fresh && current[i].mtime == stamp.mtime &&
+              current[i].size == stamp.size;
+    }
+    ++i;
+  });
+  return valid && fresh && i == files.size();
+}
@@ -0,0 +1,63 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#ifndef FILTER_SNAPSHOT_H
+#define FILTER_SNAPSHOT_H
+
+#include "config_parser.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace usps_api_server {
+// A binary snapshot of the compiled deny, allow and delay indexes.
+//
+// The snapshot holds the raw hash table slots and trie nodes of each filter
+// in native byte order, 8-byte aligned, after a header with a version and
+// the stat of every file the filters were loaded from. Loading maps the file
+// and points the indexes into the mapping, so it takes constant time no
+// matter how many identifiers the filters hold; pages are faulted in by
+// lookups. The source files are checked separately with Fresh(), so a server
+// can start serving from the snapshot and revalidate it afterwards.
+//
+// The parsed identifier lists are not stored, so a Config loaded from a
+// snapshot only has its indexes filled.
+class FilterSnapshot {
+  public:
+    static constexpr std::uint32_t kVersion = 1;
+    // The stat of one file the filters were loaded from.
+    struct Source {
+      std::string path;
+      std::int64_t mtime = -1;
+      std::int64_t size = -1;
+    };
+    // Returns the stat of each of 'files', with -1s for missing ones.
+    static std::vector<Source> Stat(const std::vector<std::string>& files);
+    // Writes the indexes of 'config' and 'sources' to 'path'. The sources
+    // must be stat'ed before 'config' read them, so a file changed while
+    // loading leaves the snapshot stale. The snapshot is written to a
+    // temporary file and renamed into place, so readers never map a partial
+    // snapshot.
+    static bool Write(const Config& config, const std::vector<Source>& sources,
+                      const std::string& path);
+    // Points the filter indexes of 'config' into the snapshot at 'path'.
+    // Returns false if it is missing, truncated or of another version.
+    static bool Load(const std::string& path, Config* config);
+    // Returns true if the snapshot at 'path' was written from exactly
+    // 'files' and none of them has changed size or mtime since.
+    static bool Fresh(const std::string& path,
+                      const std::vector<std::string>& files);
+};
+}
+
+#endif
@@ -0,0 +1,77 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#ifndef PACKED_ARRAY_H
+#define PACKED_ARRAY_H
+
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace usps_api_server {
+// An array of plain structs that either owns its elements or views elements
+// stored in a mapped snapshot.
+//
+// Views keep their backing mapping alive and are copied into owned storage
+// the first time they are modified, so a compiled index loaded from a
+// snapshot behaves like one built in memory.
+template <typename T>
+class PackedArray {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "PackedArray elements are stored as raw bytes");
+  public:
+    // Takes ownership of 'items'.
+    void Assign(std::vector<T> items) {
+      owned_ = std::move(items);
+      view_ = nullptr;
+      size_ = owned_.size();
+      backing_.reset();
+    }
+    // Views 'size' elements at 'data', which 'backing' keeps alive.
+    void View(const T* data, std::size_t size,
+              std::shared_ptr<const void> backing) {
+      owned_.clear();
+      view_ = data;
+      size_ = size;
+      backing_ = std::move(backing);
+    }
+    // Returns the owned elements for modification, copying a view first.
+    // Callers that change the size must not hold data() across the call.
+    std::vector<T>& Mutable() {
+      if (backing_ != nullptr) {
+        owned_.assign(view_, view_ + size_);
+        view_ = nullptr;
+        backing_.reset();
+      }
+      return owned_;
+    }
+    const T* data() const {
+      return backing_ != nullptr ? view_ : owned_.data();
+    }
+    std::size_t size() const {
+      return backing_ != nullptr ? size_ : owned_.size();
+    }
+    bool empty() const { return size() == 0; }
+    const T& operator[](std::size_t i) const { return data()[i]; }
+
+  private:
+    std::vector<T> owned_;
+    const T* view_ = nullptr;
+    std::size_t size_ = 0;
+    std::shared_ptr<const void> backing_;
+};
+}
+
+#endif
@@ -0,0 +1,187 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#include "prefix_trie.h"
+#include <algorithm>
+
+namespace {
+// A node waiting to be filled in. Its prefixes are the sorted range
+// [lo, hi), all of which share the upper 'depth' bits.
+struct Pending {
+  std::size_t lo;
+  std::size_t hi;
+  std::uint32_t depth;
+  std::uint32_t node;
+};
+}
+
+constexpr std::uint32_t usps_api_server::PrefixTrie::kLabelBits;
+constexpr std::uint32_t usps_api_server::PrefixTrie::kStride;
+
+// Builds the node and leaf arrays breadth first so that the children of
+// every node end up contiguous.
+void usps_api_server::PrefixTrie::Build(std::vector<Prefix> prefixes) {
+  nodes_.Assign({});
+  leaves_.Assign({});
+  std::vector<Prefix> valid;
+  valid.reserve(prefixes.size());
+  for (const Prefix& prefix : prefixes) {
+    if (prefix.len == 0 || prefix.len > kLabelBits) {
+      continue;
+    }
+    valid.push_back(Prefix{Mask(prefix.value, prefix.len), prefix.len});
+  }
+  std::sort(valid.begin(), valid.end(), [](const Prefix& a, const Prefix& b) {
+    return a.value != b.value ? a.value < b.value : a.len < b.len;
+  });
+  valid.erase(std::unique(valid.begin(), valid.end(),
+                          [](const Prefix& a, const Prefix& b) {
+                            return a.value == b.value && a.len == b.len;
+                          }),
+              valid.end());
+  size_ = valid.size();
+  if (valid.empty()) {
+    return;
+  }
+  std::vector<Node> nodes;
+  std::vector<Leaf> leaves;
+  nodes.push_back(Node{0, 0, 0, 0});
+  std::vector<Pending> queue;
+  queue.push_back(Pending{0, valid.size(), 0, 0});
+  for (std::size_t head = 0; head < queue.size(); ++head) {
+    const Pending pending = queue[head];
+    Leaf slots[64] = {};
+    std::size_t child_lo[64];
+    std::size_t child_hi[64];
+    std::uint64_t children = 0;
+    for (std::size_t i = pending.lo; i < pending.hi; ++i) {
+      const Prefix& prefix = valid[i];
+      // Shorter prefixes were already expanded into an ancestor.
+      if (prefix.len <= pending.depth) {
+        continue;
+      }
+      std::uint32_t chunk = Chunk(prefix.value, pending.depth);
+      if (prefix.len <= pending.depth + kStride) {
+        // Expand the prefix over every slot it covers in this node.
+        std::uint32_t span = 1u << (pending.depth + kStride - prefix.len);
+        for (std::uint32_t slot = chunk; slot < chunk + span; ++slot) {
+          Leaf& leaf = slots[slot];
+          if (leaf.min_len == 0 || prefix.len < leaf.min_len) {
+            leaf.min_len = prefix.len;
+          }
+          if (prefix.len > leaf.max_len) {
+            leaf.max_len = prefix.len;
+          }
+        }
+      } else {
+        if (!(children & (1ULL << chunk))) {
+          children |= 1ULL << chunk;
+          child_lo[chunk] = i;
+        }
+        child_hi[chunk] = i + 1;
+      }
+    }
+    std::uint32_t child_base = nodes.size();
+    for (std::uint32_t chunk = 0; chunk < 64; ++chunk) {
+      if (children & (1ULL << chunk)) {
+        queue.push_back(Pending{child_lo[chunk], child_hi[chunk],
+                                pending.depth + kStride,
+                                static_cast<std::uint32_t>(nodes.size())});
+        nodes.push_back(Node{0, 0, 0, 0});
+      }
+    }
+    // Runs of identical slots share one leaf; a set bit marks a run start.
+    std::uint64_t leaf_bits = 0;
+    std::uint32_t leaf_base = leaves.size();
+    for (std::uint32_t slot = 0; slot < 64; ++slot) {
+      if (slot == 0 || slots[slot].min_len != slots[slot - 1].min_len ||
+          slots[slot].max_len != slots[slot - 1].max_len) {
+        leaf_bits |= 1ULL << slot;
+        leaves.push_back(slots[slot]);
+      }
+    }
+    nodes[pending.node] = Node{children, leaf_bits, child_base, leaf_base};
+  }
+  nodes_.Assign(std::move(nodes));
+  leaves_.Assign(std::move(leaves));
+}
+
+bool usps_api_server::PrefixTrie::Covers(std::uint64_t value,
+                                         std::uint32_t len) const {
+  if (nodes_.empty() || len == 0) {
+    return false;
+  }
+  len = std::min(len, kLabelBits);
+  // Bits past 'len' are zeroed, so the final, partial chunk lands on the
+  // first slot of the range the query spans.
+  value = Mask(value, len);
+  const Node* node = nodes_.data();
+  for (std::uint32_t depth = 0;; depth += kStride) {
+    std::uint32_t chunk = Chunk(value, depth);
+    const Leaf& leaf = LeafAt(*node, chunk);
+    if (leaf.min_len != 0 && leaf.min_len <= len) {
+      return true;
+    }
+    if (len <= depth + kStride || !(node->children & (1ULL << chunk))) {
+      return false;
+    }
+    node = nodes_.data() + node->child_base +
+           __builtin_popcountll(node->children & ((1ULL << chunk) - 1));
+  }
+}
+
+std::uint32_t usps_api_server::PrefixTrie::LongestMatch(
+    std::uint64_t value) const {
+  if (nodes_.empty()) {
+    return 0;
+  }
+  value = Mask(value, kLabelBits);
+  std::uint32_t best = 0;
+  const Node* node = nodes_.data();
+  for (std::uint32_t depth = 0; depth < kLabelBits; depth += kStride) {
+    std::uint32_t chunk = Chunk(value, depth);
+    const Leaf& leaf = LeafAt(*node, chunk);
+    if (leaf.max_len != 0) {
+      best = leaf.max_len;
+    }
+    if (!(node->children & (1ULL << chunk))) {
+      break;
+    }
+    node = nodes_.data() + node->child_base +
+           __builtin_popcountll(node->children & ((1ULL << chunk) - 1));
+  }
+  return best;
+}
+
+std::uint64_t usps_api_server::PrefixTrie::Mask(std::uint64_t value,
+                                                std::uint32_t len) {
+  if (len == 0) {
+    return 0;
+  }
+  len = std::min(len, kLabelBits);
+  std::uint64_t label = value & ((1ULL << kLabelBits) - 1);
+  return label & (((1ULL << len) - 1) << (kLabelBits - len));
+}
+
+// Returns the 6 bits of the label starting 'depth' bits from the top.
+std::uint32_t usps_api_server::PrefixTrie::Chunk(std::uint64_t value,
+                                                 std::uint32_t depth) {
+  return (value >> (kLabelBits - kStride - depth)) & 63;
+}
+
+const usps_api_server::PrefixTrie::Leaf& usps_api_server::PrefixTrie::LeafAt(
+    const Node& node, std::uint32_t slot) const {
+  return leaves_[node.leaf_base +
+                 __builtin_popcountll(node.leaves & (~0ULL >> (63 - slot))) -
+                 1];
+}
@@ -0,0 +1,78 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#ifndef PREFIX_TRIE_H
+#define PREFIX_TRIE_H
+
+#include "packed_array.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace usps_api_server {
+// A read-only, compressed multibit trie over 48-bit Ghost label prefixes.
+//
+// The trie follows the poptrie layout: every node consumes 6 bits of the
+// label and stores a 64-bit child bitmap and a 64-bit leaf bitmap. Children
+// and leaves of a node are stored contiguously, so the index of the next
+// node or leaf is a base offset plus a popcount. A lookup touches at most
+// 8 nodes (48 / 6) and never allocates.
+class PrefixTrie {
+  public:
+    static constexpr std::uint32_t kLabelBits = 48;
+    static constexpr std::uint32_t kStride = 6;
+
+    struct Prefix {
+      std::uint64_t value;
+      std::uint32_t len;
+    };
+
+    // Rebuilds the trie. Prefixes with a length outside [1, 48] are ignored.
+    void Build(std::vector<Prefix> prefixes);
+    // Returns true if some stored prefix contains the prefix 'value'/'len',
+    // i.e. a stored prefix is no longer than 'len' and agrees with 'value'
+    // on all of its bits.
+    bool Covers(std::uint64_t value, std::uint32_t len) const;
+    // Returns the length of the longest stored prefix matching the 48-bit
+    // label 'value', or 0 if none does.
+    std::uint32_t LongestMatch(std::uint64_t value) const;
+    // Number of distinct prefixes stored.
+    std::size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    // Masks 'value' down to its upper 'len' bits of the 48-bit label.
+    static std::uint64_t Mask(std::uint64_t value, std::uint32_t len);
+
+  private:
+    struct Node {
+      std::uint64_t children;
+      std::uint64_t leaves;
+      std::uint32_t child_base;
+      std::uint32_t leaf_base;
+    };
+    // Shortest and longest prefix, among those ending in the node, covering
+    // a slot. Zero means no prefix covers the slot.
+    struct Leaf {
+      std::uint8_t min_len;
+      std::uint8_t max_len;
+    };
+    static std::uint32_t Chunk(std::uint64_t value, std::uint32_t depth);
+    const Leaf& LeafAt(const Node& node, std::uint32_t slot) const;
+    friend class FilterSnapshot;
+    PackedArray<Node> nodes_;
+    PackedArray<Leaf> leaves_;
+    std::size_t size_ = 0;
+};
+}
+
+#endif
@@ -0,0 +1,440 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#include "aes.h"
+#include <algorithm>
+#include <cstring>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define AES_TARGET __attribute__((target("aes,pclmul,ssse3,sse4.1")))
+#endif
+
+constexpr std::size_t usps_api_server::AesKey::kBlock;
+
+#if defined(__x86_64__)
+namespace {
+constexpr std::size_t kLanes = 8;
+constexpr std::size_t kBlock = usps_api_server::AesKey::kBlock;
+
+AES_TARGET inline __m128i Load(const std::uint8_t* p) {
+  return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+}
+
+AES_TARGET inline void Store(std::uint8_t* p, __m128i value) {
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(p), value);
+}
+
+// Builds block 'i' of a counter-mode job in a register; 'base' is the
+// job's counter block as loaded. Assembling it in memory byte by byte
+// stalls the load that follows.
+AES_TARGET inline __m128i CounterBlock(const usps_api_server::CtrJob& job,
+                                       __m128i base, std::uint32_t i) {
+  if (job.wide) {
+    std::uint64_t high = __builtin_bswap64(
+        static_cast<std::uint64_t>(_mm_extract_epi64(base, 0)));
+    std::uint64_t low = __builtin_bswap64(
+        static_cast<std::uint64_t>(_mm_extract_epi64(base, 1)));
+    std::uint64_t sum = low + job.start + i;
+    return _mm_set_epi64x(
+        static_cast<long long>(__builtin_bswap64(sum)),
+        static_cast<long long>(__builtin_bswap64(high + (sum < low ? 1 : 0))));
+  }
+  return _mm_insert_epi32(
+      base, static_cast<int>(__builtin_bswap32(job.start + i)), 3);
+}
+
+AES_TARGET inline __m128i ByteSwap(__m128i value) {
+  return _mm_shuffle_epi8(
+      value, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+// Runs each round over all 'count' blocks before the next, so up to
+// kLanes independent aesenc are in flight.
+AES_TARGET inline void EncryptBlocks(const std::uint8_t (*keys)[16],
+                                     int rounds, __m128i* blocks,
+                                     std::size_t count) {
+  __m128i key = _mm_load_si128(reinterpret_cast<const __m128i*>(keys[0]));
+  for (std::size_t i = 0; i < count; ++i) {
+    blocks[i] = _mm_xor_si128(blocks[i], key);
+  }
+  for (int round = 1; round < rounds; ++round) {
+    key = _mm_load_si128(reinterpret_cast<const __m128i*>(keys[round]));
+    for (std::size_t i = 0; i < count; ++i) {
+      blocks[i] = _mm_aesenc_si128(blocks[i], key);
+    }
+  }
+  key = _mm_load_si128(reinterpret_cast<const __m128i*>(keys[rounds]));
+  for (std::size_t i = 0; i < count; ++i) {
+    blocks[i] = _mm_aesenclast_si128(blocks[i], key);
+  }
+}
+
+AES_TARGET inline void DecryptBlocks(const std::uint8_t (*keys)[16],
+                                     int rounds, __m128i* blocks,
+                                     std::size_t count) {
+  __m128i key = _mm_load_si128(reinterpret_cast<const __m128i*>(keys[0]));
+  for (std::size_t i = 0; i < count; ++i) {
+    blocks[i] = _mm_xor_si128(blocks[i], key);
+  }
+  for (int round = 1; round < rounds; ++round) {
+    key = _mm_load_si128(reinterpret_cast<const __m128i*>(keys[round]));
+    for (std::size_t i = 0; i < count; ++i) {
+      blocks[i] = _mm_aesdec_si128(blocks[i], key);
+    }
+  }
+  key = _mm_load_si128(reinterpret_cast<const __m128i*>(keys[rounds]));
+  for (std::size_t i = 0; i < count; ++i) {
+    blocks[i] = _mm_aesdeclast_si128(blocks[i], key);
+  }
+}
+
+// Encrypts the counter 'blocks' and XORs them into 'lengths' bytes at 'out'.
+AES_TARGET void XorStream(const std::uint8_t (*keys)[16], int rounds,
+                          __m128i* blocks, std::uint8_t* const* out,
+                          const std::size_t* lengths, std::size_t lanes) {
+  EncryptBlocks(keys, rounds, blocks, lanes);
+  for (std::size_t l = 0; l < lanes; ++l) {
+    if (lengths[l] == 16) {
+      Store(out[l], _mm_xor_si128(Load(out[l]), blocks[l]));
+    } else {
+      alignas(16) std::uint8_t stream[16];
+      Store(stream, blocks[l]);
+      for (std::size_t b = 0; b < lengths[l]; ++b) {
+        out[l][b] ^= stream[b];
+      }
+    }
+  }
+}
+
+// Decrypts 'blocks' and stores each XORed with its 'chain' value at 'out'.
+AES_TARGET void DecryptChained(const std::uint8_t (*keys)[16], int rounds,
+                               __m128i* blocks, const __m128i* chain,
+                               std::uint8_t* const* out, std::size_t lanes) {
+  DecryptBlocks(keys, rounds, blocks, lanes);
+  for (std::size_t l = 0; l < lanes; ++l) {
+    Store(out[l], _mm_xor_si128(blocks[l], chain[l]));
+  }
+}
+
+AES_TARGET std::uint32_t SubWord(std::uint32_t word) {
+  return static_cast<std::uint32_t>(_mm_cvtsi128_si32(_mm_aeskeygenassist_si128(
+      _mm_set_epi32(0, 0, static_cast<int>(word), 0), 0)));
+}
+
+// Multiplies byte-reversed elements of GF(2^128) as GCM defines it, with
+// carry-less multiplication and the reduction from Intel's "Carry-Less
+// Multiplication and Its Usage for Computing the GCM Mode".
+AES_TARGET inline __m128i GfMul(__m128i a, __m128i b) {
+  __m128i low = _mm_clmulepi64_si128(a, b, 0x00);
+  __m128i middle = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10),
+                                 _mm_clmulepi64_si128(a, b, 0x01));
+  __m128i high = _mm_clmulepi64_si128(a, b, 0x11);
+  low = _mm_xor_si128(low, _mm_slli_si128(middle, 8));
+  high = _mm_xor_si128(high, _mm_srli_si128(middle, 8));
+  // Shifts the 256-bit product left by one bit.
+  __m128i low_carry = _mm_srli_epi32(low, 31);
+  __m128i high_carry = _mm_srli_epi32(high, 31);
+  low = _mm_slli_epi32(low, 1);
+  high = _mm_slli_epi32(high, 1);
+  __m128i cross = _mm_srli_si128(low_carry, 12);
+  high_carry = _mm_slli_si128(high_carry, 4);
+  low_carry = _mm_slli_si128(low_carry, 4);
+  low = _mm_or_si128(low, low_carry);
+  high = _mm_or_si128(_mm_or_si128(high, high_carry), cross);
+  // Reduces modulo x^128 + x^7 + x^2 + x + 1.
+  __m128i a1 = _mm_slli_epi32(low, 31);
+  __m128i a2 = _mm_slli_epi32(low, 30);
+  __m128i a3 = _mm_slli_epi32(low, 25);
+  a1 = _mm_xor_si128(_mm_xor_si128(a1, a2), a3);
+  __m128i carried = _mm_srli_si128(a1, 4);
+  low = _mm_xor_si128(low, _mm_slli_si128(a1, 12));
+  __m128i b1 = _mm_srli_epi32(low, 1);
+  __m128i b2 = _mm_srli_epi32(low, 2);
+  __m128i b3 = _mm_srli_epi32(low, 7);
+  b1 = _mm_xor_si128(_mm_xor_si128(b1, b2), _mm_xor_si128(b3, carried));
+  low = _mm_xor_si128(low, b1);
+  return _mm_xor_si128(high, low);
+}
+
+// Absorbs 'data' into the byte-reversed GHASH state 'y', zero-padding a
+// partial last block.
+AES_TARGET inline __m128i GhashAbsorb(const std::uint8_t (*powers)[16],
+                                      __m128i y, const std::uint8_t* data,
+                                      std::size_t length) {
+  __m128i h1 = _mm_load_si128(reinterpret_cast<const __m128i*>(powers[0]));
+  __m128i h2 = _mm_load_si128(reinterpret_cast<const __m128i*>(powers[1]));
+  __m128i h3 = _mm_load_si128(reinterpret_cast<const __m128i*>(powers[2]));
+  __m128i h4 = _mm_load_si128(reinterpret_cast<const __m128i*>(powers[3]));
+  // ((((y + x1)H + x2)H + x3)H + x4)H, with the four products independent.
+  for (; length >= 64; data += 64, length -= 64) {
+    __m128i x1 = _mm_xor_si128(y, ByteSwap(Load(data)));
+    __m128i x2 = ByteSwap(Load(data + 16));
+    __m128i x3 = ByteSwap(Load(data + 32));
+    __m128i x4 = ByteSwap(Load(data + 48));
+    y = _mm_xor_si128(_mm_xor_si128(GfMul(x1, h4), GfMul(x2, h3)),
+                      _mm_xor_si128(GfMul(x3, h2), GfMul(x4, h1)));
+  }
+  for (; length >= 16; data += 16, length -= 16) {
+    y = GfMul(_mm_xor_si128(y, ByteSwap(Load(data))), h1);
+  }
+  if (length > 0) {
+    alignas(16) std::uint8_t last[16] = {};
+    std::memcpy(last, data, length);
+    y = GfMul(_mm_xor_si128(y, ByteSwap(Load(last))), h1);
+  }
+  return y;
+}
+
+void StoreBig64(std::uint8_t* p, std::uint64_t value) {
+  for (int i = 7; i >= 0; --i) {
+    p[i] = static_cast<std::uint8_t>(value);
+    value >>= 8;
+  }
+}
+
+// Doubles 'in' in GF(2^128) as CMAC subkey generation does.
+void Double(const std::uint8_t* in, std::uint8_t* out) {
+  std::uint8_t carry = 0;
+  for (int i = 15; i >= 0; --i) {
+    out[i] = static_cast<std::uint8_t>(in[i] << 1 | carry);
+    carry = in[i] >> 7;
+  }
+  if (in[0] & 0x80) {
+    out[15] ^= 0x87;
+  }
+}
+
+// A CBC-MAC job being run in a lane.
+struct MacLane {
+  usps_api_server::MacJob* job;
+  std::size_t block;
+  std::size_t blocks;
+  __m128i state;
+};
+
+std::size_t MacBlocks(const usps_api_server::MacJob& job) {
+  std::size_t blocks = job.prefix_blocks + (job.length + 15) / 16;
+  if (blocks == 0 && job.padding == usps_api_server::MacJob::CMAC) {
+    return 1;
+  }
+  return blocks;
+}
+}
+
+bool usps_api_server::AesKey::Supported() {
+  static const bool supported =
+      __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul") &&
+      __builtin_cpu_supports("ssse3") && __builtin_cpu_supports("sse4.1");
+  return supported;
+}
+
+// Expands the key as FIPS 197 does, with aeskeygenassist for SubWord.
+AES_TARGET bool usps_api_server::AesKey::Init(const std::string& key) {
+  if ((key.size() != 16 && key.size() != 24 && key.size() != 32) ||
+      !Supported()) {
+    return false;
+  }
+  std::size_t words = key.size() / 4;
+  rounds_ = static_cast<int>(words) + 6;
+  std::uint32_t w[60];
+  std::memcpy(w, key.data(), key.size());
+  std::uint32_t rcon = 1;
+  for (std::size_t i = words; i < 4 * (rounds_ + 1u); ++i) {
+    std::uint32_t t = w[i - 1];
+    if (i % words == 0) {
+      t = SubWord(t >> 8 | t << 24) ^ rcon;
+      rcon <<= 1;
+      if (rcon & 0x100) {
+        rcon ^= 0x11b;
+      }
+    } else if (words > 6 && i % words == 4) {
+      t = SubWord(t);
+    }
+    w[i] = w[i - words] ^ t;
+  }
+  std::memcpy(encrypt_, w, kBlock * (rounds_ + 1));
+  std::memcpy(decrypt_[0], encrypt_[rounds_], kBlock);
+  for (int round = 1; round < rounds_; ++round) {
+    Store(decrypt_[round], _mm_aesimc_si128(Load(encrypt_[rounds_ - round])));
+  }
+  std::memcpy(decrypt_[rounds_], encrypt_[0], kBlock);
+
+  // CMAC and GHASH both start from the encryption of the zero block.
+  __m128i zero = _mm_setzero_si128();
+  EncryptBlocks(encrypt_, rounds_, &zero, 1);
+  alignas(16) std::uint8_t l[kBlock];
+  Store(l, zero);
+  Double(l, cmac_[0]);
+  Double(cmac_[0], cmac_[1]);
+  __m128i h = ByteSwap(zero);
+  __m128i power = h;
+  for (int i = 0; i < 4; ++i) {
+    Store(ghash_[i], power);
+    power = GfMul(power, h);
+  }
+  return true;
+}
+
+AES_TARGET void usps_api_server::AesKernels::Ctr(const AesKey& key,
+                                                 const CtrJob* jobs,
+                                                 std::size_t count) {
+  __m128i blocks[kLanes];
+  std::uint8_t* out[kLanes];
+  std::size_t lengths[kLanes];
+  std::size_t lanes = 0;
+  for (std::size_t j = 0; j < count; ++j) {
+    const CtrJob& job = jobs[j];
+    __m128i base = Load(job.counter);
+    std::uint32_t i = 0;
+    for (std::size_t offset = 0; offset < job.length; offset += kBlock, ++i) {
+      blocks[lanes] = CounterBlock(job, base, i);
+      out[lanes] = job.data + offset;
+      lengths[lanes] = std::min(kBlock, job.length - offset);
+      if (++lanes == kLanes) {
+        XorStream(key.encrypt_, key.rounds_, blocks, out, lengths, lanes);
+        lanes = 0;
+      }
+    }
+  }
+  XorStream(key.encrypt_, key.rounds_, blocks, out, lengths, lanes);
+}
+
+// Keeps up to kLanes jobs chaining side by side, starting the next job in
+// a lane as soon as its job finishes.
+AES_TARGET void usps_api_server::AesKernels::Mac(const AesKey& key,
+                                                 MacJob* jobs,
+                                                 std::size_t count) {
+  MacLane lanes[kLanes];
+  std::size_t active = 0;
+  std::size_t next = 0;
+  while (true) {
+    while (active < kLanes && next < count) {
+      MacJob* job = &jobs[next++];
+      std::size_t blocks = MacBlocks(*job);
+      if (blocks > 0) {
+        lanes[active++] = MacLane{job, 0, blocks, Load(job->state)};
+      }
+    }
+    if (active == 0) {
+      return;
+    }
+    __m128i blocks[kLanes];
+    for (std::size_t l = 0; l < active; ++l) {
+      const MacLane& lane = lanes[l];
+      const MacJob& job = *lane.job;
+      bool last = lane.block + 1 == lane.blocks;
+      __m128i block;
+      bool complete = true;
+      if (lane.block < job.prefix_blocks) {
+        block = Load(job.prefix + kBlock * lane.block);
+      } else {
+        std::size_t offset = kBlock * (lane.block - job.prefix_blocks);
+        std::size_t remaining = job.length - offset;
+        if (remaining >= kBlock) {
+          block = Load(job.data + offset);
+        } else {
+          alignas(16) std::uint8_t padded[kBlock] = {};
+          std::memcpy(padded, job.data + offset, remaining);
+          if (job.padding == MacJob::CMAC) {
+            padded[remaining] = 0x80;
+          }
+          block = Load(padded);
+          complete = false;
+        }
+      }
+      if (last && job.padding == MacJob::CMAC) {
+        block = _mm_xor_si128(block,
+                              Load(complete ? key.cmac_[0] : key.cmac_[1]));
+      }
+      blocks[l] = _mm_xor_si128(lane.state, block);
+    }
+    EncryptBlocks(key.encrypt_, key.rounds_, blocks, active);
+    std::size_t kept = 0;
+    for (std::size_t l = 0; l < active; ++l) {
+      MacLane lane = lanes[l];
+      lane.state = blocks[l];
+      if (lane.job->write_back) {
+        Store(lane.job->data + kBlock * (lane.block - lane.job->prefix_blocks),
+              lane.state);
+      }
+      if (++lane.block == lane.blocks) {
+        Store(lane.job->state, lane.state);
+      } else {
+        lanes[kept++] = lane;
+      }
+    }
+    active = kept;
+  }
+}
+
+// Each block is loaded, and kept as the next block's chaining value, before
+// any output is stored, so decryption can run in place.
+AES_TARGET void usps_api_server::AesKernels::CbcDecrypt(const AesKey& key,
+                                                        const CbcJob* jobs,
+                                                        std::size_t count) {
+  __m128i blocks[kLanes];
+  __m128i chain[kLanes];
+  std::uint8_t* out[kLanes];
+  std::size_t lanes = 0;
+  for (std::size_t j = 0; j < count; ++j) {
+    __m128i previous = Load(jobs[j].iv);
+    for (std::size_t offset = 0; offset + kBlock <= jobs[j].length;
+         offset += kBlock) {
+      blocks[lanes] = Load(jobs[j].data + offset);
+      chain[lanes] = previous;
+      previous = blocks[lanes];
+      out[lanes] = jobs[j].data + offset;
+      if (++lanes == kLanes) {
+        DecryptChained(key.decrypt_, key.rounds_, blocks, chain, out, lanes);
+        lanes = 0;
+      }
+    }
+  }
+  DecryptChained(key.decrypt_, key.rounds_, blocks, chain, out, lanes);
+}
+
+AES_TARGET void usps_api_server::AesKernels::Ghash(
+    const AesKey& key, const std::uint8_t* aad, std::size_t aad_length,
+    const std::uint8_t* data, std::size_t length, std::uint8_t* out) {
+  __m128i y = GhashAbsorb(key.ghash_, _mm_setzero_si128(), aad, aad_length);
+  y = GhashAbsorb(key.ghash_, y, data, length);
+  alignas(16) std::uint8_t lengths[kBlock];
+  StoreBig64(lengths, static_cast<std::uint64_t>(aad_length) * 8);
+  StoreBig64(lengths + 8, static_cast<std::uint64_t>(length) * 8);
+  y = GfMul(_mm_xor_si128(y, ByteSwap(Load(lengths))),
+            _mm_load_si128(reinterpret_cast<const __m128i*>(key.ghash_[0])));
+  Store(out, ByteSwap(y));
+}
+#else
+bool usps_api_server::AesKey::Supported() {
+  return false;
+}
+
+bool usps_api_server::AesKey::Init(const std::string& key) {
+  return false;
+}
+
+void usps_api_server::AesKernels::Ctr(const AesKey& key, const CtrJob* jobs,
+                                      std::size_t count) {}
+
+void usps_api_server::AesKernels::Mac(const AesKey& key, MacJob* jobs,
+                                      std::size_t count) {}
+
+void usps_api_server::AesKernels::CbcDecrypt(const AesKey& key,
+                                             const CbcJob* jobs,
+                                             std::size_t count) {}
+
+void usps_api_server::AesKernels::Ghash(
+    const AesKey& key, const std::uint8_t* aad, std::size_t aad_length,
+    const std::uint8_t* data, std::size_t length, std::uint8_t* out) {}
+#endif
@@ -0,0 +1,104 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#ifndef AES_H
+#define AES_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace usps_api_server {
+// An AES key expanded for AES-NI, with everything the cipher modes derive
+// from it: decryption round keys, CMAC subkeys and powers of the GHASH key.
+// Expanding once when an SFC is installed keeps it off the packet path.
+//
+// The functions below process many packets at once. AES-NI has several
+// cycles of latency per round but can start a round every cycle, so blocks
+// are encrypted eight at a time, taken from as many packets as needed.
+// Modes that chain blocks within a packet, such as CBC encryption and
+// CBC-MAC, run eight packets side by side instead.
+class AesKey {
+  public:
+    static constexpr std::size_t kBlock = 16;
+    // Returns true if the CPU has AES-NI and PCLMULQDQ.
+    static bool Supported();
+    // Expands 'key'. Returns false if it is not 16, 24 or 32 bytes or the
+    // CPU is not supported.
+    bool Init(const std::string& key);
+    int rounds() const { return rounds_; }
+
+  private:
+    friend class AesKernels;
+    alignas(16) std::uint8_t encrypt_[15][kBlock];
+    alignas(16) std::uint8_t decrypt_[15][kBlock];
+    // CMAC subkeys K1 and K2.
+    alignas(16) std::uint8_t cmac_[2][kBlock];
+    // H^1 to H^4 byte-reversed, for GHASH four blocks at a time.
+    alignas(16) std::uint8_t ghash_[4][kBlock];
+    int rounds_ = 0;
+};
+
+// XORs a counter-mode keystream into 'data'. Block i of the stream
+// encrypts 'counter' with its last four bytes replaced by the big-endian
+// 'start + i', or with 'start + i' added to all 128 bits if 'wide'.
+struct CtrJob {
+  std::uint8_t counter[AesKey::kBlock];
+  std::uint32_t start;
+  bool wide;
+  std::uint8_t* data;
+  std::size_t length;
+};
+
+// A CBC-MAC over up to two 'prefix' blocks followed by 'data'. 'state'
+// holds the IV on entry and the MAC on return.
+struct MacJob {
+  enum Padding {
+    // Zero-pads a partial last block, as CCM does.
+    ZERO,
+    // Pads and masks the last block with the CMAC subkeys.
+    CMAC,
+  };
+  std::uint8_t prefix[2 * AesKey::kBlock];
+  std::size_t prefix_blocks;
+  std::uint8_t* data;
+  std::size_t length;
+  Padding padding;
+  // Stores each chained block over 'data', which makes this CBC
+  // encryption of whole blocks.
+  bool write_back;
+  std::uint8_t state[AesKey::kBlock];
+};
+
+// CBC decryption of whole blocks in place.
+struct CbcJob {
+  std::uint8_t iv[AesKey::kBlock];
+  std::uint8_t* data;
+  std::size_t length;
+};
+
+// The kernels behind the cipher stage, for keys whose Init succeeded.
+class AesKernels {
+  public:
+    static void Ctr(const AesKey& key, const CtrJob* jobs, std::size_t count);
+    static void Mac(const AesKey& key, MacJob* jobs, std::size_t count);
+    static void CbcDecrypt(const AesKey& key, const CbcJob* jobs,
+                           std::size_t count);
+    // Writes GHASH_H(aad, data) to 'out'.
+    static void Ghash(const AesKey& key, const std::uint8_t* aad,
+                      std::size_t aad_length, const std::uint8_t* data,
+                      std::size_t length, std::uint8_t* out);
+};
+}
+
+#endif
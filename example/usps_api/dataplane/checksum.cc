@@ -0,0 +1,169 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#include "checksum.h"
+#include <cstring>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define AVX2_TARGET __attribute__((target("avx2")))
+#endif
+
+namespace {
+// Sums are accumulated from native-order loads and converted once at the
+// end, which RFC 1071 shows gives the byte-swapped sum on little-endian
+// machines.
+std::uint16_t ToBigEndian(std::uint16_t sum) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  return __builtin_bswap16(sum);
+#else
+  return sum;
+#endif
+}
+
+// Adds the words of 'data' as 32-bit native loads, which fold to the same
+// sum as the 16-bit words they hold.
+std::uint64_t NativeSum(const std::uint8_t* data, std::size_t length) {
+  std::uint64_t sum = 0;
+  std::size_t i = 0;
+  for (; i + 4 <= length; i += 4) {
+    std::uint32_t word;
+    std::memcpy(&word, data + i, sizeof(word));
+    sum += word;
+  }
+  if (i + 2 <= length) {
+    std::uint16_t word;
+    std::memcpy(&word, data + i, sizeof(word));
+    sum += word;
+    i += 2;
+  }
+  if (i < length) {
+    // The odd byte is the first of a zero-padded word.
+    std::uint8_t last[2] = {data[i], 0};
+    std::uint16_t word;
+    std::memcpy(&word, last, sizeof(word));
+    sum += word;
+  }
+  return sum;
+}
+} // namespace
+
+std::uint16_t usps_api_server::Checksum::Sum(const std::uint8_t* data,
+                                             std::size_t length) {
+  using SumFn = std::uint16_t (*)(const std::uint8_t*, std::size_t);
+  static const SumFn sum = Avx2Supported() ? SumAvx2 : SumScalar;
+  return sum(data, length);
+}
+
+std::uint16_t usps_api_server::Checksum::SumScalar(const std::uint8_t* data,
+                                                   std::size_t length) {
+  return ToBigEndian(Fold(NativeSum(data, length)));
+}
+
+std::uint16_t usps_api_server::Checksum::Combine(std::uint16_t first,
+                                                 std::uint16_t second,
+                                                 std::size_t offset) {
+  if (offset % 2 != 0) {
+    second = __builtin_bswap16(second);
+  }
+  return Fold(static_cast<std::uint64_t>(first) + second);
+}
+
+std::uint16_t usps_api_server::Checksum::Fold(std::uint64_t sum) {
+  sum = (sum & 0xffffffff) + (sum >> 32);
+  sum = (sum & 0xffffffff) + (sum >> 32);
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum = (sum & 0xffff) + (sum >> 16);
+  return static_cast<std::uint16_t>(sum);
+}
+
+// HC' = ~(~HC + ~m + m'). Unlike HC' = HC - ~m - m' (eqn. 2) it cannot
+// turn a checksum of 0xffff into 0.
+std::uint16_t usps_api_server::Checksum::Update16(std::uint16_t checksum,
+                                                  std::uint16_t old_value,
+                                                  std::uint16_t new_value) {
+  std::uint64_t sum = static_cast<std::uint16_t>(~checksum);
+  sum += static_cast<std::uint16_t>(~old_value);
+  sum += new_value;
+  return static_cast<std::uint16_t>(~Fold(sum));
+}
+
+std::uint16_t usps_api_server::Checksum::Update32(std::uint16_t checksum,
+                                                  std::uint32_t old_value,
+                                                  std::uint32_t new_value) {
+  std::uint64_t sum = static_cast<std::uint16_t>(~checksum);
+  sum += static_cast<std::uint16_t>(~(old_value >> 16));
+  sum += static_cast<std::uint16_t>(~old_value);
+  sum += new_value >> 16;
+  sum += new_value & 0xffff;
+  return static_cast<std::uint16_t>(~Fold(sum));
+}
+
+#if defined(__x86_64__)
+bool usps_api_server::Checksum::Avx2Supported() {
+  static const bool supported = __builtin_cpu_supports("avx2");
+  return supported;
+}
+
+// Splits every 32-bit lane into its two words and adds them into separate
+// 32-bit accumulators, four of them for two 32-byte loads a step so no add
+// waits on another. A lane gains under 2^16 a step, so the accumulators are
+// emptied into a 64-bit sum every kSteps steps, before they can carry out.
+AVX2_TARGET std::uint16_t usps_api_server::Checksum::SumAvx2(
+    const std::uint8_t* data, std::size_t length) {
+  constexpr std::size_t kStep = 64;
+  constexpr std::size_t kSteps = 1 << 15;
+  const __m256i low_words = _mm256_set1_epi32(0xffff);
+  const __m256i zero = _mm256_setzero_si256();
+  std::uint64_t sum = 0;
+  std::size_t i = 0;
+  while (i + kStep <= length) {
+    __m256i accumulators[4] = {zero, zero, zero, zero};
+    for (std::size_t step = 0; step < kSteps && i + kStep <= length;
+         ++step, i += kStep) {
+      __m256i a =
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+      __m256i b =
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + 32));
+      accumulators[0] =
+          _mm256_add_epi32(accumulators[0], _mm256_and_si256(a, low_words));
+      accumulators[1] =
+          _mm256_add_epi32(accumulators[1], _mm256_srli_epi32(a, 16));
+      accumulators[2] =
+          _mm256_add_epi32(accumulators[2], _mm256_and_si256(b, low_words));
+      accumulators[3] =
+          _mm256_add_epi32(accumulators[3], _mm256_srli_epi32(b, 16));
+    }
+    // Widens the lanes to 64 bits before adding them across.
+    __m256i lanes = zero;
+    for (const __m256i& accumulator : accumulators) {
+      lanes = _mm256_add_epi64(lanes, _mm256_unpacklo_epi32(accumulator, zero));
+      lanes = _mm256_add_epi64(lanes, _mm256_unpackhi_epi32(accumulator, zero));
+    }
+    __m128i half = _mm_add_epi64(_mm256_castsi256_si128(lanes),
+                                 _mm256_extracti128_si256(lanes, 1));
+    sum += static_cast<std::uint64_t>(_mm_cvtsi128_si64(half)) +
+           static_cast<std::uint64_t>(_mm_extract_epi64(half, 1));
+  }
+  sum += NativeSum(data + i, length - i);
+  return ToBigEndian(Fold(sum));
+}
+#else
+bool usps_api_server::Checksum::Avx2Supported() {
+  return false;
+}
+
+std::uint16_t usps_api_server::Checksum::SumAvx2(const std::uint8_t* data,
+                                                 std::size_t length) {
+  return SumScalar(data, length);
+}
+#endif
@@ -0,0 +1,58 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace usps_api_server {
+// Internet checksum arithmetic (RFC 1071). A sum is the ones-complement sum
+// of the data as big-endian 16-bit words, an odd last byte padded with
+// zero, folded to 16 bits; a checksum is its complement.
+//
+// Headers built from templates are checksummed incrementally (RFC 1624)
+// from the template's checksum. Payloads are summed whole, with AVX2 when
+// the CPU has it: ones-complement addition is commutative, so the words are
+// added in 32-bit lanes in any order and folded at the end.
+class Checksum {
+  public:
+    // Returns the sum of 'length' bytes at 'data' with the fastest kernel
+    // the CPU supports.
+    static std::uint16_t Sum(const std::uint8_t* data, std::size_t length);
+    static std::uint16_t SumScalar(const std::uint8_t* data,
+                                   std::size_t length);
+    // Requires Avx2Supported().
+    static std::uint16_t SumAvx2(const std::uint8_t* data, std::size_t length);
+    static bool Avx2Supported();
+    // Returns the sum of data summing to 'first' followed by data summing
+    // to 'second' that starts 'offset' bytes in. An odd offset swaps the
+    // bytes of every word of the second part.
+    static std::uint16_t Combine(std::uint16_t first, std::uint16_t second,
+                                 std::size_t offset);
+    // Folds a sum of 16-bit words to 16 bits.
+    static std::uint16_t Fold(std::uint64_t sum);
+    // Returns 'checksum' updated for a 16-bit word of the data changing from
+    // 'old_value' to 'new_value', as equation 3 of RFC 1624 does.
+    static std::uint16_t Update16(std::uint16_t checksum,
+                                  std::uint16_t old_value,
+                                  std::uint16_t new_value);
+    // As Update16, for a 32-bit field such as an IPv4 address.
+    static std::uint16_t Update32(std::uint16_t checksum,
+                                  std::uint32_t old_value,
+                                  std::uint32_t new_value);
+};
+}
+
+#endif
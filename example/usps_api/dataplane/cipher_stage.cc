@@ -0,0 +1,463 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#include "cipher_stage.h"
+#include <algorithm>
+#include <cstring>
+#include <random>
+
+constexpr std::size_t usps_api_server::CipherStage::kIvBytes;
+constexpr std::size_t usps_api_server::CipherStage::kTagBytes;
+constexpr std::size_t usps_api_server::CipherStage::kChunk;
+
+namespace {
+constexpr std::size_t kBlock = usps_api_server::AesKey::kBlock;
+
+// The CCM B0 flags for additional data, a 16-byte tag and a 4-byte length.
+constexpr std::uint8_t kCcmFlags = 0x40 | ((16 - 2) / 2) << 3 | (4 - 1);
+
+// Where the ciphertext of a framed packet lies.
+struct Body {
+  std::uint8_t* data;
+  std::size_t length;
+};
+
+Body BodyOf(usps_api_server::Packet* packet, std::size_t tag_bytes) {
+  return Body{packet->data() + usps_api_server::CipherStage::kIvBytes,
+              packet->length() - usps_api_server::CipherStage::kIvBytes - 1 -
+                  tag_bytes};
+}
+
+void StoreBig64(std::uint8_t* p, std::uint64_t value) {
+  for (int i = 7; i >= 0; --i) {
+    p[i] = static_cast<std::uint8_t>(value);
+    value >>= 8;
+  }
+}
+
+// Compares in time independent of where the tags differ.
+bool TagsEqual(const std::uint8_t* a, const std::uint8_t* b) {
+  std::uint8_t diff = 0;
+  for (std::size_t i = 0; i < kBlock; ++i) {
+    diff |= a[i] ^ b[i];
+  }
+  return diff == 0;
+}
+
+// Starts a CCM CBC-MAC job over B0, the key byte and 'body', leaving the
+// nonce in B0 to the caller.
+void CcmMac(std::uint8_t key_byte, const Body& body,
+            usps_api_server::MacJob* job) {
+  std::memset(job, 0, sizeof(*job));
+  job->prefix[0] = kCcmFlags;
+  job->prefix[12] = static_cast<std::uint8_t>(body.length >> 24);
+  job->prefix[13] = static_cast<std::uint8_t>(body.length >> 16);
+  job->prefix[14] = static_cast<std::uint8_t>(body.length >> 8);
+  job->prefix[15] = static_cast<std::uint8_t>(body.length);
+  // The additional data is one byte, after its two-byte length.
+  job->prefix[17] = 1;
+  job->prefix[18] = key_byte;
+  job->prefix_blocks = 2;
+  job->data = body.data;
+  job->length = body.length;
+}
+
+// Starts an EAX OMAC job tweaked with 't'.
+void Omac(int t, std::uint8_t* data, std::size_t length,
+          usps_api_server::MacJob* job) {
+  std::memset(job, 0, sizeof(*job));
+  job->prefix[kBlock - 1] = static_cast<std::uint8_t>(t);
+  job->prefix_blocks = 1;
+  job->data = data;
+  job->length = length;
+  job->padding = usps_api_server::MacJob::CMAC;
+}
+}
+
+std::unique_ptr<usps_api_server::CipherStage>
+usps_api_server::CipherStage::Compile(const ghost::CipherServiceFn& fn,
+                                      std::string* error) {
+  std::unique_ptr<CipherStage> stage(new CipherStage());
+  std::size_t salt_bytes = 4;
+  switch (fn.cipher_protocol()) {
+    case ghost::CipherServiceFn::CIPHER_CCMP_AES:
+      stage->mode_ = CCM;
+      salt_bytes = 3;
+      break;
+    case ghost::CipherServiceFn::CIPHER_AES_GCM:
+      stage->mode_ = GCM;
+      break;
+    case ghost::CipherServiceFn::CIPHER_AES_CBC:
+      stage->mode_ = CBC;
+      break;
+    case ghost::CipherServiceFn::CIPHER_AES_CTR:
+      stage->mode_ = CTR;
+      break;
+    case ghost::CipherServiceFn::CIPHER_AES_EAX:
+      stage->mode_ = EAX;
+      break;
+    default:
+      *error = "cipher protocol is not set";
+      return nullptr;
+  }
+  if (fn.block_size_bytes() != kBlock) {
+    *error = "block_size_bytes must be 16 for AES";
+    return nullptr;
+  }
+  if (fn.cipher_type() == ghost::CipherServiceFn::CIPHER_TYPE_UNSPECIFIED) {
+    *error = "cipher_type is not set";
+    return nullptr;
+  }
+  if (!fn.salt().empty() && fn.salt().size() != salt_bytes) {
+    *error = "salt must be " + std::to_string(salt_bytes) + " bytes";
+    return nullptr;
+  }
+  if (fn.keyid() > 0x0f || fn.version() > 0x0f) {
+    *error = "keyid and version must fit in 4 bits";
+    return nullptr;
+  }
+  if (!AesKey::Supported()) {
+    *error = "AES ciphers need a CPU with AES-NI and PCLMULQDQ";
+    return nullptr;
+  }
+  if (!stage->key_.Init(fn.key())) {
+    *error = "key must be 16, 24 or 32 bytes";
+    return nullptr;
+  }
+  stage->encrypt_ = fn.cipher_type() == ghost::CipherServiceFn::ENCRYPT;
+  stage->salt_ = fn.salt();
+  stage->salt_.resize(salt_bytes, '\0');
+  stage->key_byte_ = static_cast<std::uint8_t>(fn.version() << 4 | fn.keyid());
+  // A random start keeps a restarted stage from repeating IVs it used
+  // before under the same key.
+  std::random_device random;
+  stage->next_iv_ = static_cast<std::uint64_t>(random()) << 32 | random();
+  return stage;
+}
+
+void usps_api_server::CipherStage::Process(PacketBatch* batch,
+                                           PacketSink* sink) const {
+  if (encrypt_) {
+    Encrypt(batch);
+  } else {
+    Decrypt(batch);
+  }
+}
+
+// Frames every packet, then seals the batch a chunk at a time. IVs for the
+// whole batch are taken with one atomic add.
+void usps_api_server::CipherStage::Encrypt(PacketBatch* batch) const {
+  std::uint64_t iv = next_iv_.fetch_add(batch->size(),
+                                        std::memory_order_relaxed);
+  std::size_t tag_bytes = TagBytes();
+  batch->Filter([this, &iv, tag_bytes](Packet* packet) {
+    std::size_t pad = mode_ == CBC ? kBlock - packet->length() % kBlock : 0;
+    std::uint8_t* head = packet->Prepend(kIvBytes);
+    std::uint8_t* tail =
+        head == nullptr ? nullptr : packet->Append(pad + 1 + tag_bytes);
+    if (tail == nullptr) {
+      return false;
+    }
+    StoreBig64(head, iv++);
+    std::memset(tail, static_cast<int>(pad), pad);
+    tail[pad] = key_byte_;
+    return true;
+  });
+  for (std::size_t i = 0; i < batch->size(); i += kChunk) {
+    Seal(batch->begin() + i, std::min(kChunk, batch->size() - i));
+  }
+}
+
+// Drops packets that cannot be ours before spending any AES on them.
+void usps_api_server::CipherStage::Decrypt(PacketBatch* batch) const {
+  std::size_t tag_bytes = TagBytes();
+  std::size_t minimum = kIvBytes + 1 + tag_bytes + (mode_ == CBC ? kBlock : 0);
+  batch->Filter([this, tag_bytes, minimum](Packet* packet) {
+    if (packet->length() < minimum ||
+        packet->data()[packet->length() - tag_bytes - 1] != key_byte_) {
+      return false;
+    }
+    return mode_ != CBC || BodyOf(packet, tag_bytes).length % kBlock == 0;
+  });
+  bool ok[PacketBatch::kMaxSize];
+  std::fill(ok, ok + batch->size(), true);
+  for (std::size_t i = 0; i < batch->size(); i += kChunk) {
+    Open(batch->begin() + i, std::min(kChunk, batch->size() - i), ok + i);
+  }
+  std::size_t index = 0;
+  batch->Filter([this, &ok, &index, tag_bytes](Packet* packet) {
+    if (!ok[index++] || !packet->Adjust(kIvBytes) ||
+        !packet->Trim(1 + tag_bytes)) {
+      return false;
+    }
+    if (mode_ != CBC) {
+      return true;
+    }
+    const std::uint8_t* end = packet->data() + packet->length();
+    std::size_t pad = end[-1];
+    if (pad == 0 || pad > kBlock) {
+      return false;
+    }
+    std::uint8_t diff = 0;
+    for (std::size_t i = 1; i <= pad; ++i) {
+      diff |= end[-static_cast<std::ptrdiff_t>(i)] ^ pad;
+    }
+    return diff == 0 && packet->Trim(pad);
+  });
+}
+
+std::size_t usps_api_server::CipherStage::Nonce(const std::uint8_t* iv,
+                                                std::uint8_t* block) const {
+  std::memcpy(block, salt_.data(), salt_.size());
+  std::memcpy(block + salt_.size(), iv, kIvBytes);
+  return salt_.size() + kIvBytes;
+}
+
+// CBC chains from the encryption of the nonce, which an observer cannot
+// predict even though the IV on the wire is a counter.
+void usps_api_server::CipherStage::CbcIvs(
+    Packet* const* packets, std::size_t count,
+    std::uint8_t (*ivs)[AesKey::kBlock]) const {
+  CtrJob jobs[kChunk] = {};
+  for (std::size_t i = 0; i < count; ++i) {
+    Nonce(packets[i]->data(), jobs[i].counter);
+    std::memset(ivs[i], 0, kBlock);
+    jobs[i].data = ivs[i];
+    jobs[i].length = kBlock;
+  }
+  AesKernels::Ctr(key_, jobs, count);
+}
+
+void usps_api_server::CipherStage::Seal(Packet* const* packets,
+                                        std::size_t count) const {
+  std::size_t tag_bytes = TagBytes();
+  CtrJob ctr[2 * kChunk];
+  MacJob mac[3 * kChunk];
+  std::memset(ctr, 0, sizeof(CtrJob) * 2 * count);
+  switch (mode_) {
+    case CTR:
+      for (std::size_t i = 0; i < count; ++i) {
+        Body body = BodyOf(packets[i], tag_bytes);
+        Nonce(packets[i]->data(), ctr[i].counter);
+        ctr[i].start = 1;
+        ctr[i].data = body.data;
+        ctr[i].length = body.length;
+      }
+      AesKernels::Ctr(key_, ctr, count);
+      break;
+    case CBC: {
+      std::uint8_t ivs[kChunk][AesKey::kBlock];
+      CbcIvs(packets, count, ivs);
+      for (std::size_t i = 0; i < count; ++i) {
+        Body body = BodyOf(packets[i], tag_bytes);
+        std::memset(&mac[i], 0, sizeof(MacJob));
+        std::memcpy(mac[i].state, ivs[i], kBlock);
+        mac[i].data = body.data;
+        mac[i].length = body.length;
+        mac[i].write_back = true;
+      }
+      AesKernels::Mac(key_, mac, count);
+      break;
+    }
+    case GCM: {
+      // Counter 1 masks the tag and the data starts at counter 2.
+      for (std::size_t i = 0; i < count; ++i) {
+        Body body = BodyOf(packets[i], tag_bytes);
+        Nonce(packets[i]->data(), ctr[i].counter);
+        ctr[i].start = 2;
+        ctr[i].data = body.data;
+        ctr[i].length = body.length;
+      }
+      AesKernels::Ctr(key_, ctr, count);
+      for (std::size_t i = 0; i < count; ++i) {
+        Body body = BodyOf(packets[i], tag_bytes);
+        std::uint8_t* tag = body.data + body.length + 1;
+        AesKernels::Ghash(key_, body.data + body.length, 1, body.data,
+                          body.length, tag);
+        ctr[count + i] = ctr[i];
+        ctr[count + i].start = 1;
+        ctr[count + i].data = tag;
+        ctr[count + i].length = kBlock;
+      }
+      AesKernels::Ctr(key_, ctr + count, count);
+      break;
+    }
+    case CCM:
+      // CBC-MAC over B0, the key byte and the plaintext, then counter 0
+      // masks the tag and the data starts at counter 1.
+      for (std::size_t i = 0; i < count; ++i) {
+        Body body = BodyOf(packets[i], tag_bytes);
+        CcmMac(key_byte_, body, &mac[i]);
+        Nonce(packets[i]->data(), mac[i].prefix + 1);
+      }
+      AesKernels::Mac(key_, mac, count);
+      for (std::size_t i = 0; i < count; ++i) {
+        Body body = BodyOf(packets[i], tag_bytes);
+        std::uint8_t* tag = body.data + body.length + 1;
+        std::memcpy(tag, mac[i].state, kBlock);
+        ctr[i].counter[0] = 4 - 1;
+        Nonce(packets[i]->data(), ctr[i].counter + 1);
+        ctr[i].start = 1;
+        ctr[i].data = body.data;
+        ctr[i].length = body.length;
+        ctr[count + i] = ctr[i];
+        ctr[count + i].start = 0;
+        ctr[count + i].data = tag;
+        ctr[count + i].length = kBlock;
+      }
+      AesKernels::Ctr(key_, ctr, 2 * count);
+      break;
+    case EAX:
+      // Tag = OMAC0(nonce) ^ OMAC1(key byte) ^ OMAC2(ciphertext), with the
+      // data encrypted from OMAC0(nonce) as a 128-bit counter.
+      for (std::size_t i = 0; i < count; ++i) {
+        Body body = BodyOf(packets[i], tag_bytes);
+        std::uint8_t* tag = body.data + body.length + 1;
+        // The nonce is built in the tag, which it is hashed from before
+        // the tag is written.
+        std::size_t nonce_bytes = Nonce(packets[i]->data(), tag);
+        Omac(0, tag, nonce_bytes, &mac[2 * i]);
+        Omac(1, body.data + body.length, 1, &mac[2 * i + 1]);
+      }
+      AesKernels::Mac(key_, mac, 2 * count);
+      for (std::size_t i = 0; i < count; ++i) {
+        Body body = BodyOf(packets[i], tag_bytes);
+        std::memcpy(ctr[i].counter, mac[2 * i].state, kBlock);
+        ctr[i].wide = true;
+        ctr[i].data = body.data;
+        ctr[i].length = body.length;
+      }
+      AesKernels::Ctr(key_, ctr, count);
+      for (std::size_t i = 0; i < count; ++i) {
+        Body body = BodyOf(packets[i], tag_bytes);
+        Omac(2, body.data, body.length, &mac[2 * count + i]);
+      }
+      AesKernels::Mac(key_, mac + 2 * count, count);
+      for (std::size_t i = 0; i < count; ++i) {
+        Body body = BodyOf(packets[i], tag_bytes);
+        std::uint8_t* tag = body.data + body.length + 1;
+        for (std::size_t b = 0; b < kBlock; ++b) {
+          tag[b] = mac[2 * i].state[b] ^ mac[2 * i + 1].state[b] ^
+                   mac[2 * count + i].state[b];
+        }
+      }
+      break;
+  }
+}
+
+void usps_api_server::CipherStage::Open(Packet* const* packets,
+                                        std::size_t count, bool* ok) const {
+  std::size_t tag_bytes = TagBytes();
+  CtrJob ctr[2 * kChunk];
+  MacJob mac[3 * kChunk];
+  std::uint8_t expected[kChunk][AesKey::kBlock];
+  std::memset(ctr, 0, sizeof(CtrJob) * 2 * count);
+  switch (mode_) {
+    case CTR:
+      for (std::size_t i = 0; i < count; ++i) {
+        Body body = BodyOf(packets[i], tag_bytes);
+        Nonce(packets[i]->data(), ctr[i].counter);
+        ctr[i].start = 1;
+        ctr[i].data = body.data;
+        ctr[i].length = body.length;
+      }
+      AesKernels::Ctr(key_, ctr, count);
+      break;
+    case CBC: {
+      CbcJob cbc[kChunk];
+      CbcIvs(packets, count, expected);
+      for (std::size_t i = 0; i < count; ++i) {
+        Body body = BodyOf(packets[i], tag_bytes);
+        std::memcpy(cbc[i].iv, expected[i], kBlock);
+        cbc[i].data = body.data;
+        cbc[i].length = body.length;
+      }
+      AesKernels::CbcDecrypt(key_, cbc, count);
+      break;
+    }
+    case GCM:
+      for (std::size_t i = 0; i < count; ++i) {
+        Body body = BodyOf(packets[i], tag_bytes);
+        AesKernels::Ghash(key_, body.data + body.length, 1, body.data,
+                          body.length, expected[i]);
+        Nonce(packets[i]->data(), ctr[i].counter);
+        ctr[i].start = 2;
+        ctr[i].data = body.data;
+        ctr[i].length = body.length;
+        ctr[count + i] = ctr[i];
+        ctr[count + i].start = 1;
+        ctr[count + i].data = expected[i];
+        ctr[count + i].length = kBlock;
+      }
+      AesKernels::Ctr(key_, ctr, 2 * count);
+      for (std::size_t i = 0; i < count; ++i) {
+        Body body = BodyOf(packets[i], tag_bytes);
+        ok[i] = TagsEqual(expected[i], body.data + body.length + 1);
+      }
+      break;
+    case CCM:
+      for (std::size_t i = 0; i < count; ++i) {
+        Body body = BodyOf(packets[i], tag_bytes);
+        ctr[i].counter[0] = 4 - 1;
+        Nonce(packets[i]->data(), ctr[i].counter + 1);
+        ctr[i].start = 1;
+        ctr[i].data = body.data;
+        ctr[i].length = body.length;
+      }
+      AesKernels::Ctr(key_, ctr, count);
+      for (std::size_t i = 0; i < count; ++i) {
+        Body body = BodyOf(packets[i], tag_bytes);
+        CcmMac(key_byte_, body, &mac[i]);
+        Nonce(packets[i]->data(), mac[i].prefix + 1);
+      }
+      AesKernels::Mac(key_, mac, count);
+      for (std::size_t i = 0; i < count; ++i) {
+        std::memcpy(expected[i], mac[i].state, kBlock);
+        ctr[count + i] = ctr[i];
+        ctr[count + i].start = 0;
+        ctr[count + i].data = expected[i];
+        ctr[count + i].length = kBlock;
+      }
+      AesKernels::Ctr(key_, ctr + count, count);
+      for (std::size_t i = 0; i < count; ++i) {
+        Body body = BodyOf(packets[i], tag_bytes);
+        ok[i] = TagsEqual(expected[i], body.data + body.length + 1);
+      }
+      break;
+    case EAX: {
+      std::uint8_t nonces[kChunk][AesKey::kBlock];
+      for (std::size_t i = 0; i < count; ++i) {
+        Body body = BodyOf(packets[i], tag_bytes);
+        std::size_t nonce_bytes = Nonce(packets[i]->data(), nonces[i]);
+        Omac(0, nonces[i], nonce_bytes, &mac[3 * i]);
+        Omac(1, body.data + body.length, 1, &mac[3 * i + 1]);
+        Omac(2, body.data, body.length, &mac[3 * i + 2]);
+      }
+      AesKernels::Mac(key_, mac, 3 * count);
+      for (std::size_t i = 0; i < count; ++i) {
+        Body body = BodyOf(packets[i], tag_bytes);
+        for (std::size_t b = 0; b < kBlock; ++b) {
+          expected[i][b] = mac[3 * i].state[b] ^ mac[3 * i + 1].state[b] ^
+                           mac[3 * i + 2].state[b];
+        }
+        ok[i] = TagsEqual(expected[i], body.data + body.length + 1);
+        std::memcpy(ctr[i].counter, mac[3 * i].state, kBlock);
+        ctr[i].wide = true;
+        ctr[i].data = body.data;
+        ctr[i].length = body.length;
+      }
+      AesKernels::Ctr(key_, ctr, count);
+      break;
+    }
+  }
+}
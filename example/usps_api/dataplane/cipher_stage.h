@@ -0,0 +1,76 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#ifndef CIPHER_STAGE_H
+#define CIPHER_STAGE_H
+
+#include "aes.h"
+#include "stages.h"
+#include "proto/usps_api/service_function.pb.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace usps_api_server {
+// Encrypts or decrypts whole packets with AES.
+//
+// An encrypted packet is laid out as
+//   | IV (8) | ciphertext | version << 4 | keyid (1) | tag (16) |
+// The IV is a per-stage counter, so it never repeats under one key. The
+// key byte is authenticated as additional data, and the tag is present for
+// the authenticated modes only: CCM, GCM and EAX. CBC pads the plaintext
+// to whole blocks as PKCS #7 does and encrypts the IV into a random-looking
+// one; CBC and CTR provide no integrity. Decryption drops packets whose key
+// byte, tag or padding does not check out.
+//
+// The nonce is the salt followed by the IV: 3 salt bytes for CCM, as in
+// RFC 4309, and 4 for the other modes, as in RFC 4106 and RFC 3686.
+class CipherStage : public Stage {
+  public:
+    static constexpr std::size_t kIvBytes = 8;
+    static constexpr std::size_t kTagBytes = 16;
+    // Returns nullptr and sets 'error' if a field is invalid or the CPU
+    // lacks AES-NI.
+    static std::unique_ptr<CipherStage> Compile(
+        const ghost::CipherServiceFn& fn, std::string* error);
+    void Process(PacketBatch* batch, PacketSink* sink) const override;
+
+  private:
+    enum Mode { CCM, GCM, CBC, CTR, EAX };
+    // Packets are sealed or opened this many at a time, which bounds the
+    // jobs kept on the stack while leaving plenty for the lanes.
+    static constexpr std::size_t kChunk = 64;
+    CipherStage() = default;
+    void Encrypt(PacketBatch* batch) const;
+    void Decrypt(PacketBatch* batch) const;
+    void Seal(Packet* const* packets, std::size_t count) const;
+    // Decrypts 'packets' in place and clears 'ok' where a tag is wrong.
+    void Open(Packet* const* packets, std::size_t count, bool* ok) const;
+    // Writes the nonce of the packet with 'iv' to the front of 'block'.
+    std::size_t Nonce(const std::uint8_t* iv, std::uint8_t* block) const;
+    void CbcIvs(Packet* const* packets, std::size_t count,
+                std::uint8_t (*ivs)[AesKey::kBlock]) const;
+    std::size_t TagBytes() const { return mode_ == CBC || mode_ == CTR
+                                              ? 0 : kTagBytes; }
+    AesKey key_;
+    Mode mode_;
+    bool encrypt_;
+    std::string salt_;
+    std::uint8_t key_byte_;
+    mutable std::atomic<std::uint64_t> next_iv_;
+};
+}
+
+#endif
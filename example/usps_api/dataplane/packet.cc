@@ -0,0 +1,261 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#include "packet.h"
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <new>
+
+constexpr std::size_t usps_api_server::Packet::kHeadroom;
+constexpr std::size_t usps_api_server::Packet::kTailroom;
+constexpr std::size_t usps_api_server::PacketBatch::kMaxSize;
+
+namespace {
+std::size_t LinesOf(std::size_t bytes) {
+  return (bytes + 63) / 64;
+}
+
+// Each thread has a pool of packets and a pool of the small buffers that
+// hold the headers of shares.
+enum LocalKind { PACKETS, HEADERS, LOCAL_KINDS };
+
+// Pools of exited threads, waiting for a new owner.
+std::mutex idle_mutex;
+std::vector<usps_api_server::PacketPool*>* idle_pools =
+    new std::vector<usps_api_server::PacketPool*>[LOCAL_KINDS];
+
+// Hands the pools on when their thread exits.
+struct LocalPools {
+  usps_api_server::PacketPool* pools[LOCAL_KINDS] = {};
+  ~LocalPools();
+};
+thread_local LocalPools local_pools;
+
+usps_api_server::PacketPool* LocalPool(
+    LocalKind kind, const usps_api_server::PacketPool::Options& options) {
+  usps_api_server::PacketPool*& pool = local_pools.pools[kind];
+  if (pool == nullptr) {
+    {
+      std::lock_guard<std::mutex> lock(idle_mutex);
+      if (!idle_pools[kind].empty()) {
+        pool = idle_pools[kind].back();
+        idle_pools[kind].pop_back();
+      }
+    }
+    if (pool == nullptr) {
+      pool = new usps_api_server::PacketPool(options);
+    }
+    pool->Adopt();
+  }
+  return pool;
+}
+
+LocalPools::~LocalPools() {
+  std::lock_guard<std::mutex> lock(idle_mutex);
+  for (int kind = 0; kind < LOCAL_KINDS; ++kind) {
+    if (pools[kind] != nullptr) {
+      pools[kind]->Disown();
+      idle_pools[kind].push_back(pools[kind]);
+    }
+  }
+}
+} // namespace
+
+usps_api_server::Packet* usps_api_server::Packet::Create(
+    const std::uint8_t* data, std::size_t length) {
+  return PacketPool::Local()->Allocate(data, length);
+}
+
+// The count is only read while the packet holds the one reference, as no
+// other thread can then be taking or dropping one.
+void usps_api_server::Packet::Release() {
+  if (refs_.load(std::memory_order_acquire) != 1 &&
+      refs_.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+    return;
+  }
+  Packet* payload = payload_;
+  if (pool_ != nullptr) {
+    pool_->Free(this);
+  } else {
+    delete[] buffer_;
+    delete this;
+  }
+  // Last, so a payload freed here is the next buffer to be reused.
+  if (payload != nullptr) {
+    payload->Release();
+  }
+}
+
+usps_api_server::Packet* usps_api_server::Packet::Share() {
+  Packet* share;
+  Packet* owner;
+  PacketPool* headers = PacketPool::LocalHeaders();
+  if (payload_ == nullptr) {
+    share = headers->Allocate(nullptr, 0);
+    owner = this;
+    share->payload_data_ = data_;
+    share->payload_length_ = length_;
+  } else {
+    share = headers->Allocate(data_, length_);
+    owner = payload_;
+    share->payload_data_ = payload_data_;
+    share->payload_length_ = payload_length_;
+  }
+  owner->refs_.fetch_add(1, std::memory_order_relaxed);
+  share->payload_ = owner;
+  return share;
+}
+
+void usps_api_server::Packet::Copy(std::size_t offset, std::size_t bytes,
+                                   std::uint8_t* out) const {
+  if (offset < length_) {
+    std::size_t own = std::min(bytes, length_ - offset);
+    std::memcpy(out, data_ + offset, own);
+    out += own;
+    bytes -= own;
+    offset = 0;
+  } else {
+    offset -= length_;
+  }
+  if (bytes != 0) {
+    std::memcpy(out, payload_data_ + offset, bytes);
+  }
+}
+
+std::uint8_t* usps_api_server::Packet::Prepend(std::size_t bytes) {
+  if (bytes > headroom()) {
+    return nullptr;
+  }
+  data_ -= bytes;
+  length_ += bytes;
+  return data_;
+}
+
+bool usps_api_server::Packet::Adjust(std::size_t bytes) {
+  if (bytes > length_) {
+    return false;
+  }
+  data_ += bytes;
+  length_ -= bytes;
+  return true;
+}
+
+std::uint8_t* usps_api_server::Packet::Append(std::size_t bytes) {
+  if (bytes > tailroom() || payload_ != nullptr) {
+    return nullptr;
+  }
+  std::uint8_t* tail = data_ + length_;
+  length_ += bytes;
+  return tail;
+}
+
+bool usps_api_server::Packet::Trim(std::size_t bytes) {
+  if (bytes > length_ || payload_ != nullptr) {
+    return false;
+  }
+  length_ -= bytes;
+  return true;
+}
+
+void usps_api_server::PacketBatch::ReleaseAll() {
+  for (std::size_t i = 0; i < size_; ++i) {
+    packets_[i]->Release();
+  }
+  size_ = 0;
+}
+
+usps_api_server::PacketPool::PacketPool(const Options& options)
+    : options_(options),
+      capacity_(options.headroom + options.data_room + options.tailroom),
+      stride_(64 * (LinesOf(sizeof(Packet)) + LinesOf(capacity_))),
+      owner_(Marker()) {}
+
+usps_api_server::PacketPool* usps_api_server::PacketPool::Local() {
+  return LocalPool(PACKETS, Options());
+}
+
+// Header buffers have room for a share's copy of the headers in front of
+// the payload and for as many more again.
+usps_api_server::PacketPool* usps_api_server::PacketPool::LocalHeaders() {
+  Options options;
+  options.data_room = Packet::kHeadroom;
+  options.tailroom = 0;
+  return LocalPool(HEADERS, options);
+}
+
+usps_api_server::Packet* usps_api_server::PacketPool::Allocate(
+    const std::uint8_t* data, std::size_t length) {
+  Packet* packet;
+  if (length > options_.data_room) {
+    std::size_t capacity = options_.headroom + length + options_.tailroom;
+    packet = new Packet(new std::uint8_t[capacity], capacity, nullptr);
+  } else {
+    if (free_ == nullptr) {
+      free_ = remote_.exchange(nullptr, std::memory_order_acquire);
+      if (free_ == nullptr) {
+        Grow();
+      }
+    }
+    packet = free_;
+    free_ = packet->next_;
+  }
+  packet->data_ = packet->buffer_ + options_.headroom;
+  packet->length_ = length;
+  packet->payload_ = nullptr;
+  packet->payload_data_ = nullptr;
+  packet->payload_length_ = 0;
+  packet->refs_.store(1, std::memory_order_relaxed);
+  if (length != 0) {
+    std::memcpy(packet->data_, data, length);
+  }
+  return packet;
+}
+
+// The owner's releases stay on its free list. Another thread may see a
+// stale owner while the pool changes hands, but never its own marker, so it
+// always takes the remote path.
+void usps_api_server::PacketPool::Free(Packet* packet) {
+  if (owner_.load(std::memory_order_relaxed) == Marker()) {
+    packet->next_ = free_;
+    free_ = packet;
+    return;
+  }
+  Packet* head = remote_.load(std::memory_order_relaxed);
+  do {
+    packet->next_ = head;
+  } while (!remote_.compare_exchange_weak(head, packet,
+                                          std::memory_order_release,
+                                          std::memory_order_relaxed));
+}
+
+// Its address tells the threads apart. A thread's pool is disowned before
+// the thread exits, so a later thread given the same address owns nothing.
+const void* usps_api_server::PacketPool::Marker() {
+  static thread_local char marker;
+  return &marker;
+}
+
+void usps_api_server::PacketPool::Grow() {
+  std::size_t lines = stride_ / 64;
+  slabs_.emplace_back(new Line[lines * options_.slab_buffers]);
+  std::uint8_t* slab = slabs_.back()[0].bytes;
+  std::size_t buffer_offset = 64 * LinesOf(sizeof(Packet));
+  for (std::size_t i = options_.slab_buffers; i-- > 0;) {
+    std::uint8_t* start = slab + i * stride_;
+    Packet* packet = new (start) Packet(start + buffer_offset, capacity_, this);
+    packet->next_ = free_;
+    free_ = packet;
+  }
+  buffers_ += options_.slab_buffers;
+}
@@ -0,0 +1,229 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace usps_api_server {
+class PacketPool;
+
+// A packet in a buffer with room to grow at both ends.
+//
+// The data starts some headroom into the buffer, kHeadroom by default, so
+// encapsulation headers are prepended and decapsulated ones skipped by
+// moving the data pointer, never the data. Tailroom is left after the data
+// for trailers.
+//
+// A packet may be followed by a payload it shares with other packets, as
+// scatter-gather: its own bytes are the headers in front of the payload.
+// The buffer holding a shared payload counts its references atomically and
+// goes back to its pool with the last of them.
+class Packet {
+  public:
+    static constexpr std::size_t kHeadroom = 128;
+    static constexpr std::size_t kTailroom = 64;
+
+    // Returns a packet holding a copy of 'data' from the calling thread's
+    // pool.
+    static Packet* Create(const std::uint8_t* data, std::size_t length);
+    Packet(const Packet&) = delete;
+    Packet& operator=(const Packet&) = delete;
+    // Drops the packet's reference to its buffer, returning the buffer to
+    // its pool with the last one. May be called on any thread.
+    void Release();
+    // Returns a packet with the same bytes, from the calling thread's pool
+    // of header buffers. The payload is shared rather than copied: the new
+    // packet holds only a copy of this packet's own bytes if it has a
+    // payload already, and nothing otherwise. Neither packet may write the
+    // shared bytes after.
+    Packet* Share();
+
+    // The packet's own bytes, in front of any payload.
+    std::uint8_t* data() { return data_; }
+    const std::uint8_t* data() const { return data_; }
+    std::size_t length() const { return length_; }
+    // The shared bytes after data(), or nullptr.
+    const std::uint8_t* payload() const { return payload_data_; }
+    std::size_t payload_length() const { return payload_length_; }
+    std::size_t total_length() const { return length_ + payload_length_; }
+    // Copies 'bytes' bytes from 'offset' on, across data() and payload().
+    void Copy(std::size_t offset, std::size_t bytes, std::uint8_t* out) const;
+    std::size_t headroom() const {
+      return static_cast<std::size_t>(data_ - buffer_);
+    }
+    std::size_t tailroom() const {
+      return capacity_ - headroom() - length_;
+    }
+    // Grows the packet by 'bytes' at the front and returns the new start, or
+    // nullptr if there is not enough headroom.
+    std::uint8_t* Prepend(std::size_t bytes);
+    // Removes 'bytes' from the front. Returns false if the packet is shorter.
+    bool Adjust(std::size_t bytes);
+    // Grows the packet by 'bytes' at the end and returns the first of them,
+    // or nullptr if there is not enough tailroom or the packet has a payload.
+    std::uint8_t* Append(std::size_t bytes);
+    // Removes 'bytes' from the end. Returns false if the packet is shorter
+    // or has a payload.
+    bool Trim(std::size_t bytes);
+
+  private:
+    friend class PacketPool;
+    Packet(std::uint8_t* buffer, std::size_t capacity, PacketPool* pool)
+        : buffer_(buffer), capacity_(capacity), data_(buffer), pool_(pool) {}
+    std::uint8_t* buffer_;
+    std::size_t capacity_;
+    std::uint8_t* data_;
+    std::size_t length_ = 0;
+    // The pool the buffer belongs to, or nullptr if the packet was too long
+    // for it and has a buffer of its own.
+    PacketPool* pool_;
+    // Links the packet into a free list while it is in its pool.
+    Packet* next_ = nullptr;
+    // The packet whose buffer holds the payload, and so holds a reference
+    // for this one. It never has a payload of its own.
+    Packet* payload_ = nullptr;
+    const std::uint8_t* payload_data_ = nullptr;
+    std::size_t payload_length_ = 0;
+    // References to the buffer: the packet itself and every packet sharing
+    // its bytes as their payload.
+    std::atomic<std::uint32_t> refs_{1};
+};
+
+// Fixed-size packet buffers for one thread, like DPDK's mbuf pools.
+//
+// Each buffer holds its Packet followed by headroom, data room and tailroom,
+// and buffers are carved out of slabs that stay with the pool until it is
+// destroyed, so once a pool has grown to its working set no packet costs an
+// allocation. The thread that owns the pool allocates and releases through
+// a plain free list. Packets released on other threads are pushed onto a
+// lock-free stack, which the owner takes whole with one exchange when its
+// free list runs dry; as the stack is only ever taken whole it has no ABA
+// problem.
+class PacketPool {
+  public:
+    struct Options {
+      std::size_t headroom = Packet::kHeadroom;
+      std::size_t data_room = 2048;
+      std::size_t tailroom = Packet::kTailroom;
+      // Buffers carved per slab.
+      std::size_t slab_buffers = 256;
+    };
+
+    // The pool is owned by the calling thread.
+    explicit PacketPool(const Options& options);
+    PacketPool(const PacketPool&) = delete;
+    PacketPool& operator=(const PacketPool&) = delete;
+    // Every packet of the pool must have been released.
+    ~PacketPool() = default;
+    // Returns the calling thread's pool, with the default options. The pool
+    // of a thread that exits is handed to the next thread that asks, so
+    // packets may outlive the thread that created them.
+    static PacketPool* Local();
+    // Returns the calling thread's pool of small buffers for the headers
+    // of shares, handed on in the same way.
+    static PacketPool* LocalHeaders();
+    // Returns a packet holding a copy of 'data'. A packet longer than the
+    // data room gets a buffer of its own. Only the owner may allocate.
+    Packet* Allocate(const std::uint8_t* data, std::size_t length);
+    // Returns 'packet' to the pool. May be called on any thread.
+    void Free(Packet* packet);
+    // Makes the calling thread the owner. The previous owner must have
+    // disowned the pool or stopped using it.
+    void Adopt() { owner_.store(Marker(), std::memory_order_relaxed); }
+    // Leaves the pool without an owner until a thread adopts it.
+    void Disown() { owner_.store(nullptr, std::memory_order_relaxed); }
+    // Returns the number of buffers carved so far.
+    std::size_t buffers() const { return buffers_; }
+
+  private:
+    struct alignas(64) Line {
+      std::uint8_t bytes[64];
+    };
+    // Returns an address unique to the calling thread among live threads.
+    static const void* Marker();
+    // Carves another slab of buffers onto the free list.
+    void Grow();
+    Options options_;
+    std::size_t capacity_;
+    // Bytes from one buffer's Packet to the next, in whole cache lines.
+    std::size_t stride_;
+    // The Marker() of the owning thread.
+    std::atomic<const void*> owner_;
+    Packet* free_ = nullptr;
+    std::size_t buffers_ = 0;
+    std::vector<std::unique_ptr<Line[]>> slabs_;
+    // Packets released on other threads, on its own line.
+    alignas(64) std::atomic<Packet*> remote_{nullptr};
+};
+
+// Up to kMaxSize packets processed together. Each stage of a chain runs over
+// the whole batch before the next one starts, so its code and tables stay in
+// cache and its dispatch is paid once per batch rather than once per packet.
+// The batch owns its packets.
+class PacketBatch {
+  public:
+    static constexpr std::size_t kMaxSize = 256;
+
+    PacketBatch() = default;
+    PacketBatch(const PacketBatch&) = delete;
+    PacketBatch& operator=(const PacketBatch&) = delete;
+    ~PacketBatch() { ReleaseAll(); }
+
+    std::size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    bool full() const { return size_ == kMaxSize; }
+    Packet* operator[](std::size_t i) const { return packets_[i]; }
+    Packet* const* begin() const { return packets_.data(); }
+    Packet* const* end() const { return packets_.data() + size_; }
+    // Adds 'packet' to a batch that is not full.
+    void Add(Packet* packet) { packets_[size_++] = packet; }
+    // Empties the batch without releasing its packets, once their ownership
+    // has been passed on.
+    void Clear() { size_ = 0; }
+    // Releases every packet and empties the batch.
+    void ReleaseAll();
+    // Calls 'fn' on each packet in order, keeping those it returns true for
+    // and releasing the others. The data of the packet a few places ahead is
+    // prefetched while the current one is processed.
+    template <typename Fn>
+    void Filter(Fn fn) {
+      std::size_t kept = 0;
+      for (std::size_t i = 0; i < size_; ++i) {
+        if (i + kPrefetch < size_) {
+          __builtin_prefetch(packets_[i + kPrefetch]->data());
+        }
+        Packet* packet = packets_[i];
+        if (fn(packet)) {
+          packets_[kept++] = packet;
+        } else {
+          packet->Release();
+        }
+      }
+      size_ = kept;
+    }
+
+  private:
+    static constexpr std::size_t kPrefetch = 2;
+    std::array<Packet*, kMaxSize> packets_;
+    std::size_t size_ = 0;
+};
+}
+
+#endif
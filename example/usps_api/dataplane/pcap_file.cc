@@ -0,0 +1,96 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#include "pcap_file.h"
+#include "example/usps_api/utils/file_reader.h"
+#include <cstring>
+#include <fstream>
+
+constexpr std::uint32_t usps_api_server::PcapFile::kEthernet;
+constexpr std::uint32_t usps_api_server::PcapFile::kRaw;
+
+namespace {
+constexpr std::uint32_t kMicroMagic = 0xa1b2c3d4;
+constexpr std::uint32_t kNanoMagic = 0xa1b23c4d;
+constexpr std::size_t kFileHeader = 24;
+constexpr std::size_t kRecordHeader = 16;
+
+std::uint32_t Load32(const char* p, bool swapped) {
+  std::uint32_t value;
+  std::memcpy(&value, p, sizeof(value));
+  return swapped ? __builtin_bswap32(value) : value;
+}
+
+void Append16(std::string* out, std::uint16_t value) {
+  out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void Append32(std::string* out, std::uint32_t value) {
+  out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+}
+
+bool usps_api_server::PcapFile::Read(const std::string& filename,
+                                     std::string* error) {
+  FileReader::MappedFile file(filename);
+  if (!file.ok()) {
+    *error = "cannot read " + filename;
+    return false;
+  }
+  std::string_view data = file.data();
+  if (data.size() < kFileHeader) {
+    *error = filename + " is too short for a pcap file";
+    return false;
+  }
+  std::uint32_t magic = Load32(data.data(), false);
+  bool swapped = magic == __builtin_bswap32(kMicroMagic) ||
+                 magic == __builtin_bswap32(kNanoMagic);
+  if (!swapped && magic != kMicroMagic && magic != kNanoMagic) {
+    *error = filename + " is not a pcap file";
+    return false;
+  }
+  link_type = Load32(data.data() + 20, swapped);
+  packets.clear();
+  std::size_t offset = kFileHeader;
+  while (offset + kRecordHeader <= data.size()) {
+    std::size_t length = Load32(data.data() + offset + 8, swapped);
+    offset += kRecordHeader;
+    if (length > data.size() - offset) {
+      break;
+    }
+    packets.emplace_back(data.data() + offset, length);
+    offset += length;
+  }
+  return true;
+}
+
+bool usps_api_server::PcapFile::Write(const std::string& filename) const {
+  std::string out;
+  Append32(&out, kMicroMagic);
+  Append16(&out, 2);  // Version 2.4
+  Append16(&out, 4);
+  Append32(&out, 0);  // Time zone
+  Append32(&out, 0);  // Timestamp accuracy
+  Append32(&out, 262144);  // Snapshot length
+  Append32(&out, link_type);
+  for (const std::string& packet : packets) {
+    Append32(&out, 0);
+    Append32(&out, 0);
+    Append32(&out, static_cast<std::uint32_t>(packet.size()));
+    Append32(&out, static_cast<std::uint32_t>(packet.size()));
+    out += packet;
+  }
+  std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+  file.write(out.data(), out.size());
+  return file.good();
+}
@@ -0,0 +1,41 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#ifndef PCAP_FILE_H
+#define PCAP_FILE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace usps_api_server {
+// The packets of a capture in the classic libpcap format, in either byte
+// order and with micro- or nanosecond timestamps. Timestamps are not kept.
+struct PcapFile {
+  // LINKTYPE_ETHERNET, LINKTYPE_RAW, etc.
+  static constexpr std::uint32_t kEthernet = 1;
+  static constexpr std::uint32_t kRaw = 101;
+  std::uint32_t link_type = kEthernet;
+  std::vector<std::string> packets;
+
+  // Reads the capture at 'filename'. Returns false and sets 'error' if it
+  // cannot be read or is not a pcap file; a truncated last packet is
+  // dropped.
+  bool Read(const std::string& filename, std::string* error);
+  // Writes the packets to 'filename', with zero timestamps. Returns false
+  // if the file cannot be written.
+  bool Write(const std::string& filename) const;
+};
+}
+
+#endif
@@ -0,0 +1,136 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#include "replay.h"
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <thread>
+
+namespace {
+// Counts and releases what a chain transmits.
+class CountingSink : public usps_api_server::PacketSink {
+  public:
+    void Transmit(usps_api_server::PacketBatch* batch) override {
+      for (usps_api_server::Packet* packet : *batch) {
+        bytes += packet->total_length();
+      }
+      packets += batch->size();
+      batch->ReleaseAll();
+    }
+    std::uint64_t packets = 0;
+    std::uint64_t bytes = 0;
+};
+
+double ThreadCpuSeconds() {
+  timespec now;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+}
+
+void usps_api_server::ReplayReport::Merge(const ReplayReport& other) {
+  packets += other.packets;
+  bytes += other.bytes;
+  transmitted += other.transmitted;
+  transmitted_bytes += other.transmitted_bytes;
+  seconds = std::max(seconds, other.seconds);
+  cpu_seconds += other.cpu_seconds;
+}
+
+double usps_api_server::ReplayReport::MppsPerCore() const {
+  return cpu_seconds > 0 ? packets / cpu_seconds / 1e6 : 0;
+}
+
+void usps_api_server::ReplayReport::Print(std::ostream* out) const {
+  *out << std::fixed << std::setprecision(2) << packets << " packets in "
+       << seconds << " s on " << cpu_seconds << " CPU s: "
+       << MppsPerCore() << " Mpps per core, "
+       << (cpu_seconds > 0 ? bytes * 8 / cpu_seconds / 1e9 : 0)
+       << " Gbps per core\n"
+       << transmitted << " packets (" << transmitted_bytes
+       << " bytes) transmitted\n";
+}
+
+usps_api_server::Replayer::Replayer(const ServiceChain* chain,
+                                    const std::vector<std::string>* packets,
+                                    ReplayOptions options)
+    : chain_(chain), packets_(packets), options_(options) {
+  options_.batch_size =
+      std::min(std::max<std::size_t>(options_.batch_size, 1),
+               PacketBatch::kMaxSize);
+  options_.threads = std::max(options_.threads, 1);
+}
+
+usps_api_server::ReplayReport usps_api_server::Replayer::Run() const {
+  std::vector<ReplayReport> reports(options_.threads);
+  std::vector<std::thread> threads;
+  unsigned int cpus = std::max(std::thread::hardware_concurrency(), 1u);
+  for (int i = 0; i < options_.threads; ++i) {
+    threads.emplace_back([this, &reports, i] { reports[i] = RunThread(i); });
+    if (options_.pin_cpus) {
+      cpu_set_t cpuset;
+      CPU_ZERO(&cpuset);
+      CPU_SET(i % cpus, &cpuset);
+      pthread_setaffinity_np(threads.back().native_handle(),
+                             sizeof(cpu_set_t), &cpuset);
+    }
+  }
+  ReplayReport report;
+  for (int i = 0; i < options_.threads; ++i) {
+    threads[i].join();
+    report.Merge(reports[i]);
+  }
+  return report;
+}
+
+// Threads start at different packets so they do not replay in lockstep.
+usps_api_server::ReplayReport usps_api_server::Replayer::RunThread(
+    int thread) const {
+  ReplayReport report;
+  if (packets_->empty()) {
+    return report;
+  }
+  CountingSink sink;
+  PacketBatch batch;
+  std::size_t next = thread % packets_->size();
+  auto start = std::chrono::steady_clock::now();
+  auto deadline = start + std::chrono::duration_cast<
+                              std::chrono::steady_clock::duration>(
+                              std::chrono::duration<double>(options_.seconds));
+  double cpu_start = ThreadCpuSeconds();
+  auto now = start;
+  while (now < deadline) {
+    for (std::size_t i = 0; i < options_.batch_size; ++i) {
+      const std::string& packet = (*packets_)[next];
+      batch.Add(Packet::Create(
+          reinterpret_cast<const std::uint8_t*>(packet.data()),
+          packet.size()));
+      report.bytes += packet.size();
+      if (++next == packets_->size()) {
+        next = 0;
+      }
+    }
+    report.packets += batch.size();
+    chain_->Run(&batch, &sink);
+    now = std::chrono::steady_clock::now();
+  }
+  report.cpu_seconds = ThreadCpuSeconds() - cpu_start;
+  report.seconds = std::chrono::duration<double>(now - start).count();
+  report.transmitted = sink.packets;
+  report.transmitted_bytes = sink.bytes;
+  return report;
+}
@@ -0,0 +1,71 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "service_chain.h"
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace usps_api_server {
+// How a Replayer runs captured packets through a chain.
+struct ReplayOptions {
+  // Packets per batch, at most PacketBatch::kMaxSize.
+  std::size_t batch_size = 32;
+  double seconds = 5;
+  int threads = 1;
+  // Pins thread i to CPU i.
+  bool pin_cpus = false;
+};
+
+// What a replay processed, summed over its threads.
+struct ReplayReport {
+  std::uint64_t packets = 0;
+  std::uint64_t bytes = 0;
+  std::uint64_t transmitted = 0;
+  std::uint64_t transmitted_bytes = 0;
+  double seconds = 0;
+  // CPU time of the replay threads, so rates per core hold however many
+  // threads share a CPU.
+  double cpu_seconds = 0;
+  void Merge(const ReplayReport& other);
+  // Millions of packets per CPU second.
+  double MppsPerCore() const;
+  void Print(std::ostream* out) const;
+};
+
+// Runs captured packets through a chain as fast as it can, offline.
+//
+// Each thread cycles through the packets, copying them into batches of
+// 'batch_size' and running each batch through the chain. Transmitted
+// packets are counted and released. The copy is part of the measured cost,
+// as receiving a packet would be.
+class Replayer {
+  public:
+    Replayer(const ServiceChain* chain, const std::vector<std::string>* packets,
+             ReplayOptions options);
+    ReplayReport Run() const;
+
+  private:
+    ReplayReport RunThread(int thread) const;
+    const ServiceChain* chain_;
+    const std::vector<std::string>* packets_;
+    ReplayOptions options_;
+};
+}
+
+#endif
@@ -0,0 +1,81 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#include "pcap_file.h"
+#include "replay.h"
+#include "service_chain.h"
+#include "example/usps_api/packet_counters.h"
+#include "example/usps_api/utils/file_reader.h"
+#include "proto/usps_api/sfc.pb.h"
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include <google/protobuf/text_format.h>
+#include <cstddef>
+#include <iostream>
+#include <string>
+
+ABSL_FLAG(std::string, PCAP, "", "The pcap file to replay");
+ABSL_FLAG(std::string, CHAIN, "",
+          "A CreateSfcRequest in text format whose service functions the "
+          "packets run through");
+ABSL_FLAG(std::size_t, BATCH, 32, "Packets per batch, up to 256");
+ABSL_FLAG(double, SECONDS, 5, "How long to replay for");
+ABSL_FLAG(int, THREADS, 1, "Threads replaying the capture at once");
+ABSL_FLAG(bool, PIN_CPUS, false, "Pin each replay thread to its own CPU");
+
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+  std::string error;
+  usps_api_server::PcapFile pcap;
+  if (!pcap.Read(absl::GetFlag(FLAGS_PCAP), &error)) {
+    std::cerr << error << std::endl;
+    return 1;
+  }
+  ghost::CreateSfcRequest request;
+  if (!google::protobuf::TextFormat::ParseFromString(
+          FileReader::ReadString(absl::GetFlag(FLAGS_CHAIN)), &request)) {
+    std::cerr << "Cannot parse " << absl::GetFlag(FLAGS_CHAIN) << std::endl;
+    return 1;
+  }
+  std::size_t counter_count = 0;
+  for (const ghost::ServiceFn& service_fn :
+       request.service_functions_to_install()) {
+    if (service_fn.has_increment_counter()) {
+      ++counter_count;
+    }
+  }
+  usps_api_server::PacketCounters counters(counter_count);
+  std::unique_ptr<usps_api_server::ServiceChain> chain =
+      usps_api_server::ServiceChain::Compile(
+          request.service_functions_to_install(), &counters, &error);
+  if (chain == nullptr) {
+    std::cerr << error << std::endl;
+    return 1;
+  }
+  std::cout << "Replaying " << pcap.packets.size() << " packets of link type "
+            << pcap.link_type << " through " << chain->size() << " stages"
+            << std::endl;
+
+  usps_api_server::ReplayOptions options;
+  options.batch_size = absl::GetFlag(FLAGS_BATCH);
+  options.seconds = absl::GetFlag(FLAGS_SECONDS);
+  options.threads = absl::GetFlag(FLAGS_THREADS);
+  options.pin_cpus = absl::GetFlag(FLAGS_PIN_CPUS);
+  usps_api_server::Replayer replayer(chain.get(), &pcap.packets, options);
+  usps_api_server::ReplayReport report = replayer.Run();
+  report.Print(&std::cout);
+  for (std::size_t i = 0; i < counters.size(); ++i) {
+    std::cout << "counter " << i << ": " << counters.Value(i) << "\n";
+  }
+  return 0;
+}
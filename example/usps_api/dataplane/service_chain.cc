@@ -0,0 +1,75 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#include "service_chain.h"
+#include "cipher_stage.h"
+#include <utility>
+
+// Null ciphers compile to nothing, so the chain holds only stages that do
+// work.
+std::unique_ptr<usps_api_server::ServiceChain>
+usps_api_server::ServiceChain::Compile(
+    const google::protobuf::RepeatedPtrField<ghost::ServiceFn>& service_fns,
+    PacketCounters* counters, std::string* error) {
+  std::unique_ptr<ServiceChain> chain(new ServiceChain());
+  std::size_t counter = 0;
+  for (const ghost::ServiceFn& service_fn : service_fns) {
+    std::unique_ptr<const Stage> stage;
+    switch (service_fn.service_fn_type_case()) {
+      case ghost::ServiceFn::kCipher:
+        if (service_fn.cipher().cipher_protocol() ==
+            ghost::CipherServiceFn::CIPHER_NULL) {
+          continue;
+        }
+        stage = CipherStage::Compile(service_fn.cipher(), error);
+        break;
+      case ghost::ServiceFn::kEncapAndTx:
+        stage = EncapAndTxStage::Compile(service_fn.encap_and_tx(), error);
+        break;
+      case ghost::ServiceFn::kDupEncapAndTx:
+        stage = DupEncapAndTxStage::Compile(service_fn.dup_encap_and_tx(),
+                                            error);
+        break;
+      case ghost::ServiceFn::kDecap:
+        stage = DecapStage::Compile(service_fn.decap(), error);
+        break;
+      case ghost::ServiceFn::kIncrementCounter:
+        if (counters == nullptr || counter >= counters->size()) {
+          *error = "too few packet counters for the chain";
+          return nullptr;
+        }
+        stage.reset(new CounterStage(counters, counter++));
+        break;
+      default:
+        *error = "service function is not set";
+        return nullptr;
+    }
+    if (stage == nullptr) {
+      return nullptr;
+    }
+    chain->stages_.push_back(std::move(stage));
+  }
+  return chain;
+}
+
+// Stops early once every packet has been transmitted or dropped.
+void usps_api_server::ServiceChain::Run(PacketBatch* batch,
+                                        PacketSink* sink) const {
+  for (const std::unique_ptr<const Stage>& stage : stages_) {
+    if (batch->empty()) {
+      return;
+    }
+    stage->Process(batch, sink);
+  }
+  batch->ReleaseAll();
+}
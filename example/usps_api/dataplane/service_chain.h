@@ -0,0 +1,53 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#ifndef SERVICE_CHAIN_H
+#define SERVICE_CHAIN_H
+
+#include "packet.h"
+#include "stages.h"
+#include "example/usps_api/packet_counters.h"
+#include "proto/usps_api/service_function.pb.h"
+#include <google/protobuf/repeated_field.h>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace usps_api_server {
+// The service functions of one SFC compiled into a flat list of stages.
+//
+// A batch of packets runs through the stages in order, each stage over the
+// whole batch. A chain is immutable once compiled and may run batches on
+// any number of threads at once.
+class ServiceChain {
+  public:
+    // Compiles 'service_fns'. Counter stages count into 'counters', which
+    // must outlive the chain and hold one counter per
+    // IncrementCounterServiceFn. Returns nullptr and sets 'error' if a
+    // service function is invalid or not supported.
+    static std::unique_ptr<ServiceChain> Compile(
+        const google::protobuf::RepeatedPtrField<ghost::ServiceFn>&
+            service_fns,
+        PacketCounters* counters, std::string* error);
+    // Runs 'batch' through the stages and leaves it empty. Packets that
+    // reach the end without being transmitted are released.
+    void Run(PacketBatch* batch, PacketSink* sink) const;
+    std::size_t size() const { return stages_.size(); }
+
+  private:
+    std::vector<std::unique_ptr<const Stage>> stages_;
+};
+}
+
+#endif
@@ -0,0 +1,451 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#include "stages.h"
+#include "checksum.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <cstring>
+#include <utility>
+
+constexpr std::size_t usps_api_server::EncapAndTxStage::kGhostHeaderBytes;
+
+namespace {
+constexpr std::size_t kEthernetHeader = 14;
+constexpr std::size_t kVlanTag = 4;
+constexpr std::size_t kIpv4Header = 20;
+constexpr std::size_t kIpv6Header = 40;
+constexpr std::size_t kGreHeader = 4;
+constexpr std::size_t kUdpHeader = 8;
+
+std::uint16_t Load16(const std::uint8_t* p) {
+  return static_cast<std::uint16_t>(p[0] << 8 | p[1]);
+}
+
+void Store16(std::uint8_t* p, std::size_t value) {
+  p[0] = static_cast<std::uint8_t>(value >> 8);
+  p[1] = static_cast<std::uint8_t>(value);
+}
+
+// Returns the sum of the packet's own bytes and its payload.
+std::uint16_t PacketSum(const usps_api_server::Packet& packet) {
+  return usps_api_server::Checksum::Combine(
+      usps_api_server::Checksum::Sum(packet.data(), packet.length()),
+      usps_api_server::Checksum::Sum(packet.payload(),
+                                     packet.payload_length()),
+      packet.length());
+}
+
+// Mixes the GhOST labels at the start of 'data' with the splitmix64
+// finalizer.
+std::uint64_t HashGhostHeader(const std::uint8_t* data) {
+  std::uint64_t first;
+  std::uint64_t second;
+  std::memcpy(&first, data, sizeof(first));
+  std::memcpy(&second, data + sizeof(first), sizeof(second));
+  std::uint64_t h = first * 0x9e3779b97f4a7c15ULL ^ second;
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111ebULL;
+  h ^= h >> 31;
+  return h;
+}
+
+// Stores the checksum for the UDP header at 'p' from the unfolded sum of
+// everything it covers. A zero checksum means none, so it is sent as 0xffff.
+void StoreUdpChecksum(std::uint64_t sum, std::uint8_t* p) {
+  std::uint16_t checksum =
+      static_cast<std::uint16_t>(~usps_api_server::Checksum::Fold(sum));
+  Store16(p + 6, checksum == 0 ? 0xffff : checksum);
+}
+
+bool ValidPort(std::uint32_t port, const char* field, std::string* error) {
+  if (port > 0xffff) {
+    *error = std::string(field) + " is not a valid port";
+    return false;
+  }
+  return true;
+}
+}
+
+std::unique_ptr<usps_api_server::DecapStage>
+usps_api_server::DecapStage::Compile(const ghost::DecapServiceFn& fn,
+                                     std::string* error) {
+  std::vector<Layer> layers;
+  for (const ghost::PacketDecapsulationServiceFn& decap : fn.decaps()) {
+    switch (decap.decap_case()) {
+      case ghost::PacketDecapsulationServiceFn::kEthernetDecap:
+        layers.push_back(ETHERNET);
+        break;
+      case ghost::PacketDecapsulationServiceFn::kIpDecap:
+        layers.push_back(IP);
+        break;
+      case ghost::PacketDecapsulationServiceFn::kGreDecap:
+        layers.push_back(GRE);
+        break;
+      case ghost::PacketDecapsulationServiceFn::kUdpDecap:
+        layers.push_back(UDP);
+        break;
+      default:
+        *error = "decapsulation is not set";
+        return nullptr;
+    }
+  }
+  return std::unique_ptr<DecapStage>(new DecapStage(std::move(layers)));
+}
+
+void usps_api_server::DecapStage::Process(PacketBatch* batch,
+                                          PacketSink* sink) const {
+  batch->Filter([this](Packet* packet) {
+    for (Layer layer : layers_) {
+      if (!Decap(layer, packet)) {
+        return false;
+      }
+    }
+    return true;
+  });
+}
+
+// Headers are checked against the packet length, and the IP and UDP length
+// fields are used to trim any link-layer padding after the payload.
+bool usps_api_server::DecapStage::Decap(Layer layer, Packet* packet) {
+  const std::uint8_t* data = packet->data();
+  std::size_t length = packet->length();
+  switch (layer) {
+    case ETHERNET: {
+      std::size_t size = kEthernetHeader;
+      // Skips up to two 802.1Q or 802.1ad tags.
+      for (int tags = 0; tags < 2 && length >= size + kVlanTag; ++tags) {
+        std::uint16_t type = Load16(data + size - 2);
+        if (type != 0x8100 && type != 0x88a8) {
+          break;
+        }
+        size += kVlanTag;
+      }
+      return packet->Adjust(size);
+    }
+    case IP: {
+      if (length < 1) {
+        return false;
+      }
+      std::size_t size;
+      std::size_t total;
+      if (data[0] >> 4 == 4) {
+        size = static_cast<std::size_t>(data[0] & 0x0f) * 4;
+        if (size < kIpv4Header || length < size) {
+          return false;
+        }
+        total = Load16(data + 2);
+      } else if (data[0] >> 4 == 6) {
+        size = kIpv6Header;
+        if (length < size) {
+          return false;
+        }
+        total = size + Load16(data + 4);
+      } else {
+        return false;
+      }
+      if (total < size || total > length) {
+        return false;
+      }
+      return packet->Trim(length - total) && packet->Adjust(size);
+    }
+    case GRE: {
+      if (length < kGreHeader) {
+        return false;
+      }
+      std::uint16_t flags = Load16(data);
+      // Source routing and versions other than 0 are not supported.
+      if ((flags & 0x4007) != 0) {
+        return false;
+      }
+      std::size_t size = kGreHeader;
+      size += (flags & 0x8000) ? 4 : 0;  // Checksum
+      size += (flags & 0x2000) ? 4 : 0;  // Key
+      size += (flags & 0x1000) ? 4 : 0;  // Sequence number
+      return packet->Adjust(size);
+    }
+    case UDP: {
+      if (length < kUdpHeader) {
+        return false;
+      }
+      std::size_t total = Load16(data + 4);
+      if (total < kUdpHeader || total > length) {
+        return false;
+      }
+      return packet->Trim(length - total) && packet->Adjust(kUdpHeader);
+    }
+  }
+  return false;
+}
+
+// Resolves each header's constant fields. An IP header's protocol comes
+// from the header inside it, if any.
+std::unique_ptr<usps_api_server::EncapAndTxStage>
+usps_api_server::EncapAndTxStage::Compile(const ghost::EncapAndTxServiceFn& fn,
+                                          std::string* error) {
+  std::unique_ptr<EncapAndTxStage> stage(new EncapAndTxStage());
+  for (const ghost::PacketEncapsulationServiceFn& encap : fn.encaps()) {
+    Header header;
+    std::memset(&header, 0, sizeof(header));
+    switch (encap.encap_case()) {
+      case ghost::PacketEncapsulationServiceFn::kIpEncap: {
+        std::uint32_t protocol = encap.ip_encap().has_protocol()
+                                     ? encap.ip_encap().protocol()
+                                     : static_cast<std::uint32_t>(IPPROTO_RAW);
+        if (!stage->headers_.empty()) {
+          switch (stage->headers_.back().kind) {
+            case Header::IPV4:
+              protocol = IPPROTO_IPIP;
+              break;
+            case Header::IPV6:
+              protocol = IPPROTO_IPV6;
+              break;
+            default:
+              protocol = IPPROTO_UDP;
+              break;
+          }
+        }
+        if (protocol > 0xff) {
+          *error = "protocol is not a valid IP protocol";
+          return nullptr;
+        }
+        if (!CompileIp(encap.ip_encap(), static_cast<std::uint8_t>(protocol),
+                       &header, error)) {
+          return nullptr;
+        }
+        break;
+      }
+      case ghost::PacketEncapsulationServiceFn::kUdpEncap: {
+        const ghost::UdpEncapsulationServiceFn& udp = encap.udp_encap();
+        if (!ValidPort(udp.source_port(), "source_port", error) ||
+            !ValidPort(udp.destination_port(), "destination_port", error)) {
+          return nullptr;
+        }
+        header.kind = Header::UDP;
+        header.checksum = udp.checksum();
+        Store16(header.bytes, udp.source_port());
+        Store16(header.bytes + 2, udp.destination_port());
+        break;
+      }
+      case ghost::PacketEncapsulationServiceFn::kGhostUdpEncap: {
+        const ghost::GhostUdpEncapsulationServiceFn& udp =
+            encap.ghost_udp_encap();
+        if (!ValidPort(udp.source_port(), "source_port", error) ||
+            !ValidPort(udp.destination_port_low(), "destination_port_low",
+                       error) ||
+            !ValidPort(udp.destination_port_high(), "destination_port_high",
+                       error)) {
+          return nullptr;
+        }
+        if (udp.destination_port_low() > udp.destination_port_high()) {
+          *error = "destination_port_low is above destination_port_high";
+          return nullptr;
+        }
+        header.kind = Header::GHOST_UDP;
+        header.checksum = udp.checksum();
+        header.port_low =
+            static_cast<std::uint16_t>(udp.destination_port_low());
+        header.port_count = static_cast<std::uint16_t>(
+            udp.destination_port_high() - udp.destination_port_low() + 1);
+        header.source_port = static_cast<std::uint16_t>(udp.source_port());
+        break;
+      }
+      default:
+        *error = "encapsulation is not set";
+        return nullptr;
+    }
+    stage->headers_.push_back(header);
+  }
+  for (std::size_t i = 0; i < stage->headers_.size(); ++i) {
+    if (stage->headers_[i].checksum &&
+        !CompilePseudoHeader(stage->headers_.data() + i,
+                             i + 1 < stage->headers_.size()
+                                 ? &stage->headers_[i + 1]
+                                 : nullptr,
+                             error)) {
+      return nullptr;
+    }
+  }
+  return stage;
+}
+
+// Sums the UDP template with the parts of the pseudo-header that the IP
+// header 'ip' fixes: its addresses and the protocol.
+bool usps_api_server::EncapAndTxStage::CompilePseudoHeader(Header* udp,
+                                                           const Header* ip,
+                                                           std::string* error) {
+  std::uint64_t sum = Checksum::Sum(udp->bytes, kUdpHeader) + IPPROTO_UDP;
+  if (ip != nullptr && ip->kind == Header::IPV4) {
+    sum += Checksum::Sum(ip->bytes + 12, 8);
+  } else if (ip != nullptr && ip->kind == Header::IPV6) {
+    sum += Checksum::Sum(ip->bytes + 8, 32);
+  } else {
+    *error = "a UDP checksum needs an ip_encap right after its udp_encap";
+    return false;
+  }
+  udp->sum = Checksum::Fold(sum);
+  return true;
+}
+
+// Fills an IPv4 or IPv6 header template, whichever family the addresses
+// are in. The lengths, and the IPv4 checksum, are filled per packet.
+bool usps_api_server::EncapAndTxStage::CompileIp(
+    const ghost::IpEncapsulationServiceFn& fn, std::uint8_t protocol,
+    Header* header, std::string* error) {
+  std::uint8_t* bytes = header->bytes;
+  if (inet_pton(AF_INET, fn.source_address().c_str(), bytes + 12) == 1 &&
+      inet_pton(AF_INET, fn.destination_address().c_str(), bytes + 16) == 1) {
+    header->kind = Header::IPV4;
+    bytes[0] = 0x45;
+    bytes[8] = 64;  // TTL
+    bytes[9] = protocol;
+    header->sum = static_cast<std::uint16_t>(
+        ~Checksum::Sum(bytes, kIpv4Header));
+    return true;
+  }
+  if (inet_pton(AF_INET6, fn.source_address().c_str(), bytes + 8) == 1 &&
+      inet_pton(AF_INET6, fn.destination_address().c_str(), bytes + 24) == 1) {
+    header->kind = Header::IPV6;
+    bytes[0] = 0x60;
+    bytes[6] = protocol;
+    bytes[7] = 64;  // Hop limit
+    return true;
+  }
+  *error = "source_address and destination_address are not both IPv4 or "
+           "both IPv6 addresses";
+  return false;
+}
+
+std::size_t usps_api_server::EncapAndTxStage::Size(Header::Kind kind) {
+  switch (kind) {
+    case Header::IPV4:
+      return kIpv4Header;
+    case Header::IPV6:
+      return kIpv6Header;
+    default:
+      return kUdpHeader;
+  }
+}
+
+void usps_api_server::EncapAndTxStage::Process(PacketBatch* batch,
+                                               PacketSink* sink) const {
+  batch->Filter([this](Packet* packet) { return Encap(packet); });
+  if (!batch->empty()) {
+    sink->Transmit(batch);
+  }
+}
+
+// UDP checksums are left zero unless asked for, which RFC 768 allows over
+// IPv4 and RFC 6935 allows for tunnels over IPv6. The IPv4 checksum is the
+// template's updated for the length.
+bool usps_api_server::EncapAndTxStage::Encap(Packet* packet) const {
+  for (const Header& header : headers_) {
+    std::size_t size = Size(header.kind);
+    std::uint16_t payload_sum = header.checksum ? PacketSum(*packet) : 0;
+    std::uint64_t hash = 0;
+    if (header.kind == Header::GHOST_UDP &&
+        packet->total_length() >= kGhostHeaderBytes) {
+      if (packet->length() >= kGhostHeaderBytes) {
+        hash = HashGhostHeader(packet->data());
+      } else {
+        std::uint8_t labels[kGhostHeaderBytes];
+        packet->Copy(0, kGhostHeaderBytes, labels);
+        hash = HashGhostHeader(labels);
+      }
+    }
+    std::uint8_t* p = packet->Prepend(size);
+    if (p == nullptr) {
+      return false;
+    }
+    std::memcpy(p, header.bytes, size);
+    std::size_t length = packet->total_length();
+    switch (header.kind) {
+      case Header::IPV4:
+        Store16(p + 2, length);
+        Store16(p + 10, Checksum::Update16(
+                            static_cast<std::uint16_t>(header.sum), 0,
+                            static_cast<std::uint16_t>(length)));
+        break;
+      case Header::IPV6:
+        Store16(p + 4, length - kIpv6Header);
+        break;
+      case Header::UDP:
+        Store16(p + 4, length);
+        if (header.checksum) {
+          StoreUdpChecksum(header.sum + 2 * length + payload_sum, p);
+        }
+        break;
+      case Header::GHOST_UDP:
+        // Packets of one GhOST tunnel keep one port pair, while different
+        // tunnels spread over the destination range and the dynamic source
+        // ports. Packets too short for a GhOST header use the configured
+        // source port.
+        if (length - size >= kGhostHeaderBytes) {
+          Store16(p, 49152 + (hash >> 48) % 16384);
+        } else {
+          Store16(p, header.source_port);
+        }
+        Store16(p + 2, header.port_low + hash % header.port_count);
+        Store16(p + 4, length);
+        if (header.checksum) {
+          StoreUdpChecksum(header.sum + 2 * length + Load16(p) +
+                               Load16(p + 2) + payload_sum,
+                           p);
+        }
+        break;
+    }
+  }
+  return true;
+}
+
+std::unique_ptr<usps_api_server::DupEncapAndTxStage>
+usps_api_server::DupEncapAndTxStage::Compile(
+    const ghost::DupEncapAndTxServiceFn& fn, std::string* error) {
+  if (fn.dups_size() == 0) {
+    *error = "dup_encap_and_tx has no dups";
+    return nullptr;
+  }
+  std::unique_ptr<DupEncapAndTxStage> stage(new DupEncapAndTxStage());
+  for (const ghost::EncapAndTxServiceFn& dup : fn.dups()) {
+    std::unique_ptr<EncapAndTxStage> encap =
+        EncapAndTxStage::Compile(dup, error);
+    if (encap == nullptr) {
+      return nullptr;
+    }
+    stage->dups_.push_back(std::move(encap));
+  }
+  return stage;
+}
+
+// Shares are taken before the originals are encapsulated by the first dup,
+// so each dup writes only its own headers in front of the shared bytes.
+void usps_api_server::DupEncapAndTxStage::Process(PacketBatch* batch,
+                                                  PacketSink* sink) const {
+  for (std::size_t i = 1; i < dups_.size(); ++i) {
+    PacketBatch shares;
+    for (Packet* packet : *batch) {
+      shares.Add(packet->Share());
+    }
+    dups_[i]->Process(&shares, sink);
+  }
+  dups_[0]->Process(batch, sink);
+}
+
+void usps_api_server::CounterStage::Process(PacketBatch* batch,
+                                            PacketSink* sink) const {
+  if (!batch->empty()) {
+    counters_->Increment(counter_, batch->size());
+  }
+}
@@ -0,0 +1,133 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#ifndef STAGES_H
+#define STAGES_H
+
+#include "packet.h"
+#include "example/usps_api/packet_counters.h"
+#include "proto/usps_api/service_function.pb.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace usps_api_server {
+// Where a chain sends the packets it transmits.
+class PacketSink {
+  public:
+    virtual ~PacketSink() = default;
+    // Takes ownership of the packets in 'batch' and empties it.
+    virtual void Transmit(PacketBatch* batch) = 0;
+};
+
+// A service function compiled for one SFC. Everything that can be resolved
+// from the ServiceFn, such as header templates and counter slots, is
+// resolved when the stage is built, so processing only touches packets.
+class Stage {
+  public:
+    virtual ~Stage() = default;
+    // Processes every packet in 'batch'. Packets the stage drops are
+    // released and packets it transmits are passed to 'sink'; either way
+    // they leave the batch.
+    virtual void Process(PacketBatch* batch, PacketSink* sink) const = 0;
+};
+
+// Removes a list of headers, outermost first. Malformed packets are dropped.
+class DecapStage : public Stage {
+  public:
+    enum Layer { ETHERNET, IP, GRE, UDP };
+    explicit DecapStage(std::vector<Layer> layers)
+        : layers_(std::move(layers)) {}
+    // Returns nullptr and sets 'error' if a decapsulation is unset.
+    static std::unique_ptr<DecapStage> Compile(const ghost::DecapServiceFn& fn,
+                                               std::string* error);
+    void Process(PacketBatch* batch, PacketSink* sink) const override;
+    // Removes the 'layer' header from 'packet'. Returns false if the packet
+    // does not hold a valid one.
+    static bool Decap(Layer layer, Packet* packet);
+
+  private:
+    std::vector<Layer> layers_;
+};
+
+// Prepends a list of headers, innermost first, and transmits the packets.
+class EncapAndTxStage : public Stage {
+  public:
+    // Returns nullptr and sets 'error' if an encapsulation is invalid.
+    static std::unique_ptr<EncapAndTxStage> Compile(
+        const ghost::EncapAndTxServiceFn& fn, std::string* error);
+    void Process(PacketBatch* batch, PacketSink* sink) const override;
+    // Prepends every header to 'packet'. Returns false if it runs out of
+    // headroom.
+    bool Encap(Packet* packet) const;
+
+    // GhOST UDP encapsulation hashes this many leading bytes, which hold
+    // the GhOST labels, to pick its ports.
+    static constexpr std::size_t kGhostHeaderBytes = 16;
+
+  private:
+    // A header with its constant fields filled in at compile time.
+    struct Header {
+      enum Kind { IPV4, IPV6, UDP, GHOST_UDP } kind;
+      std::uint8_t bytes[40];
+      // IPv4: the checksum of the template, whose length is zero.
+      // UDP and GhOST UDP with a checksum: the sum of the pseudo-header's
+      // addresses and protocol and of the template.
+      std::uint32_t sum;
+      // UDP and GhOST UDP: whether to fill the checksum.
+      bool checksum;
+      // GhOST UDP: the destination port range and fallback source port.
+      std::uint16_t port_low;
+      std::uint16_t port_count;
+      std::uint16_t source_port;
+    };
+    static bool CompileIp(const ghost::IpEncapsulationServiceFn& fn,
+                          std::uint8_t protocol, Header* header,
+                          std::string* error);
+    static bool CompilePseudoHeader(Header* udp, const Header* ip,
+                                    std::string* error);
+    static std::size_t Size(Header::Kind kind);
+    std::vector<Header> headers_;
+};
+
+// Shares each packet once per extra dup, then encapsulates and transmits
+// the original and its shares each with their own headers. Sinks see the
+// shares as headers followed by a payload.
+class DupEncapAndTxStage : public Stage {
+  public:
+    // Returns nullptr and sets 'error' if there are no dups or one is
+    // invalid.
+    static std::unique_ptr<DupEncapAndTxStage> Compile(
+        const ghost::DupEncapAndTxServiceFn& fn, std::string* error);
+    void Process(PacketBatch* batch, PacketSink* sink) const override;
+
+  private:
+    std::vector<std::unique_ptr<EncapAndTxStage>> dups_;
+};
+
+// Counts the packets that reach it, once per batch.
+class CounterStage : public Stage {
+  public:
+    CounterStage(PacketCounters* counters, std::size_t counter)
+        : counters_(counters), counter_(counter) {}
+    void Process(PacketBatch* batch, PacketSink* sink) const override;
+
+  private:
+    PacketCounters* counters_;
+    std::size_t counter_;
+};
+}
+
+#endif
@@ -0,0 +1,346 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#include "load_generator.h"
+#include "utils/file_reader.h"
+#include "proto/usps_api/sfc.grpc.pb.h"
+#include <grpcpp/alarm.h>
+#include <grpcpp/client_context.h>
+#include <grpcpp/completion_queue.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <iomanip>
+#include <random>
+#include <sstream>
+#include <thread>
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+void SetFilter(const std::pair<std::uint64_t, std::uint64_t>& label,
+               ghost::SfcFilter* sfc_filter) {
+  ghost::GhostTunnelIdentifier* tunnel_id = sfc_filter->add_filter_layers()
+      ->mutable_ghost_filter()->mutable_tunnel_id();
+  tunnel_id->mutable_terminal_label()->set_value(label.first);
+  tunnel_id->mutable_service_label()->set_value(label.second);
+}
+
+// Converts a steady clock time to the system clock for grpc::Alarm.
+std::chrono::system_clock::time_point ToSystem(Clock::time_point time) {
+  return std::chrono::system_clock::now() +
+         std::chrono::duration_cast<std::chrono::system_clock::duration>(
+             time - Clock::now());
+}
+} // namespace
+
+// Runs the RPCs of one channel on its own completion queue.
+class usps_api_client::LoadGenerator::Worker {
+  public:
+    Worker(const LoadGenerator& generator,
+           std::shared_ptr<grpc::Channel> channel, double qps,
+           std::uint64_t seed)
+        : generator_(generator),
+          stub_(ghost::SfcService::NewStub(channel)),
+          qps_(qps),
+          rng_(seed) {}
+    LoadReport Run(Clock::time_point start, Clock::time_point deadline);
+
+  private:
+    struct Call {
+      LoadReport::Op op;
+      Clock::time_point due;
+      grpc::ClientContext context;
+      grpc::Status status;
+      ghost::CreateSfcResponse create_response;
+      ghost::DeleteSfcResponse delete_response;
+      ghost::QueryResponse query_response;
+      std::unique_ptr<grpc::ClientAsyncResponseReader<
+          ghost::CreateSfcResponse>> create;
+      std::unique_ptr<grpc::ClientAsyncResponseReader<
+          ghost::DeleteSfcResponse>> del;
+      std::unique_ptr<grpc::ClientAsyncResponseReader<
+          ghost::QueryResponse>> query;
+    };
+    // Sends one RPC that was due at 'due'.
+    void Start(Clock::time_point due);
+    LoadReport::Op PickOp();
+    const std::pair<std::uint64_t, std::uint64_t>& PickLabel();
+    const LoadGenerator& generator_;
+    std::unique_ptr<ghost::SfcService::Stub> stub_;
+    double qps_;
+    std::mt19937_64 rng_;
+    grpc::CompletionQueue queue_;
+    grpc::Alarm alarm_;
+    int in_flight_ = 0;
+};
+
+usps_api_client::LoadReport usps_api_client::LoadGenerator::Worker::Run(
+    Clock::time_point start, Clock::time_point deadline) {
+  const LoadOptions& options = generator_.options_;
+  LoadReport report;
+  bool open_loop = qps_ > 0;
+  Clock::duration interval = std::chrono::duration_cast<Clock::duration>(
+      std::chrono::duration<double>(open_loop ? 1 / qps_ : 0));
+  Clock::time_point next = start;
+  // Open-loop RPCs that are due but wait for a free slot.
+  std::deque<Clock::time_point> backlog;
+  bool alarm_pending = false;
+  if (open_loop) {
+    alarm_.Set(&queue_, ToSystem(next), &alarm_);
+    alarm_pending = true;
+  } else {
+    for (int i = 0; i < options.in_flight; ++i) {
+      Start(Clock::now());
+    }
+  }
+  void* tag;
+  bool ok;
+  while ((in_flight_ > 0 || alarm_pending) && queue_.Next(&tag, &ok)) {
+    Clock::time_point now = Clock::now();
+    if (tag == &alarm_) {
+      alarm_pending = false;
+      for (; next <= now && next < deadline; next += interval) {
+        if (in_flight_ < options.in_flight) {
+          Start(next);
+        } else {
+          backlog.push_back(next);
+        }
+      }
+      if (next < deadline) {
+        alarm_.Set(&queue_, ToSystem(next), &alarm_);
+        alarm_pending = true;
+      }
+      continue;
+    }
+    Call* call = static_cast<Call*>(tag);
+    --in_flight_;
+    if (ok && call->status.ok()) {
+      ++report.ok[call->op];
+      report.latency[call->op].Record(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              now - call->due).count());
+    } else {
+      ++report.failed[call->op];
+      if (call->status.error_code() == grpc::StatusCode::RESOURCE_EXHAUSTED) {
+        ++report.rejected[call->op];
+      }
+    }
+    delete call;
+    if (now >= deadline) {
+      continue;
+    }
+    if (!open_loop) {
+      Start(now);
+    } else if (!backlog.empty()) {
+      Start(backlog.front());
+      backlog.pop_front();
+    }
+  }
+  report.dropped = backlog.size();
+  report.seconds = std::chrono::duration<double>(
+      std::min(Clock::now(), deadline) - start).count();
+  queue_.Shutdown();
+  while (queue_.Next(&tag, &ok)) {
+  }
+  return report;
+}
+
+void usps_api_client::LoadGenerator::Worker::Start(Clock::time_point due) {
+  Call* call = new Call;
+  call->op = PickOp();
+  call->due = due;
+  const std::pair<std::uint64_t, std::uint64_t>& label = PickLabel();
+  switch (call->op) {
+    case LoadReport::CREATE: {
+      ghost::CreateSfcRequest request;
+      SetFilter(label, request.mutable_sfc_filter());
+      call->create =
+          stub_->PrepareAsyncCreateSfc(&call->context, request, &queue_);
+      call->create->StartCall();
+      call->create->Finish(&call->create_response, &call->status, call);
+      break;
+    }
+    case LoadReport::DELETE: {
+      ghost::DeleteSfcRequest request;
+      SetFilter(label, request.mutable_sfc_filter());
+      call->del =
+          stub_->PrepareAsyncDeleteSfc(&call->context, request, &queue_);
+      call->del->StartCall();
+      call->del->Finish(&call->delete_response, &call->status, call);
+      break;
+    }
+    default: {
+      ghost::QueryRequest request;
+      SetFilter(label, request.mutable_sfc_filter());
+      call->query = stub_->PrepareAsyncQuery(&call->context, request, &queue_);
+      call->query->StartCall();
+      call->query->Finish(&call->query_response, &call->status, call);
+      break;
+    }
+  }
+  ++in_flight_;
+}
+
+usps_api_client::LoadReport::Op
+usps_api_client::LoadGenerator::Worker::PickOp() {
+  const LoadOptions& options = generator_.options_;
+  std::uint64_t total =
+      options.create_weight + options.delete_weight + options.query_weight;
+  std::uint64_t pick = rng_() % total;
+  if (pick < static_cast<std::uint64_t>(options.create_weight)) {
+    return LoadReport::CREATE;
+  }
+  if (pick < static_cast<std::uint64_t>(options.create_weight +
+                                        options.delete_weight)) {
+    return LoadReport::DELETE;
+  }
+  return LoadReport::QUERY;
+}
+
+const std::pair<std::uint64_t, std::uint64_t>&
+usps_api_client::LoadGenerator::Worker::PickLabel() {
+  const std::vector<std::pair<std::uint64_t, std::uint64_t>>& labels =
+      generator_.options_.labels;
+  if (generator_.zipf_cdf_.empty()) {
+    return labels[rng_() % labels.size()];
+  }
+  double u = std::uniform_real_distribution<double>(0, 1)(rng_);
+  std::size_t rank = std::lower_bound(generator_.zipf_cdf_.begin(),
+                                      generator_.zipf_cdf_.end(), u) -
+                     generator_.zipf_cdf_.begin();
+  return labels[std::min(rank, labels.size() - 1)];
+}
+
+usps_api_client::LoadGenerator::LoadGenerator(
+    std::vector<std::shared_ptr<grpc::Channel>> channels, LoadOptions options)
+    : channels_(std::move(channels)), options_(std::move(options)) {
+  options_.in_flight = std::max(options_.in_flight, 1);
+  if (options_.create_weight + options_.delete_weight +
+          options_.query_weight <= 0) {
+    options_.create_weight = 1;
+  }
+  if (options_.labels.empty()) {
+    options_.labels.emplace_back(1, 1);
+  }
+  // Rank r is drawn with probability proportional to 1 / (r + 1)^s.
+  if (options_.distribution == LoadOptions::ZIPF) {
+    zipf_cdf_.reserve(options_.labels.size());
+    double sum = 0;
+    for (std::size_t rank = 0; rank < options_.labels.size(); ++rank) {
+      sum += 1 / std::pow(rank + 1, options_.zipf_exponent);
+      zipf_cdf_.push_back(sum);
+    }
+    for (double& p : zipf_cdf_) {
+      p /= sum;
+    }
+  }
+}
+
+usps_api_client::LoadReport usps_api_client::LoadGenerator::Run() {
+  std::vector<std::unique_ptr<Worker>> workers;
+  for (std::size_t i = 0; i < channels_.size(); ++i) {
+    workers.emplace_back(new Worker(*this, channels_[i],
+                                    options_.qps / channels_.size(), i + 1));
+  }
+  std::vector<LoadReport> reports(workers.size());
+  Clock::time_point start = Clock::now();
+  Clock::time_point deadline =
+      start + std::chrono::duration_cast<Clock::duration>(
+                  std::chrono::duration<double>(options_.seconds));
+  std::vector<std::thread> threads;
+  for (std::size_t i = 0; i < workers.size(); ++i) {
+    threads.emplace_back([&workers, &reports, i, start, deadline]() {
+      reports[i] = workers[i]->Run(start, deadline);
+    });
+  }
+  LoadReport total;
+  for (std::size_t i = 0; i < threads.size(); ++i) {
+    threads[i].join();
+    total.Merge(reports[i]);
+  }
+  return total;
+}
+
+bool usps_api_client::LoadGenerator::ParseMix(const std::string& mix,
+                                              LoadOptions* options) {
+  std::istringstream in(mix);
+  char colon1 = 0;
+  char colon2 = 0;
+  int create = 0;
+  int del = 0;
+  int query = 0;
+  if (!(in >> create >> colon1 >> del >> colon2 >> query) || colon1 != ':' ||
+      colon2 != ':' || create < 0 || del < 0 || query < 0 ||
+      create + del + query == 0) {
+    return false;
+  }
+  options->create_weight = create;
+  options->delete_weight = del;
+  options->query_weight = query;
+  return true;
+}
+
+bool usps_api_client::LoadGenerator::ReadLabels(const std::string& filename,
+                                                LoadOptions* options) {
+  FileReader::MappedFile file(filename);
+  if (!file.ok()) {
+    return false;
+  }
+  FileReader::ParsePairs(file.data(), [options](std::uint64_t terminal,
+                                                std::uint64_t service) {
+    options->labels.emplace_back(terminal, service);
+  });
+  return !options->labels.empty();
+}
+
+void usps_api_client::LoadReport::Merge(const LoadReport& other) {
+  seconds = std::max(seconds, other.seconds);
+  for (int op = 0; op < kOps; ++op) {
+    ok[op] += other.ok[op];
+    failed[op] += other.failed[op];
+    rejected[op] += other.rejected[op];
+    latency[op].Merge(other.latency[op]);
+  }
+  dropped += other.dropped;
+}
+
+void usps_api_client::LoadReport::Print(std::ostream* out) const {
+  static const char* const kNames[kOps] = {"CreateSfc", "DeleteSfc", "Query"};
+  std::uint64_t total = 0;
+  std::uint64_t total_rejected = 0;
+  for (int op = 0; op < kOps; ++op) {
+    total += ok[op] + failed[op];
+    total_rejected += rejected[op];
+  }
+  *out << std::fixed << std::setprecision(1) << total << " RPCs in "
+       << seconds << " s: " << (seconds > 0 ? total / seconds : 0)
+       << " RPC/s, " << total_rejected << " rejected, " << dropped
+       << " dropped\n";
+  *out << std::left << std::setw(10) << "rpc" << std::right << std::setw(10)
+       << "ok" << std::setw(10) << "failed" << std::setw(12) << "p50 us"
+       << std::setw(12) << "p99 us" << std::setw(12) << "p99.9 us"
+       << std::setw(12) << "max us" << "\n";
+  for (int op = 0; op < kOps; ++op) {
+    if (ok[op] + failed[op] == 0) {
+      continue;
+    }
+    *out << std::left << std::setw(10) << kNames[op] << std::right
+         << std::setw(10) << ok[op] << std::setw(10) << failed[op]
+         << std::setw(12) << latency[op].Percentile(50) / 1e3
+         << std::setw(12) << latency[op].Percentile(99) / 1e3
+         << std::setw(12) << latency[op].Percentile(99.9) / 1e3
+         << std::setw(12) << latency[op].max() / 1e3 << "\n";
+  }
+}
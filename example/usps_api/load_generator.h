@@ -0,0 +1,90 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#ifndef LOAD_GENERATOR_H
+#define LOAD_GENERATOR_H
+
+#include "utils/latency_histogram.h"
+#include <grpcpp/channel.h>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace usps_api_client {
+// How a LoadGenerator drives the server.
+struct LoadOptions {
+  enum Distribution { UNIFORM, ZIPF };
+  // Outstanding RPCs allowed on each channel.
+  int in_flight = 64;
+  // Total target rate over all channels. 0 runs a closed loop, starting a
+  // new RPC as soon as one finishes.
+  double qps = 0;
+  double seconds = 10;
+  // Relative weights of CreateSfc, DeleteSfc and Query.
+  int create_weight = 1;
+  int delete_weight = 0;
+  int query_weight = 0;
+  // Terminal and service labels of the tunnel filters to send, and how
+  // they are drawn.
+  std::vector<std::pair<std::uint64_t, std::uint64_t>> labels;
+  Distribution distribution = UNIFORM;
+  double zipf_exponent = 1.0;
+};
+
+// Throughput and latency of one run.
+struct LoadReport {
+  enum Op { CREATE, DELETE, QUERY, kOps };
+  double seconds = 0;
+  std::uint64_t ok[kOps] = {};
+  std::uint64_t failed[kOps] = {};
+  // The failed RPCs the server rejected with RESOURCE_EXHAUSTED.
+  std::uint64_t rejected[kOps] = {};
+  // Open-loop RPCs that were due but not sent because every slot was busy.
+  std::uint64_t dropped = 0;
+  // Latency of the RPCs that succeeded. Failures, which a loaded server
+  // often returns quickly, would otherwise pull the percentiles down.
+  LatencyHistogram latency[kOps];
+  void Merge(const LoadReport& other);
+  void Print(std::ostream* out) const;
+};
+
+// Drives a GhOST server with the async stub API.
+//
+// Each channel gets its own completion queue and thread, which keeps up to
+// 'in_flight' RPCs outstanding. In a closed loop every completion starts
+// the next RPC. In an open loop RPCs are due at fixed intervals; a due RPC
+// waits for a free slot, and its latency is measured from when it was due,
+// so a slow server is not hidden by the client sending less.
+class LoadGenerator {
+  public:
+    LoadGenerator(std::vector<std::shared_ptr<grpc::Channel>> channels,
+                  LoadOptions options);
+    LoadReport Run();
+    // Parses "create:delete:query" weights such as "8:1:1".
+    static bool ParseMix(const std::string& mix, LoadOptions* options);
+    // Reads tunnel labels from a CSV file of terminal,service lines.
+    static bool ReadLabels(const std::string& filename, LoadOptions* options);
+
+  private:
+    class Worker;
+    std::vector<std::shared_ptr<grpc::Channel>> channels_;
+    LoadOptions options_;
+    // Cumulative probabilities of the label ranks for ZIPF.
+    std::vector<double> zipf_cdf_;
+};
+}
+
+#endif
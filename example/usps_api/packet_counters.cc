@@ -0,0 +1,52 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#include "packet_counters.h"
+#include <sched.h>
+#include <unistd.h>
+
+constexpr std::size_t usps_api_server::PacketCounters::kPerLine;
+
+// SFCs without counters allocate nothing.
+usps_api_server::PacketCounters::PacketCounters(std::size_t count)
+    : count_(count),
+      cpus_(Cpus()),
+      lines_per_cpu_((count + kPerLine - 1) / kPerLine),
+      lines_(count == 0 ? nullptr : new Line[cpus_ * lines_per_cpu_]()) {}
+
+std::uint64_t usps_api_server::PacketCounters::Value(
+    std::size_t counter) const {
+  std::uint64_t sum = 0;
+  for (std::size_t cpu = 0; cpu < cpus_; ++cpu) {
+    sum += lines_[cpu * lines_per_cpu_ + counter / kPerLine]
+               .values[counter % kPerLine]
+               .load(std::memory_order_relaxed);
+  }
+  return sum;
+}
+
+// Counts configured rather than online CPUs, since CPU numbers of offline
+// CPUs may still be returned once they come up.
+std::size_t usps_api_server::PacketCounters::Cpus() {
+  static const std::size_t cpus = [] {
+    long configured = sysconf(_SC_NPROCESSORS_CONF);
+    return configured > 0 ? static_cast<std::size_t>(configured)
+                          : std::size_t{1};
+  }();
+  return cpus;
+}
+
+std::size_t usps_api_server::PacketCounters::CurrentCpu() {
+  int cpu = sched_getcpu();
+  return cpu < 0 ? 0 : static_cast<std::size_t>(cpu);
+}
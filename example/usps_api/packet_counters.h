@@ -0,0 +1,67 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#ifndef PACKET_COUNTERS_H
+#define PACKET_COUNTERS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace usps_api_server {
+// The packet counters of one SFC, sharded per CPU.
+//
+// Each CPU has its own row of the counters, padded to whole cache lines, so
+// threads counting packets on different CPUs never write the same line.
+// An increment is a relaxed add to the current CPU's row; it stays atomic
+// because a thread may be preempted and another scheduled on the same CPU
+// between reading the CPU number and the add. Reading a counter sums its
+// column over the CPUs.
+class PacketCounters {
+  public:
+    explicit PacketCounters(std::size_t count);
+    PacketCounters(const PacketCounters&) = delete;
+    PacketCounters& operator=(const PacketCounters&) = delete;
+    std::size_t size() const { return count_; }
+    // Adds 'delta' to 'counter' in the row of the calling thread's CPU.
+    void Increment(std::size_t counter, std::uint64_t delta = 1) {
+      IncrementOn(CurrentCpu(), counter, delta);
+    }
+    void IncrementOn(std::size_t cpu, std::size_t counter,
+                     std::uint64_t delta) {
+      Cell(cpu % cpus_, counter)->fetch_add(delta, std::memory_order_relaxed);
+    }
+    // Returns the sum of 'counter' over every CPU.
+    std::uint64_t Value(std::size_t counter) const;
+    // Returns the number of CPUs counters are sharded over.
+    static std::size_t Cpus();
+    static std::size_t CurrentCpu();
+
+  private:
+    static constexpr std::size_t kPerLine = 64 / sizeof(std::uint64_t);
+    struct alignas(64) Line {
+      std::atomic<std::uint64_t> values[kPerLine];
+    };
+    std::atomic<std::uint64_t>* Cell(std::size_t cpu, std::size_t counter) {
+      return &lines_[cpu * lines_per_cpu_ + counter / kPerLine]
+                  .values[counter % kPerLine];
+    }
+    std::size_t count_;
+    std::size_t cpus_;
+    std::size_t lines_per_cpu_;
+    std::unique_ptr<Line[]> lines_;
+};
+}
+
+#endif
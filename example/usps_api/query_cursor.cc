@@ -0,0 +1,80 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#include "query_cursor.h"
+
+constexpr std::size_t usps_api_server::QueryCursor::kDefaultPageSize;
+
+usps_api_server::QueryCursor::QueryCursor(const Scheduler& scheduler,
+                                          const ghost::QueryRequest& request)
+    : scheduler_(scheduler), table_(scheduler.table()), request_(request),
+      page_size_(request.page_size() > 0 ? request.page_size()
+                                         : kDefaultPageSize) {
+  if (request_.has_sfc_filter()) {
+    selected_ = table_->Find(request_.sfc_filter());
+    // Nothing else is walked for a filtered query.
+    shard_ = SfcTable::kShards;
+  }
+  if (request_.include_future_instructions()) {
+    pending_done_ = false;
+    // The first page tells found() whether a filter matches anything.
+    FetchPending();
+  }
+}
+
+void usps_api_server::QueryCursor::FetchPending() {
+  pending_.clear();
+  pending_pos_ = 0;
+  scheduler_.PendingPage(request_, page_size_, &position_, &pending_);
+  pending_done_ = pending_.empty();
+}
+
+bool usps_api_server::QueryCursor::found() const {
+  return !request_.has_sfc_filter() || selected_ != nullptr ||
+         !pending_.empty();
+}
+
+bool usps_api_server::QueryCursor::Next(ghost::QueryResponse* response) {
+  response->Clear();
+  std::size_t count = 0;
+  bool counters = request_.include_counter_values();
+  if (selected_ != nullptr) {
+    SfcTable::Export(*selected_, counters, response->add_installed_sfcs());
+    selected_ = nullptr;
+    ++count;
+  }
+  while (count < page_size_) {
+    if (sfc_pos_ == sfcs_.size()) {
+      if (shard_ == SfcTable::kShards) {
+        break;
+      }
+      // Drops the previous shard before copying the next one.
+      sfcs_.clear();
+      sfc_pos_ = 0;
+      table_->CopyShard(shard_++, &sfcs_);
+      continue;
+    }
+    SfcTable::Export(*sfcs_[sfc_pos_++], counters,
+                     response->add_installed_sfcs());
+    ++count;
+  }
+  while (count < page_size_ && !pending_done_) {
+    if (pending_pos_ == pending_.size()) {
+      FetchPending();
+      continue;
+    }
+    *response->add_scheduled_requests() = *pending_[pending_pos_++];
+    ++count;
+  }
+  return count > 0;
+}
@@ -0,0 +1,66 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#ifndef QUERY_CURSOR_H
+#define QUERY_CURSOR_H
+
+#include "scheduler.h"
+#include "sfc_table.h"
+#include "proto/usps_api/sfc.pb.h"
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+namespace usps_api_server {
+// Walks the results of a query in pages for QueryStream.
+//
+// Installed SFCs are copied out of the table one shard at a time, so the
+// cursor holds pointers to at most one shard's SFCs and each response holds
+// at most one page. Scheduled requests are fetched a page at a time,
+// resuming from the activation time and order of the last one fetched.
+// Counter values are read when their page is built. The scheduler must
+// outlive the cursor.
+class QueryCursor {
+  public:
+    static constexpr std::size_t kDefaultPageSize = 1000;
+
+    QueryCursor(const Scheduler& scheduler, const ghost::QueryRequest& request);
+    // Returns false if the query has a filter that matches nothing.
+    bool found() const;
+    // Fills 'response' with the next page. Returns false once every result
+    // has been returned.
+    bool Next(ghost::QueryResponse* response);
+
+  private:
+    // Fetches the next page of scheduled requests into pending_.
+    void FetchPending();
+    const Scheduler& scheduler_;
+    std::shared_ptr<SfcTable> table_;
+    ghost::QueryRequest request_;
+    std::size_t page_size_;
+    // The SFC selected by the query's filter, if it has one.
+    std::shared_ptr<const InstalledSfc> selected_;
+    // Next shard to copy and the SFCs copied from the last one.
+    std::size_t shard_ = 0;
+    std::vector<std::shared_ptr<const InstalledSfc>> sfcs_;
+    std::size_t sfc_pos_ = 0;
+    // The page of scheduled requests being returned, and where the next
+    // one starts.
+    std::vector<std::shared_ptr<const ghost::ScheduledRequest>> pending_;
+    std::size_t pending_pos_ = 0;
+    Scheduler::PendingPosition position_;
+    bool pending_done_ = true;
+};
+}
+
+#endif
@@ -23,6 +23,7 @@
 #include <grpcpp/server_context.h>
 #include <grpcpp/security/server_credentials.h>
 #include <arpa/inet.h>
+#include <signal.h>
 
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
@@ -31,9 +32,11 @@
 ABSL_FLAG(std::string, HOST, "", "The host of the ip to listen on");
 // The port will be within a valid range due to the flag being uint16_t type.
 ABSL_FLAG(std::uint16_t, PORT, 0, "The port of the ip to listen on");
+ABSL_FLAG(std::string, SNAPSHOT, "",
+          "The compiled filter snapshot to start from, or empty for none");
 
 // Gets server credentials if ssl is enabled
-std::shared_ptr<grpc::ServerCredentials> GetCreds(usps_api_server::Config* config) {
+std::shared_ptr<grpc::ServerCredentials> GetCreds(const usps_api_server::Config* config) {
   if (config->enable_ssl_) {
     std::string key = FileReader::ReadString(config->key_);
     std::string cert = FileReader::ReadString(config->cert_);
@@ -48,36 +51,57 @@ std::shared_ptr<grpc::ServerCredentials> GetCreds(usps_api_server::Config* confi
   }
 }
 
+// Returns the signals that shut the server down.
+sigset_t ShutdownSignals() {
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  return signals;
+}
+
 // Runs the server using the grpc server builder.
 // See https://grpc.io/docs/languages/cpp/basics/ for more info
 // TODO(sam) use absl:status as return type & implement configuration.
 void Run(std::string host,
          uint16_t port,
-         std::shared_ptr<usps_api_server::Config> config) {
+         std::shared_ptr<usps_api_server::ConfigStore> store) {
   std::string server_address = host + ":" + std::to_string(port);
   std::cout << "Server attempting to listen on " << server_address << std::endl;
   grpc::ServerBuilder builder;
-  usps_api_server::GhostImpl service(config);
+  usps_api_server::ConfigSnapshot config = store->Load();
+  std::shared_ptr<usps_api_server::Scheduler> scheduler =
+      std::make_shared<usps_api_server::Scheduler>(
+          std::make_shared<usps_api_server::SfcTable>());
+  usps_api_server::GhostImpl service(store, scheduler);
   ghost::SfcService::AsyncService async_service;
-  std::unique_ptr<grpc::ServerCompletionQueue> cq;
+  usps_api_server::WorkerPool pool(&async_service, store, scheduler);
   std::shared_ptr<grpc::ServerCredentials> creds = GetCreds(config.get());
   builder.AddListeningPort(server_address, creds);
   if ((config.get())->async_) {
     builder.RegisterService(&async_service);
-    cq = builder.AddCompletionQueue();
+    pool.AddQueues(&builder, config->worker_threads_);
   } else {
     builder.RegisterService(&service);
   }
   std::unique_ptr<grpc::Server> server = builder.BuildAndStart();
-  if ((config.get())->async_) {
-    usps_api_server::HandleRpcs(async_service, cq.get(), config);
-  }
   if (server == nullptr) {
     std::cout << "Server could not listen on " << server_address << std::endl;
     return;
   }
+  if ((config.get())->async_) {
+    pool.Start(config->worker_calls_, config->pin_cpus_);
+  }
   std::cout << "Server listening on " << server_address << std::endl;
-  server->Wait();
+  // Waits for SIGINT or SIGTERM, which are blocked on every thread.
+  sigset_t signals = ShutdownSignals();
+  int signal;
+  sigwait(&signals, &signal);
+  std::cout << "Shutting down..." << std::endl;
+  server->Shutdown();
+  if ((config.get())->async_) {
+    pool.Shutdown();
+  }
 }
 
 // Verifies a valid IPV4 address in the form A.B.C.D or localhost.
@@ -95,22 +119,41 @@ bool IsValidAddress(std::string host) {
 // See https://abseil.io/docs/cpp/guides/flags for more information on flags.
 int main(int argc, char *argv[]) {
   absl::ParseCommandLine(argc, argv);
+  // Blocks shutdown signals before any thread starts so that only Run
+  // receives them.
+  sigset_t signals = ShutdownSignals();
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
   std::shared_ptr<usps_api_server::Config> config =
       std::make_shared<usps_api_server::Config>();
-  if(!(config.get()->Initialize())) {
+  // Starts from the snapshot if there is one. The monitor thread checks it
+  // against the source files once the server is up.
+  std::string snapshot = absl::GetFlag(FLAGS_SNAPSHOT);
+  bool from_snapshot =
+      !snapshot.empty() && config->InitializeFromSnapshot(snapshot);
+  std::vector<usps_api_server::FilterSnapshot::Source> sources;
+  if (!from_snapshot) {
+    sources = usps_api_server::ConfigStore::StatFiles(*config);
+  }
+  if(!from_snapshot && !(config.get()->Initialize())) {
     std::cout << "Configuration file failed to initialize" << std::endl;
     return 1;
   }
-  config.get()->MonitorConfig();
+  std::shared_ptr<usps_api_server::ConfigStore> store =
+      std::make_shared<usps_api_server::ConfigStore>(config, sources);
+  store->SetSnapshot(snapshot);
+  if (!from_snapshot) {
+    store->WriteSnapshot();
+  }
+  store->MonitorConfig();
   // Prioritize using address specified in flags.
   if (IsValidAddress(absl::GetFlag(FLAGS_HOST))) {
-    Run(absl::GetFlag(FLAGS_HOST), absl::GetFlag(FLAGS_PORT), config);
+    Run(absl::GetFlag(FLAGS_HOST), absl::GetFlag(FLAGS_PORT), store);
   } else if (config.get()->host_ != "") {
     // Fall back to address in config if present.
     std::string host = config.get()->host_;
     std::uint16_t port = config.get()->port_;
     if (IsValidAddress(host)) {
-      Run(host, port, config);
+      Run(host, port, store);
     } else {
       std::cout << "Invalid address in config." << std::endl;
     }
@@ -0,0 +1,437 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#include "scheduler.h"
+#include <algorithm>
+#include <chrono>
+#include <utility>
+
+namespace {
+// Seconds from the Unix epoch to the GPS epoch, 1980-01-06T00:00:00Z.
+constexpr std::int64_t kGpsEpochOffset = 315964800;
+constexpr std::int64_t kNanosPerSecond = 1000000000;
+}
+
+usps_api_server::Scheduler::Scheduler(std::shared_ptr<SfcTable> table)
+    : table_(table) {
+  thread_ = std::thread(&Scheduler::Run, this);
+}
+
+usps_api_server::Scheduler::~Scheduler() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  wake_.notify_one();
+  thread_.join();
+}
+
+grpc::Status usps_api_server::Scheduler::Create(
+    const ghost::CreateSfcRequest& request) {
+  Plan plan;
+  grpc::Status status = PlanCreate(request, Now(), 0, &plan);
+  if (!status.ok()) {
+    return status;
+  }
+  std::vector<grpc::Status> statuses(1);
+  Commit(&plan, &statuses);
+  return statuses[0];
+}
+
+grpc::Status usps_api_server::Scheduler::Delete(
+    const ghost::DeleteSfcRequest& request) {
+  Plan plan;
+  grpc::Status status = PlanDelete(request, Now(), 0, &plan);
+  if (!status.ok()) {
+    return status;
+  }
+  std::vector<grpc::Status> statuses(1);
+  Commit(&plan, &statuses);
+  return statuses[0];
+}
+
+std::vector<grpc::Status> usps_api_server::Scheduler::Program(
+    const std::vector<const ghost::ScheduledRequest*>& requests) {
+  std::vector<grpc::Status> statuses(requests.size());
+  Plan plan;
+  plan.updates.reserve(requests.size());
+  Time now = Now();
+  for (std::size_t i = 0; i < requests.size(); ++i) {
+    if (requests[i]->has_create_request()) {
+      statuses[i] = PlanCreate(requests[i]->create_request(), now, i, &plan);
+    } else if (requests[i]->has_delete_request()) {
+      statuses[i] = PlanDelete(requests[i]->delete_request(), now, i, &plan);
+    } else {
+      statuses[i] = grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                                 "empty request");
+    }
+  }
+  Commit(&plan, &statuses);
+  return statuses;
+}
+
+grpc::Status usps_api_server::Scheduler::PlanCreate(
+    const ghost::CreateSfcRequest& request, Time now, std::size_t item,
+    Plan* plan) {
+  if ((request.has_activation_time() && !Valid(request.activation_time())) ||
+      (request.has_expiration_time() && !Valid(request.expiration_time()))) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "invalid timestamp");
+  }
+  Time activation = request.has_activation_time()
+      ? ToTime(request.activation_time()) : now;
+  if (request.has_expiration_time() &&
+      ToTime(request.expiration_time()) <= std::max(activation, now)) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "expiration_time must be after activation_time");
+  }
+  // Scheduled creates are compiled now too, so service functions the data
+  // plane cannot run are rejected instead of failing at activation.
+  SfcTable::Update update;
+  std::string error;
+  if (!SfcTable::MakeInsert(request, &update, &error)) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, error);
+  }
+  std::unique_ptr<Entry> entry(new Entry());
+  if (activation > now) {
+    std::shared_ptr<ghost::ScheduledRequest> scheduled =
+        std::make_shared<ghost::ScheduledRequest>();
+    *scheduled->mutable_create_request() = request;
+    entry->due = activation;
+    entry->kind = ACTIVATE;
+    entry->request = std::move(scheduled);
+    entry->index_key = IndexKey(request.sfc_filter(), activation);
+    entry->update = std::move(update);
+  } else {
+    plan->updates.push_back(std::move(update));
+    if (!request.has_expiration_time()) {
+      return grpc::Status::OK;
+    }
+    entry->due = ToTime(request.expiration_time());
+    entry->kind = EXPIRE;
+    entry->installed = plan->updates.back().installed;
+  }
+  plan->ops.push_back(Plan::Op{item, std::move(entry), std::string()});
+  return grpc::Status::OK;
+}
+
+grpc::Status usps_api_server::Scheduler::PlanDelete(
+    const ghost::DeleteSfcRequest& request, Time now, std::size_t item,
+    Plan* plan) {
+  if ((request.has_activation_time() && !Valid(request.activation_time())) ||
+      (request.has_timestamp_to_deactivate() &&
+       !Valid(request.timestamp_to_deactivate()))) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "invalid timestamp");
+  }
+  if (request.has_timestamp_to_deactivate()) {
+    plan->ops.push_back(Plan::Op{item, nullptr, IndexKey(
+        request.sfc_filter(), ToTime(request.timestamp_to_deactivate()))});
+    return grpc::Status::OK;
+  }
+  if (request.has_activation_time() &&
+      ToTime(request.activation_time()) > now) {
+    std::shared_ptr<ghost::ScheduledRequest> scheduled =
+        std::make_shared<ghost::ScheduledRequest>();
+    *scheduled->mutable_delete_request() = request;
+    std::unique_ptr<Entry> entry(new Entry());
+    entry->due = ToTime(request.activation_time());
+    entry->kind = ACTIVATE;
+    entry->request = std::move(scheduled);
+    entry->index_key = IndexKey(request.sfc_filter(), entry->due);
+    plan->ops.push_back(Plan::Op{item, std::move(entry), std::string()});
+    return grpc::Status::OK;
+  }
+  // Deleting an SFC that is not installed is not an error.
+  plan->updates.push_back(SfcTable::MakeErase(request.sfc_filter()));
+  return grpc::Status::OK;
+}
+
+// Applies the table updates of 'plan', then its scheduling changes in
+// request order. Cancels that find nothing set their request's status.
+void usps_api_server::Scheduler::Commit(Plan* plan,
+                                        std::vector<grpc::Status>* statuses) {
+  if (!plan->updates.empty()) {
+    table_->Apply(std::move(plan->updates));
+  }
+  if (plan->ops.empty()) {
+    return;
+  }
+  // Cancelled and replaced entries are released after unlocking.
+  std::vector<std::unique_ptr<Entry>> cancelled;
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (Plan::Op& op : plan->ops) {
+    if (op.entry != nullptr) {
+      std::unique_ptr<Entry> replaced = Schedule(std::move(op.entry));
+      if (replaced != nullptr) {
+        cancelled.push_back(std::move(replaced));
+      }
+      continue;
+    }
+    auto it = index_.find(op.cancel);
+    if (it == index_.end()) {
+      (*statuses)[op.item] = grpc::Status(
+          grpc::StatusCode::NOT_FOUND,
+          "no request scheduled at timestamp_to_deactivate");
+    } else {
+      cancelled.push_back(Remove(it->second->pos));
+    }
+  }
+}
+
+bool usps_api_server::Scheduler::Query(const ghost::QueryRequest& request,
+                                       ghost::QueryResponse* response) const {
+  bool found = table_->Query(request, response);
+  if (!request.include_future_instructions()) {
+    return found;
+  }
+  std::vector<std::shared_ptr<const ghost::ScheduledRequest>> requests =
+      Pending(request);
+  response->mutable_scheduled_requests()->Reserve(requests.size());
+  for (const std::shared_ptr<const ghost::ScheduledRequest>& scheduled :
+       requests) {
+    *response->add_scheduled_requests() = *scheduled;
+  }
+  return found || !requests.empty();
+}
+
+std::vector<std::shared_ptr<const ghost::ScheduledRequest>>
+usps_api_server::Scheduler::Pending(const ghost::QueryRequest& request) const {
+  std::vector<std::shared_ptr<const ghost::ScheduledRequest>> requests;
+  PendingPosition position;
+  PendingPage(request, std::numeric_limits<std::size_t>::max(), &position,
+              &requests);
+  return requests;
+}
+
+void usps_api_server::Scheduler::PendingPage(
+    const ghost::QueryRequest& request, std::size_t limit,
+    PendingPosition* position,
+    std::vector<std::shared_ptr<const ghost::ScheduledRequest>>* requests)
+    const {
+  std::string key;
+  if (request.has_sfc_filter()) {
+    key = SfcTable::Key(SfcTable::Normalize(request.sfc_filter()));
+  }
+  std::size_t count = 0;
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = activations_.lower_bound({position->due, position->seq});
+  for (; it != activations_.end() && count < limit; ++it) {
+    const Entry& entry = *it->second;
+    if (key.empty() ||
+        (entry.index_key.size() == key.size() + sizeof(Time) &&
+         entry.index_key.compare(0, key.size(), key) == 0)) {
+      requests->push_back(entry.request);
+      ++count;
+    }
+  }
+  if (it != activations_.end()) {
+    *position = PendingPosition{it->first.first, it->first.second};
+  } else {
+    *position = PendingPosition{std::numeric_limits<Time>::max(),
+                                std::numeric_limits<std::uint64_t>::max()};
+  }
+}
+
+std::size_t usps_api_server::Scheduler::RunDue(Time now) {
+  std::size_t applied = 0;
+  std::vector<std::unique_ptr<Entry>> due;
+  while (true) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      while (!heap_.empty() && heap_[0]->due <= now) {
+        due.push_back(Remove(0));
+      }
+    }
+    if (due.empty()) {
+      return applied;
+    }
+    // Applying an activation may schedule an expiration that is already
+    // due, so the heap is checked again afterwards.
+    for (const std::unique_ptr<Entry>& entry : due) {
+      Apply(*entry);
+    }
+    applied += due.size();
+    due.clear();
+  }
+}
+
+std::size_t usps_api_server::Scheduler::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return heap_.size();
+}
+
+usps_api_server::Scheduler::Time usps_api_server::Scheduler::Now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::system_clock::now().time_since_epoch()).count() -
+         kGpsEpochOffset * kNanosPerSecond;
+}
+
+usps_api_server::Scheduler::Time usps_api_server::Scheduler::ToTime(
+    const ghost::GpsEpochTimestamp& timestamp) {
+  return timestamp.seconds() * kNanosPerSecond + timestamp.nanos();
+}
+
+bool usps_api_server::Scheduler::Valid(
+    const ghost::GpsEpochTimestamp& timestamp) {
+  return timestamp.seconds() >= 0 &&
+         timestamp.seconds() < INT64_MAX / kNanosPerSecond &&
+         timestamp.nanos() >= 0 && timestamp.nanos() < kNanosPerSecond;
+}
+
+// Pending activations are indexed by their normalized filter key followed
+// by their activation time, so a filter's entries share a key prefix.
+std::string usps_api_server::Scheduler::IndexKey(
+    const ghost::SfcFilter& sfc_filter, Time activation) {
+  std::string key = SfcTable::Key(SfcTable::Normalize(sfc_filter));
+  key.append(reinterpret_cast<const char*>(&activation), sizeof(activation));
+  return key;
+}
+
+void usps_api_server::Scheduler::Apply(const Entry& entry) {
+  if (entry.kind == EXPIRE) {
+    std::shared_ptr<const InstalledSfc> installed = entry.installed.lock();
+    if (installed != nullptr) {
+      table_->Erase(installed->sfc.sfc_filter(), installed.get());
+    }
+    return;
+  }
+  if (entry.request->has_delete_request()) {
+    table_->Erase(entry.request->delete_request().sfc_filter());
+    return;
+  }
+  const ghost::CreateSfcRequest& request = entry.request->create_request();
+  std::vector<SfcTable::Update> updates;
+  updates.push_back(entry.update);
+  table_->Apply(std::move(updates));
+  if (request.has_expiration_time()) {
+    std::unique_ptr<Entry> expiry(new Entry());
+    expiry->due = ToTime(request.expiration_time());
+    expiry->kind = EXPIRE;
+    expiry->installed = entry.update.installed;
+    std::lock_guard<std::mutex> lock(mutex_);
+    Schedule(std::move(expiry));
+  }
+}
+
+// Adds 'entry' to the heap and the index. Returns the pending activation
+// it replaces, if any, so the caller can release it after unlocking.
+// Requires mutex_.
+std::unique_ptr<usps_api_server::Scheduler::Entry>
+usps_api_server::Scheduler::Schedule(std::unique_ptr<Entry> entry) {
+  std::unique_ptr<Entry> replaced;
+  entry->seq = next_seq_++;
+  if (entry->kind == ACTIVATE) {
+    auto it = index_.find(entry->index_key);
+    if (it != index_.end()) {
+      replaced = Remove(it->second->pos);
+    }
+    index_[entry->index_key] = entry.get();
+    activations_[{entry->due, entry->seq}] = entry.get();
+  }
+  std::size_t pos = heap_.size();
+  heap_.emplace_back();
+  Place(pos, std::move(entry));
+  SiftUp(pos);
+  // The timer thread only needs to wake if the earliest entry changed.
+  if (heap_[0]->seq == next_seq_ - 1) {
+    wake_.notify_one();
+  }
+  return replaced;
+}
+
+// Removes and returns the entry at 'pos'. Requires mutex_.
+std::unique_ptr<usps_api_server::Scheduler::Entry>
+usps_api_server::Scheduler::Remove(std::size_t pos) {
+  std::unique_ptr<Entry> removed = std::move(heap_[pos]);
+  std::size_t last = heap_.size() - 1;
+  if (pos != last) {
+    Place(pos, std::move(heap_[last]));
+    heap_.pop_back();
+    SiftUp(pos);
+    SiftDown(pos);
+  } else {
+    heap_.pop_back();
+  }
+  if (removed->kind == ACTIVATE) {
+    index_.erase(removed->index_key);
+    activations_.erase({removed->due, removed->seq});
+  }
+  return removed;
+}
+
+bool usps_api_server::Scheduler::Before(std::size_t a, std::size_t b) const {
+  const Entry& x = *heap_[a];
+  const Entry& y = *heap_[b];
+  return x.due != y.due ? x.due < y.due : x.seq < y.seq;
+}
+
+void usps_api_server::Scheduler::Place(std::size_t pos,
+                                       std::unique_ptr<Entry> entry) {
+  entry->pos = pos;
+  heap_[pos] = std::move(entry);
+}
+
+void usps_api_server::Scheduler::SiftUp(std::size_t pos) {
+  while (pos > 0) {
+    std::size_t parent = (pos - 1) / 2;
+    if (!Before(pos, parent)) {
+      return;
+    }
+    std::swap(heap_[pos], heap_[parent]);
+    heap_[pos]->pos = pos;
+    heap_[parent]->pos = parent;
+    pos = parent;
+  }
+}
+
+void usps_api_server::Scheduler::SiftDown(std::size_t pos) {
+  std::size_t size = heap_.size();
+  while (true) {
+    std::size_t smallest = pos;
+    std::size_t left = 2 * pos + 1;
+    std::size_t right = left + 1;
+    if (left < size && Before(left, smallest)) {
+      smallest = left;
+    }
+    if (right < size && Before(right, smallest)) {
+      smallest = right;
+    }
+    if (smallest == pos) {
+      return;
+    }
+    std::swap(heap_[pos], heap_[smallest]);
+    heap_[pos]->pos = pos;
+    heap_[smallest]->pos = smallest;
+    pos = smallest;
+  }
+}
+
+// Sleeps until the earliest entry is due, then applies due entries.
+void usps_api_server::Scheduler::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stop_) {
+    if (heap_.empty()) {
+      wake_.wait(lock);
+      continue;
+    }
+    Time now = Now();
+    if (heap_[0]->due > now) {
+      wake_.wait_for(lock, std::chrono::nanoseconds(heap_[0]->due - now));
+      continue;
+    }
+    lock.unlock();
+    RunDue(now);
+    lock.lock();
+  }
+}
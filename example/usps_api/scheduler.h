@@ -0,0 +1,162 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "sfc_table.h"
+#include "proto/usps_api/sfc.pb.h"
+#include "absl/container/flat_hash_map.h"
+#include <grpcpp/support/status.h>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace usps_api_server {
+// Applies CreateSfc and DeleteSfc requests to an SfcTable at their
+// activation times and removes SFCs at their expiration times.
+//
+// Pending entries are kept in an indexed binary min-heap ordered by due
+// time, so scheduling and cancelling are O(log n). A single timer thread
+// sleeps until the earliest entry is due and applies every due entry in
+// order.
+class Scheduler {
+  public:
+    // Nanoseconds since the GPS epoch, not counting leap seconds.
+    using Time = std::int64_t;
+
+    // Starts the timer thread.
+    explicit Scheduler(std::shared_ptr<SfcTable> table);
+    // Stops the timer thread. Pending entries are dropped.
+    ~Scheduler();
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+    // Installs the request's SFC now, or at its activation time if that is
+    // in the future. Scheduling a request with the same filter and
+    // activation time as a pending one replaces it.
+    grpc::Status Create(const ghost::CreateSfcRequest& request);
+    // Removes the request's SFC now or at its activation time. If
+    // timestamp_to_deactivate is set, cancels the pending request with the
+    // same filter and activation time instead.
+    grpc::Status Delete(const ghost::DeleteSfcRequest& request);
+    // Applies 'requests' as one batch, as if each were sent to Create or
+    // Delete in order. Table updates take each shard lock once and pending
+    // entries take the scheduler lock once. Returns a status per request.
+    std::vector<grpc::Status> Program(
+        const std::vector<const ghost::ScheduledRequest*>& requests);
+    // Fills 'response' with installed SFCs as SfcTable::Query does and, if
+    // include_future_instructions is set, with the pending requests for the
+    // same filter in activation order. Returns false if a filter is set and
+    // nothing matches it.
+    bool Query(const ghost::QueryRequest& request,
+               ghost::QueryResponse* response) const;
+    // Where a walk of the pending requests resumes: the activation time and
+    // scheduling order of the next request to return.
+    struct PendingPosition {
+      Time due = std::numeric_limits<Time>::min();
+      std::uint64_t seq = 0;
+    };
+    // Returns the pending requests for the query's filter, or all of them
+    // if it has none, in activation order.
+    std::vector<std::shared_ptr<const ghost::ScheduledRequest>> Pending(
+        const ghost::QueryRequest& request) const;
+    // Appends up to 'limit' of the pending requests Pending would return,
+    // starting at 'position', to 'requests' and moves 'position' past them.
+    // A filtered walk skips other filters' requests without copying them.
+    void PendingPage(
+        const ghost::QueryRequest& request, std::size_t limit,
+        PendingPosition* position,
+        std::vector<std::shared_ptr<const ghost::ScheduledRequest>>* requests)
+        const;
+    // Applies every entry due at or before 'now'. Returns the number of
+    // entries applied. Called by the timer thread.
+    std::size_t RunDue(Time now);
+    // Number of pending activations and expirations.
+    std::size_t size() const;
+    std::shared_ptr<SfcTable> table() const { return table_; }
+
+    static Time Now();
+    static Time ToTime(const ghost::GpsEpochTimestamp& timestamp);
+    static bool Valid(const ghost::GpsEpochTimestamp& timestamp);
+
+  private:
+    enum Kind { ACTIVATE, EXPIRE };
+    struct Entry {
+      Time due;
+      // Breaks ties so entries due together run in scheduling order.
+      std::uint64_t seq;
+      Kind kind;
+      // Position in heap_, kept current by the heap operations.
+      std::size_t pos;
+      // Set for ACTIVATE entries.
+      std::shared_ptr<const ghost::ScheduledRequest> request;
+      std::string index_key;
+      // Set for ACTIVATE entries of creates: the SFC compiled when the
+      // request was accepted, installed as is at activation.
+      SfcTable::Update update;
+      // Set for EXPIRE entries. Expiry is skipped if the SFC is gone.
+      std::weak_ptr<const InstalledSfc> installed;
+    };
+
+    // Changes collected from a batch of requests and committed together.
+    struct Plan {
+      // A pending entry to schedule, or the index key of one to cancel.
+      struct Op {
+        std::size_t item;
+        std::unique_ptr<Entry> entry;
+        std::string cancel;
+      };
+      std::vector<SfcTable::Update> updates;
+      std::vector<Op> ops;
+    };
+
+    static grpc::Status PlanCreate(const ghost::CreateSfcRequest& request,
+                                   Time now, std::size_t item, Plan* plan);
+    static grpc::Status PlanDelete(const ghost::DeleteSfcRequest& request,
+                                   Time now, std::size_t item, Plan* plan);
+    void Commit(Plan* plan, std::vector<grpc::Status>* statuses);
+    static std::string IndexKey(const ghost::SfcFilter& sfc_filter,
+                                Time activation);
+    void Apply(const Entry& entry);
+    std::unique_ptr<Entry> Schedule(std::unique_ptr<Entry> entry);
+    std::unique_ptr<Entry> Remove(std::size_t pos);
+    bool Before(std::size_t a, std::size_t b) const;
+    void Place(std::size_t pos, std::unique_ptr<Entry> entry);
+    void SiftUp(std::size_t pos);
+    void SiftDown(std::size_t pos);
+    void Run();
+
+    std::shared_ptr<SfcTable> table_;
+    mutable std::mutex mutex_;
+    std::condition_variable wake_;
+    std::vector<std::unique_ptr<Entry>> heap_;
+    // Pending activations by filter and activation time.
+    absl::flat_hash_map<std::string, Entry*> index_;
+    // Pending activations in activation order, for paging through them.
+    std::map<std::pair<Time, std::uint64_t>, const Entry*> activations_;
+    std::uint64_t next_seq_ = 0;
+    bool stop_ = false;
+    std::thread thread_;
+};
+}
+
+#endif
@@ -22,6 +22,8 @@
 #include <grpcpp/security/server_credentials.h>
 
 #include "proto/usps_api/sfc.grpc.pb.h"
+#include "stats.h"
+#include "utils/metrics.h"
 #include <thread>
 #include <chrono>
 
@@ -29,54 +31,112 @@
 grpc::Status usps_api_server::GhostImpl::CreateSfc(grpc::ServerContext* context,
                  const ghost::CreateSfcRequest* request,
                  ghost::CreateSfcResponse* response) {
-  Config* config = config_.get();
+  RpcTimer timer(Metrics::CREATE_SFC);
+  ConfigSnapshot snapshot = store_->Load();
+  const Config* config = snapshot.get();
+  grpc::Status status = grpc::Status::CANCELLED;
   // If creating is disabled, deny request.
-  if (!(config->create_)) {
-    return grpc::Status::CANCELLED;
-  }
-  const ghost::SfcFilter sfc_filter = request->sfc_filter();
-  // Delay list is active.
-  if (config->FilterActive(&(config->delay_))) {
-    if (config->FilterMatch(&(config->delay_), &sfc_filter)) {
-      int delay_time = config->delay_time_ * 1000;
-      // TODO(sam) use multithreading to avoid blocking main thread
-      std::this_thread::sleep_for(std::chrono::milliseconds(delay_time));
-      return grpc::Status::OK;
-    }
-  }
-  // Deny list is active.
-  if (config->FilterActive(&(config->deny_))) {
-    if (config->FilterMatch(&(config->deny_), &sfc_filter)) {
-      return grpc::Status::CANCELLED;
-    }
-    return grpc::Status::OK;
-  } else if (config->FilterActive(&(config->allow_))) {
-    // Allow list is active.
-    if (config->FilterMatch(&(config->allow_), &sfc_filter)) {
-      return grpc::Status::OK;
+  if (config->create_) {
+    switch (config->Evaluate(&(request->sfc_filter()))) {
+      case Config::DELAY:
+        // The sync API holds a handler thread for the whole delay. The async
+        // server defers delayed calls without blocking a thread.
+        std::this_thread::sleep_for(std::chrono::seconds(config->delay_time_));
+        status = scheduler_->Create(*request);
+        break;
+      case Config::DENY:
+        break;
+      default:
+        status = scheduler_->Create(*request);
+        break;
     }
-    return grpc::Status::CANCELLED;
-  } else { // Neither allow or deny is active.
-    return grpc::Status::OK;
   }
+  timer.Finish(status.ok());
+  return status;
 }
 grpc::Status usps_api_server::GhostImpl::DeleteSfc(grpc::ServerContext* context,
                        const ghost::DeleteSfcRequest* request,
                        ghost::DeleteSfcResponse* response) {
-  Config* config = config_.get();
+  RpcTimer timer(Metrics::DELETE_SFC);
+  ConfigSnapshot snapshot = store_->Load();
+  const Config* config = snapshot.get();
+  grpc::Status status = grpc::Status::CANCELLED;
   // If deleting is disabled, deny request.
-  if (!(config->del_)) {
-    return grpc::Status::CANCELLED;
+  if (config->del_) {
+    status = scheduler_->Delete(*request);
   }
-  return grpc::Status::OK;
+  timer.Finish(status.ok());
+  return status;
 }
 grpc::Status usps_api_server::GhostImpl::Query(grpc::ServerContext* context,
                    const ghost::QueryRequest* request,
                    ghost::QueryResponse* response){
-  Config* config = config_.get();
+  RpcTimer timer(Metrics::QUERY);
+  ConfigSnapshot snapshot = store_->Load();
+  const Config* config = snapshot.get();
+  grpc::Status status = grpc::Status::OK;
   // If querying is disabled, deny request.
   if (!(config->query_)) {
+    status = grpc::Status::CANCELLED;
+  } else if (!scheduler_->Query(*request, response)) {
+    status = grpc::Status(grpc::StatusCode::NOT_FOUND, "SFC not installed");
+  }
+  timer.Finish(status.ok());
+  return status;
+}
+grpc::Status usps_api_server::GhostImpl::QueryStream(
+    grpc::ServerContext* context,
+    const ghost::QueryRequest* request,
+    grpc::ServerWriter<ghost::QueryResponse>* writer) {
+  RpcTimer timer(Metrics::QUERY_STREAM);
+  ConfigSnapshot snapshot = store_->Load();
+  // If querying is disabled, deny request.
+  if (!(snapshot->query_)) {
+    timer.Finish(false);
     return grpc::Status::CANCELLED;
   }
+  QueryCursor cursor(*scheduler_, *request);
+  if (!cursor.found()) {
+    timer.Finish(false);
+    return grpc::Status(grpc::StatusCode::NOT_FOUND, "SFC not installed");
+  }
+  ghost::QueryResponse response;
+  while (cursor.Next(&response)) {
+    if (!writer->Write(response)) {
+      break;
+    }
+  }
+  timer.Finish(true);
+  return grpc::Status::OK;
+}
+grpc::Status usps_api_server::GhostImpl::ProgramSfcs(
+    grpc::ServerContext* context,
+    grpc::ServerReaderWriter<ghost::ProgramSfcsResponse,
+                             ghost::ProgramSfcsRequest>* stream) {
+  ghost::ProgramSfcsRequest request;
+  ghost::ProgramSfcsResponse response;
+  SfcBatch batch;
+  // Answers each batch before reading the next.
+  while (stream->Read(&request)) {
+    std::uint64_t start = Metrics::Now();
+    ConfigSnapshot snapshot = store_->Load();
+    if (batch.Apply(*snapshot, request, scheduler_.get(), &response)) {
+      std::this_thread::sleep_for(std::chrono::seconds(batch.delay_time()));
+      batch.ApplyDelayed(request, scheduler_.get(), &response);
+    }
+    RecordBatch(response, Metrics::Now() - start);
+    if (!stream->Write(response)) {
+      break;
+    }
+  }
+  return grpc::Status::OK;
+}
+grpc::Status usps_api_server::GhostImpl::Stats(
+    grpc::ServerContext* context,
+    const ghost::StatsRequest* request,
+    ghost::StatsResponse* response) {
+  RpcTimer timer(Metrics::STATS);
+  FillStats(*store_->Load(), response);
+  timer.Finish(true);
   return grpc::Status::OK;
 }
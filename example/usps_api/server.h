@@ -12,6 +12,11 @@
 // License for the specific language governing permissions and limitations under
 // the License.
 #include "config/config_parser.h"
+#include "config/config_store.h"
+#include "query_cursor.h"
+#include "scheduler.h"
+#include "sfc_batch.h"
+#include "sfc_table.h"
 #include "proto/usps_api/sfc.grpc.pb.h"
 #include <string>
 #include <grpcpp/security/server_credentials.h>
@@ -20,8 +25,19 @@ namespace usps_api_server {
 class GhostImpl final : public ghost::SfcService::Service {
  public:
    explicit GhostImpl(std::shared_ptr<Config> c) {
-    config_ = c;
+    store_ = std::make_shared<ConfigStore>(c);
+    scheduler_ = std::make_shared<Scheduler>(std::make_shared<SfcTable>());
    }
+   explicit GhostImpl(std::shared_ptr<ConfigStore> store) {
+    store_ = store;
+    scheduler_ = std::make_shared<Scheduler>(std::make_shared<SfcTable>());
+   }
+   GhostImpl(std::shared_ptr<ConfigStore> store,
+             std::shared_ptr<Scheduler> scheduler) {
+    store_ = store;
+    scheduler_ = scheduler;
+   }
+   std::shared_ptr<SfcTable> table() const { return scheduler_->table(); }
 
    grpc::Status CreateSfc(grpc::ServerContext* context,
                        const ghost::CreateSfcRequest* request,
@@ -32,8 +48,20 @@ class GhostImpl final : public ghost::SfcService::Service {
    grpc::Status Query(grpc::ServerContext* context,
                          const ghost::QueryRequest* request,
                          ghost::QueryResponse* response) override;
+   grpc::Status QueryStream(
+       grpc::ServerContext* context,
+       const ghost::QueryRequest* request,
+       grpc::ServerWriter<ghost::QueryResponse>* writer) override;
+   grpc::Status ProgramSfcs(
+       grpc::ServerContext* context,
+       grpc::ServerReaderWriter<ghost::ProgramSfcsResponse,
+                                ghost::ProgramSfcsRequest>* stream) override;
+   grpc::Status Stats(grpc::ServerContext* context,
+                      const ghost::StatsRequest* request,
+                      ghost::StatsResponse* response) override;
 
  private:
-   std::shared_ptr<Config> config_;
+   std::shared_ptr<ConfigStore> store_;
+   std::shared_ptr<Scheduler> scheduler_;
 };
 } //namespace
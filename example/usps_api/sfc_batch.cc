@@ -0,0 +1,103 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#include "sfc_batch.h"
+#include <grpcpp/support/status.h>
+
+namespace {
+void SetResult(const grpc::Status& status, ghost::ProgramSfcsResult* result) {
+  result->set_code(status.error_code());
+  if (!status.ok()) {
+    result->set_message(status.error_message());
+  }
+}
+}
+
+bool usps_api_server::SfcBatch::Apply(const Config& config,
+                                      const ghost::ProgramSfcsRequest& request,
+                                      Scheduler* scheduler,
+                                      ghost::ProgramSfcsResponse* response) {
+  response->Clear();
+  response->mutable_results()->Reserve(request.requests_size());
+  delayed_.clear();
+  delay_time_ = config.delay_time_;
+  std::vector<std::size_t> ready;
+  ready.reserve(request.requests_size());
+  // Once a request is delayed, the requests after it wait for it.
+  std::vector<std::size_t>* target = &ready;
+  for (int i = 0; i < request.requests_size(); ++i) {
+    const ghost::ScheduledRequest& scheduled = request.requests(i);
+    // Defaults to OK and is overwritten once the request is applied.
+    ghost::ProgramSfcsResult* result = response->add_results();
+    result->set_code(grpc::StatusCode::OK);
+    if (scheduled.has_create_request()) {
+      // If creating is disabled, deny request.
+      if (!config.create_) {
+        SetResult(grpc::Status::CANCELLED, result);
+        continue;
+      }
+      switch (config.Evaluate(&scheduled.create_request().sfc_filter())) {
+        case Config::DELAY:
+          target = &delayed_;
+          delayed_.push_back(i);
+          break;
+        case Config::DENY:
+          SetResult(grpc::Status::CANCELLED, result);
+          break;
+        default:
+          target->push_back(i);
+          break;
+      }
+    } else if (scheduled.has_delete_request()) {
+      // If deleting is disabled, deny request.
+      if (!config.del_) {
+        SetResult(grpc::Status::CANCELLED, result);
+        continue;
+      }
+      target->push_back(i);
+    } else {
+      SetResult(grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                             "empty request"), result);
+    }
+  }
+  Program(request, ready, scheduler, response);
+  return !delayed_.empty();
+}
+
+void usps_api_server::SfcBatch::ApplyDelayed(
+    const ghost::ProgramSfcsRequest& request,
+    Scheduler* scheduler,
+    ghost::ProgramSfcsResponse* response) {
+  Program(request, delayed_, scheduler, response);
+  delayed_.clear();
+}
+
+// Applies the requests at 'items' as one scheduler batch.
+void usps_api_server::SfcBatch::Program(
+    const ghost::ProgramSfcsRequest& request,
+    const std::vector<std::size_t>& items,
+    Scheduler* scheduler,
+    ghost::ProgramSfcsResponse* response) {
+  if (items.empty()) {
+    return;
+  }
+  std::vector<const ghost::ScheduledRequest*> requests;
+  requests.reserve(items.size());
+  for (std::size_t item : items) {
+    requests.push_back(&request.requests(item));
+  }
+  std::vector<grpc::Status> statuses = scheduler->Program(requests);
+  for (std::size_t i = 0; i < items.size(); ++i) {
+    SetResult(statuses[i], response->mutable_results(items[i]));
+  }
+}
@@ -0,0 +1,55 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#ifndef SFC_BATCH_H
+#define SFC_BATCH_H
+
+#include "config/config_parser.h"
+#include "scheduler.h"
+#include "proto/usps_api/sfc.pb.h"
+#include <cstddef>
+#include <vector>
+
+namespace usps_api_server {
+// Applies one ProgramSfcs batch with the same checks as the unary
+// handlers. The first request on the delay list holds back itself and every
+// request after it, so the batch keeps its order and waits for the
+// configured delay at most once.
+class SfcBatch {
+  public:
+    // Checks each request against the enabled requests and sfcfilter lists
+    // of 'config', applies those that pass and fills 'response' with a
+    // result per request. Returns true if some requests were delayed, in
+    // which case ApplyDelayed must be called once the delay has passed.
+    bool Apply(const Config& config,
+               const ghost::ProgramSfcsRequest& request,
+               Scheduler* scheduler,
+               ghost::ProgramSfcsResponse* response);
+    // Applies the requests held back by Apply.
+    void ApplyDelayed(const ghost::ProgramSfcsRequest& request,
+                      Scheduler* scheduler,
+                      ghost::ProgramSfcsResponse* response);
+    // Seconds the delayed requests must wait.
+    int delay_time() const { return delay_time_; }
+
+  private:
+    static void Program(const ghost::ProgramSfcsRequest& request,
+                        const std::vector<std::size_t>& items,
+                        Scheduler* scheduler,
+                        ghost::ProgramSfcsResponse* response);
+    std::vector<std::size_t> delayed_;
+    int delay_time_ = 0;
+};
+}
+
+#endif
@@ -0,0 +1,264 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#include "sfc_table.h"
+#include "config/prefix_trie.h"
+#include "dataplane/service_chain.h"
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <algorithm>
+#include <utility>
+
+constexpr std::size_t usps_api_server::SfcTable::kShards;
+
+usps_api_server::InstalledSfc::InstalledSfc(ghost::Sfc s,
+                                            std::size_t counter_count)
+    : sfc(std::move(s)), counters(counter_count) {}
+
+usps_api_server::InstalledSfc::~InstalledSfc() = default;
+
+std::shared_ptr<const usps_api_server::InstalledSfc>
+usps_api_server::SfcTable::Insert(const ghost::CreateSfcRequest& request) {
+  Update update;
+  std::string error;
+  if (!MakeInsert(request, &update, &error)) {
+    return nullptr;
+  }
+  std::shared_ptr<const InstalledSfc> replaced;
+  Shard& shard = ShardFor(update.key);
+  {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto result = shard.sfcs.try_emplace(std::move(update.key),
+                                         update.installed);
+    if (result.second) {
+      ++size_;
+    } else {
+      // Releases the replaced entry after unlocking, as EraseKey does.
+      replaced = std::move(result.first->second);
+      result.first->second = update.installed;
+    }
+  }
+  return update.installed;
+}
+
+bool usps_api_server::SfcTable::MakeInsert(
+    const ghost::CreateSfcRequest& request, Update* update,
+    std::string* error) {
+  ghost::Sfc sfc;
+  *sfc.mutable_sfc_filter() = Normalize(request.sfc_filter());
+  *sfc.mutable_service_functions() = request.service_functions_to_install();
+  if (request.has_expiration_time()) {
+    *sfc.mutable_expiration_time() = request.expiration_time();
+  }
+  std::size_t counter_count = 0;
+  for (const ghost::ServiceFn& service_fn : sfc.service_functions()) {
+    if (service_fn.has_increment_counter()) {
+      ++counter_count;
+    }
+  }
+  std::shared_ptr<InstalledSfc> installed =
+      std::make_shared<InstalledSfc>(std::move(sfc), counter_count);
+  installed->chain = ServiceChain::Compile(installed->sfc.service_functions(),
+                                           &installed->counters, error);
+  if (installed->chain == nullptr) {
+    return false;
+  }
+  update->key = Key(installed->sfc.sfc_filter());
+  update->installed = std::move(installed);
+  return true;
+}
+
+usps_api_server::SfcTable::Update usps_api_server::SfcTable::MakeErase(
+    const ghost::SfcFilter& sfc_filter) {
+  return Update{Key(Normalize(sfc_filter)), nullptr};
+}
+
+void usps_api_server::SfcTable::Apply(std::vector<Update> updates) {
+  std::vector<std::pair<std::size_t, Update*>> order;
+  order.reserve(updates.size());
+  for (Update& update : updates) {
+    order.emplace_back(std::hash<std::string>()(update.key) % kShards,
+                       &update);
+  }
+  // Stable, so updates to one key keep their order within its shard.
+  std::stable_sort(order.begin(), order.end(),
+                   [](const std::pair<std::size_t, Update*>& a,
+                      const std::pair<std::size_t, Update*>& b) {
+                     return a.first < b.first;
+                   });
+  // Replaced and erased entries are released after their shard unlocks.
+  std::vector<std::shared_ptr<const InstalledSfc>> released;
+  for (std::size_t i = 0; i < order.size();) {
+    Shard& shard = shards_[order[i].first];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    for (; i < order.size() && &shards_[order[i].first] == &shard; ++i) {
+      Update& update = *order[i].second;
+      auto it = shard.sfcs.find(update.key);
+      if (update.installed == nullptr) {
+        if (it != shard.sfcs.end()) {
+          released.push_back(std::move(it->second));
+          shard.sfcs.erase(it);
+          --size_;
+        }
+      } else if (it != shard.sfcs.end()) {
+        released.push_back(std::move(it->second));
+        it->second = std::move(update.installed);
+      } else {
+        shard.sfcs.emplace(std::move(update.key), std::move(update.installed));
+        ++size_;
+      }
+    }
+  }
+}
+
+bool usps_api_server::SfcTable::Erase(const ghost::SfcFilter& sfc_filter) {
+  return EraseKey(Key(Normalize(sfc_filter)), nullptr);
+}
+
+bool usps_api_server::SfcTable::Erase(const ghost::SfcFilter& sfc_filter,
+                                      const InstalledSfc* expected) {
+  return EraseKey(Key(Normalize(sfc_filter)), expected);
+}
+
+// Erases 'key', or only its entry 'expected' if that is not null.
+bool usps_api_server::SfcTable::EraseKey(const std::string& key,
+                                         const InstalledSfc* expected) {
+  std::shared_ptr<const InstalledSfc> erased;
+  Shard& shard = ShardFor(key);
+  {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.sfcs.find(key);
+    if (it == shard.sfcs.end() ||
+        (expected != nullptr && it->second.get() != expected)) {
+      return false;
+    }
+    // Releases the entry after unlocking, in case this is the last owner.
+    erased = std::move(it->second);
+    shard.sfcs.erase(it);
+  }
+  --size_;
+  return true;
+}
+
+std::shared_ptr<const usps_api_server::InstalledSfc>
+usps_api_server::SfcTable::Find(const ghost::SfcFilter& sfc_filter) const {
+  std::string key = Key(Normalize(sfc_filter));
+  const Shard& shard = ShardFor(key);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  auto it = shard.sfcs.find(key);
+  if (it == shard.sfcs.end()) {
+    return nullptr;
+  }
+  return it->second;
+}
+
+void usps_api_server::SfcTable::ForEach(
+    const std::function<void(const InstalledSfc&)>& fn) const {
+  // Reused across shards so a full scan allocates only while it grows.
+  std::vector<std::shared_ptr<const InstalledSfc>> batch;
+  for (std::size_t shard = 0; shard < kShards; ++shard) {
+    CopyShard(shard, &batch);
+    for (const std::shared_ptr<const InstalledSfc>& installed : batch) {
+      fn(*installed);
+    }
+    batch.clear();
+  }
+}
+
+void usps_api_server::SfcTable::CopyShard(
+    std::size_t shard,
+    std::vector<std::shared_ptr<const InstalledSfc>>* sfcs) const {
+  std::lock_guard<std::mutex> lock(shards_[shard].mutex);
+  sfcs->reserve(sfcs->size() + shards_[shard].sfcs.size());
+  for (const auto& entry : shards_[shard].sfcs) {
+    sfcs->push_back(entry.second);
+  }
+}
+
+bool usps_api_server::SfcTable::Query(const ghost::QueryRequest& request,
+                                      ghost::QueryResponse* response) const {
+  if (request.has_sfc_filter()) {
+    std::shared_ptr<const InstalledSfc> installed = Find(request.sfc_filter());
+    if (installed == nullptr) {
+      return false;
+    }
+    Export(*installed, request.include_counter_values(),
+           response->add_installed_sfcs());
+    return true;
+  }
+  // Counter values are only reported for a single filtered SFC.
+  response->mutable_installed_sfcs()->Reserve(size());
+  ForEach([response](const InstalledSfc& installed) {
+    Export(installed, false, response->add_installed_sfcs());
+  });
+  return true;
+}
+
+std::size_t usps_api_server::SfcTable::size() const {
+  return size_;
+}
+
+void usps_api_server::SfcTable::Export(const InstalledSfc& installed,
+                                       bool include_counter_values,
+                                       ghost::Sfc* sfc) {
+  *sfc = installed.sfc;
+  if (include_counter_values) {
+    sfc->mutable_counter_values()->Reserve(installed.counters.size());
+    for (std::size_t i = 0; i < installed.counters.size(); ++i) {
+      sfc->add_counter_values(installed.counters.Value(i));
+    }
+  }
+}
+
+ghost::SfcFilter usps_api_server::SfcTable::Normalize(
+    const ghost::SfcFilter& sfc_filter) {
+  std::vector<std::string> layers;
+  layers.reserve(sfc_filter.filter_layers_size());
+  for (const ghost::FilterLayer& filter_layer : sfc_filter.filter_layers()) {
+    ghost::FilterLayer layer = filter_layer;
+    if (layer.ghost_filter().has_routing_id()) {
+      ghost::GhostLabelPrefix* prefix = layer.mutable_ghost_filter()
+          ->mutable_routing_id()->mutable_destination_label_prefix();
+      prefix->set_value(
+          PrefixTrie::Mask(prefix->value(), prefix->prefix_len()));
+    }
+    layers.push_back(layer.SerializeAsString());
+  }
+  std::sort(layers.begin(), layers.end());
+  layers.erase(std::unique(layers.begin(), layers.end()), layers.end());
+  ghost::SfcFilter normalized;
+  for (const std::string& layer : layers) {
+    normalized.add_filter_layers()->ParseFromString(layer);
+  }
+  return normalized;
+}
+
+std::string usps_api_server::SfcTable::Key(const ghost::SfcFilter& normalized) {
+  std::string key;
+  google::protobuf::io::StringOutputStream stream(&key);
+  google::protobuf::io::CodedOutputStream output(&stream);
+  output.SetSerializationDeterministic(true);
+  normalized.SerializeToCodedStream(&output);
+  output.Trim();
+  return key;
+}
+
+usps_api_server::SfcTable::Shard& usps_api_server::SfcTable::ShardFor(
+    const std::string& key) {
+  return shards_[std::hash<std::string>()(key) % kShards];
+}
+
+const usps_api_server::SfcTable::Shard& usps_api_server::SfcTable::ShardFor(
+    const std::string& key) const {
+  return shards_[std::hash<std::string>()(key) % kShards];
+}
@@ -0,0 +1,128 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#ifndef SFC_TABLE_H
+#define SFC_TABLE_H
+
+#include "packet_counters.h"
+#include "proto/usps_api/sfc.pb.h"
+#include "absl/container/flat_hash_map.h"
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace usps_api_server {
+class ServiceChain;
+
+// An SFC installed by a CreateSfcRequest.
+struct InstalledSfc {
+  InstalledSfc(ghost::Sfc s, std::size_t counter_count);
+  ~InstalledSfc();
+  // Normalized filter, service functions and expiration time.
+  ghost::Sfc sfc;
+  // One packet counter per IncrementCounterServiceFn in the chain. Mutable
+  // so that packets are counted through the shared const entries.
+  mutable PacketCounters counters;
+  // The service functions compiled for the data plane, counting into
+  // 'counters'. SFCs whose service functions do not compile are never
+  // installed.
+  std::unique_ptr<const ServiceChain> chain;
+};
+
+// A concurrent table of installed SFCs keyed by normalized SfcFilter.
+//
+// The table is split into shards, each a hash map behind its own mutex, so
+// concurrent inserts and deletes of different filters rarely contend.
+// Entries are immutable apart from their counters and are shared with
+// readers, so a lookup or scan holds a shard lock only long enough to copy
+// pointers out.
+class SfcTable {
+  public:
+    static constexpr std::size_t kShards = 64;
+
+    // Installs an SFC for the request's filter, replacing any SFC already
+    // installed for the same filter. Returns the installed entry, or nullptr
+    // without installing anything if the service functions do not compile.
+    std::shared_ptr<const InstalledSfc> Insert(
+        const ghost::CreateSfcRequest& request);
+    // Removes the SFC installed for 'sfc_filter'. Returns false if there is
+    // none.
+    bool Erase(const ghost::SfcFilter& sfc_filter);
+    // Removes the SFC installed for 'sfc_filter' only if it is 'expected',
+    // so an SFC that has since been replaced is left alone.
+    bool Erase(const ghost::SfcFilter& sfc_filter,
+               const InstalledSfc* expected);
+    // Returns the SFC installed for 'sfc_filter', or nullptr.
+    std::shared_ptr<const InstalledSfc> Find(
+        const ghost::SfcFilter& sfc_filter) const;
+    // A pending insert, or an erase if 'installed' is null.
+    struct Update {
+      std::string key;
+      std::shared_ptr<const InstalledSfc> installed;
+    };
+    // Builds the entry a request would install into 'update', without
+    // installing it. Returns false and sets 'error' if the service functions
+    // do not compile for the data plane.
+    static bool MakeInsert(const ghost::CreateSfcRequest& request,
+                           Update* update, std::string* error);
+    static Update MakeErase(const ghost::SfcFilter& sfc_filter);
+    // Applies 'updates' taking each shard lock once. Updates to the same
+    // filter are applied in order.
+    void Apply(std::vector<Update> updates);
+    // Calls 'fn' on every installed SFC. SFCs inserted or erased during the
+    // scan may or may not be visited.
+    void ForEach(const std::function<void(const InstalledSfc&)>& fn) const;
+    // Appends the SFCs installed in shard 'shard' to 'sfcs'. Lets callers
+    // walk the table a shard at a time.
+    void CopyShard(std::size_t shard,
+                   std::vector<std::shared_ptr<const InstalledSfc>>* sfcs)
+        const;
+    // Fills 'response' with the SFC selected by the request's filter, or with
+    // every installed SFC if the filter is unset. Returns false if a filter
+    // is set and no SFC is installed for it.
+    bool Query(const ghost::QueryRequest& request,
+               ghost::QueryResponse* response) const;
+    std::size_t size() const;
+
+    // Copies 'installed' into 'sfc', with counter values if requested.
+    static void Export(const InstalledSfc& installed,
+                       bool include_counter_values,
+                       ghost::Sfc* sfc);
+    // Returns the canonical form of 'sfc_filter': routing prefixes are
+    // masked to their prefix_len and layers are sorted and deduplicated, so
+    // filters matching the same traffic share a key.
+    static ghost::SfcFilter Normalize(const ghost::SfcFilter& sfc_filter);
+    // Returns the table key of a normalized filter.
+    static std::string Key(const ghost::SfcFilter& normalized);
+
+  private:
+    struct alignas(64) Shard {
+      mutable std::mutex mutex;
+      absl::flat_hash_map<std::string, std::shared_ptr<const InstalledSfc>>
+          sfcs;
+    };
+    bool EraseKey(const std::string& key, const InstalledSfc* expected);
+    Shard& ShardFor(const std::string& key);
+    const Shard& ShardFor(const std::string& key) const;
+    std::array<Shard, kShards> shards_;
+    std::atomic<std::size_t> size_{0};
+};
+}
+
+#endif
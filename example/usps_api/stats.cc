@@ -0,0 +1,48 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#include "stats.h"
+#include "utils/metrics.h"
+#include <string>
+
+void usps_api_server::FillStats(const Config& config,
+                                ghost::StatsResponse* response) {
+  std::string* text = response->mutable_prometheus_text();
+  Metrics::WritePrometheus(Metrics::Collect(), text);
+  text->append("# HELP ghost_filter_identifiers Distinct identifiers in each "
+               "sfcfilter list.\n"
+               "# TYPE ghost_filter_identifiers gauge\n");
+  const Config::Filter* filters[] = {&config.allow_, &config.deny_,
+                                     &config.delay_};
+  const char* const names[] = {"allow", "deny", "delay"};
+  for (int f = 0; f < 3; ++f) {
+    text->append(std::string("ghost_filter_identifiers{filter=\"") +
+                 names[f] + "\"} " +
+                 std::to_string(filters[f]->index.size()) + "\n");
+  }
+  text->append("# HELP ghost_config_version Version of the published "
+               "configuration.\n"
+               "# TYPE ghost_config_version gauge\n"
+               "ghost_config_version " +
+               std::to_string(config.version_) + "\n");
+}
+
+void usps_api_server::RecordBatch(const ghost::ProgramSfcsResponse& response,
+                                  std::uint64_t nanos) {
+  Metrics::Record(Metrics::PROGRAM_SFCS_BATCH, nanos);
+  for (const ghost::ProgramSfcsResult& result : response.results()) {
+    if (result.code() != 0) {
+      Metrics::Increment(Metrics::PROGRAM_SFCS_FAILED);
+    }
+  }
+}
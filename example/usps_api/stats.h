@@ -0,0 +1,31 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#ifndef STATS_H
+#define STATS_H
+
+#include "config/config_parser.h"
+#include "proto/usps_api/sfc.pb.h"
+#include <cstdint>
+
+namespace usps_api_server {
+// Fills 'response' with the process metrics and the filter sizes and
+// version of 'config'.
+void FillStats(const Config& config, ghost::StatsResponse* response);
+// Records a ProgramSfcs batch that took 'nanos' and counts the requests in
+// 'response' that failed.
+void RecordBatch(const ghost::ProgramSfcsResponse& response,
+                 std::uint64_t nanos);
+}
+
+#endif
@@ -12,12 +12,20 @@
 // License for the specific language governing permissions and limitations under
 // the License.
 #include "file_reader.h"
+#include <cstring>
 #include <string>
 #include <list>
 #include <vector>
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 // Reads a file as a string.
 std::string FileReader::ReadString(std::string filename) {
@@ -49,4 +57,72 @@ std::list<std::vector<std::string>> FileReader::ParseCSV(std::string filename) {
   return parsed_entries;
 }
 
+// Maps 'filename' read-only. The mapping is advised for sequential access
+// since parsers walk it front to back once.
+FileReader::MappedFile::MappedFile(const std::string& filename) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == 0) {
+    size_ = st.st_size;
+    if (size_ == 0) {
+      ok_ = true;
+    } else {
+      void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED) {
+        madvise(data, size_, MADV_SEQUENTIAL);
+        data_ = static_cast<const char*>(data);
+        ok_ = true;
+      } else {
+        size_ = 0;
+      }
+    }
+  }
+  close(fd);
+}
 
+FileReader::MappedFile::~MappedFile() {
+  if (data_ != nullptr) {
+    munmap(const_cast<char*>(data_), size_);
+  }
+}
+
+std::uint64_t FileReader::Hash(std::string_view data) {
+  const std::uint64_t kMul = 0x9e3779b97f4a7c15ULL;
+  std::uint64_t h = data.size() * kMul;
+  std::size_t i = 0;
+  for (; i + 8 <= data.size(); i += 8) {
+    std::uint64_t word;
+    std::memcpy(&word, data.data() + i, 8);
+    h = (h ^ word) * kMul;
+    h ^= h >> 32;
+  }
+  std::uint64_t tail = 0;
+  if (i < data.size()) {
+    std::memcpy(&tail, data.data() + i, data.size() - i);
+  }
+  h = (h ^ tail) * kMul;
+  h ^= h >> 29;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  return h ^ (h >> 32);
+}
+
+const char* FileReader::FindNewline(const char* begin, const char* end) {
+#if defined(__SSE2__)
+  const __m128i newline = _mm_set1_epi8('\n');
+  while (end - begin >= 16) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+    if (mask != 0) {
+      return begin + __builtin_ctz(mask);
+    }
+    begin += 16;
+  }
+#endif
+  while (begin != end && *begin != '\n') {
+    ++begin;
+  }
+  return begin;
+}
@@ -11,10 +11,83 @@
 // WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
 // License for the specific language governing permissions and limitations under
 // the License.
+#ifndef FILE_READER_H
+#define FILE_READER_H
+
 #include <string>
+#include <string_view>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
 #include <list>
 #include <vector>
 namespace FileReader {
 std::string ReadString(std::string filename);
 std::list<std::vector<std::string>> ParseCSV(std::string filename);
+
+// A read-only memory mapping of a whole file.
+class MappedFile {
+  public:
+    explicit MappedFile(const std::string& filename);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    // Returns false if the file could not be opened or mapped.
+    bool ok() const { return ok_; }
+    std::string_view data() const { return std::string_view(data_, size_); }
+  private:
+    const char* data_ = nullptr;
+    std::size_t size_ = 0;
+    bool ok_ = false;
+};
+
+// Returns a 64-bit hash of 'data', read eight bytes at a time. Used to tell
+// whether a file's contents changed, not for hash tables.
+std::uint64_t Hash(std::string_view data);
+
+// Returns the first newline in [begin, end), or end. Scans 16 bytes at a
+// time where SSE2 is available.
+const char* FindNewline(const char* begin, const char* end);
+
+// Parses an unsigned decimal at 'p', after any spaces or tabs. Returns the
+// end of the number, or nullptr if there is none.
+inline const char* ParseUint(const char* p, const char* end,
+                             std::uint64_t* value) {
+  while (p != end && (*p == ' ' || *p == '\t')) {
+    ++p;
+  }
+  std::from_chars_result result = std::from_chars(p, end, *value);
+  return result.ec == std::errc() ? result.ptr : nullptr;
 }
+
+// Calls 'fn(first, second)' for every line of 'text' that starts with two
+// comma-separated unsigned integers, straight from the text without
+// copying fields. Other lines are skipped. Returns the number of lines
+// passed to 'fn'.
+template <typename Fn>
+std::size_t ParsePairs(std::string_view text, Fn fn) {
+  const char* p = text.data();
+  const char* end = p + text.size();
+  std::size_t parsed = 0;
+  while (p < end) {
+    const char* line_end = FindNewline(p, end);
+    std::uint64_t first;
+    std::uint64_t second;
+    const char* q = ParseUint(p, line_end, &first);
+    if (q != nullptr) {
+      while (q != line_end && (*q == ' ' || *q == '\t')) {
+        ++q;
+      }
+      if (q != line_end && *q == ',' &&
+          ParseUint(q + 1, line_end, &second) != nullptr) {
+        fn(first, second);
+        ++parsed;
+      }
+    }
+    p = line_end == end ? end : line_end + 1;
+  }
+  return parsed;
+}
+}
+
+#endif
@@ -0,0 +1,134 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#include "file_watcher.h"
+#include <chrono>
+#include <cstdint>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+namespace {
+const std::uint32_t kFileMask = IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB |
+                                IN_DELETE_SELF | IN_MOVE_SELF;
+const std::uint32_t kDirMask = IN_CREATE | IN_MOVED_TO;
+} // namespace
+
+FileWatcher::FileWatcher()
+    : inotify_fd_(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)),
+      stop_fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+      epoll_fd_(epoll_create1(EPOLL_CLOEXEC)) {
+  struct epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.fd = inotify_fd_;
+  epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, inotify_fd_, &event);
+  event.data.fd = stop_fd_;
+  epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, stop_fd_, &event);
+}
+
+FileWatcher::~FileWatcher() {
+  close(epoll_fd_);
+  close(stop_fd_);
+  close(inotify_fd_);
+}
+
+void FileWatcher::Watch(const std::vector<std::string>& paths) {
+  std::unordered_map<int, std::string> files;
+  std::unordered_map<int, std::set<std::string>> dirs;
+  for (const std::string& path : paths) {
+    int wd = inotify_add_watch(inotify_fd_, path.c_str(), kFileMask);
+    if (wd >= 0) {
+      files[wd] = path;
+    }
+    std::size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "."
+                      : slash == 0               ? "/"
+                                                 : path.substr(0, slash);
+    wd = inotify_add_watch(inotify_fd_, dir.c_str(), kDirMask);
+    if (wd >= 0) {
+      dirs[wd].insert(path.substr(slash + 1));
+    }
+  }
+  // Adding a watch on an inode that is already watched returns its
+  // descriptor, so only the watches no longer wanted are removed.
+  for (const auto& file : files_) {
+    if (files.count(file.first) == 0 && dirs.count(file.first) == 0) {
+      inotify_rm_watch(inotify_fd_, file.first);
+    }
+  }
+  for (const auto& dir : dirs_) {
+    if (files.count(dir.first) == 0 && dirs.count(dir.first) == 0) {
+      inotify_rm_watch(inotify_fd_, dir.first);
+    }
+  }
+  files_.swap(files);
+  dirs_.swap(dirs);
+}
+
+FileWatcher::Event FileWatcher::Wait(int timeout_ms) {
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::milliseconds(timeout_ms);
+  while (true) {
+    int wait_ms = -1;
+    if (timeout_ms >= 0) {
+      auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+          deadline - std::chrono::steady_clock::now());
+      wait_ms = left.count() > 0 ? static_cast<int>(left.count()) : 0;
+    }
+    struct epoll_event events[2];
+    int ready = epoll_wait(epoll_fd_, events, 2, wait_ms);
+    if (ready == 0) {
+      return TIMEOUT;
+    }
+    bool changed = false;
+    for (int i = 0; i < ready; ++i) {
+      // The stop eventfd is never read, so it stays readable.
+      if (events[i].data.fd == stop_fd_) {
+        return STOPPED;
+      }
+      changed = ReadEvents() || changed;
+    }
+    if (changed) {
+      return CHANGED;
+    }
+  }
+}
+
+void FileWatcher::Stop() {
+  std::uint64_t one = 1;
+  ssize_t written = write(stop_fd_, &one, sizeof(one));
+  (void)written;
+}
+
+bool FileWatcher::ReadEvents() {
+  alignas(struct inotify_event) char buffer[4096];
+  bool changed = false;
+  ssize_t length;
+  while ((length = read(inotify_fd_, buffer, sizeof(buffer))) > 0) {
+    for (char* p = buffer; p < buffer + length;) {
+      const struct inotify_event* event =
+          reinterpret_cast<const struct inotify_event*>(p);
+      if (files_.count(event->wd) != 0) {
+        changed = true;
+      } else if (event->len > 0) {
+        auto dir = dirs_.find(event->wd);
+        if (dir != dirs_.end() && dir->second.count(event->name) != 0) {
+          changed = true;
+        }
+      }
+      p += sizeof(struct inotify_event) + event->len;
+    }
+  }
+  return changed;
+}
@@ -0,0 +1,58 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#ifndef FILE_WATCHER_H
+#define FILE_WATCHER_H
+
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Waits for changes to a set of files on one inotify descriptor.
+//
+// The inotify descriptor and an eventfd used for shutdown are polled with
+// epoll, so a waiting thread sleeps in the kernel until a watched file
+// changes or Stop() is called. Each file is watched for writes, and its
+// directory for entries created or renamed under the file's name, so saves
+// that write a temporary file and rename it over the original are seen too.
+class FileWatcher {
+  public:
+    enum Event { CHANGED, TIMEOUT, STOPPED };
+    FileWatcher();
+    ~FileWatcher();
+    FileWatcher(const FileWatcher&) = delete;
+    FileWatcher& operator=(const FileWatcher&) = delete;
+    // Watches exactly 'paths' from now on. Files that do not exist yet are
+    // picked up through their directory once they are created.
+    void Watch(const std::vector<std::string>& paths);
+    // Waits up to 'timeout_ms', or forever if it is negative, for a change to
+    // a watched file.
+    Event Wait(int timeout_ms);
+    // Makes the current and every later Wait return STOPPED. May be called
+    // from any thread.
+    void Stop();
+
+  private:
+    // Returns true if the queued inotify events include a watched file.
+    bool ReadEvents();
+    int inotify_fd_;
+    int stop_fd_;
+    int epoll_fd_;
+    // Watch descriptors of the files, and of their directories with the
+    // names watched in each.
+    std::unordered_map<int, std::string> files_;
+    std::unordered_map<int, std::set<std::string>> dirs_;
+};
+
+#endif
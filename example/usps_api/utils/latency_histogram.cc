@@ -0,0 +1,92 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#include "latency_histogram.h"
+#include <algorithm>
+#include <cmath>
+
+namespace {
+const std::size_t kSubBuckets = std::size_t{1} << LatencyHistogram::kSubBits;
+// One linear range below kSubBuckets, then one per remaining power of two.
+const std::size_t kBuckets = (64 - LatencyHistogram::kSubBits + 1) *
+                             kSubBuckets;
+} // namespace
+
+LatencyHistogram::LatencyHistogram() : counts_(kBuckets, 0) {}
+
+void LatencyHistogram::Record(std::uint64_t nanos) {
+  ++counts_[Index(nanos)];
+  ++count_;
+  min_ = std::min(min_, nanos);
+  max_ = std::max(max_, nanos);
+  sum_ += nanos;
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram& other) {
+  for (std::size_t i = 0; i < kBuckets; ++i) {
+    counts_[i] += other.counts_[i];
+  }
+  count_ += other.count_;
+  min_ = std::min(min_, other.min_);
+  max_ = std::max(max_, other.max_);
+  sum_ += other.sum_;
+}
+
+void LatencyHistogram::Clear() {
+  std::fill(counts_.begin(), counts_.end(), 0);
+  count_ = 0;
+  min_ = ~0ULL;
+  max_ = 0;
+  sum_ = 0;
+}
+
+double LatencyHistogram::mean() const {
+  return count_ == 0 ? 0 : sum_ / count_;
+}
+
+std::uint64_t LatencyHistogram::Percentile(double percentile) const {
+  if (count_ == 0) {
+    return 0;
+  }
+  std::uint64_t rank = static_cast<std::uint64_t>(
+      std::ceil(std::min(std::max(percentile, 0.0), 100.0) / 100 * count_));
+  rank = std::max<std::uint64_t>(rank, 1);
+  std::uint64_t seen = 0;
+  for (std::size_t i = 0; i < kBuckets; ++i) {
+    seen += counts_[i];
+    if (seen >= rank) {
+      return std::min(UpperBound(i), max_);
+    }
+  }
+  return max_;
+}
+
+// Values below kSubBuckets map to themselves. A larger value with its top
+// bit at 'msb' keeps its top kSubBits + 1 bits, which select one of the
+// kSubBuckets buckets of its power of two.
+std::size_t LatencyHistogram::Index(std::uint64_t value) {
+  if (value < kSubBuckets) {
+    return value;
+  }
+  int shift = 63 - __builtin_clzll(value) - kSubBits;
+  return (shift + 1) * kSubBuckets + ((value >> shift) - kSubBuckets);
+}
+
+std::uint64_t LatencyHistogram::UpperBound(std::size_t index) {
+  if (index < 2 * kSubBuckets) {
+    return index;
+  }
+  int shift = index / kSubBuckets - 1;
+  std::uint64_t sub = index % kSubBuckets + kSubBuckets;
+  return ((sub + 1) << shift) - 1;
+}
@@ -0,0 +1,55 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// A log-linear histogram of nanosecond latencies in the style of
+// HdrHistogram.
+//
+// Values below 2^kSubBits are counted exactly. Above that, every power of
+// two is split into 2^kSubBits equal buckets, so a reported percentile is
+// within 1/2^kSubBits of the recorded value over the whole 64-bit range.
+// Recording is a few instructions and never allocates; histograms from
+// several threads are combined with Merge.
+class LatencyHistogram {
+  public:
+    static constexpr int kSubBits = 7;
+    LatencyHistogram();
+    void Record(std::uint64_t nanos);
+    void Merge(const LatencyHistogram& other);
+    void Clear();
+    std::uint64_t count() const { return count_; }
+    std::uint64_t min() const { return count_ == 0 ? 0 : min_; }
+    std::uint64_t max() const { return max_; }
+    double mean() const;
+    // Returns the smallest bucket bound at or above 'percentile' (0-100) of
+    // the recorded values, or 0 if none were recorded.
+    std::uint64_t Percentile(double percentile) const;
+
+  private:
+    static std::size_t Index(std::uint64_t value);
+    // Returns the highest value counted in bucket 'index'.
+    static std::uint64_t UpperBound(std::size_t index);
+    std::vector<std::uint64_t> counts_;
+    std::uint64_t count_ = 0;
+    std::uint64_t min_ = ~0ULL;
+    std::uint64_t max_ = 0;
+    double sum_ = 0;
+};
+
+#endif
@@ -0,0 +1,170 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#include "metrics.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+namespace {
+// Cache-line aligned so threads never share a line between shards.
+struct alignas(64) Shard {
+  std::atomic<std::uint64_t> counters[Metrics::kCounters];
+  std::atomic<std::uint64_t> buckets[Metrics::kHistograms][Metrics::kBuckets];
+  std::atomic<std::uint64_t> sums[Metrics::kHistograms];
+};
+
+// Only the owning thread writes a shard, so a relaxed load and store is
+// enough and avoids a locked instruction.
+void Add(std::atomic<std::uint64_t>* value, std::uint64_t delta) {
+  value->store(value->load(std::memory_order_relaxed) + delta,
+               std::memory_order_relaxed);
+}
+
+struct Registry {
+  std::mutex mutex;
+  std::vector<Shard*> shards;
+  // Sums of the shards of threads that have exited.
+  Metrics::Snapshot retired;
+};
+
+// Never destroyed, so threads that exit during static destruction can
+// still retire their shards.
+Registry& GetRegistry() {
+  static Registry* registry = new Registry;
+  return *registry;
+}
+
+void AddShard(const Shard& shard, Metrics::Snapshot* snapshot) {
+  for (int c = 0; c < Metrics::kCounters; ++c) {
+    snapshot->counters[c] += shard.counters[c].load(std::memory_order_relaxed);
+  }
+  for (int h = 0; h < Metrics::kHistograms; ++h) {
+    for (int b = 0; b < Metrics::kBuckets; ++b) {
+      std::uint64_t count = shard.buckets[h][b].load(std::memory_order_relaxed);
+      snapshot->buckets[h][b] += count;
+      snapshot->counts[h] += count;
+    }
+    snapshot->sums[h] += shard.sums[h].load(std::memory_order_relaxed);
+  }
+}
+
+// Registers a shard for the thread and retires it when the thread exits.
+struct ShardOwner {
+  Shard* shard = new Shard();
+  ShardOwner() {
+    Registry& registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.shards.push_back(shard);
+  }
+  ~ShardOwner() {
+    Registry& registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    AddShard(*shard, &registry.retired);
+    registry.shards.erase(
+        std::find(registry.shards.begin(), registry.shards.end(), shard));
+    delete shard;
+  }
+};
+
+Shard* LocalShard() {
+  thread_local ShardOwner owner;
+  return owner.shard;
+}
+
+void AppendNumber(double value, std::string* out) {
+  char buffer[32];
+  std::snprintf(buffer, sizeof(buffer), "%.9g", value);
+  out->append(buffer);
+}
+
+void AppendHistogram(const std::string& name, const std::string& labels,
+                     const Metrics::Snapshot& snapshot,
+                     Metrics::Histogram histogram, std::string* out) {
+  std::string separator = labels.empty() ? "" : ",";
+  std::uint64_t cumulative = 0;
+  for (int b = 0; b + 1 < Metrics::kBuckets; ++b) {
+    cumulative += snapshot.buckets[histogram][b];
+    out->append(name + "_bucket{" + labels + separator + "le=\"");
+    AppendNumber(Metrics::BucketBound(b) / 1e9, out);
+    out->append("\"} " + std::to_string(cumulative) + "\n");
+  }
+  out->append(name + "_bucket{" + labels + separator + "le=\"+Inf\"} " +
+              std::to_string(snapshot.counts[histogram]) + "\n");
+  std::string braces = labels.empty() ? "" : "{" + labels + "}";
+  out->append(name + "_sum" + braces + " ");
+  AppendNumber(snapshot.sums[histogram] / 1e9, out);
+  out->append("\n" + name + "_count" + braces + " " +
+              std::to_string(snapshot.counts[histogram]) + "\n");
+}
+} // namespace
+
+void Metrics::Increment(Counter counter) {
+  Add(&LocalShard()->counters[counter], 1);
+}
+
+void Metrics::Record(Histogram histogram, std::uint64_t nanos) {
+  std::uint64_t high = nanos >> kMinBucketBits;
+  int bucket = high == 0 ? 0 : 64 - __builtin_clzll(high);
+  Shard* shard = LocalShard();
+  Add(&shard->buckets[histogram][std::min(bucket, kBuckets - 1)], 1);
+  Add(&shard->sums[histogram], nanos);
+}
+
+Metrics::Snapshot Metrics::Collect() {
+  Registry& registry = GetRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  Snapshot snapshot = registry.retired;
+  for (const Shard* shard : registry.shards) {
+    AddShard(*shard, &snapshot);
+  }
+  return snapshot;
+}
+
+void Metrics::WritePrometheus(const Snapshot& snapshot, std::string* out) {
+  static const char* const kRpcNames[kRpcs] = {
+      "CreateSfc", "DeleteSfc", "Query", "QueryStream", "ProgramSfcs", "Stats"};
+  static const char* const kActions[] = {"allow", "deny", "delay"};
+  out->append("# HELP ghost_rpc_latency_seconds Time to handle an RPC, or "
+              "one ProgramSfcs batch.\n"
+              "# TYPE ghost_rpc_latency_seconds histogram\n");
+  for (int rpc = 0; rpc < kRpcs; ++rpc) {
+    AppendHistogram("ghost_rpc_latency_seconds",
+                    std::string("rpc=\"") + kRpcNames[rpc] + "\"", snapshot,
+                    static_cast<Histogram>(rpc), out);
+  }
+  out->append("# HELP ghost_rpc_failures_total RPCs, or ProgramSfcs "
+              "requests, that did not return OK.\n"
+              "# TYPE ghost_rpc_failures_total counter\n");
+  for (int rpc = 0; rpc < kRpcs; ++rpc) {
+    out->append(std::string("ghost_rpc_failures_total{rpc=\"") +
+                kRpcNames[rpc] + "\"} " +
+                std::to_string(snapshot.counters[rpc]) + "\n");
+  }
+  out->append("# HELP ghost_filter_decision_seconds Time to evaluate the "
+              "sfcfilter lists, by decision.\n"
+              "# TYPE ghost_filter_decision_seconds histogram\n");
+  for (int action = 0; action < 3; ++action) {
+    AppendHistogram("ghost_filter_decision_seconds",
+                    std::string("action=\"") + kActions[action] + "\"",
+                    snapshot, static_cast<Histogram>(FILTER_ALLOW + action),
+                    out);
+  }
+  out->append("# HELP ghost_config_reload_seconds Time to reload the "
+              "configuration.\n"
+              "# TYPE ghost_config_reload_seconds histogram\n");
+  AppendHistogram("ghost_config_reload_seconds", "", snapshot, CONFIG_RELOAD,
+                  out);
+}
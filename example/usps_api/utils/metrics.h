@@ -0,0 +1,123 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Process-wide counters and latency histograms.
+//
+// Every thread records into its own shard, so recording is a few relaxed
+// loads and stores to memory no other thread writes: no locks, no atomic
+// read-modify-writes and no shared cache lines. Collect() sums the shards
+// under a lock; a thread's shard is folded into a total when it exits.
+//
+// Histograms have fixed power-of-two buckets: bucket i counts latencies
+// below 2^(i + kMinBucketBits) ns, and the last one counts everything above.
+class Metrics {
+  public:
+    enum Histogram {
+      CREATE_SFC,
+      DELETE_SFC,
+      QUERY,
+      QUERY_STREAM,
+      PROGRAM_SFCS_BATCH,
+      STATS,
+      // Time Config::Evaluate took, by the decision it made.
+      FILTER_ALLOW,
+      FILTER_DENY,
+      FILTER_DELAY,
+      CONFIG_RELOAD,
+      kHistograms
+    };
+    // The failed RPCs of each RPC histogram above, in the same order.
+    enum Counter {
+      CREATE_SFC_FAILED,
+      DELETE_SFC_FAILED,
+      QUERY_FAILED,
+      QUERY_STREAM_FAILED,
+      PROGRAM_SFCS_FAILED,
+      STATS_FAILED,
+      kCounters
+    };
+    static constexpr int kRpcs = STATS + 1;
+    // Returns the failure counter of 'rpc', or kCounters if 'rpc' does not
+    // time an RPC.
+    static constexpr Counter FailedCounter(Histogram rpc) {
+      return rpc < kRpcs ? static_cast<Counter>(rpc) : kCounters;
+    }
+    static constexpr int kMinBucketBits = 8;
+    static constexpr int kBuckets = 32;
+    struct Snapshot {
+      std::uint64_t counters[kCounters] = {};
+      std::uint64_t buckets[kHistograms][kBuckets] = {};
+      std::uint64_t counts[kHistograms] = {};
+      std::uint64_t sums[kHistograms] = {};
+    };
+    static void Increment(Counter counter);
+    static void Record(Histogram histogram, std::uint64_t nanos);
+    static Snapshot Collect();
+    // Appends the snapshot to 'out' in the Prometheus text format.
+    static void WritePrometheus(const Snapshot& snapshot, std::string* out);
+    // Returns a monotonic time in nanoseconds.
+    static std::uint64_t Now() {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                 std::chrono::steady_clock::now().time_since_epoch())
+          .count();
+    }
+    // Returns the exclusive upper bound of 'bucket' in nanoseconds.
+    static std::uint64_t BucketBound(int bucket) {
+      return std::uint64_t{1} << (bucket + kMinBucketBits);
+    }
+};
+
+static_assert(Metrics::kCounters == Metrics::kRpcs,
+              "every RPC histogram has a failure counter");
+static_assert(Metrics::FailedCounter(Metrics::CREATE_SFC) ==
+                  Metrics::CREATE_SFC_FAILED &&
+              Metrics::FailedCounter(Metrics::DELETE_SFC) ==
+                  Metrics::DELETE_SFC_FAILED &&
+              Metrics::FailedCounter(Metrics::QUERY) == Metrics::QUERY_FAILED &&
+              Metrics::FailedCounter(Metrics::QUERY_STREAM) ==
+                  Metrics::QUERY_STREAM_FAILED &&
+              Metrics::FailedCounter(Metrics::PROGRAM_SFCS_BATCH) ==
+                  Metrics::PROGRAM_SFCS_FAILED &&
+              Metrics::FailedCounter(Metrics::STATS) == Metrics::STATS_FAILED,
+              "RPC histograms and failure counters are in the same order");
+static_assert(Metrics::FailedCounter(Metrics::FILTER_ALLOW) ==
+                  Metrics::kCounters,
+              "only RPC histograms have failure counters");
+
+// Times an RPC from construction, or the last Restart(), to Finish().
+class RpcTimer {
+  public:
+    explicit RpcTimer(Metrics::Histogram rpc)
+        : rpc_(rpc), start_(Metrics::Now()) {}
+    void Restart() { start_ = Metrics::Now(); }
+    void Finish(bool ok) {
+      Metrics::Record(rpc_, Metrics::Now() - start_);
+      Metrics::Counter failed = Metrics::FailedCounter(rpc_);
+      if (!ok && failed != Metrics::kCounters) {
+        Metrics::Increment(failed);
+      }
+    }
+
+  private:
+    Metrics::Histogram rpc_;
+    std::uint64_t start_;
+};
+
+#endif
@@ -0,0 +1,67 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#include "benchmark/benchmark.h"
+#include "example/usps_api/dataplane/checksum.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace {
+std::vector<std::uint8_t> Payload(std::size_t size) {
+  std::vector<std::uint8_t> payload(size);
+  for (std::size_t i = 0; i < size; ++i) {
+    payload[i] = static_cast<std::uint8_t>(i * 31);
+  }
+  return payload;
+}
+
+template <std::uint16_t (*Sum)(const std::uint8_t*, std::size_t)>
+void BM_Sum(benchmark::State& state) {
+  std::vector<std::uint8_t> payload =
+      Payload(static_cast<std::size_t>(state.range(0)));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(Sum(payload.data(), payload.size()));
+  }
+  state.SetBytesProcessed(state.iterations() * payload.size());
+}
+} // namespace
+
+// Sums UDP payloads of 'size' bytes with each kernel.
+static void BM_SumScalar(benchmark::State& state) {
+  BM_Sum<usps_api_server::Checksum::SumScalar>(state);
+}
+BENCHMARK(BM_SumScalar)->ArgName("size")->Arg(64)->Arg(512)->Arg(1500)
+    ->Arg(9000);
+
+static void BM_SumAvx2(benchmark::State& state) {
+  if (!usps_api_server::Checksum::Avx2Supported()) {
+    state.SkipWithError("AVX2 is not available");
+    return;
+  }
+  BM_Sum<usps_api_server::Checksum::SumAvx2>(state);
+}
+BENCHMARK(BM_SumAvx2)->ArgName("size")->Arg(64)->Arg(512)->Arg(1500)
+    ->Arg(9000);
+
+// Updates an IPv4 header checksum for a new total length, as encapsulation
+// does for every packet.
+static void BM_Update16(benchmark::State& state) {
+  std::uint16_t checksum = 0x1234;
+  std::uint16_t length = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        usps_api_server::Checksum::Update16(checksum, 0, ++length));
+  }
+}
+BENCHMARK(BM_Update16);
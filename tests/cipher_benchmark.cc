@@ -0,0 +1,115 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#include "benchmark/benchmark.h"
+#include "example/usps_api/dataplane/packet.h"
+#include "example/usps_api/dataplane/service_chain.h"
+#include "proto/usps_api/sfc.pb.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace {
+const ghost::CipherServiceFn::CipherProtocol kProtocols[] = {
+    ghost::CipherServiceFn::CIPHER_CCMP_AES,
+    ghost::CipherServiceFn::CIPHER_AES_GCM,
+    ghost::CipherServiceFn::CIPHER_AES_CBC,
+    ghost::CipherServiceFn::CIPHER_AES_CTR,
+    ghost::CipherServiceFn::CIPHER_AES_EAX,
+};
+constexpr std::size_t kBatch = 64;
+
+class DiscardSink : public usps_api_server::PacketSink {
+  public:
+    void Transmit(usps_api_server::PacketBatch* batch) override {
+      batch->ReleaseAll();
+    }
+};
+
+// Keeps what a chain transmits.
+class KeepingSink : public usps_api_server::PacketSink {
+  public:
+    void Transmit(usps_api_server::PacketBatch* batch) override {
+      for (usps_api_server::Packet* packet : *batch) {
+        packets.emplace_back(reinterpret_cast<const char*>(packet->data()),
+                             packet->length());
+      }
+      batch->ReleaseAll();
+    }
+    std::vector<std::string> packets;
+};
+
+// A chain that ciphers with AES-128 and then transmits.
+std::unique_ptr<usps_api_server::ServiceChain> CipherChain(
+    ghost::CipherServiceFn::CipherProtocol protocol,
+    ghost::CipherServiceFn::CipherType type) {
+  ghost::CreateSfcRequest request;
+  ghost::CipherServiceFn* cipher =
+      request.add_service_functions_to_install()->mutable_cipher();
+  cipher->set_cipher_protocol(protocol);
+  cipher->set_cipher_type(type);
+  cipher->set_key(std::string(16, 'k'));
+  request.add_service_functions_to_install()->mutable_encap_and_tx();
+  std::string error;
+  return usps_api_server::ServiceChain::Compile(
+      request.service_functions_to_install(), nullptr, &error);
+}
+
+void Run(const usps_api_server::ServiceChain& chain,
+         const std::vector<std::string>& packets,
+         usps_api_server::PacketSink* sink) {
+  usps_api_server::PacketBatch batch;
+  for (const std::string& packet : packets) {
+    batch.Add(usps_api_server::Packet::Create(
+        reinterpret_cast<const std::uint8_t*>(packet.data()), packet.size()));
+  }
+  chain.Run(&batch, sink);
+}
+} // namespace
+
+// Encrypts or decrypts batches of 64 packets of 'size' bytes with AES-128
+// on one core. Gbps counts plaintext bytes; packets are copied into fresh
+// buffers each batch, as received packets would be.
+static void BM_Cipher(benchmark::State& state) {
+  ghost::CipherServiceFn::CipherProtocol protocol = kProtocols[state.range(0)];
+  std::size_t size = static_cast<std::size_t>(state.range(1));
+  bool decrypt = state.range(2) != 0;
+  std::unique_ptr<usps_api_server::ServiceChain> encrypt =
+      CipherChain(protocol, ghost::CipherServiceFn::ENCRYPT);
+  if (encrypt == nullptr) {
+    state.SkipWithError("AES-NI is not available");
+    return;
+  }
+  std::vector<std::string> packets(kBatch, std::string(size, 'p'));
+  std::unique_ptr<usps_api_server::ServiceChain> chain = std::move(encrypt);
+  if (decrypt) {
+    KeepingSink sealed;
+    Run(*chain, packets, &sealed);
+    packets = sealed.packets;
+    chain = CipherChain(protocol, ghost::CipherServiceFn::DECRYPT);
+  }
+  DiscardSink sink;
+  for (auto _ : state) {
+    Run(*chain, packets, &sink);
+  }
+  state.SetLabel(ghost::CipherServiceFn::CipherProtocol_Name(protocol) +
+                 (decrypt ? " decrypt" : " encrypt"));
+  state.SetItemsProcessed(state.iterations() * kBatch);
+  state.counters["Gbps"] = benchmark::Counter(
+      state.iterations() * kBatch * size * 8 / 1e9,
+      benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_Cipher)
+    ->ArgNames({"protocol", "size", "decrypt"})
+    ->ArgsProduct({{0, 1, 2, 3, 4}, {64, 512, 1500}, {0, 1}});
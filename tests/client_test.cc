@@ -9,6 +9,10 @@
 #include <grpcpp/create_channel.h>
 #include <grpcpp/security/credentials.h>
 #include "example/usps_api/server.h"
+#include "example/usps_api/load_generator.h"
+#include "example/usps_api/utils/latency_histogram.h"
+#include "config_helper.h"
+#include <grpcpp/server_builder.h>
 using ::testing::AtLeast;
 using ::testing::DoAll;
 using ::testing::_;
@@ -69,3 +73,71 @@ TEST(ClientTest, CanQuery) {
   FakeClient client(&stub);
   client.DoQuery();
 }
+
+TEST(ClientTest, HistogramPercentiles) {
+  LatencyHistogram histogram;
+  for (std::uint64_t nanos = 1; nanos <= 100000; ++nanos) {
+    histogram.Record(nanos * 1000);
+  }
+  EXPECT_EQ(histogram.count(), 100000);
+  EXPECT_EQ(histogram.min(), 1000);
+  EXPECT_EQ(histogram.max(), 100000000);
+  // Buckets are within 1/128 of the recorded value.
+  EXPECT_NEAR(histogram.Percentile(50), 50000000, 50000000 / 128);
+  EXPECT_NEAR(histogram.Percentile(99), 99000000, 99000000 / 128);
+  EXPECT_NEAR(histogram.Percentile(99.9), 99900000, 99900000 / 128);
+  EXPECT_EQ(histogram.Percentile(100), 100000000);
+  LatencyHistogram other;
+  other.Record(5);
+  histogram.Merge(other);
+  EXPECT_EQ(histogram.min(), 5);
+  EXPECT_EQ(histogram.Percentile(0), 5);
+}
+TEST(ClientTest, LoadGeneratorRunsMix) {
+  std::shared_ptr<usps_api_server::Config> config =
+      ConfigHelper::CreateSharedConfig();
+  config.get()->Initialize();
+  usps_api_server::GhostImpl service(config);
+  grpc::ServerBuilder builder;
+  int port = 0;
+  builder.AddListeningPort("localhost:0", grpc::InsecureServerCredentials(),
+                           &port);
+  builder.RegisterService(&service);
+  std::unique_ptr<grpc::Server> server = builder.BuildAndStart();
+  ASSERT_NE(server, nullptr);
+  usps_api_client::LoadOptions options;
+  ASSERT_FALSE(usps_api_client::LoadGenerator::ParseMix("1:1", &options));
+  ASSERT_TRUE(usps_api_client::LoadGenerator::ParseMix("2:1:1", &options));
+  options.in_flight = 4;
+  options.seconds = 0.5;
+  options.distribution = usps_api_client::LoadOptions::ZIPF;
+  for (std::uint64_t label = 1; label <= 16; ++label) {
+    options.labels.emplace_back(label, label);
+  }
+  std::vector<std::shared_ptr<grpc::Channel>> channels;
+  for (int i = 0; i < 2; ++i) {
+    channels.push_back(grpc::CreateChannel(
+        "localhost:" + std::to_string(port),
+        grpc::InsecureChannelCredentials()));
+  }
+  usps_api_client::LoadReport report =
+      usps_api_client::LoadGenerator(channels, options).Run();
+  using Report = usps_api_client::LoadReport;
+  EXPECT_GT(report.ok[Report::CREATE], 0);
+  EXPECT_GT(report.ok[Report::DELETE] + report.failed[Report::DELETE], 0);
+  EXPECT_GT(report.ok[Report::QUERY] + report.failed[Report::QUERY], 0);
+  // Only successful RPCs are timed.
+  EXPECT_EQ(report.latency[Report::CREATE].count(), report.ok[Report::CREATE]);
+  EXPECT_EQ(report.rejected[Report::CREATE], 0);
+  EXPECT_EQ(report.dropped, 0);
+  // An open loop sends about qps * seconds RPCs.
+  options.qps = 200;
+  report = usps_api_client::LoadGenerator(channels, options).Run();
+  std::uint64_t sent = 0;
+  for (int op = 0; op < Report::kOps; ++op) {
+    sent += report.ok[op] + report.failed[op];
+  }
+  EXPECT_GE(sent, 80);
+  EXPECT_LE(sent, 101);
+  server->Shutdown();
+}
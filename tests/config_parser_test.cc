@@ -16,13 +16,26 @@
 
 #include "config_helper.h"
 #include "example/usps_api/config/config_parser.h"
+#include "example/usps_api/config/config_store.h"
+#include "example/usps_api/config/filter_loader.h"
+#include "example/usps_api/config/filter_snapshot.h"
+#include "example/usps_api/utils/file_reader.h"
+#include "example/usps_api/config/filter_index.h"
+#include "example/usps_api/config/prefix_trie.h"
 #include "proto/usps_api/ghost_label.pb.h"
 #include <string>
 #include <list>
 #include <cstdio>
 #include <fstream>
 #include <iostream>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <vector>
 #include "json/json.h"
+#include <fcntl.h>
+#include <sys/stat.h>
 using namespace ConfigHelper;
 
 // Tests if config file does not exist
@@ -91,7 +104,8 @@ TEST(ConfigTest, CanParseAllow) {
   root["sfcfilter"]["allow"]["ghost_routing_identifier"]["destination_label_prefix"] = labels;
   WriteToConfig(config, root);
   config->Initialize();
-  std::list<ghost::GhostRoutingIdentifier> tunnels = config->allow_.routings;
+  const usps_api_server::ArenaList<ghost::GhostRoutingIdentifier>& tunnels =
+      config->allow_.routings;
   EXPECT_GT(tunnels.size(), 0);
   ghost::GhostRoutingIdentifier id = tunnels.front();
   EXPECT_EQ(id.destination_label_prefix().value(), 1234);
@@ -110,7 +124,8 @@ TEST(ConfigTest, CanParseDeny) {
   root["sfcfilter"]["deny"]["ghost_tunnel_identifier"]["ghostlabel"] = labels;
   WriteToConfig(config, root);
   config->Initialize();
-  std::list<ghost::GhostTunnelIdentifier> tunnels = config->deny_.tunnels;
+  const usps_api_server::ArenaList<ghost::GhostTunnelIdentifier>& tunnels =
+      config->deny_.tunnels;
   EXPECT_GT(tunnels.size(), 0);
   ghost::GhostTunnelIdentifier id = tunnels.front();
   EXPECT_EQ(id.terminal_label().value(), 1234);
@@ -129,7 +144,8 @@ TEST(ConfigTest, CanParseDelay) {
   root["sfcfilter"]["delay"]["ghost_tunnel_identifier"]["ghostlabel"] = labels;
   WriteToConfig(config, root);
   config->Initialize();
-  std::list<ghost::GhostTunnelIdentifier> tunnels = config->delay_.tunnels;
+  const usps_api_server::ArenaList<ghost::GhostTunnelIdentifier>& tunnels =
+      config->delay_.tunnels;
   EXPECT_GT(tunnels.size(), 0);
   ghost::GhostTunnelIdentifier id = tunnels.front();
   EXPECT_EQ(id.terminal_label().value(), 1234);
@@ -202,10 +218,10 @@ TEST(ConfigTest, CanMatchFilterRoute) {
   Json::Value label1;
   Json::Value label2;
   label1["value"] = 100;
-  label1["prefix_len"] = 1;
+  label1["prefix_len"] = 47;
   labels.append(label1);
   label2["value"] = 999;
-  label2["prefix_len"] = 2;
+  label2["prefix_len"] = 48;
   labels.append(label2);
   root["sfcfilter"]["allow"]["ghost_routing_identifier"]["destination_label_prefix"] = labels;
   WriteToConfig(config, root);
@@ -216,11 +232,445 @@ TEST(ConfigTest, CanMatchFilterRoute) {
   ghost::GhostRoutingIdentifier* routing_id = filter->mutable_routing_id();
   ghost::GhostLabelPrefix* dest_label = routing_id->mutable_destination_label_prefix();
   dest_label->set_value(100);
-  dest_label->set_prefix_len(1);
+  dest_label->set_prefix_len(47);
   EXPECT_TRUE(config->FilterMatch(&(config->allow_), &sfc_filter));
   dest_label->set_value(999);
   EXPECT_FALSE(config->FilterMatch(&(config->allow_), &sfc_filter));
-  dest_label->set_prefix_len(2);
+  dest_label->set_prefix_len(48);
   EXPECT_TRUE(config->FilterMatch(&(config->allow_), &sfc_filter));
   delete config;
 }
+// Tests if a route filter covers every longer prefix inside it.
+TEST(ConfigTest, CanMatchFilterRoutePrefix) {
+  usps_api_server::Config *config = CreateConfig();
+  Json::Value root;
+  Json::Value labels;
+  Json::Value label;
+  label["value"] = Json::UInt64(0xABCD00000000);
+  label["prefix_len"] = 16;
+  labels.append(label);
+  root["sfcfilter"]["deny"]["ghost_routing_identifier"]["destination_label_prefix"] = labels;
+  WriteToConfig(config, root);
+  config->Initialize();
+  ghost::SfcFilter sfc_filter;
+  ghost::GhostLabelPrefix* dest_label = sfc_filter.add_filter_layers()
+      ->mutable_ghost_filter()->mutable_routing_id()
+      ->mutable_destination_label_prefix();
+  dest_label->set_value(0xABCD00000000);
+  dest_label->set_prefix_len(16);
+  EXPECT_TRUE(config->FilterMatch(&(config->deny_), &sfc_filter));
+  dest_label->set_value(0xABCDEF000000);
+  dest_label->set_prefix_len(24);
+  EXPECT_TRUE(config->FilterMatch(&(config->deny_), &sfc_filter));
+  dest_label->set_prefix_len(48);
+  EXPECT_TRUE(config->FilterMatch(&(config->deny_), &sfc_filter));
+  dest_label->set_prefix_len(8);
+  EXPECT_FALSE(config->FilterMatch(&(config->deny_), &sfc_filter));
+  dest_label->set_value(0xABCE00000000);
+  dest_label->set_prefix_len(24);
+  EXPECT_FALSE(config->FilterMatch(&(config->deny_), &sfc_filter));
+  delete config;
+}
+// Tests longest prefix matching on the routing trie.
+TEST(ConfigTest, PrefixTrieLongestMatch) {
+  usps_api_server::PrefixTrie trie;
+  trie.Build({{0xAB0000000000, 8},
+              {0xABC000000000, 12},
+              {0xABCDEF000000, 24},
+              {0xABCDEF123456, 48},
+              {0x123456789ABC, 0},
+              {0x123456789ABC, 49}});
+  EXPECT_EQ(trie.size(), 4);
+  EXPECT_EQ(trie.LongestMatch(0xABCDEF123456), 48);
+  EXPECT_EQ(trie.LongestMatch(0xABCDEF123457), 24);
+  EXPECT_EQ(trie.LongestMatch(0xABCD00000000), 12);
+  EXPECT_EQ(trie.LongestMatch(0xAB0000000001), 8);
+  EXPECT_EQ(trie.LongestMatch(0xAC0000000000), 0);
+  EXPECT_TRUE(trie.Covers(0xABCDE0000000, 20));
+  EXPECT_TRUE(trie.Covers(0xAB0000000000, 9));
+  EXPECT_FALSE(trie.Covers(0xAB0000000000, 7));
+  EXPECT_FALSE(trie.Covers(0x123456789ABC, 48));
+}
+// Tests if the compiled filter index matches every entry of a large list.
+TEST(ConfigTest, CanMatchLargeFilter) {
+  usps_api_server::Config *config = CreateConfig();
+  config->Initialize();
+  for (int i = 0; i < 1000; ++i) {
+    config->deny_.tunnels.push_back(config->CreateGhostTunnel(i, i + 1));
+    config->deny_.routings.push_back(
+        config->CreateGhostRoute(static_cast<std::uint64_t>(i) << 24, 24));
+  }
+  config->deny_.Compile();
+  EXPECT_EQ(config->deny_.index.size(), 2000);
+  ghost::SfcFilter tunnel_filter;
+  ghost::GhostTunnelIdentifier* tunnel_id =
+      tunnel_filter.add_filter_layers()->mutable_ghost_filter()->mutable_tunnel_id();
+  ghost::SfcFilter route_filter;
+  ghost::GhostLabelPrefix* dest_label =
+      route_filter.add_filter_layers()->mutable_ghost_filter()
+          ->mutable_routing_id()->mutable_destination_label_prefix();
+  for (int i = 0; i < 1000; ++i) {
+    tunnel_id->mutable_terminal_label()->set_value(i);
+    tunnel_id->mutable_service_label()->set_value(i + 1);
+    EXPECT_TRUE(config->FilterMatch(&(config->deny_), &tunnel_filter));
+    tunnel_id->mutable_service_label()->set_value(i);
+    EXPECT_FALSE(config->FilterMatch(&(config->deny_), &tunnel_filter));
+    dest_label->set_value((static_cast<std::uint64_t>(i) << 24) | 0xABC);
+    dest_label->set_prefix_len(48);
+    EXPECT_TRUE(config->FilterMatch(&(config->deny_), &route_filter));
+    dest_label->set_prefix_len(23);
+    EXPECT_FALSE(config->FilterMatch(&(config->deny_), &route_filter));
+  }
+  // Direction is part of the packed tunnel key.
+  tunnel_id->mutable_terminal_label()->set_value(1);
+  tunnel_id->mutable_service_label()->set_value(2);
+  EXPECT_TRUE(config->FilterMatch(&(config->deny_), &tunnel_filter));
+  tunnel_id->set_direction(ghost::GhostTunnelIdentifier::UPLINK);
+  EXPECT_FALSE(config->FilterMatch(&(config->deny_), &tunnel_filter));
+  delete config;
+}
+// Tests if tunnel and route CSV files are parsed, skipping malformed lines.
+TEST(ConfigTest, CanParseCsvFiles) {
+  usps_api_server::Config *config = CreateConfig();
+  std::ofstream("tunnels_test.csv")
+      << "1234,230\n"
+      << " 5, 6 \r\n"
+      << "\n"
+      << "7\n"
+      << "x,8\n"
+      << "281474976710655,18446744073709551615\n"
+      << "9,10";
+  std::ofstream("routes_test.csv") << "11259375,24\n";
+  Json::Value root;
+  root["sfcfilter"]["deny"]["ghost_tunnel_identifier"]["file"] =
+      "tunnels_test.csv";
+  root["sfcfilter"]["deny"]["ghost_routing_identifier"]["file"] =
+      "routes_test.csv";
+  WriteToConfig(config, root);
+  config->Initialize();
+  std::vector<std::pair<std::uint64_t, std::uint64_t>> tunnels;
+  for (const ghost::GhostTunnelIdentifier& id : config->deny_.tunnels) {
+    tunnels.emplace_back(id.terminal_label().value(),
+                         id.service_label().value());
+  }
+  std::vector<std::pair<std::uint64_t, std::uint64_t>> expected = {
+      {1234, 230}, {5, 6}, {281474976710655ULL, 18446744073709551615ULL},
+      {9, 10}};
+  EXPECT_EQ(tunnels, expected);
+  ASSERT_EQ(config->deny_.routings.size(), 1);
+  EXPECT_EQ(config->deny_.routings.front().destination_label_prefix().value(),
+            11259375);
+  EXPECT_EQ(
+      config->deny_.routings.front().destination_label_prefix().prefix_len(),
+      24);
+  std::remove("tunnels_test.csv");
+  std::remove("routes_test.csv");
+  delete config;
+}
+// Tests if sharded parsing keeps every line and the file order, including
+// lines that straddle shard boundaries and files without a final newline.
+TEST(ConfigTest, LoaderShardsKeepFileOrder) {
+  std::ofstream tunnel_file("tunnels_test.csv");
+  for (int i = 0; i < 5000; ++i) {
+    tunnel_file << i << ',' << i * 3 << (i % 7 == 0 ? "\r\n" : "\n");
+  }
+  tunnel_file << "5000,15000";
+  tunnel_file.close();
+  std::ofstream("routes_test.csv") << "11259375,24\n";
+  Json::Value root;
+  root["ghost_tunnel_identifier"]["file"] = "tunnels_test.csv";
+  root["ghost_tunnel_identifier"]["ghostlabel"][0]["terminal_label"] = 9;
+  root["ghost_tunnel_identifier"]["ghostlabel"][0]["service_label"] = 9;
+  root["ghost_routing_identifier"]["file"] = "routes_test.csv";
+  usps_api_server::Config::Filter deny, allow;
+  usps_api_server::FilterLoader loader(4, 100);
+  loader.Add(&deny, root);
+  loader.Add(&allow, Json::Value());
+  loader.Load();
+  ASSERT_EQ(deny.tunnels.size(), 5002);
+  std::uint64_t i = 0;
+  for (const ghost::GhostTunnelIdentifier& id : deny.tunnels) {
+    std::uint64_t expected = i < 5001 ? i : 9;
+    EXPECT_EQ(id.terminal_label().value(), expected);
+    EXPECT_EQ(id.service_label().value(), i < 5001 ? i * 3 : 9);
+    ++i;
+  }
+  EXPECT_EQ(deny.routings.size(), 1);
+  EXPECT_TRUE(deny.index.Contains(
+      usps_api_server::Config().CreateGhostTunnel(4999, 14997)));
+  EXPECT_TRUE(allow.tunnels.empty());
+  EXPECT_TRUE(allow.index.empty());
+  std::remove("tunnels_test.csv");
+  std::remove("routes_test.csv");
+}
+// Tests if reloads publish new snapshots and keep the old one on failure.
+TEST(ConfigTest, StoreCanReload) {
+  std::shared_ptr<usps_api_server::Config> config = CreateSharedConfig();
+  config->Initialize();
+  usps_api_server::ConfigStore store(config);
+  usps_api_server::ConfigSnapshot first = store.Load();
+  EXPECT_EQ(first->host_, "");
+  Json::Value root;
+  root["address"]["host"] = "1.1.1.1";
+  WriteToConfig(config.get(), root);
+  EXPECT_TRUE(store.Reload());
+  usps_api_server::ConfigSnapshot second = store.Load();
+  EXPECT_EQ(second->host_, "1.1.1.1");
+  EXPECT_GT(second->version_, first->version_);
+  // Snapshots held by readers are never modified.
+  EXPECT_EQ(first->host_, "");
+  std::ofstream outfile(config->kFilename);
+  outfile << "{";
+  outfile.close();
+  EXPECT_FALSE(store.Reload());
+  EXPECT_EQ(store.Load(), second);
+}
+// Tests if readers always see a consistent snapshot while reloading.
+TEST(ConfigTest, StoreReloadIsConsistent) {
+  std::shared_ptr<usps_api_server::Config> config = CreateSharedConfig();
+  config->Initialize();
+  usps_api_server::ConfigStore store(config);
+  std::atomic<bool> done(false);
+  std::atomic<int> inconsistent(0);
+  std::vector<std::thread> readers;
+  for (int i = 0; i < 4; ++i) {
+    readers.emplace_back([&]() {
+      while (!done) {
+        usps_api_server::ConfigSnapshot snapshot = store.Load();
+        if (snapshot->deny_.index.size() != snapshot->deny_.tunnels.size() ||
+            snapshot->deny_.tunnels.size() !=
+                static_cast<std::size_t>(snapshot->port_)) {
+          ++inconsistent;
+        }
+      }
+    });
+  }
+  for (int size = 1; size <= 20; ++size) {
+    Json::Value root;
+    Json::Value labels;
+    for (int i = 0; i < size; ++i) {
+      Json::Value label;
+      label["terminal_label"] = i;
+      label["service_label"] = i;
+      labels.append(label);
+    }
+    root["address"]["port"] = size;
+    root["sfcfilter"]["deny"]["ghost_tunnel_identifier"]["ghostlabel"] = labels;
+    WriteToConfig(config.get(), root);
+    EXPECT_TRUE(store.Reload());
+  }
+  done = true;
+  for (std::thread& reader : readers) {
+    reader.join();
+  }
+  EXPECT_EQ(inconsistent, 0);
+  EXPECT_EQ(store.Load()->port_, 20);
+}
+// Tests if erasing keeps every other key reachable and counts duplicates.
+TEST(ConfigTest, FilterIndexCanErase) {
+  usps_api_server::Config config;
+  usps_api_server::FilterIndex index;
+  for (int i = 0; i < 1000; ++i) {
+    index.Insert(config.CreateGhostTunnel(i, i));
+  }
+  index.Insert(config.CreateGhostTunnel(7, 7));
+  for (int i = 0; i < 1000; i += 2) {
+    index.Erase(config.CreateGhostTunnel(i, i));
+  }
+  EXPECT_EQ(index.size(), 500);
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_EQ(index.Contains(config.CreateGhostTunnel(i, i)), i % 2 == 1);
+  }
+  index.Erase(config.CreateGhostTunnel(7, 7));
+  EXPECT_TRUE(index.Contains(config.CreateGhostTunnel(7, 7)));
+  index.Erase(config.CreateGhostTunnel(7, 7));
+  EXPECT_FALSE(index.Contains(config.CreateGhostTunnel(7, 7)));
+}
+// Tests if reloads apply CSV edits in place and skip unchanged files.
+TEST(ConfigTest, StoreAppliesFileDeltas) {
+  std::shared_ptr<usps_api_server::Config> config = CreateSharedConfig();
+  std::ofstream tunnel_file("tunnels_test.csv");
+  for (int i = 0; i < 1000; ++i) {
+    tunnel_file << i << ',' << i << '\n';
+  }
+  tunnel_file.close();
+  std::ofstream("routes_test.csv") << "11259375,24\n";
+  Json::Value root;
+  root["sfcfilter"]["deny"]["ghost_tunnel_identifier"]["file"] =
+      "tunnels_test.csv";
+  root["sfcfilter"]["deny"]["ghost_routing_identifier"]["file"] =
+      "routes_test.csv";
+  WriteToConfig(config.get(), root);
+  config->Initialize();
+  usps_api_server::ConfigStore store(config);
+  // The first two reloads fill new configs; the third reuses the first.
+  EXPECT_TRUE(store.Reload());
+  const usps_api_server::Config* filled = store.Load().get();
+  root["address"]["host"] = "1.1.1.1";
+  WriteToConfig(config.get(), root);
+  EXPECT_TRUE(store.Reload());
+  std::uint64_t version = store.Load()->version_;
+  EXPECT_TRUE(store.Reload());
+  EXPECT_EQ(store.Load()->version_, version);
+
+  std::ofstream edited("tunnels_test.csv");
+  for (int i = 0; i < 1000; ++i) {
+    edited << (i == 5 ? 5000 : i) << ',' << (i == 5 ? 5000 : i) << '\n';
+  }
+  edited.close();
+  std::ofstream("routes_test.csv") << "11259375,24\n281474976710655,48\n";
+  EXPECT_TRUE(store.Reload());
+  usps_api_server::ConfigSnapshot snapshot = store.Load();
+  EXPECT_EQ(snapshot.get(), filled);
+  EXPECT_EQ(snapshot->host_, "1.1.1.1");
+  EXPECT_EQ(snapshot->deny_.tunnels.size(), 1000);
+  EXPECT_EQ(snapshot->deny_.index.size(), 1002);
+  EXPECT_FALSE(snapshot->deny_.index.Contains(
+      config->CreateGhostTunnel(5, 5)));
+  EXPECT_TRUE(snapshot->deny_.index.Contains(
+      config->CreateGhostTunnel(5000, 5000)));
+  EXPECT_TRUE(snapshot->deny_.index.Contains(
+      config->CreateGhostRoute(281474976710655ULL, 48)));
+  for (const ghost::GhostTunnelIdentifier& id : snapshot->deny_.tunnels) {
+    EXPECT_NE(id.terminal_label().value(), 5);
+  }
+  std::remove("tunnels_test.csv");
+  std::remove("routes_test.csv");
+}
+// Tests if a file rewritten with the same size and mtime right after a load
+// is still hashed again on the next reload.
+TEST(ConfigTest, StoreRehashesRacilyCleanFiles) {
+  std::shared_ptr<usps_api_server::Config> config = CreateSharedConfig();
+  std::ofstream("tunnels_test.csv") << "1,1\n";
+  Json::Value root;
+  root["sfcfilter"]["deny"]["ghost_tunnel_identifier"]["file"] =
+      "tunnels_test.csv";
+  WriteToConfig(config.get(), root);
+  config->Initialize();
+  usps_api_server::ConfigStore store(config);
+  EXPECT_TRUE(store.Reload());
+  struct stat st;
+  ASSERT_EQ(stat("tunnels_test.csv", &st), 0);
+  std::ofstream("tunnels_test.csv") << "2,2\n";
+  struct timespec times[2] = {st.st_atim, st.st_mtim};
+  ASSERT_EQ(utimensat(AT_FDCWD, "tunnels_test.csv", times, 0), 0);
+  EXPECT_TRUE(store.Reload());
+  EXPECT_TRUE(store.Load()->deny_.index.Contains(
+      config->CreateGhostTunnel(2, 2)));
+  EXPECT_FALSE(store.Load()->deny_.index.Contains(
+      config->CreateGhostTunnel(1, 1)));
+  std::remove("tunnels_test.csv");
+}
+// Tests if the watcher picks up rename-style saves of referenced CSV files
+// and stops cleanly.
+TEST(ConfigTest, StoreWatchesReferencedFiles) {
+  std::shared_ptr<usps_api_server::Config> config = CreateSharedConfig();
+  std::ofstream("tunnels_test.csv") << "1,1\n";
+  Json::Value root;
+  root["sfcfilter"]["deny"]["ghost_tunnel_identifier"]["file"] =
+      "tunnels_test.csv";
+  WriteToConfig(config.get(), root);
+  config->Initialize();
+  usps_api_server::ConfigStore store(config);
+  store.MonitorConfig();
+  // Waits up to two seconds for 'done' to hold on the current snapshot.
+  auto wait_for = [&store](std::function<bool(const usps_api_server::Config&)>
+                               done) {
+    for (int i = 0; i < 200 && !done(*store.Load()); ++i) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return done(*store.Load());
+  };
+  std::ofstream("tunnels_test.csv.tmp") << "2,2\n";
+  std::rename("tunnels_test.csv.tmp", "tunnels_test.csv");
+  EXPECT_TRUE(wait_for([&config](const usps_api_server::Config& current) {
+    return current.deny_.index.Contains(config->CreateGhostTunnel(2, 2));
+  }));
+  // The replaced file is watched again after the reload.
+  std::ofstream("tunnels_test.csv", std::ios::app) << "3,3\n";
+  EXPECT_TRUE(wait_for([&config](const usps_api_server::Config& current) {
+    return current.deny_.index.Contains(config->CreateGhostTunnel(3, 3));
+  }));
+  root["address"]["host"] = "1.1.1.1";
+  WriteToConfig(config.get(), root);
+  EXPECT_TRUE(wait_for([](const usps_api_server::Config& current) {
+    return current.host_ == "1.1.1.1";
+  }));
+  store.StopMonitor();
+  std::remove("tunnels_test.csv");
+}
+// Tests if a snapshot restores the same indexes and detects stale sources.
+TEST(ConfigTest, SnapshotRoundTrip) {
+  usps_api_server::Config* config = CreateConfig();
+  std::ofstream tunnel_file("tunnels_test.csv");
+  for (int i = 0; i < 1000; ++i) {
+    tunnel_file << i << ',' << i << '\n';
+  }
+  tunnel_file.close();
+  std::ofstream("routes_test.csv") << "11259375,24\n";
+  Json::Value root;
+  root["address"]["host"] = "1.1.1.1";
+  root["sfcfilter"]["deny"]["ghost_tunnel_identifier"]["file"] =
+      "tunnels_test.csv";
+  root["sfcfilter"]["deny"]["ghost_routing_identifier"]["file"] =
+      "routes_test.csv";
+  root["sfcfilter"]["delay"]["ghost_tunnel_identifier"]["ghostlabel"][0]
+      ["terminal_label"] = 5000;
+  root["sfcfilter"]["delay"]["ghost_tunnel_identifier"]["ghostlabel"][0]
+      ["service_label"] = 5000;
+  WriteToConfig(config, root);
+  std::vector<std::string> files = {"tunnels_test.csv", "routes_test.csv",
+                                    config->kFilename};
+  std::vector<usps_api_server::FilterSnapshot::Source> sources =
+      usps_api_server::FilterSnapshot::Stat(files);
+  ASSERT_TRUE(config->Initialize());
+  ASSERT_TRUE(usps_api_server::FilterSnapshot::Write(*config, sources,
+                                                     "filters_test.snapshot"));
+  EXPECT_TRUE(usps_api_server::FilterSnapshot::Fresh("filters_test.snapshot",
+                                                     files));
+
+  usps_api_server::Config loaded;
+  ASSERT_TRUE(loaded.InitializeFromSnapshot("filters_test.snapshot"));
+  // The mapping outlives the file.
+  std::remove("filters_test.snapshot");
+  EXPECT_EQ(loaded.host_, "1.1.1.1");
+  EXPECT_TRUE(loaded.deny_.tunnels.empty());
+  EXPECT_EQ(loaded.deny_.index.size(), config->deny_.index.size());
+  EXPECT_EQ(loaded.delay_.index.size(), 1);
+  EXPECT_TRUE(loaded.allow_.index.empty());
+  for (int i = 990; i < 1010; ++i) {
+    EXPECT_EQ(loaded.deny_.index.Contains(config->CreateGhostTunnel(i, i)),
+              i < 1000);
+  }
+  EXPECT_TRUE(loaded.deny_.index.Contains(
+      config->CreateGhostRoute(11259375, 32)));
+  EXPECT_TRUE(loaded.delay_.index.Contains(
+      config->CreateGhostTunnel(5000, 5000)));
+  // Modifying a loaded index copies it out of the mapping first.
+  loaded.deny_.index.Insert(config->CreateGhostTunnel(2000, 2000));
+  EXPECT_TRUE(loaded.deny_.index.Contains(
+      config->CreateGhostTunnel(2000, 2000)));
+  EXPECT_FALSE(config->deny_.index.Contains(
+      config->CreateGhostTunnel(2000, 2000)));
+
+  // A file changed after it was stat'ed leaves the snapshot stale, even if
+  // the snapshot is written after the change.
+  std::ofstream("routes_test.csv", std::ios::app) << "1,48\n";
+  ASSERT_TRUE(usps_api_server::FilterSnapshot::Write(*config, sources,
+                                                     "filters_test.snapshot"));
+  EXPECT_FALSE(usps_api_server::FilterSnapshot::Fresh("filters_test.snapshot",
+                                                      files));
+  files.pop_back();
+  EXPECT_FALSE(usps_api_server::FilterSnapshot::Fresh("filters_test.snapshot",
+                                                      files));
+  // Truncated snapshots are rejected.
+  std::string data = FileReader::ReadString("filters_test.snapshot");
+  std::ofstream("filters_test.snapshot", std::ios::binary | std::ios::trunc)
+      << data.substr(0, data.size() - 8);
+  usps_api_server::Config truncated;
+  EXPECT_FALSE(truncated.InitializeFromSnapshot("filters_test.snapshot"));
+  std::remove("filters_test.snapshot");
+  std::remove("tunnels_test.csv");
+  std::remove("routes_test.csv");
+  delete config;
+}
@@ -0,0 +1,77 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#include "benchmark/benchmark.h"
+#include "counter_writer.h"
+#include "example/usps_api/packet_counters.h"
+#include "example/usps_api/sfc_table.h"
+#include "proto/usps_api/sfc.pb.h"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+namespace {
+std::atomic<std::uint64_t> shared_counter{0};
+usps_api_server::PacketCounters per_cpu_counters(4);
+
+ghost::CreateSfcRequest CountingRequest(int counters) {
+  ghost::CreateSfcRequest request;
+  ghost::GhostTunnelIdentifier* tunnel_id =
+      request.mutable_sfc_filter()->add_filter_layers()
+          ->mutable_ghost_filter()->mutable_tunnel_id();
+  tunnel_id->mutable_terminal_label()->set_value(100);
+  tunnel_id->mutable_service_label()->set_value(1);
+  for (int i = 0; i < counters; ++i) {
+    request.add_service_functions_to_install()->mutable_increment_counter();
+  }
+  return request;
+}
+} // namespace
+
+// The single atomic every packet used to increment.
+static void BM_IncrementShared(benchmark::State& state) {
+  for (auto _ : state) {
+    shared_counter.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+BENCHMARK(BM_IncrementShared)->ThreadRange(1, 8)->UseRealTime();
+
+static void BM_IncrementPerCpu(benchmark::State& state) {
+  for (auto _ : state) {
+    per_cpu_counters.Increment(1);
+  }
+}
+BENCHMARK(BM_IncrementPerCpu)->ThreadRange(1, 8)->UseRealTime();
+
+// Query with counter values while 'writers' threads count packets on the
+// same SFC.
+static void BM_QueryCountersUnderLoad(benchmark::State& state) {
+  usps_api_server::SfcTable table;
+  ghost::CreateSfcRequest request = CountingRequest(4);
+  std::unique_ptr<CounterWriter> writer(
+      new CounterWriter({table.Insert(request)}, state.range(0)));
+  ghost::QueryRequest query;
+  *query.mutable_sfc_filter() = request.sfc_filter();
+  query.set_include_counter_values(true);
+  for (auto _ : state) {
+    ghost::QueryResponse response;
+    benchmark::DoNotOptimize(table.Query(query, &response));
+  }
+  std::uint64_t increments = writer->Stop();
+  state.counters["increments_per_second"] =
+      benchmark::Counter(increments, benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_QueryCountersUnderLoad)
+    ->ArgName("writers")
+    ->DenseRange(0, 4)
+    ->UseRealTime();
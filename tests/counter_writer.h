@@ -0,0 +1,71 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#ifndef COUNTER_WRITER_H
+#define COUNTER_WRITER_H
+
+#include "example/usps_api/sfc_table.h"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Stands in for the data plane: 'threads' threads increment every counter
+// of 'sfcs' as fast as they can until Stop(), so that queries with counter
+// values can be tested and measured under write load.
+class CounterWriter {
+  public:
+    CounterWriter(
+        std::vector<std::shared_ptr<const usps_api_server::InstalledSfc>> sfcs,
+        int threads)
+        : sfcs_(std::move(sfcs)) {
+      for (int t = 0; t < threads; ++t) {
+        threads_.emplace_back([this]() { Write(); });
+      }
+    }
+    ~CounterWriter() { Stop(); }
+    // Stops the threads and returns how many increments they made.
+    std::uint64_t Stop() {
+      stop_ = true;
+      for (std::thread& thread : threads_) {
+        thread.join();
+      }
+      threads_.clear();
+      return increments_;
+    }
+
+  private:
+    void Write() {
+      std::uint64_t increments = 0;
+      while (!stop_.load(std::memory_order_relaxed)) {
+        // Checks for Stop() once per 1024 rounds over the SFCs.
+        for (int round = 0; round < 1024; ++round) {
+          for (const auto& installed : sfcs_) {
+            for (std::size_t i = 0; i < installed->counters.size(); ++i) {
+              installed->counters.Increment(i);
+            }
+            increments += installed->counters.size();
+          }
+        }
+      }
+      increments_ += increments;
+    }
+    std::vector<std::shared_ptr<const usps_api_server::InstalledSfc>> sfcs_;
+    std::vector<std::thread> threads_;
+    std::atomic<bool> stop_{false};
+    std::atomic<std::uint64_t> increments_{0};
+};
+
+#endif
@@ -0,0 +1,124 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#include "benchmark/benchmark.h"
+#include "example/usps_api/config/arena_list.h"
+#include "example/usps_api/config/config_parser.h"
+#include "example/usps_api/config/filter_loader.h"
+#include "example/usps_api/utils/file_reader.h"
+#include "proto/usps_api/ghost_label.pb.h"
+#include "json/json.h"
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <list>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+// Writes 'lines' random tunnel identifiers to a CSV file and returns its
+// name.
+std::string WriteTunnelFile(std::int64_t lines) {
+  std::string filename = "csv_benchmark_" + std::to_string(lines) + ".csv";
+  std::ofstream file(filename);
+  std::mt19937_64 rng(lines);
+  for (std::int64_t i = 0; i < lines; ++i) {
+    file << (rng() >> 16) << ',' << (rng() >> 16) << '\n';
+  }
+  return filename;
+}
+} // namespace
+
+// The original path: a list of string vectors, then stoull per field.
+static void BM_ParseCSV(benchmark::State& state) {
+  std::string filename = WriteTunnelFile(state.range(0));
+  for (auto _ : state) {
+    usps_api_server::ArenaList<ghost::GhostTunnelIdentifier> tunnels;
+    std::list<std::vector<std::string>> entries =
+        FileReader::ParseCSV(filename);
+    for (const std::vector<std::string>& entry : entries) {
+      if (entry.size() < 2) {
+        continue;
+      }
+      usps_api_server::Config::SetGhostTunnel(
+          std::stoull(entry[0]), std::stoull(entry[1]), tunnels.Add());
+    }
+    benchmark::DoNotOptimize(tunnels.size());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  std::remove(filename.c_str());
+}
+BENCHMARK(BM_ParseCSV)->Range(1 << 10, 1 << 20)->Unit(benchmark::kMillisecond);
+
+// The mapped path: from_chars straight from the mapping into the list.
+static void BM_ParseMapped(benchmark::State& state) {
+  std::string filename = WriteTunnelFile(state.range(0));
+  for (auto _ : state) {
+    usps_api_server::ArenaList<ghost::GhostTunnelIdentifier> tunnels;
+    FileReader::MappedFile file(filename);
+    FileReader::ParsePairs(file.data(),
+                           [&tunnels](std::uint64_t term,
+                                      std::uint64_t service) {
+      usps_api_server::Config::SetGhostTunnel(term, service, tunnels.Add());
+    });
+    benchmark::DoNotOptimize(tunnels.size());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  std::remove(filename.c_str());
+}
+BENCHMARK(BM_ParseMapped)
+    ->Range(1 << 10, 1 << 20)
+    ->Unit(benchmark::kMillisecond);
+
+// Scanning and number parsing alone, without building protos.
+static void BM_ParsePairsOnly(benchmark::State& state) {
+  std::string filename = WriteTunnelFile(state.range(0));
+  FileReader::MappedFile file(filename);
+  for (auto _ : state) {
+    std::uint64_t sum = 0;
+    FileReader::ParsePairs(file.data(),
+                           [&sum](std::uint64_t first, std::uint64_t second) {
+      sum += first ^ second;
+    });
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetBytesProcessed(state.iterations() * file.data().size());
+  std::remove(filename.c_str());
+}
+BENCHMARK(BM_ParsePairsOnly)
+    ->Range(1 << 10, 1 << 20)
+    ->Unit(benchmark::kMillisecond);
+
+// Three filters of 'lines' identifiers each, loaded on 1 to N threads.
+static void BM_LoadFilters(benchmark::State& state) {
+  std::string filename = WriteTunnelFile(state.range(0));
+  Json::Value root;
+  root["ghost_tunnel_identifier"]["file"] = filename;
+  for (auto _ : state) {
+    usps_api_server::Config::Filter deny, allow, delay;
+    usps_api_server::FilterLoader loader(state.range(1));
+    loader.Add(&deny, root);
+    loader.Add(&allow, root);
+    loader.Add(&delay, root);
+    loader.Load();
+    benchmark::DoNotOptimize(deny.index.size());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0) * 3);
+  std::remove(filename.c_str());
+}
+BENCHMARK(BM_LoadFilters)
+    ->ArgsProduct({{1 << 20}, {1, 2, 4, 8}})
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
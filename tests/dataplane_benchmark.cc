@@ -0,0 +1,124 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#include "benchmark/benchmark.h"
+#include "example/usps_api/dataplane/packet.h"
+#include "example/usps_api/dataplane/service_chain.h"
+#include "example/usps_api/packet_counters.h"
+#include "proto/usps_api/sfc.pb.h"
+#include <google/protobuf/text_format.h>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace {
+// Decapsulates a UDP tunnel, counts and re-encapsulates, as a gateway
+// forwarding between tunnels would.
+const char kTunnel[] = R"(
+  service_functions_to_install { decap {
+    decaps { ethernet_decap {} } decaps { ip_decap {} } decaps { udp_decap {} }
+  } }
+  service_functions_to_install { increment_counter {} }
+  service_functions_to_install { encap_and_tx {
+    encaps { udp_encap { source_port: 1000 destination_port: 2000 } }
+    encaps { ip_encap { source_address: "10.0.0.1"
+                        destination_address: "10.0.0.2" } }
+  } }
+)";
+
+class DiscardSink : public usps_api_server::PacketSink {
+  public:
+    void Transmit(usps_api_server::PacketBatch* batch) override {
+      batch->ReleaseAll();
+    }
+};
+
+// An Ethernet, IPv4 and UDP frame of 'size' bytes.
+std::string Frame(std::size_t size) {
+  std::string frame(size, '\0');
+  frame[12] = 0x08;
+  frame[14] = 0x45;
+  frame[16] = static_cast<char>((size - 14) >> 8);
+  frame[17] = static_cast<char>(size - 14);
+  frame[23] = 17;
+  frame[38] = static_cast<char>((size - 34) >> 8);
+  frame[39] = static_cast<char>(size - 34);
+  return frame;
+}
+} // namespace
+
+// Runs batches of 'batch' 128-byte frames through a tunnel chain. A batch
+// of one is the cost of running packets through the chain one at a time.
+static void BM_ServiceChain(benchmark::State& state) {
+  ghost::CreateSfcRequest request;
+  google::protobuf::TextFormat::ParseFromString(kTunnel, &request);
+  usps_api_server::PacketCounters counters(1);
+  std::string error;
+  std::unique_ptr<usps_api_server::ServiceChain> chain =
+      usps_api_server::ServiceChain::Compile(
+          request.service_functions_to_install(), &counters, &error);
+  std::string frame = Frame(128);
+  const std::uint8_t* data = reinterpret_cast<const std::uint8_t*>(frame.data());
+  std::size_t size = static_cast<std::size_t>(state.range(0));
+  usps_api_server::PacketBatch batch;
+  DiscardSink sink;
+  for (auto _ : state) {
+    for (std::size_t i = 0; i < size; ++i) {
+      batch.Add(usps_api_server::Packet::Create(data, frame.size()));
+    }
+    chain->Run(&batch, &sink);
+  }
+  state.SetItemsProcessed(state.iterations() * size);
+}
+BENCHMARK(BM_ServiceChain)
+    ->ArgName("batch")
+    ->Arg(1)->Arg(8)->Arg(32)->Arg(64)->Arg(128)->Arg(256);
+
+// Sends batches of 64 MTU-size packets out through 'dups' tunnels. Items
+// are transmitted packets; the packets are created afresh each batch.
+static void BM_DupEncapAndTx(benchmark::State& state) {
+  std::size_t dups = static_cast<std::size_t>(state.range(0));
+  std::string text = "service_functions_to_install { dup_encap_and_tx {";
+  for (std::size_t i = 0; i < dups; ++i) {
+    text += R"( dups {
+      encaps { udp_encap { source_port: 1000 destination_port: 2000 } }
+      encaps { ip_encap { source_address: "10.0.0.1"
+                          destination_address: "10.0.0.)" +
+            std::to_string(i + 2) + "\" } } }";
+  }
+  text += " } }";
+  ghost::CreateSfcRequest request;
+  google::protobuf::TextFormat::ParseFromString(text, &request);
+  std::string error;
+  std::unique_ptr<usps_api_server::ServiceChain> chain =
+      usps_api_server::ServiceChain::Compile(
+          request.service_functions_to_install(), nullptr, &error);
+  if (chain == nullptr) {
+    state.SkipWithError(error.c_str());
+    return;
+  }
+  std::string payload(1500 - 28, 'p');
+  const std::uint8_t* data =
+      reinterpret_cast<const std::uint8_t*>(payload.data());
+  usps_api_server::PacketBatch batch;
+  DiscardSink sink;
+  for (auto _ : state) {
+    for (std::size_t i = 0; i < 64; ++i) {
+      batch.Add(usps_api_server::Packet::Create(data, payload.size()));
+    }
+    chain->Run(&batch, &sink);
+  }
+  state.SetItemsProcessed(state.iterations() * 64 * dups);
+  state.SetBytesProcessed(state.iterations() * 64 * dups * 1500);
+}
+BENCHMARK(BM_DupEncapAndTx)->ArgName("dups")->Arg(1)->Arg(2)->Arg(4)->Arg(8);
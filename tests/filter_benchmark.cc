@@ -0,0 +1,183 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#include "benchmark/benchmark.h"
+#include "label_files.h"
+#include "example/usps_api/config/config_parser.h"
+#include "example/usps_api/server.h"
+#include "example/usps_api/utils/file_reader.h"
+#include "proto/usps_api/sfc.pb.h"
+#include "json/json.h"
+#include <grpcpp/server_context.h>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+// Requests cycle through this many distinct filters.
+const std::size_t kRequests = 4096;
+
+Json::Value FilterRoot(const LabelFiles& files) {
+  Json::Value root;
+  root["ghost_tunnel_identifier"]["file"] = files.tunnel_file();
+  root["ghost_routing_identifier"]["file"] = files.route_file();
+  return root;
+}
+
+// Returns a config with every setting enabled and the deny list loaded from
+// 'files'.
+std::shared_ptr<usps_api_server::Config> DenyConfig(const LabelFiles& files) {
+  std::shared_ptr<usps_api_server::Config> config =
+      std::make_shared<usps_api_server::Config>();
+  config->create_ = true;
+  config->del_ = true;
+  config->query_ = true;
+  config->delay_time_ = 0;
+  config->ParseIdentifiers(&config->deny_, FilterRoot(files));
+  return config;
+}
+
+void AddTunnel(std::uint64_t terminal, std::uint64_t service,
+               ghost::SfcFilter* sfc_filter) {
+  usps_api_server::Config::SetGhostTunnel(
+      terminal, service,
+      sfc_filter->add_filter_layers()->mutable_ghost_filter()
+          ->mutable_tunnel_id());
+}
+
+// Filters on tunnels of the deny list if 'hit', otherwise on random
+// tunnels that are almost surely absent.
+std::vector<ghost::SfcFilter> TunnelFilters(
+    const usps_api_server::Config& config, bool hit) {
+  const auto& tunnels = config.deny_.tunnels;
+  std::vector<ghost::SfcFilter> filters(kRequests);
+  std::mt19937_64 rng(kRequests);
+  for (std::size_t i = 0; i < kRequests; ++i) {
+    if (hit) {
+      const ghost::GhostTunnelIdentifier& tunnel_id =
+          *(tunnels.begin() + rng() % tunnels.size());
+      AddTunnel(tunnel_id.terminal_label().value(),
+                tunnel_id.service_label().value(), &filters[i]);
+    } else {
+      AddTunnel(rng(), rng(), &filters[i]);
+    }
+  }
+  return filters;
+}
+} // namespace
+
+// The generic CSV reader. Stops at 1M lines: at 10M the list of string
+// vectors alone takes gigabytes.
+BENCHMARK_DEFINE_F(LabelFiles, ParseCSV)(benchmark::State& state) {
+  for (auto _ : state) {
+    std::list<std::vector<std::string>> entries =
+        FileReader::ParseCSV(tunnel_file());
+    benchmark::DoNotOptimize(entries.size());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK_REGISTER_F(LabelFiles, ParseCSV)
+    ->RangeMultiplier(10)
+    ->Range(10, 1000000)
+    ->Unit(benchmark::kMillisecond);
+
+// A tunnel file and a routing file loaded and compiled into one filter.
+BENCHMARK_DEFINE_F(LabelFiles, ParseIdentifiers)(benchmark::State& state) {
+  Json::Value root = FilterRoot(*this);
+  usps_api_server::Config config;
+  for (auto _ : state) {
+    usps_api_server::Config::Filter filter;
+    config.ParseIdentifiers(&filter, root);
+    benchmark::DoNotOptimize(filter.index.size());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0) * 2);
+}
+BENCHMARK_REGISTER_F(LabelFiles, ParseIdentifiers)
+    ->RangeMultiplier(10)
+    ->Range(10, 10000000)
+    ->Unit(benchmark::kMillisecond);
+
+BENCHMARK_DEFINE_F(LabelFiles, FilterMatchTunnelHit)(benchmark::State& state) {
+  std::shared_ptr<usps_api_server::Config> config = DenyConfig(*this);
+  std::vector<ghost::SfcFilter> filters = TunnelFilters(*config, true);
+  std::size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(config->FilterMatch(&config->deny_, &filters[i]));
+    i = (i + 1) % kRequests;
+  }
+}
+BENCHMARK_REGISTER_F(LabelFiles, FilterMatchTunnelHit)
+    ->RangeMultiplier(10)
+    ->Range(10, 10000000);
+
+BENCHMARK_DEFINE_F(LabelFiles, FilterMatchTunnelMiss)(benchmark::State& state) {
+  std::shared_ptr<usps_api_server::Config> config = DenyConfig(*this);
+  std::vector<ghost::SfcFilter> filters = TunnelFilters(*config, false);
+  std::size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(config->FilterMatch(&config->deny_, &filters[i]));
+    i = (i + 1) % kRequests;
+  }
+}
+BENCHMARK_REGISTER_F(LabelFiles, FilterMatchTunnelMiss)
+    ->RangeMultiplier(10)
+    ->Range(10, 10000000);
+
+// Random full-length labels against the routing prefixes.
+BENCHMARK_DEFINE_F(LabelFiles, FilterMatchRoute)(benchmark::State& state) {
+  std::shared_ptr<usps_api_server::Config> config = DenyConfig(*this);
+  std::vector<ghost::SfcFilter> filters(kRequests);
+  std::mt19937_64 rng(kRequests);
+  for (ghost::SfcFilter& sfc_filter : filters) {
+    usps_api_server::Config::SetGhostRoute(
+        rng() & ((1ULL << 48) - 1), 48,
+        sfc_filter.add_filter_layers()->mutable_ghost_filter()
+            ->mutable_routing_id());
+  }
+  std::size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(config->FilterMatch(&config->deny_, &filters[i]));
+    i = (i + 1) % kRequests;
+  }
+}
+BENCHMARK_REGISTER_F(LabelFiles, FilterMatchRoute)
+    ->RangeMultiplier(10)
+    ->Range(10, 10000000);
+
+// A whole sync CreateSfc call in process, without the transport: config
+// load, filter evaluation and scheduling. Allowed requests are installed;
+// denied ones stop at the deny list.
+BENCHMARK_DEFINE_F(LabelFiles, CreateSfc)(benchmark::State& state) {
+  std::shared_ptr<usps_api_server::Config> config = DenyConfig(*this);
+  std::vector<ghost::SfcFilter> filters =
+      TunnelFilters(*config, state.range(1) != 0);
+  std::vector<ghost::CreateSfcRequest> requests(kRequests);
+  for (std::size_t i = 0; i < kRequests; ++i) {
+    *requests[i].mutable_sfc_filter() = filters[i];
+  }
+  usps_api_server::GhostImpl service(config);
+  grpc::ServerContext context;
+  ghost::CreateSfcResponse response;
+  std::size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        service.CreateSfc(&context, &requests[i], &response));
+    i = (i + 1) % kRequests;
+  }
+}
+BENCHMARK_REGISTER_F(LabelFiles, CreateSfc)
+    ->ArgNames({"lines", "denied"})
+    ->ArgsProduct({{10, 1000, 100000, 10000000}, {0, 1}});
@@ -0,0 +1,85 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#ifndef LABEL_FILES_H
+#define LABEL_FILES_H
+
+#include "benchmark/benchmark.h"
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <random>
+#include <string>
+
+// A benchmark fixture with synthetic label CSVs of state.range(0) lines.
+//
+// Writing ten million lines takes seconds, so each size is written once
+// and kept for every benchmark and repetition of the binary that asks for
+// it. The files are removed when the binary exits.
+class LabelFiles : public benchmark::Fixture {
+  public:
+    void SetUp(const benchmark::State& state) override {
+      std::int64_t lines = state.range(0);
+      tunnel_file_ = Cached(&Files().tunnels, "tunnels", lines, false);
+      route_file_ = Cached(&Files().routes, "routes", lines, true);
+    }
+    // terminal,service lines.
+    const std::string& tunnel_file() const { return tunnel_file_; }
+    // value,prefix_len lines with prefix lengths between 8 and 48.
+    const std::string& route_file() const { return route_file_; }
+
+  private:
+    struct Registry {
+      std::map<std::int64_t, std::string> tunnels;
+      std::map<std::int64_t, std::string> routes;
+      ~Registry() {
+        for (const auto& entry : tunnels) {
+          std::remove(entry.second.c_str());
+        }
+        for (const auto& entry : routes) {
+          std::remove(entry.second.c_str());
+        }
+      }
+    };
+    static Registry& Files() {
+      static Registry registry;
+      return registry;
+    }
+    static const std::string& Cached(std::map<std::int64_t, std::string>* files,
+                                     const std::string& kind,
+                                     std::int64_t lines, bool routes) {
+      auto it = files->find(lines);
+      if (it != files->end()) {
+        return it->second;
+      }
+      std::string filename =
+          "label_files_" + kind + "_" + std::to_string(lines) + ".csv";
+      std::ofstream file(filename);
+      std::mt19937_64 rng(lines);
+      std::uniform_int_distribution<std::uint32_t> len(8, 48);
+      for (std::int64_t i = 0; i < lines; ++i) {
+        if (routes) {
+          file << (rng() & ((1ULL << 48) - 1)) << ',' << len(rng) << '\n';
+        } else {
+          std::uint64_t terminal = rng() >> 16;
+          file << terminal << ',' << (rng() >> 16) << '\n';
+        }
+      }
+      return (*files)[lines] = filename;
+    }
+    std::string tunnel_file_;
+    std::string route_file_;
+};
+
+#endif
@@ -0,0 +1,49 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#include "benchmark/benchmark.h"
+#include "example/usps_api/utils/metrics.h"
+#include <cstdint>
+
+static void BM_Increment(benchmark::State& state) {
+  for (auto _ : state) {
+    Metrics::Increment(Metrics::QUERY_FAILED);
+  }
+}
+BENCHMARK(BM_Increment)->ThreadRange(1, 8);
+
+static void BM_Record(benchmark::State& state) {
+  std::uint64_t nanos = 1;
+  for (auto _ : state) {
+    Metrics::Record(Metrics::QUERY, nanos);
+    nanos = nanos * 3 % 1000003;
+  }
+}
+BENCHMARK(BM_Record)->ThreadRange(1, 8);
+
+// What an RPC pays: two clock reads and a record.
+static void BM_RpcTimer(benchmark::State& state) {
+  for (auto _ : state) {
+    RpcTimer timer(Metrics::QUERY);
+    timer.Finish(true);
+  }
+}
+BENCHMARK(BM_RpcTimer)->ThreadRange(1, 8);
+
+static void BM_Collect(benchmark::State& state) {
+  Metrics::Record(Metrics::QUERY, 1);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(Metrics::Collect());
+  }
+}
+BENCHMARK(BM_Collect);
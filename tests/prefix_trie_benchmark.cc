@@ -0,0 +1,85 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#include "benchmark/benchmark.h"
+#include "example/usps_api/config/prefix_trie.h"
+#include <cstdint>
+#include <random>
+#include <vector>
+
+namespace {
+// Builds a trie of 'count' random prefixes with lengths between 8 and 48.
+usps_api_server::PrefixTrie BuildTrie(std::int64_t count,
+                                      std::vector<std::uint64_t>* labels) {
+  std::mt19937_64 rng(count);
+  std::uniform_int_distribution<std::uint32_t> len(8, 48);
+  std::vector<usps_api_server::PrefixTrie::Prefix> prefixes;
+  prefixes.reserve(count);
+  for (std::int64_t i = 0; i < count; ++i) {
+    std::uint64_t value = rng() & ((1ULL << 48) - 1);
+    prefixes.push_back({value, len(rng)});
+    labels->push_back(value);
+  }
+  usps_api_server::PrefixTrie trie;
+  trie.Build(prefixes);
+  return trie;
+}
+} // namespace
+
+// Lookups of labels that are covered by a stored prefix.
+static void BM_CoversHit(benchmark::State& state) {
+  std::vector<std::uint64_t> labels;
+  usps_api_server::PrefixTrie trie = BuildTrie(state.range(0), &labels);
+  std::size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(trie.Covers(labels[i], 48));
+    i = (i + 1) % labels.size();
+  }
+}
+BENCHMARK(BM_CoversHit)->Range(1 << 10, 1 << 20);
+
+// Lookups of random labels, most of which fall outside every prefix.
+static void BM_CoversRandom(benchmark::State& state) {
+  std::vector<std::uint64_t> labels;
+  usps_api_server::PrefixTrie trie = BuildTrie(state.range(0), &labels);
+  std::mt19937_64 rng(1);
+  std::vector<std::uint64_t> queries(1 << 16);
+  for (std::uint64_t& query : queries) {
+    query = rng();
+  }
+  std::size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(trie.Covers(queries[i], 32));
+    i = (i + 1) & (queries.size() - 1);
+  }
+}
+BENCHMARK(BM_CoversRandom)->Range(1 << 10, 1 << 20);
+
+static void BM_LongestMatch(benchmark::State& state) {
+  std::vector<std::uint64_t> labels;
+  usps_api_server::PrefixTrie trie = BuildTrie(state.range(0), &labels);
+  std::size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(trie.LongestMatch(labels[i]));
+    i = (i + 1) % labels.size();
+  }
+}
+BENCHMARK(BM_LongestMatch)->Range(1 << 10, 1 << 20);
+
+static void BM_Build(benchmark::State& state) {
+  for (auto _ : state) {
+    std::vector<std::uint64_t> labels;
+    benchmark::DoNotOptimize(BuildTrie(state.range(0), &labels));
+  }
+}
+BENCHMARK(BM_Build)->Range(1 << 10, 1 << 20)->Unit(benchmark::kMillisecond);
@@ -0,0 +1,176 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#include "benchmark/benchmark.h"
+#include "example/usps_api/async_server.h"
+#include "example/usps_api/load_generator.h"
+#include "example/usps_api/server.h"
+#include <grpcpp/create_channel.h>
+#include <grpcpp/security/credentials.h>
+#include <grpcpp/security/server_credentials.h>
+#include <grpcpp/server.h>
+#include <grpcpp/server_builder.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace {
+enum Mode { SYNC, ASYNC };
+// How long each point of the curve is driven for.
+const double kSeconds = 1.0;
+// Calls each async worker keeps posted for every RPC.
+const int kCalls = 16;
+
+// Returns the user and system CPU time of the whole process in seconds.
+double ProcessCpuSeconds() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// The server as run_server.cc builds it, on a free local port.
+class Server {
+  public:
+    // Starts with an SFC installed for every label in 'labels', so that
+    // queries find them.
+    Server(Mode mode, int workers,
+           const std::vector<std::pair<std::uint64_t, std::uint64_t>>& labels)
+        : mode_(mode) {
+      std::shared_ptr<usps_api_server::Config> config =
+          std::make_shared<usps_api_server::Config>();
+      config->create_ = true;
+      config->del_ = true;
+      config->query_ = true;
+      config->delay_time_ = 0;
+      std::shared_ptr<usps_api_server::ConfigStore> store =
+          std::make_shared<usps_api_server::ConfigStore>(config);
+      std::shared_ptr<usps_api_server::Scheduler> scheduler =
+          std::make_shared<usps_api_server::Scheduler>(
+              std::make_shared<usps_api_server::SfcTable>());
+      for (const auto& label : labels) {
+        ghost::CreateSfcRequest request;
+        usps_api_server::Config::SetGhostTunnel(
+            label.first, label.second,
+            request.mutable_sfc_filter()->add_filter_layers()
+                ->mutable_ghost_filter()->mutable_tunnel_id());
+        scheduler->Create(request);
+      }
+      service_.reset(new usps_api_server::GhostImpl(store, scheduler));
+      pool_.reset(
+          new usps_api_server::WorkerPool(&async_service_, store, scheduler));
+      grpc::ServerBuilder builder;
+      builder.AddListeningPort("localhost:0",
+                               grpc::InsecureServerCredentials(), &port_);
+      if (mode_ == ASYNC) {
+        builder.RegisterService(&async_service_);
+        pool_->AddQueues(&builder, workers);
+      } else {
+        // Runs sync handlers on 'workers' polling threads. Unlike a thread
+        // quota, this queues calls beyond them instead of rejecting them,
+        // so both modes complete the same work.
+        builder.SetSyncServerOption(grpc::ServerBuilder::NUM_CQS, 1);
+        builder.SetSyncServerOption(grpc::ServerBuilder::MIN_POLLERS, workers);
+        builder.SetSyncServerOption(grpc::ServerBuilder::MAX_POLLERS, workers);
+        builder.RegisterService(service_.get());
+      }
+      server_ = builder.BuildAndStart();
+      if (mode_ == ASYNC) {
+        pool_->Start(kCalls, false);
+      }
+    }
+    ~Server() {
+      server_->Shutdown();
+      if (mode_ == ASYNC) {
+        pool_->Shutdown();
+      }
+    }
+    int port() const { return port_; }
+
+  private:
+    Mode mode_;
+    int port_ = 0;
+    std::unique_ptr<usps_api_server::GhostImpl> service_;
+    ghost::SfcService::AsyncService async_service_;
+    std::unique_ptr<usps_api_server::WorkerPool> pool_;
+    std::unique_ptr<grpc::Server> server_;
+};
+} // namespace
+
+// One point of the throughput/latency curve: a server in 'mode' with
+// 'workers' threads, driven in a closed loop by 'concurrency' outstanding
+// RPCs spread over up to four channels. The client runs in the same
+// process, so cpu_us_per_rpc includes it; it is the same for both modes.
+// Run with --benchmark_format=json or --benchmark_out=<file> to track the
+// curves over time.
+static void BM_ServerThroughput(benchmark::State& state) {
+  Mode mode = static_cast<Mode>(state.range(0));
+  int workers = state.range(1);
+  int concurrency = state.range(2);
+  usps_api_client::LoadOptions options;
+  options.seconds = kSeconds;
+  options.create_weight = 1;
+  options.query_weight = 1;
+  for (std::uint64_t label = 1; label <= 1024; ++label) {
+    options.labels.emplace_back(label, label);
+  }
+  Server server(mode, workers, options.labels);
+  int channel_count = std::min(concurrency, 4);
+  options.in_flight = concurrency / channel_count;
+  std::vector<std::shared_ptr<grpc::Channel>> channels;
+  for (int i = 0; i < channel_count; ++i) {
+    // Distinct arguments give each channel its own connection.
+    grpc::ChannelArguments args;
+    args.SetInt("usps_api.channel", i);
+    channels.push_back(grpc::CreateCustomChannel(
+        "localhost:" + std::to_string(server.port()),
+        grpc::InsecureChannelCredentials(), args));
+  }
+  usps_api_client::LoadReport report;
+  double cpu_seconds = 0;
+  for (auto _ : state) {
+    double cpu_start = ProcessCpuSeconds();
+    report = usps_api_client::LoadGenerator(channels, options).Run();
+    cpu_seconds = ProcessCpuSeconds() - cpu_start;
+    state.SetIterationTime(report.seconds);
+  }
+  // Throughput, latency and CPU cost count successful RPCs only. Rejected
+  // RPCs are reported separately and should be zero.
+  std::uint64_t rpcs = 0;
+  std::uint64_t failed = 0;
+  std::uint64_t rejected = 0;
+  LatencyHistogram latency;
+  for (int op = 0; op < usps_api_client::LoadReport::kOps; ++op) {
+    rpcs += report.ok[op];
+    failed += report.failed[op];
+    rejected += report.rejected[op];
+    latency.Merge(report.latency[op]);
+  }
+  state.counters["rpcs_per_second"] = rpcs / report.seconds;
+  state.counters["failed"] = failed - rejected;
+  state.counters["rejected_fraction"] =
+      rpcs + failed == 0 ? 0 : static_cast<double>(rejected) / (rpcs + failed);
+  state.counters["p50_us"] = latency.Percentile(50) / 1e3;
+  state.counters["p99_us"] = latency.Percentile(99) / 1e3;
+  state.counters["p999_us"] = latency.Percentile(99.9) / 1e3;
+  state.counters["cpu_us_per_rpc"] = rpcs == 0 ? 0 : cpu_seconds * 1e6 / rpcs;
+}
+BENCHMARK(BM_ServerThroughput)
+    ->ArgNames({"async", "workers", "concurrency"})
+    ->ArgsProduct({{SYNC, ASYNC}, {1, 2, 4}, {1, 4, 16, 64, 256}})
+    ->Iterations(1)
+    ->UseManualTime()
+    ->Unit(benchmark::kMillisecond);
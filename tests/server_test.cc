@@ -15,7 +15,16 @@
 #include "gmock/gmock.h"
 #include "config_helper.h"
 #include "example/usps_api/server.h"
+#include "example/usps_api/async_server.h"
+#include "example/usps_api/utils/metrics.h"
+#include <grpcpp/grpcpp.h>
+#include <chrono>
+#include <thread>
+#include <vector>
 #include "proto/usps_api/sfc.grpc.pb.h"
+#include "allocation_counter.h"
+#include "counter_writer.h"
+#include <google/protobuf/arena.h>
 using namespace ConfigHelper;
 using namespace ghost;
 using ::testing::AtLeast;
@@ -61,6 +70,11 @@ GhostTunnelIdentifier* CreateSfcTunnel(std::uint64_t terminal_value,
   service_label->set_value(service_value);
   return tunnel_id;
 }
+void SetTime(usps_api_server::Scheduler::Time time,
+             GpsEpochTimestamp* timestamp) {
+  timestamp->set_seconds(time / 1000000000);
+  timestamp->set_nanos(time % 1000000000);
+}
 GhostRoutingIdentifier* CreateSfcRoute(std::uint64_t value,
                                        std::uint32_t prefix_len,
                                        CreateSfcRequest &request) {
@@ -114,16 +128,19 @@ TEST(ServerTest, DenyTunnelTest) {
   GhostTunnelIdentifier* tunnel_id2 = CreateSfcTunnel(200, 1, request2);
   config.get()->deny_.tunnels.push_back(*tunnel_id1);
   config.get()->deny_.tunnels.push_back(*tunnel_id2);
+  config.get()->deny_.Compile();
   status1 = CreateSfc(config, request1);
   status2 = CreateSfc(config, request2);
   EXPECT_FALSE(status1.ok());
   EXPECT_FALSE(status2.ok());
   config.get()->deny_.tunnels.pop_back();
+  config.get()->deny_.Compile();
   status1 = CreateSfc(config, request1);
   status2 = CreateSfc(config, request2);
   EXPECT_FALSE(status1.ok());
   EXPECT_TRUE(status2.ok());
   config.get()->deny_.tunnels.pop_back();
+  config.get()->deny_.Compile();
   status1 = CreateSfc(config, request1);
   status2 = CreateSfc(config, request2);
   EXPECT_TRUE(status1.ok());
@@ -138,20 +155,23 @@ TEST(ServerTest, DenyRoutingTest) {
   grpc::Status status2 = CreateSfc(config, request2);
   EXPECT_TRUE(status1.ok());
   EXPECT_TRUE(status2.ok());
-  GhostRoutingIdentifier* routing_id1 = CreateSfcRoute(100, 1, request1);
-  GhostRoutingIdentifier* routing_id2 = CreateSfcRoute(200, 1, request2);
+  GhostRoutingIdentifier* routing_id1 = CreateSfcRoute(100, 48, request1);
+  GhostRoutingIdentifier* routing_id2 = CreateSfcRoute(200, 48, request2);
   config.get()->deny_.routings.push_back(*routing_id1);
   config.get()->deny_.routings.push_back(*routing_id2);
+  config.get()->deny_.Compile();
   status1 = CreateSfc(config, request1);
   status2 = CreateSfc(config, request2);
   EXPECT_FALSE(status1.ok());
   EXPECT_FALSE(status2.ok());
   config.get()->deny_.routings.pop_back();
+  config.get()->deny_.Compile();
   status1 = CreateSfc(config, request1);
   status2 = CreateSfc(config, request2);
   EXPECT_FALSE(status1.ok());
   EXPECT_TRUE(status2.ok());
   config.get()->deny_.routings.pop_back();
+  config.get()->deny_.Compile();
   status1 = CreateSfc(config, request1);
   status2 = CreateSfc(config, request2);
   EXPECT_TRUE(status1.ok());
@@ -170,16 +190,19 @@ TEST(ServerTest, AllowTunnelTest) {
   GhostTunnelIdentifier* tunnel_id2 = CreateSfcTunnel(200, 1, request2);
   config.get()->allow_.tunnels.push_back(*tunnel_id1);
   config.get()->allow_.tunnels.push_back(*tunnel_id2);
+  config.get()->allow_.Compile();
   status1 = CreateSfc(config, request1);
   status2 = CreateSfc(config, request2);
   EXPECT_TRUE(status1.ok());
   EXPECT_TRUE(status2.ok());
   config.get()->allow_.tunnels.pop_back();
+  config.get()->allow_.Compile();
   status1 = CreateSfc(config, request1);
   status2 = CreateSfc(config, request2);
   EXPECT_TRUE(status1.ok());
   EXPECT_FALSE(status2.ok());
   config.get()->allow_.tunnels.pop_back();
+  config.get()->allow_.Compile();
   status1 = CreateSfc(config, request1);
   status2 = CreateSfc(config, request2);
   EXPECT_TRUE(status1.ok());
@@ -194,20 +217,23 @@ TEST(ServerTest, AllowRoutingTest) {
   grpc::Status status2 = CreateSfc(config, request2);
   EXPECT_TRUE(status1.ok());
   EXPECT_TRUE(status2.ok());
-  GhostRoutingIdentifier* routing_id1 = CreateSfcRoute(100, 1, request1);
-  GhostRoutingIdentifier* routing_id2 = CreateSfcRoute(200, 1, request2);
+  GhostRoutingIdentifier* routing_id1 = CreateSfcRoute(100, 48, request1);
+  GhostRoutingIdentifier* routing_id2 = CreateSfcRoute(200, 48, request2);
   config.get()->allow_.routings.push_back(*routing_id1);
   config.get()->allow_.routings.push_back(*routing_id2);
+  config.get()->allow_.Compile();
   status1 = CreateSfc(config, request1);
   status2 = CreateSfc(config, request2);
   EXPECT_TRUE(status1.ok());
   EXPECT_TRUE(status2.ok());
   config.get()->allow_.routings.pop_back();
+  config.get()->allow_.Compile();
   status1 = CreateSfc(config, request1);
   status2 = CreateSfc(config, request2);
   EXPECT_TRUE(status1.ok());
   EXPECT_FALSE(status2.ok());
   config.get()->allow_.routings.pop_back();
+  config.get()->allow_.Compile();
   status1 = CreateSfc(config, request1);
   status2 = CreateSfc(config, request2);
   EXPECT_TRUE(status1.ok());
@@ -227,16 +253,19 @@ TEST(ServerTest, DelayTunnelTest) {
   GhostTunnelIdentifier* tunnel_id2 = CreateSfcTunnel(200, 1, request2);
   config.get()->delay_.tunnels.push_back(*tunnel_id1);
   config.get()->delay_.tunnels.push_back(*tunnel_id2);
+  config.get()->delay_.Compile();
   status1 = CreateSfc(config, request1);
   status2 = CreateSfc(config, request2);
   EXPECT_TRUE(status1.ok());
   EXPECT_TRUE(status2.ok());
   config.get()->delay_.tunnels.pop_back();
+  config.get()->delay_.Compile();
   status1 = CreateSfc(config, request1);
   status2 = CreateSfc(config, request2);
   EXPECT_TRUE(status1.ok());
   EXPECT_TRUE(status2.ok());
   config.get()->delay_.tunnels.pop_back();
+  config.get()->delay_.Compile();
   status1 = CreateSfc(config, request1);
   status2 = CreateSfc(config, request2);
   EXPECT_TRUE(status1.ok());
@@ -251,20 +280,23 @@ TEST(ServerTest, DelayRoutingTest) {
   grpc::Status status2 = CreateSfc(config, request2);
   EXPECT_TRUE(status1.ok());
   EXPECT_TRUE(status2.ok());
-  GhostRoutingIdentifier* routing_id1 = CreateSfcRoute(100, 1, request1);
-  GhostRoutingIdentifier* routing_id2 = CreateSfcRoute(200, 1, request2);
+  GhostRoutingIdentifier* routing_id1 = CreateSfcRoute(100, 48, request1);
+  GhostRoutingIdentifier* routing_id2 = CreateSfcRoute(200, 48, request2);
   config.get()->delay_.routings.push_back(*routing_id1);
   config.get()->delay_.routings.push_back(*routing_id2);
+  config.get()->delay_.Compile();
   status1 = CreateSfc(config, request1);
   status2 = CreateSfc(config, request2);
   EXPECT_TRUE(status1.ok());
   EXPECT_TRUE(status2.ok());
   config.get()->delay_.routings.pop_back();
+  config.get()->delay_.Compile();
   status1 = CreateSfc(config, request1);
   status2 = CreateSfc(config, request2);
   EXPECT_TRUE(status1.ok());
   EXPECT_TRUE(status2.ok());
   config.get()->delay_.routings.pop_back();
+  config.get()->delay_.Compile();
   status1 = CreateSfc(config, request1);
   status2 = CreateSfc(config, request2);
   EXPECT_TRUE(status1.ok());
@@ -282,25 +314,909 @@ TEST(ServerTest, DelayAndDenyTest) {
   GhostTunnelIdentifier* tunnel_id1 = CreateSfcTunnel(100, 1, request1);
   GhostTunnelIdentifier* tunnel_id2 = CreateSfcTunnel(200, 1, request2);
   config.get()->delay_.tunnels.push_back(*tunnel_id1);
+  config.get()->delay_.Compile();
   config.get()->deny_.tunnels.push_back(*tunnel_id2);
+  config.get()->deny_.Compile();
   status1 = CreateSfc(config, request1);
   status2 = CreateSfc(config, request2);
   EXPECT_TRUE(status1.ok());
   EXPECT_FALSE(status2.ok());
   config.get()->delay_.tunnels.pop_back();
+  config.get()->delay_.Compile();
   status1 = CreateSfc(config, request1);
   status2 = CreateSfc(config, request2);
   EXPECT_TRUE(status1.ok());
   EXPECT_FALSE(status2.ok());
   config.get()->delay_.tunnels.push_back(*tunnel_id1);
+  config.get()->delay_.Compile();
   config.get()->deny_.tunnels.pop_back();
+  config.get()->deny_.Compile();
   status1 = CreateSfc(config, request1);
   status2 = CreateSfc(config, request2);
   EXPECT_TRUE(status1.ok());
   EXPECT_TRUE(status2.ok());
   config.get()->delay_.tunnels.pop_back();
+  config.get()->delay_.Compile();
   status1 = CreateSfc(config, request1);
   status2 = CreateSfc(config, request2);
   EXPECT_TRUE(status1.ok());
   EXPECT_TRUE(status2.ok());
 }
+TEST(ServerTest, QueryReturnsInstalledSfcs) {
+  std::shared_ptr<usps_api_server::Config> config = CreateSharedConfig();
+  config.get()->Initialize();
+  CreateSfcRequest denied_request;
+  CreateSfcTunnel(300, 1, denied_request);
+  config.get()->deny_.tunnels.push_back(
+      denied_request.sfc_filter().filter_layers(0).ghost_filter().tunnel_id());
+  config.get()->deny_.Compile();
+  usps_api_server::GhostImpl service(config);
+  grpc::ServerContext context;
+  CreateSfcResponse create_response;
+  CreateSfcRequest tunnel_request;
+  CreateSfcTunnel(100, 1, tunnel_request);
+  tunnel_request.add_service_functions_to_install()
+      ->mutable_increment_counter();
+  tunnel_request.add_service_functions_to_install()->mutable_decap();
+  CreateSfcRequest route_request;
+  CreateSfcRoute(0xABCDEF000000, 24, route_request);
+  EXPECT_TRUE(service.CreateSfc(&context, &tunnel_request,
+                                &create_response).ok());
+  EXPECT_TRUE(service.CreateSfc(&context, &route_request,
+                                &create_response).ok());
+  EXPECT_FALSE(service.CreateSfc(&context, &denied_request,
+                                 &create_response).ok());
+  // Installing the same filter again replaces the SFC.
+  EXPECT_TRUE(service.CreateSfc(&context, &tunnel_request,
+                                &create_response).ok());
+  QueryRequest query_all;
+  QueryResponse all;
+  EXPECT_TRUE(service.Query(&context, &query_all, &all).ok());
+  EXPECT_EQ(all.installed_sfcs_size(), 2);
+
+  QueryRequest query_tunnel;
+  *query_tunnel.mutable_sfc_filter() = tunnel_request.sfc_filter();
+  query_tunnel.set_include_counter_values(true);
+  QueryResponse tunnel;
+  EXPECT_TRUE(service.Query(&context, &query_tunnel, &tunnel).ok());
+  ASSERT_EQ(tunnel.installed_sfcs_size(), 1);
+  EXPECT_EQ(tunnel.installed_sfcs(0).service_functions_size(), 2);
+  ASSERT_EQ(tunnel.installed_sfcs(0).counter_values_size(), 1);
+  EXPECT_EQ(tunnel.installed_sfcs(0).counter_values(0), 0);
+
+  DeleteSfcRequest delete_request;
+  *delete_request.mutable_sfc_filter() = tunnel_request.sfc_filter();
+  DeleteSfcResponse delete_response;
+  EXPECT_TRUE(service.DeleteSfc(&context, &delete_request,
+                                &delete_response).ok());
+  QueryResponse deleted;
+  EXPECT_EQ(service.Query(&context, &query_tunnel, &deleted).error_code(),
+            grpc::StatusCode::NOT_FOUND);
+  EXPECT_EQ(service.table()->size(), 1);
+}
+// Parses a request into a per-call arena and evaluates its filter, the steps
+// the async server takes before dispatching, and expects no heap allocations
+// once warmed up. The gRPC call itself is not measured.
+TEST(ServerTest, ArenaParseAndEvaluateDoNotAllocate) {
+  std::shared_ptr<usps_api_server::Config> config = CreateSharedConfig();
+  config.get()->Initialize();
+  for (std::uint64_t i = 0; i < 1000; ++i) {
+    config->deny_.tunnels.push_back(config->CreateGhostTunnel(i, i + 1));
+    config->deny_.routings.push_back(config->CreateGhostRoute(i << 24, 24));
+  }
+  config->deny_.Compile();
+  CreateSfcRequest request;
+  CreateSfcTunnel(500, 501, request);
+  CreateSfcRoute(7 << 24, 32, request);
+  request.add_service_functions_to_install()->mutable_increment_counter();
+  std::string wire = request.SerializeAsString();
+  int denied = 0;
+  std::uint64_t before = 0;
+  for (int i = 0; i < 1001; ++i) {
+    // The first iteration warms up lazily initialized protobuf state.
+    if (i == 1) {
+      before = AllocationCounter::Count();
+    }
+    alignas(std::max_align_t) char block[2048];
+    google::protobuf::Arena arena(block, sizeof(block));
+    CreateSfcRequest* parsed =
+        google::protobuf::Arena::CreateMessage<CreateSfcRequest>(&arena);
+    ASSERT_TRUE(parsed->ParseFromString(wire));
+    if (config->Evaluate(&parsed->sfc_filter()) ==
+        usps_api_server::Config::DENY) {
+      ++denied;
+    }
+  }
+  EXPECT_EQ(AllocationCounter::Count() - before, 0);
+  EXPECT_EQ(denied, 1001);
+  // Without an arena every submessage is a heap allocation.
+  before = AllocationCounter::Count();
+  CreateSfcRequest heap_request;
+  ASSERT_TRUE(heap_request.ParseFromString(wire));
+  EXPECT_GT(AllocationCounter::Count() - before, 0);
+}
+TEST(ServerTest, AllocationCounterCountsAlignedNew) {
+  struct alignas(64) Line {
+    char bytes[64];
+  };
+  std::uint64_t before = AllocationCounter::Count();
+  std::unique_ptr<Line> line(new Line());
+  EXPECT_EQ(reinterpret_cast<std::uintptr_t>(line.get()) % 64, 0u);
+  EXPECT_EQ(AllocationCounter::Count() - before, 1u);
+}
+TEST(SfcTableTest, NormalizesFilters) {
+  usps_api_server::SfcTable table;
+  CreateSfcRequest request;
+  CreateSfcTunnel(100, 1, request);
+  CreateSfcRoute(0xABCDEF000000, 24, request);
+  table.Insert(request);
+  // The same layers in another order, with bits below the prefix set.
+  CreateSfcRequest equivalent;
+  CreateSfcRoute(0xABCDEF123456, 24, equivalent);
+  CreateSfcTunnel(100, 1, equivalent);
+  CreateSfcTunnel(100, 1, equivalent);
+  EXPECT_NE(table.Find(equivalent.sfc_filter()), nullptr);
+  table.Insert(equivalent);
+  EXPECT_EQ(table.size(), 1);
+  CreateSfcRequest other;
+  CreateSfcRoute(0xABCDEF000000, 23, other);
+  EXPECT_EQ(table.Find(other.sfc_filter()), nullptr);
+  EXPECT_FALSE(table.Erase(other.sfc_filter()));
+  EXPECT_TRUE(table.Erase(equivalent.sfc_filter()));
+  EXPECT_EQ(table.size(), 0);
+}
+TEST(SfcTableTest, ConcurrentInsertAndErase) {
+  usps_api_server::SfcTable table;
+  std::vector<std::thread> writers;
+  for (int t = 0; t < 4; ++t) {
+    writers.emplace_back([&table, t]() {
+      for (int i = 0; i < 1000; ++i) {
+        CreateSfcRequest request;
+        CreateSfcTunnel(t, i, request);
+        table.Insert(request);
+        if (i % 2 == 0) {
+          EXPECT_TRUE(table.Erase(request.sfc_filter()));
+        }
+      }
+    });
+  }
+  for (std::thread& writer : writers) {
+    writer.join();
+  }
+  EXPECT_EQ(table.size(), 2000);
+  std::size_t visited = 0;
+  table.ForEach([&visited](const usps_api_server::InstalledSfc& installed) {
+    ++visited;
+  });
+  EXPECT_EQ(visited, 2000);
+}
+TEST(SfcTableTest, CountersSumOverCpus) {
+  usps_api_server::PacketCounters counters(10);
+  std::size_t cpus = usps_api_server::PacketCounters::Cpus();
+  for (std::size_t cpu = 0; cpu < cpus + 1; ++cpu) {
+    counters.IncrementOn(cpu, 9, 2);
+    counters.IncrementOn(cpu, 0, 1);
+  }
+  counters.Increment(3);
+  EXPECT_EQ(counters.Value(9), 2 * (cpus + 1));
+  EXPECT_EQ(counters.Value(0), cpus + 1);
+  EXPECT_EQ(counters.Value(3), 1);
+  EXPECT_EQ(counters.Value(8), 0);
+}
+TEST(SfcTableTest, QueriesCountersUnderWriteLoad) {
+  usps_api_server::SfcTable table;
+  CreateSfcRequest request;
+  CreateSfcTunnel(100, 1, request);
+  request.add_service_functions_to_install()->mutable_increment_counter();
+  request.add_service_functions_to_install()->mutable_decap();
+  request.add_service_functions_to_install()->mutable_increment_counter();
+  CounterWriter writer({table.Insert(request)}, 4);
+  QueryRequest query;
+  *query.mutable_sfc_filter() = request.sfc_filter();
+  query.set_include_counter_values(true);
+  std::uint64_t last = 0;
+  for (int i = 0; i < 100; ++i) {
+    QueryResponse response;
+    ASSERT_TRUE(table.Query(query, &response));
+    ASSERT_EQ(response.installed_sfcs(0).counter_values_size(), 2);
+    std::uint64_t value = response.installed_sfcs(0).counter_values(0);
+    EXPECT_GE(value, last);
+    last = value;
+  }
+  std::uint64_t increments = writer.Stop();
+  QueryResponse response;
+  ASSERT_TRUE(table.Query(query, &response));
+  EXPECT_EQ(response.installed_sfcs(0).counter_values(0) +
+                response.installed_sfcs(0).counter_values(1),
+            increments);
+  EXPECT_EQ(response.installed_sfcs(0).counter_values(0),
+            response.installed_sfcs(0).counter_values(1));
+}
+TEST(SchedulerTest, ActivatesAndExpires) {
+  usps_api_server::Scheduler scheduler(
+      std::make_shared<usps_api_server::SfcTable>());
+  // Far enough ahead that the timer thread never reaches it.
+  usps_api_server::Scheduler::Time start =
+      usps_api_server::Scheduler::Now() + 3600000000000LL;
+  CreateSfcRequest request;
+  CreateSfcTunnel(100, 1, request);
+  SetTime(start, request.mutable_activation_time());
+  SetTime(start + 1000, request.mutable_expiration_time());
+  EXPECT_TRUE(scheduler.Create(request).ok());
+  EXPECT_EQ(scheduler.table()->size(), 0);
+
+  QueryRequest query;
+  *query.mutable_sfc_filter() = request.sfc_filter();
+  query.set_include_future_instructions(true);
+  QueryResponse pending;
+  EXPECT_TRUE(scheduler.Query(query, &pending));
+  ASSERT_EQ(pending.scheduled_requests_size(), 1);
+  EXPECT_TRUE(pending.scheduled_requests(0).has_create_request());
+
+  EXPECT_EQ(scheduler.RunDue(start - 1), 0);
+  EXPECT_EQ(scheduler.RunDue(start), 1);
+  EXPECT_EQ(scheduler.table()->size(), 1);
+  EXPECT_EQ(scheduler.RunDue(start + 1000), 1);
+  EXPECT_EQ(scheduler.table()->size(), 0);
+  EXPECT_EQ(scheduler.size(), 0);
+}
+TEST(SchedulerTest, CancelsScheduledRequests) {
+  usps_api_server::Scheduler scheduler(
+      std::make_shared<usps_api_server::SfcTable>());
+  usps_api_server::Scheduler::Time start =
+      usps_api_server::Scheduler::Now() + 3600000000000LL;
+  CreateSfcRequest create;
+  CreateSfcTunnel(100, 1, create);
+  SetTime(start, create.mutable_activation_time());
+  EXPECT_TRUE(scheduler.Create(create).ok());
+  DeleteSfcRequest cancel;
+  *cancel.mutable_sfc_filter() = create.sfc_filter();
+  SetTime(start + 1, cancel.mutable_timestamp_to_deactivate());
+  EXPECT_EQ(scheduler.Delete(cancel).error_code(),
+            grpc::StatusCode::NOT_FOUND);
+  SetTime(start, cancel.mutable_timestamp_to_deactivate());
+  EXPECT_TRUE(scheduler.Delete(cancel).ok());
+  EXPECT_EQ(scheduler.size(), 0);
+  EXPECT_EQ(scheduler.RunDue(start), 0);
+
+  // A scheduled delete removes the SFC at its activation time.
+  create.clear_activation_time();
+  EXPECT_TRUE(scheduler.Create(create).ok());
+  DeleteSfcRequest scheduled_delete;
+  *scheduled_delete.mutable_sfc_filter() = create.sfc_filter();
+  SetTime(start, scheduled_delete.mutable_activation_time());
+  EXPECT_TRUE(scheduler.Delete(scheduled_delete).ok());
+  EXPECT_EQ(scheduler.table()->size(), 1);
+  EXPECT_EQ(scheduler.RunDue(start), 1);
+  EXPECT_EQ(scheduler.table()->size(), 0);
+}
+TEST(SchedulerTest, ExpiryKeepsReplacedSfc) {
+  usps_api_server::Scheduler scheduler(
+      std::make_shared<usps_api_server::SfcTable>());
+  usps_api_server::Scheduler::Time start =
+      usps_api_server::Scheduler::Now() + 3600000000000LL;
+  CreateSfcRequest request;
+  CreateSfcTunnel(100, 1, request);
+  SetTime(start, request.mutable_expiration_time());
+  EXPECT_TRUE(scheduler.Create(request).ok());
+  request.clear_expiration_time();
+  EXPECT_TRUE(scheduler.Create(request).ok());
+  EXPECT_EQ(scheduler.RunDue(start), 1);
+  EXPECT_EQ(scheduler.table()->size(), 1);
+
+  CreateSfcRequest invalid;
+  SetTime(start, invalid.mutable_activation_time());
+  SetTime(start, invalid.mutable_expiration_time());
+  EXPECT_EQ(scheduler.Create(invalid).error_code(),
+            grpc::StatusCode::INVALID_ARGUMENT);
+}
+TEST(SchedulerTest, RejectsServiceFunctionsThatDoNotCompile) {
+  usps_api_server::Scheduler scheduler(
+      std::make_shared<usps_api_server::SfcTable>());
+  CreateSfcRequest request;
+  CreateSfcTunnel(100, 1, request);
+  request.add_service_functions_to_install();
+  grpc::Status status = scheduler.Create(request);
+  EXPECT_EQ(status.error_code(), grpc::StatusCode::INVALID_ARGUMENT);
+  EXPECT_EQ(status.error_message(), "service function is not set");
+  EXPECT_EQ(scheduler.table()->size(), 0);
+  // Scheduled creates are checked when they are scheduled.
+  SetTime(usps_api_server::Scheduler::Now() + 3600000000000LL,
+          request.mutable_activation_time());
+  EXPECT_EQ(scheduler.Create(request).error_code(),
+            grpc::StatusCode::INVALID_ARGUMENT);
+  EXPECT_EQ(scheduler.size(), 0);
+}
+TEST(SchedulerTest, PagesPendingRequestsInActivationOrder) {
+  usps_api_server::Scheduler scheduler(
+      std::make_shared<usps_api_server::SfcTable>());
+  usps_api_server::Scheduler::Time start =
+      usps_api_server::Scheduler::Now() + 3600000000000LL;
+  // Tunnels 0 to 24, scheduled in reverse, two at a time sharing a time.
+  for (int i = 24; i >= 0; --i) {
+    CreateSfcRequest request;
+    CreateSfcTunnel(i, 1, request);
+    SetTime(start + i / 2, request.mutable_activation_time());
+    EXPECT_TRUE(scheduler.Create(request).ok());
+  }
+  QueryRequest query;
+  usps_api_server::Scheduler::PendingPosition position;
+  std::vector<std::shared_ptr<const ScheduledRequest>> requests;
+  std::size_t pages = 0;
+  while (true) {
+    std::size_t before = requests.size();
+    scheduler.PendingPage(query, 10, &position, &requests);
+    if (requests.size() == before) {
+      break;
+    }
+    ++pages;
+    if (pages == 1) {
+      // Requests cancelled between pages are not returned.
+      CreateSfcRequest create;
+      CreateSfcTunnel(20, 1, create);
+      DeleteSfcRequest cancel;
+      *cancel.mutable_sfc_filter() = create.sfc_filter();
+      SetTime(start + 10, cancel.mutable_timestamp_to_deactivate());
+      EXPECT_TRUE(scheduler.Delete(cancel).ok());
+    }
+  }
+  EXPECT_EQ(pages, 3u);
+  ASSERT_EQ(requests.size(), 24u);
+  for (std::size_t i = 1; i < requests.size(); ++i) {
+    EXPECT_LE(usps_api_server::Scheduler::ToTime(
+                  requests[i - 1]->create_request().activation_time()),
+              usps_api_server::Scheduler::ToTime(
+                  requests[i]->create_request().activation_time()));
+  }
+  // A filtered walk returns only the filter's request.
+  CreateSfcRequest filtered;
+  CreateSfcTunnel(7, 1, filtered);
+  *query.mutable_sfc_filter() = filtered.sfc_filter();
+  requests.clear();
+  position = usps_api_server::Scheduler::PendingPosition();
+  scheduler.PendingPage(query, 1, &position, &requests);
+  ASSERT_EQ(requests.size(), 1u);
+  EXPECT_EQ(requests[0]->create_request().sfc_filter().DebugString(),
+            query.sfc_filter().DebugString());
+  scheduler.PendingPage(query, 1, &position, &requests);
+  EXPECT_EQ(requests.size(), 1u);
+}
+TEST(ServerTest, ActivatesScheduledCreate) {
+  std::shared_ptr<usps_api_server::Config> config = CreateSharedConfig();
+  config.get()->Initialize();
+  usps_api_server::GhostImpl service(config);
+  grpc::ServerContext context;
+  CreateSfcRequest request;
+  CreateSfcTunnel(100, 1, request);
+  SetTime(usps_api_server::Scheduler::Now() + 100000000,
+          request.mutable_activation_time());
+  CreateSfcResponse response;
+  EXPECT_TRUE(service.CreateSfc(&context, &request, &response).ok());
+  EXPECT_EQ(service.table()->size(), 0);
+  // Waits for the timer thread, with a deadline well past the activation.
+  std::chrono::steady_clock::time_point deadline =
+      std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (service.table()->size() == 0 &&
+         std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  EXPECT_EQ(service.table()->size(), 1);
+}
+namespace {
+// Starts an async server for 'config' on a free local port.
+std::unique_ptr<grpc::Server> StartAsyncServer(
+    ghost::SfcService::AsyncService* service,
+    usps_api_server::WorkerPool* pool,
+    int threads,
+    int* port) {
+  grpc::ServerBuilder builder;
+  builder.AddListeningPort("localhost:0", grpc::InsecureServerCredentials(),
+                           port);
+  builder.RegisterService(service);
+  pool->AddQueues(&builder, threads);
+  std::unique_ptr<grpc::Server> server = builder.BuildAndStart();
+  pool->Start(1, false);
+  return server;
+}
+// Sends 'batches' on one ProgramSfcs stream and returns the responses.
+std::vector<ProgramSfcsResponse> ProgramBatches(
+    int port, const std::vector<ProgramSfcsRequest>& batches) {
+  std::unique_ptr<SfcService::Stub> stub = SfcService::NewStub(
+      grpc::CreateChannel("localhost:" + std::to_string(port),
+                          grpc::InsecureChannelCredentials()));
+  grpc::ClientContext context;
+  std::unique_ptr<grpc::ClientReaderWriter<ProgramSfcsRequest,
+                                           ProgramSfcsResponse>> stream =
+      stub->ProgramSfcs(&context);
+  std::vector<ProgramSfcsResponse> responses;
+  for (const ProgramSfcsRequest& batch : batches) {
+    EXPECT_TRUE(stream->Write(batch));
+    ProgramSfcsResponse response;
+    EXPECT_TRUE(stream->Read(&response));
+    responses.push_back(response);
+  }
+  stream->WritesDone();
+  EXPECT_TRUE(stream->Finish().ok());
+  return responses;
+}
+// A batch creating tunnels 100 and 300, cancelling a request that was never
+// scheduled and deleting tunnel 200.
+ProgramSfcsRequest MixedBatch() {
+  ProgramSfcsRequest batch;
+  CreateSfcTunnel(100, 1, *batch.add_requests()->mutable_create_request());
+  CreateSfcTunnel(300, 1, *batch.add_requests()->mutable_create_request());
+  CreateSfcRequest missing;
+  CreateSfcTunnel(400, 1, missing);
+  DeleteSfcRequest* cancel = batch.add_requests()->mutable_delete_request();
+  *cancel->mutable_sfc_filter() = missing.sfc_filter();
+  cancel->mutable_timestamp_to_deactivate()->set_seconds(1);
+  CreateSfcTunnel(200, 1, missing);
+  *batch.add_requests()->mutable_delete_request()->mutable_sfc_filter() =
+      missing.sfc_filter();
+  return batch;
+}
+// A batch creating tunnel 'term' and then deleting it.
+ProgramSfcsRequest CreateThenDeleteBatch(std::uint64_t term) {
+  ProgramSfcsRequest batch;
+  CreateSfcRequest* create = batch.add_requests()->mutable_create_request();
+  CreateSfcTunnel(term, 1, *create);
+  *batch.add_requests()->mutable_delete_request()->mutable_sfc_filter() =
+      create->sfc_filter();
+  return batch;
+}
+// Reads every page of a QueryStream call into 'pages'.
+grpc::Status QueryPages(int port, const QueryRequest& request,
+                        std::vector<QueryResponse>* pages) {
+  std::unique_ptr<SfcService::Stub> stub = SfcService::NewStub(
+      grpc::CreateChannel("localhost:" + std::to_string(port),
+                          grpc::InsecureChannelCredentials()));
+  grpc::ClientContext context;
+  std::unique_ptr<grpc::ClientReader<QueryResponse>> reader =
+      stub->QueryStream(&context, request);
+  QueryResponse page;
+  while (reader->Read(&page)) {
+    pages->push_back(page);
+  }
+  return reader->Finish();
+}
+// Installs 'count' SFCs with a counter each and schedules one more.
+std::shared_ptr<usps_api_server::Scheduler> FilledScheduler(int count) {
+  std::shared_ptr<usps_api_server::Scheduler> scheduler =
+      std::make_shared<usps_api_server::Scheduler>(
+          std::make_shared<usps_api_server::SfcTable>());
+  for (int i = 0; i < count; ++i) {
+    CreateSfcRequest request;
+    CreateSfcTunnel(i, 1, request);
+    request.add_service_functions_to_install()->mutable_increment_counter();
+    EXPECT_TRUE(scheduler->Create(request).ok());
+  }
+  CreateSfcRequest scheduled;
+  CreateSfcTunnel(count, 1, scheduled);
+  SetTime(usps_api_server::Scheduler::Now() + 3600000000000LL,
+          scheduled.mutable_activation_time());
+  EXPECT_TRUE(scheduler->Create(scheduled).ok());
+  return scheduler;
+}
+} // namespace
+
+TEST(ServerTest, QueryStreamPages) {
+  std::shared_ptr<usps_api_server::Config> config = CreateSharedConfig();
+  config.get()->Initialize();
+  usps_api_server::GhostImpl service(
+      std::make_shared<usps_api_server::ConfigStore>(config),
+      FilledScheduler(2500));
+  grpc::ServerBuilder builder;
+  int port = 0;
+  builder.AddListeningPort("localhost:0", grpc::InsecureServerCredentials(),
+                           &port);
+  builder.RegisterService(&service);
+  std::unique_ptr<grpc::Server> server = builder.BuildAndStart();
+  ASSERT_NE(server, nullptr);
+  QueryRequest request;
+  request.set_page_size(1000);
+  request.set_include_counter_values(true);
+  request.set_include_future_instructions(true);
+  std::vector<QueryResponse> pages;
+  EXPECT_TRUE(QueryPages(port, request, &pages).ok());
+  ASSERT_EQ(pages.size(), 3);
+  int sfcs = 0;
+  for (const QueryResponse& page : pages) {
+    EXPECT_LE(page.installed_sfcs_size() + page.scheduled_requests_size(),
+              1000);
+    for (const Sfc& sfc : page.installed_sfcs()) {
+      EXPECT_EQ(sfc.counter_values_size(), 1);
+    }
+    sfcs += page.installed_sfcs_size();
+  }
+  EXPECT_EQ(sfcs, 2500);
+  EXPECT_EQ(pages.back().scheduled_requests_size(), 1);
+
+  CreateSfcRequest missing;
+  CreateSfcTunnel(5000, 1, missing);
+  *request.mutable_sfc_filter() = missing.sfc_filter();
+  pages.clear();
+  EXPECT_EQ(QueryPages(port, request, &pages).error_code(),
+            grpc::StatusCode::NOT_FOUND);
+  server->Shutdown();
+}
+
+TEST(ServerTest, ProgramSfcsBatch) {
+  std::shared_ptr<usps_api_server::Config> config = CreateSharedConfig();
+  config.get()->Initialize();
+  CreateSfcRequest denied;
+  CreateSfcTunnel(300, 1, denied);
+  config.get()->deny_.tunnels.push_back(
+      denied.sfc_filter().filter_layers(0).ghost_filter().tunnel_id());
+  config.get()->deny_.Compile();
+  usps_api_server::GhostImpl service(config);
+  grpc::ServerBuilder builder;
+  int port = 0;
+  builder.AddListeningPort("localhost:0", grpc::InsecureServerCredentials(),
+                           &port);
+  builder.RegisterService(&service);
+  std::unique_ptr<grpc::Server> server = builder.BuildAndStart();
+  ASSERT_NE(server, nullptr);
+  std::vector<ProgramSfcsResponse> responses =
+      ProgramBatches(port, {MixedBatch(), ProgramSfcsRequest()});
+  ASSERT_EQ(responses.size(), 2);
+  ASSERT_EQ(responses[0].results_size(), 4);
+  EXPECT_EQ(responses[0].results(0).code(), grpc::StatusCode::OK);
+  EXPECT_EQ(responses[0].results(1).code(), grpc::StatusCode::CANCELLED);
+  EXPECT_EQ(responses[0].results(2).code(), grpc::StatusCode::NOT_FOUND);
+  EXPECT_EQ(responses[0].results(3).code(), grpc::StatusCode::OK);
+  EXPECT_EQ(responses[1].results_size(), 0);
+  EXPECT_EQ(service.table()->size(), 1);
+  server->Shutdown();
+}
+
+// A delayed create holds back the delete after it, as two unary calls would.
+TEST(ServerTest, ProgramSfcsKeepsOrderAfterDelay) {
+  std::shared_ptr<usps_api_server::Config> config = CreateSharedConfig();
+  config.get()->Initialize();
+  ProgramSfcsRequest batch = CreateThenDeleteBatch(100);
+  config.get()->delay_.tunnels.push_back(batch.requests(0).create_request()
+      .sfc_filter().filter_layers(0).ghost_filter().tunnel_id());
+  config.get()->delay_.Compile();
+  config.get()->delay_time_ = 1;
+  usps_api_server::GhostImpl service(config);
+  grpc::ServerBuilder builder;
+  int port = 0;
+  builder.AddListeningPort("localhost:0", grpc::InsecureServerCredentials(),
+                           &port);
+  builder.RegisterService(&service);
+  std::unique_ptr<grpc::Server> server = builder.BuildAndStart();
+  ASSERT_NE(server, nullptr);
+  std::vector<ProgramSfcsResponse> responses = ProgramBatches(port, {batch});
+  ASSERT_EQ(responses.size(), 1);
+  ASSERT_EQ(responses[0].results_size(), 2);
+  EXPECT_EQ(responses[0].results(0).code(), grpc::StatusCode::OK);
+  EXPECT_EQ(responses[0].results(1).code(), grpc::StatusCode::OK);
+  EXPECT_EQ(service.table()->size(), 0);
+  server->Shutdown();
+}
+
+TEST(AsyncServerTest, ServesFromWorkerPool) {
+  std::shared_ptr<usps_api_server::Config> config = CreateSharedConfig();
+  config.get()->Initialize();
+  config.get()->del_ = false;
+  std::shared_ptr<usps_api_server::ConfigStore> store =
+      std::make_shared<usps_api_server::ConfigStore>(config);
+  ghost::SfcService::AsyncService service;
+  usps_api_server::WorkerPool pool(
+      &service, store, std::make_shared<usps_api_server::Scheduler>(
+          std::make_shared<usps_api_server::SfcTable>()));
+  grpc::ServerBuilder builder;
+  int port = 0;
+  builder.AddListeningPort("localhost:0", grpc::InsecureServerCredentials(),
+                           &port);
+  builder.RegisterService(&service);
+  pool.AddQueues(&builder, 4);
+  std::unique_ptr<grpc::Server> server = builder.BuildAndStart();
+  ASSERT_NE(server, nullptr);
+  pool.Start(2, false);
+  std::shared_ptr<grpc::Channel> channel = grpc::CreateChannel(
+      "localhost:" + std::to_string(port), grpc::InsecureChannelCredentials());
+  std::unique_ptr<SfcService::Stub> stub = SfcService::NewStub(channel);
+  std::vector<std::thread> clients;
+  for (int i = 0; i < 4; ++i) {
+    clients.emplace_back([&stub]() {
+      for (int j = 0; j < 25; ++j) {
+        grpc::ClientContext create_context;
+        CreateSfcRequest create_request;
+        CreateSfcResponse create_response;
+        EXPECT_TRUE(stub->CreateSfc(&create_context, create_request,
+                                    &create_response).ok());
+        grpc::ClientContext delete_context;
+        DeleteSfcRequest delete_request;
+        DeleteSfcResponse delete_response;
+        EXPECT_FALSE(stub->DeleteSfc(&delete_context, delete_request,
+                                     &delete_response).ok());
+        grpc::ClientContext query_context;
+        QueryRequest query_request;
+        QueryResponse query_response;
+        EXPECT_TRUE(stub->Query(&query_context, query_request,
+                                &query_response).ok());
+      }
+    });
+  }
+  for (std::thread& client : clients) {
+    client.join();
+  }
+  server->Shutdown();
+  pool.Shutdown();
+}
+TEST(AsyncServerTest, DelayDoesNotBlockOtherCalls) {
+  std::shared_ptr<usps_api_server::Config> config = CreateSharedConfig();
+  config.get()->Initialize();
+  CreateSfcRequest delayed_request;
+  CreateSfcTunnel(100, 1, delayed_request);
+  config.get()->delay_.tunnels.push_back(
+      delayed_request.sfc_filter().filter_layers(0).ghost_filter().tunnel_id());
+  config.get()->delay_.Compile();
+  config.get()->delay_time_ = 1;
+  std::shared_ptr<usps_api_server::ConfigStore> store =
+      std::make_shared<usps_api_server::ConfigStore>(config);
+  ghost::SfcService::AsyncService service;
+  usps_api_server::WorkerPool pool(
+      &service, store, std::make_shared<usps_api_server::Scheduler>(
+          std::make_shared<usps_api_server::SfcTable>()));
+  int port = 0;
+  // A single polling thread serves every call.
+  std::unique_ptr<grpc::Server> server =
+      StartAsyncServer(&service, &pool, 1, &port);
+  ASSERT_NE(server, nullptr);
+  std::unique_ptr<SfcService::Stub> stub = SfcService::NewStub(
+      grpc::CreateChannel("localhost:" + std::to_string(port),
+                          grpc::InsecureChannelCredentials()));
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  std::thread delayed([&stub, &delayed_request]() {
+    grpc::ClientContext context;
+    CreateSfcResponse response;
+    EXPECT_TRUE(stub->CreateSfc(&context, delayed_request, &response).ok());
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  for (int i = 0; i < 10; ++i) {
+    grpc::ClientContext context;
+    CreateSfcRequest request;
+    CreateSfcTunnel(200, 1, request);
+    CreateSfcResponse response;
+    EXPECT_TRUE(stub->CreateSfc(&context, request, &response).ok());
+  }
+  EXPECT_LT(std::chrono::steady_clock::now() - start,
+            std::chrono::milliseconds(800));
+  delayed.join();
+  EXPECT_GE(std::chrono::steady_clock::now() - start,
+            std::chrono::seconds(1));
+  server->Shutdown();
+  pool.Shutdown();
+}
+TEST(AsyncServerTest, DenyAndDisableTest) {
+  std::shared_ptr<usps_api_server::Config> config = CreateSharedConfig();
+  config.get()->Initialize();
+  CreateSfcRequest denied_request;
+  CreateSfcTunnel(100, 1, denied_request);
+  config.get()->deny_.tunnels.push_back(
+      denied_request.sfc_filter().filter_layers(0).ghost_filter().tunnel_id());
+  config.get()->deny_.Compile();
+  std::shared_ptr<usps_api_server::ConfigStore> store =
+      std::make_shared<usps_api_server::ConfigStore>(config);
+  ghost::SfcService::AsyncService service;
+  usps_api_server::WorkerPool pool(
+      &service, store, std::make_shared<usps_api_server::Scheduler>(
+          std::make_shared<usps_api_server::SfcTable>()));
+  int port = 0;
+  std::unique_ptr<grpc::Server> server =
+      StartAsyncServer(&service, &pool, 1, &port);
+  ASSERT_NE(server, nullptr);
+  std::unique_ptr<SfcService::Stub> stub = SfcService::NewStub(
+      grpc::CreateChannel("localhost:" + std::to_string(port),
+                          grpc::InsecureChannelCredentials()));
+  grpc::ClientContext denied_context;
+  CreateSfcResponse response;
+  EXPECT_FALSE(stub->CreateSfc(&denied_context, denied_request,
+                               &response).ok());
+  CreateSfcRequest allowed_request;
+  CreateSfcTunnel(200, 1, allowed_request);
+  grpc::ClientContext allowed_context;
+  EXPECT_TRUE(stub->CreateSfc(&allowed_context, allowed_request,
+                              &response).ok());
+  std::shared_ptr<usps_api_server::Config> disabled =
+      std::make_shared<usps_api_server::Config>(*config);
+  disabled->create_ = false;
+  store->Publish(disabled);
+  grpc::ClientContext disabled_context;
+  EXPECT_FALSE(stub->CreateSfc(&disabled_context, allowed_request,
+                               &response).ok());
+  server->Shutdown();
+  pool.Shutdown();
+}
+TEST(AsyncServerTest, ProgramSfcsBatch) {
+  std::shared_ptr<usps_api_server::Config> config = CreateSharedConfig();
+  config.get()->Initialize();
+  CreateSfcRequest delayed;
+  CreateSfcTunnel(300, 1, delayed);
+  config.get()->delay_.tunnels.push_back(
+      delayed.sfc_filter().filter_layers(0).ghost_filter().tunnel_id());
+  config.get()->delay_.Compile();
+  config.get()->delay_time_ = 1;
+  std::shared_ptr<usps_api_server::ConfigStore> store =
+      std::make_shared<usps_api_server::ConfigStore>(config);
+  std::shared_ptr<usps_api_server::Scheduler> scheduler =
+      std::make_shared<usps_api_server::Scheduler>(
+          std::make_shared<usps_api_server::SfcTable>());
+  ghost::SfcService::AsyncService service;
+  usps_api_server::WorkerPool pool(&service, store, scheduler);
+  int port = 0;
+  std::unique_ptr<grpc::Server> server =
+      StartAsyncServer(&service, &pool, 1, &port);
+  ASSERT_NE(server, nullptr);
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  std::vector<ProgramSfcsResponse> responses =
+      ProgramBatches(port, {MixedBatch(), MixedBatch()});
+  // Each batch waits for the delay once.
+  EXPECT_GE(std::chrono::steady_clock::now() - start,
+            std::chrono::seconds(2));
+  ASSERT_EQ(responses.size(), 2);
+  for (const ProgramSfcsResponse& response : responses) {
+    ASSERT_EQ(response.results_size(), 4);
+    EXPECT_EQ(response.results(0).code(), grpc::StatusCode::OK);
+    EXPECT_EQ(response.results(1).code(), grpc::StatusCode::OK);
+    EXPECT_EQ(response.results(2).code(), grpc::StatusCode::NOT_FOUND);
+    EXPECT_EQ(response.results(3).code(), grpc::StatusCode::OK);
+  }
+  EXPECT_EQ(scheduler->table()->size(), 2);
+  server->Shutdown();
+  pool.Shutdown();
+}
+// A delayed create holds back the delete after it, as two unary calls would.
+TEST(AsyncServerTest, ProgramSfcsKeepsOrderAfterDelay) {
+  std::shared_ptr<usps_api_server::Config> config = CreateSharedConfig();
+  config.get()->Initialize();
+  ProgramSfcsRequest batch = CreateThenDeleteBatch(100);
+  config.get()->delay_.tunnels.push_back(batch.requests(0).create_request()
+      .sfc_filter().filter_layers(0).ghost_filter().tunnel_id());
+  config.get()->delay_.Compile();
+  config.get()->delay_time_ = 1;
+  std::shared_ptr<usps_api_server::ConfigStore> store =
+      std::make_shared<usps_api_server::ConfigStore>(config);
+  std::shared_ptr<usps_api_server::Scheduler> scheduler =
+      std::make_shared<usps_api_server::Scheduler>(
+          std::make_shared<usps_api_server::SfcTable>());
+  ghost::SfcService::AsyncService service;
+  usps_api_server::WorkerPool pool(&service, store, scheduler);
+  int port = 0;
+  std::unique_ptr<grpc::Server> server =
+      StartAsyncServer(&service, &pool, 1, &port);
+  ASSERT_NE(server, nullptr);
+  std::vector<ProgramSfcsResponse> responses = ProgramBatches(port, {batch});
+  ASSERT_EQ(responses.size(), 1);
+  ASSERT_EQ(responses[0].results_size(), 2);
+  EXPECT_EQ(responses[0].results(0).code(), grpc::StatusCode::OK);
+  EXPECT_EQ(responses[0].results(1).code(), grpc::StatusCode::OK);
+  EXPECT_EQ(scheduler->table()->size(), 0);
+  server->Shutdown();
+  pool.Shutdown();
+}
+TEST(AsyncServerTest, QueryStreamPages) {
+  std::shared_ptr<usps_api_server::Config> config = CreateSharedConfig();
+  config.get()->Initialize();
+  std::shared_ptr<usps_api_server::ConfigStore> store =
+      std::make_shared<usps_api_server::ConfigStore>(config);
+  ghost::SfcService::AsyncService service;
+  usps_api_server::WorkerPool pool(&service, store, FilledScheduler(10));
+  int port = 0;
+  std::unique_ptr<grpc::Server> server =
+      StartAsyncServer(&service, &pool, 1, &port);
+  ASSERT_NE(server, nullptr);
+  QueryRequest request;
+  request.set_page_size(4);
+  request.set_include_future_instructions(true);
+  std::vector<QueryResponse> pages;
+  EXPECT_TRUE(QueryPages(port, request, &pages).ok());
+  ASSERT_EQ(pages.size(), 3);
+  EXPECT_EQ(pages[0].installed_sfcs_size(), 4);
+  EXPECT_EQ(pages[2].installed_sfcs_size(), 2);
+  EXPECT_EQ(pages[2].scheduled_requests_size(), 1);
+  EXPECT_EQ(pages[2].installed_sfcs(0).counter_values_size(), 0);
+  server->Shutdown();
+  pool.Shutdown();
+}
+TEST(MetricsTest, CollectsEveryThread) {
+  Metrics::Snapshot before = Metrics::Collect();
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([]() {
+      for (int i = 0; i < 1000; ++i) {
+        // Falls in [512, 1024) ns, bucket 2.
+        Metrics::Record(Metrics::STATS, 1000);
+      }
+      Metrics::Increment(Metrics::STATS_FAILED);
+    });
+  }
+  // Shards of exited threads are kept.
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  Metrics::Snapshot after = Metrics::Collect();
+  int stats = Metrics::STATS;
+  EXPECT_EQ(after.counts[stats] - before.counts[stats], 4000);
+  EXPECT_EQ(after.buckets[stats][2] - before.buckets[stats][2], 4000);
+  EXPECT_EQ(after.sums[stats] - before.sums[stats], 4000000);
+  int failed = Metrics::STATS_FAILED;
+  EXPECT_EQ(after.counters[failed] - before.counters[failed], 4);
+}
+TEST(ServerTest, StatsReportsRpcsAndDecisions) {
+  std::shared_ptr<usps_api_server::Config> config = CreateSharedConfig();
+  config.get()->Initialize();
+  CreateSfcRequest denied;
+  CreateSfcTunnel(300, 1, denied);
+  config.get()->deny_.tunnels.push_back(
+      denied.sfc_filter().filter_layers(0).ghost_filter().tunnel_id());
+  config.get()->deny_.Compile();
+  CreateSfcRequest allowed;
+  CreateSfcTunnel(300, 2, allowed);
+  usps_api_server::GhostImpl service(config);
+  Metrics::Snapshot before = Metrics::Collect();
+  grpc::ServerContext context;
+  CreateSfcResponse response;
+  EXPECT_FALSE(service.CreateSfc(&context, &denied, &response).ok());
+  EXPECT_TRUE(service.CreateSfc(&context, &allowed, &response).ok());
+  Metrics::Snapshot after = Metrics::Collect();
+  EXPECT_EQ(after.counts[Metrics::CREATE_SFC] -
+                before.counts[Metrics::CREATE_SFC], 2);
+  EXPECT_EQ(after.counters[Metrics::CREATE_SFC_FAILED] -
+                before.counters[Metrics::CREATE_SFC_FAILED], 1);
+  EXPECT_EQ(after.counts[Metrics::FILTER_DENY] -
+                before.counts[Metrics::FILTER_DENY], 1);
+  EXPECT_EQ(after.counts[Metrics::FILTER_ALLOW] -
+                before.counts[Metrics::FILTER_ALLOW], 1);
+  StatsRequest stats_request;
+  StatsResponse stats_response;
+  ASSERT_TRUE(
+      service.Stats(&context, &stats_request, &stats_response).ok());
+  const std::string& text = stats_response.prometheus_text();
+  EXPECT_NE(text.find("ghost_filter_identifiers{filter=\"deny\"} 1\n"),
+            std::string::npos);
+  EXPECT_NE(text.find("ghost_rpc_latency_seconds_count{rpc=\"CreateSfc\"} "),
+            std::string::npos);
+  EXPECT_NE(text.find("ghost_filter_decision_seconds_bucket{action=\"deny\","
+                      "le=\"+Inf\"} "),
+            std::string::npos);
+}
+TEST(AsyncServerTest, ServesStats) {
+  std::shared_ptr<usps_api_server::Config> config = CreateSharedConfig();
+  config.get()->Initialize();
+  std::shared_ptr<usps_api_server::ConfigStore> store =
+      std::make_shared<usps_api_server::ConfigStore>(config);
+  ghost::SfcService::AsyncService service;
+  usps_api_server::WorkerPool pool(
+      &service, store, std::make_shared<usps_api_server::Scheduler>(
+          std::make_shared<usps_api_server::SfcTable>()));
+  int port = 0;
+  std::unique_ptr<grpc::Server> server =
+      StartAsyncServer(&service, &pool, 1, &port);
+  ASSERT_NE(server, nullptr);
+  std::unique_ptr<SfcService::Stub> stub = SfcService::NewStub(
+      grpc::CreateChannel("localhost:" + std::to_string(port),
+                          grpc::InsecureChannelCredentials()));
+  Metrics::Snapshot before = Metrics::Collect();
+  grpc::ClientContext query_context;
+  QueryRequest query_request;
+  QueryResponse query_response;
+  EXPECT_TRUE(
+      stub->Query(&query_context, query_request, &query_response).ok());
+  grpc::ClientContext stats_context;
+  StatsRequest stats_request;
+  StatsResponse stats_response;
+  ASSERT_TRUE(
+      stub->Stats(&stats_context, stats_request, &stats_response).ok());
+  EXPECT_NE(stats_response.prometheus_text().find("ghost_config_version 1\n"),
+            std::string::npos);
+  Metrics::Snapshot after = Metrics::Collect();
+  EXPECT_EQ(after.counts[Metrics::QUERY] - before.counts[Metrics::QUERY], 1);
+  EXPECT_EQ(after.counts[Metrics::STATS] - before.counts[Metrics::STATS], 1);
+  server->Shutdown();
+  pool.Shutdown();
+}